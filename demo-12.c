@@ -3,7 +3,7 @@
  * Edouard.Thiel@lif.univ-mrs.fr - 29/04/2013 - version 1.2
  *
  * Compilation on Unix :
- *     gcc -Wall demo-12.c ez-draw.c ez-image.c -o demo-12 -lX11 -lXext -lm
+ *     gcc -Wall demo-12.c ez-draw.c ez-image.c -o demo-12 -lX11 -lXext -lm -lpthread
  * Compilation on Windows :
  *     gcc -Wall demo-12.c ez-draw.c ez-image.c -o demo-12.exe -lgdi32 -lmsimg32 -lm
  *
@@ -17,17 +17,18 @@
 
 double compute_hsv_image (Ez_image *img, double value)
 {
-    int x, y, t, dx, dy, xc, yc;
+    int x, y, dx, dy, xc, yc;
     double H, S, dc, rc, rc2, dc2, t1, t2;
-    Ez_uint8 R, G, B;
+    Ez_uint8 R, G, B, *p;
 
     if (img == NULL) return 0;
 
     xc = img->width/2; yc = img->height/2; rc = xc-1; rc2 = rc*rc;
     t1 = ez_get_time ();
 
-    for (y = 0, t = 0; y < img->height; y++)
-    for (x = 0; x < img->width ; x++, t += 4)
+    /* The rows of the image are separated by img->stride bytes */
+    for (y = 0; y < img->height; y++)
+    for (x = 0, p = EZ_IMAGE_PIXEL (img, 0, y); x < img->width ; x++, p += 4)
     {
         dx = x-xc; dy = y-yc; dc2 = dx*dx + dy*dy;
         R = G = B = 255;
@@ -44,10 +45,11 @@ double compute_hsv_image (Ez_image *img, double value)
             ez_HSV_to_RGB (H, S, value, &R, &G, &B);
         }
 
-        img->pixels_rgba[t  ] = R;
-        img->pixels_rgba[t+1] = G;
-        img->pixels_rgba[t+2] = B;
+        p[0] = R;
+        p[1] = G;
+        p[2] = B;
     }
+    ez_image_touch (img);
 
     t2 = ez_get_time ();
     return t2-t1;
@@ -3,7 +3,7 @@
  * Edouard.Thiel@lif.univ-mrs.fr - 29/04/2013 - version 1.2
  *
  * Compilation on Unix :
- *     gcc -Wall demo-13.c ez-draw.c ez-image.c -o demo-13 -lX11 -lXext -lm
+ *     gcc -Wall demo-13.c ez-draw.c ez-image.c -o demo-13 -lX11 -lXext -lm -lpthread
  * Compilation on Windows :
  *     gcc -Wall demo-13.c ez-draw.c ez-image.c -o demo-13.exe -lgdi32 -lmsimg32 -lm
  *
@@ -23,7 +23,8 @@ typedef struct {
 
 void app_data_init (App_data *a, char *filename)
 {
-    a->image1 = ez_image_load (filename);                   /* Load an image */
+    /* Load an image, reduced if needed to fit in 1024 x 768 */
+    a->image1 = ez_image_load_scaled (filename, 1024, 768);
     if (a->image1 == NULL) exit (1);
 }
 
@@ -3,7 +3,7 @@
  * Edouard.Thiel@lif.univ-mrs.fr - 29/04/2013 - version 1.2
  *
  * Compilation on Unix :
- *     gcc -Wall demo-14.c ez-draw.c ez-image.c -o demo-14 -lX11 -lXext -lm
+ *     gcc -Wall demo-14.c ez-draw.c ez-image.c -o demo-14 -lX11 -lXext -lm -lpthread
  * Compilation on Windows :
  *     gcc -Wall demo-14.c ez-draw.c ez-image.c -o demo-14.exe -lgdi32 -lmsimg32 -lm
  *
@@ -16,8 +16,9 @@
 
 
 typedef struct {
-    int i2_x, i2_y;
-    Ez_image *image1, *image2;
+    int i2_x, i2_y, blend;
+    double time1;
+    Ez_image *image1, *image2, *image1p, *image2p;
     Ez_window win1;
 } App_data;
 
@@ -30,6 +31,13 @@ void app_data_init (App_data *a, char *filename1, char *filename2)
     a->image2 = ez_image_load (filename2);
     if (a->image2 == NULL) exit (1);
 
+    /* Premultiplied copies, for blending */
+    a->image1p = ez_image_dup (a->image1);
+    a->image2p = ez_image_dup (a->image2);
+    ez_image_premultiply (a->image1p);
+    ez_image_premultiply (a->image2p);
+    a->blend = 0;
+
     /* Initial position is centered */
     a->i2_x = (a->image1->width  - a->image2->width ) / 2;
     a->i2_y = (a->image1->height - a->image2->height) / 2;
@@ -40,17 +48,32 @@ void app_data_destroy (App_data *a)
 {
     ez_image_destroy (a->image1);
     ez_image_destroy (a->image2);
+    ez_image_destroy (a->image1p);
+    ez_image_destroy (a->image2p);
 }
 
 
 void win1_on_expose (Ez_event *ev)
 {
     App_data *a = ez_get_data (ev->win);
-
-    ez_image_paint (a->win1, a->image1, 0, 0);
-    ez_image_paint (a->win1, a->image2, a->i2_x, a->i2_y); 
+    Ez_image *image3;
+
+    if (a->blend) {
+        /* True transparency: image2 is blended in a copy of image1 */
+        image3 = ez_image_dup (a->image1p);
+        a->time1 = ez_get_time ();
+        ez_image_blend (image3, a->image2p, a->i2_x, a->i2_y);
+        a->time1 = ez_get_time () - a->time1;
+        ez_image_paint (a->win1, image3, 0, 0);
+        ez_image_destroy (image3);
+        ez_draw_text (a->win1, EZ_TRF, a->image1->width-4, 4, "%.3f ms",
+            a->time1*1000);
+    } else {
+        ez_image_paint (a->win1, a->image1, 0, 0);
+        ez_image_paint (a->win1, a->image2, a->i2_x, a->i2_y); 
+    }
     ez_draw_text (a->win1, EZ_BLF, 10, a->image1->height+15, 
-        "[Arrows] to move");
+        "[Arrows] to move  b: blend %s", a->blend ? "ON ":"OFF");
     ez_draw_text (a->win1, EZ_BRF, a->image1->width-10, a->image1->height+15, 
         "Opacity [+-] : %d", a->image2->opacity);
 }
@@ -74,6 +97,7 @@ void win1_on_key_press (Ez_event *ev)
         case XK_KP_Subtract : a->image2->opacity--; break;
         case XK_plus        :
         case XK_KP_Add      : a->image2->opacity++; break;
+        case XK_b           : a->blend = !a->blend; break;
         default             : return;
     }
     ez_send_expose (a->win1);
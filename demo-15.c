@@ -3,7 +3,7 @@
  * Edouard.Thiel@lif.univ-mrs.fr - 29/04/2013 - version 1.2
  *
  * Compilation on Unix :
- *     gcc -Wall demo-15.c ez-draw.c ez-image.c -o demo-15 -lX11 -lXext -lm
+ *     gcc -Wall demo-15.c ez-draw.c ez-image.c -o demo-15 -lX11 -lXext -lm -lpthread
  * Compilation on Windows :
  *     gcc -Wall demo-15.c ez-draw.c ez-image.c -o demo-15.exe -lgdi32 -lmsimg32 -lm
  *
@@ -31,6 +31,7 @@ void app_data_init (App_data *a, char *filename)
 
     a->image1 = ez_image_load (filename);
     if (a->image1 == NULL) exit (1);
+    ez_image_set_mipmap (a->image1, 1);
 
     a->image2 = ez_image_dup (a->image1);
     ez_image_set_alpha (a->image2, a->alpha);
@@ -3,7 +3,7 @@
  * Edouard.Thiel@lif.univ-mrs.fr - 29/04/2013 - version 1.2
  *
  * Compilation on Unix :
- *     gcc -Wall demo-16.c ez-draw.c ez-image.c -o demo-16 -lX11 -lXext -lm
+ *     gcc -Wall demo-16.c ez-draw.c ez-image.c -o demo-16 -lX11 -lXext -lm -lpthread
  * Compilation on Windows :
  *     gcc -Wall demo-16.c ez-draw.c ez-image.c -o demo-16.exe -lgdi32 -lmsimg32 -lm
  *
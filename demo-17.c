@@ -3,7 +3,7 @@
  * Edouard.Thiel@lif.univ-mrs.fr - 29/04/2013 - version 1.2
  *
  * Compilation on Unix :
- *     gcc -Wall demo-17.c ez-draw.c ez-image.c -o demo-17 -lX11 -lXext -lm
+ *     gcc -Wall demo-17.c ez-draw.c ez-image.c -o demo-17 -lX11 -lXext -lm -lpthread
  * Compilation on Windows :
  *     gcc -Wall demo-17.c ez-draw.c ez-image.c -o demo-17.exe -lgdi32 -lmsimg32 -lm
  *
@@ -15,7 +15,7 @@
 #include "ez-image.h"
 
 
-#define BALL_MAX   500
+#define BALL_MAX  5000
 #define BALL_NB     50
 #define WIN1_W     900
 #define WIN1_H     700
@@ -71,7 +71,7 @@ typedef struct {
     Ez_window  win1;
     int        win1_h, win1_w;
     Ball       ball[BALL_MAX];
-    int        ball_nb, expose_nb, flag_pix;
+    int        ball_nb, expose_nb, flag_pix, flag_batch;
     double     time_ref, fps;
 } App_data;
 
@@ -98,6 +98,7 @@ void app_data_init (App_data *a, char *filename)
     a->expose_nb = 0;
 
     a->flag_pix = 0;
+    a->flag_batch = 0;
 }
 
 
@@ -126,15 +127,22 @@ void win1_on_expose (Ez_event *ev)
 
     update_fps (a);
 
-    for (i = 0; i < a->ball_nb; i++)
-        if (a->flag_pix)
-             ball_draw_pixmap (a->win1, a->pixmap1, &a->ball[i]);
-        else ball_draw_image  (a->win1, a->image1 , &a->ball[i]);
+    if (a->flag_pix && a->flag_batch) {
+        ez_sprite_batch_begin (a->win1);
+        for (i = 0; i < a->ball_nb; i++)
+            ez_sprite_batch_add (a->pixmap1, a->ball[i].x, a->ball[i].y);
+        ez_sprite_batch_end ();
+    } else {
+        for (i = 0; i < a->ball_nb; i++)
+            if (a->flag_pix)
+                 ball_draw_pixmap (a->win1, a->pixmap1, &a->ball[i]);
+            else ball_draw_image  (a->win1, a->image1 , &a->ball[i]);
+    }
 
     ez_set_color (ez_black);
     ez_draw_text (a->win1, EZ_BLF, 10, a->win1_h-10, 
-        "+-: balls %d   p: pixmap %s",
-        a->ball_nb, a->flag_pix ? "ON ":"OFF");
+        "+-*/: balls %d   p: pixmap %s   b: batch %s",
+        a->ball_nb, a->flag_pix ? "ON ":"OFF", a->flag_batch ? "ON ":"OFF");
     if (a->fps > 0)
         ez_draw_text (a->win1, EZ_BRF, a->win1_w-10, a->win1_h-10, "fps %.1f",
             a->fps);
@@ -144,6 +152,7 @@ void win1_on_expose (Ez_event *ev)
 void win1_on_key_press (Ez_event *ev)
 {
     App_data *a = ez_get_data (ev->win);
+    int i;
 
     switch (ev->key_sym) {
         case XK_q : 
@@ -161,9 +170,24 @@ void win1_on_key_press (Ez_event *ev)
             else ball_init (&a->ball[a->ball_nb-1], a->image1->width, 
                 a->image1->height, a->win1_h, a->win1_w);
             break;
+        case XK_asterisk    :
+        case XK_KP_Multiply :
+            for (i = a->ball_nb; i < 2*a->ball_nb && i < BALL_MAX; i++)
+                ball_init (&a->ball[i], a->image1->width,
+                    a->image1->height, a->win1_h, a->win1_w);
+            a->ball_nb = i;
+            break;
+        case XK_slash       :
+        case XK_KP_Divide   :
+            a->ball_nb = (a->ball_nb+1) / 2;
+            break;
         case XK_p : 
             a->flag_pix = !a->flag_pix;
             break;
+        case XK_b : 
+            a->flag_batch = !a->flag_batch;
+            if (a->flag_batch) a->flag_pix = 1;
+            break;
         default : return;
     }
     ez_send_expose (a->win1);
@@ -287,6 +287,7 @@ rst_epilog = """
 .. _ez-draw.h:  {path}ez-draw.h
 .. _ez-image.c: {path}ez-image.c
 .. _ez-image.h: {path}ez-image.h
+.. _ez-pack.c:  {path}ez-pack.c
 
 .. _Makefile:     {path}Makefile
 .. _make.bat:     {path}make.bat
@@ -309,6 +310,7 @@ rst_epilog = """
 .. _demo-16.c: {path}demo-16.c
 .. _demo-17.c: {path}demo-17.c
 
+.. _jeu-doodle.c: {path}jeu-doodle.c
 .. _jeu-nim.c: {path}jeu-nim.c
 
 .. _tutorial: ez-tutorial.html
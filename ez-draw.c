@@ -12,6 +12,11 @@
 #define EZ_PRIVATE_DEFS 1
 #include "ez-draw.h"
 
+#ifdef EZ_BASE_XLIB
+#include <unistd.h>
+#include <fcntl.h>
+#endif /* EZ_BASE_ */
+
 /* Contains internal parameters of ez-draw.c */
 Ez_X ezx;
 
@@ -141,6 +146,7 @@ int ez_init (void)
     ezx.mouse_b = 0;      /* Used for MotionNotify */
     ezx.win_nb = 0;       /* Break also event loop */
     ezx.mv_win = None;    /* To filter mouse moves */
+    ezx.layer_win = None; /* No layer being rendered */
 
     /* Initialize random numbers generator */
     ez_random_init ();
@@ -164,6 +170,7 @@ Ez_window ez_window_create (int w, int h, const char *name, Ez_func func)
 {
     Ez_window win;
     Ez_win_info *info;
+    int i;
 
     if (ez_check_state ("ez_window_create") < 0) return None;
 
@@ -239,6 +246,7 @@ Ez_window ez_window_create (int w, int h, const char *name, Ez_func func)
     info->func = func;
     info->data = NULL;
     info->dbuf = None;
+    for (i = 0; i < EZ_LAYER_MAX; i++) info->layer[i] = NULL;
     ez_window_show (win, 1);
 
     /* Store the window */
@@ -1007,6 +1015,194 @@ void ez_draw_text (Ez_window win, Ez_Align align, int x1, int y1,
 }
 
 
+/*
+ * Layers are offscreen drawings of the size of a window, stacked in the
+ * order of their number num (0 is the bottom), between 0 and EZ_LAYER_MAX-1.
+ * A layer is only rendered again when it is dirty, then all the layers are
+ * composited in the window (or in its double buffer) by a server-side copy.
+ *
+ * Typical usage in the Expose callback:
+ *
+ *     if (ez_layer_begin (win, 0)) {
+ *         ... draw the background in win ...
+ *         ez_layer_end (win);
+ *     }
+ *     ez_layer_compose (win);
+ *     ... draw the moving objects in win ...
+ *
+ * In a transparent layer, the pixels left in magenta (the initial color of
+ * the layer) are not composited.
+*/
+
+/*
+ * Create the layer num for the window win.
+ * Return 0 on success, -1 on error.
+*/
+
+int ez_layer_create (Ez_window win, int num, int transparent)
+{
+    Ez_win_info *info;
+    Ez_layer *layer;
+
+    if (ez_check_state ("ez_layer_create") < 0) return -1;
+    if (num < 0 || num >= EZ_LAYER_MAX) {
+        ez_error ("ez_layer_create: bad num\n");
+        return -1;
+    }
+    if (ez_info_get (win, &info) < 0) return -1;
+    if (info->layer[num] != NULL) {
+        ez_error ("ez_layer_create: layer %d already exists\n", num);
+        return -1;
+    }
+
+    layer = malloc (sizeof (Ez_layer));
+    if (layer == NULL) {
+        ez_error ("ez_layer_create: out of memory\n");
+        return -1;
+    }
+#ifdef EZ_BASE_XLIB
+    layer->map = layer->mask = None;
+#elif defined EZ_BASE_WIN32
+    layer->hdc = layer->hdc_mask = NULL;
+    layer->hmap = layer->hmask = NULL;
+    layer->hold = layer->hold_mask = NULL;
+#endif /* EZ_BASE_ */
+    layer->map_w = layer->map_h = 0;
+    ez_window_get_size (win, &layer->width, &layer->height);
+    layer->transparent = transparent ? 1 : 0;
+    layer->dirty = 1;
+
+    info->layer[num] = layer;
+    return 0;
+}
+
+
+/*
+ * Destroy the layer num of the window win.
+*/
+
+void ez_layer_destroy (Ez_window win, int num)
+{
+    Ez_win_info *info;
+
+    if (num < 0 || num >= EZ_LAYER_MAX) return;
+    if (ez_info_get (win, &info) < 0) return;
+    if (info->layer[num] == NULL) return;
+    if (ezx.layer_win == win && ezx.layer_num == num) ez_layer_end (win);
+
+    ez_layer_free (info->layer[num]);
+    free (info->layer[num]);
+    info->layer[num] = NULL;
+}
+
+
+/*
+ * Ask to render again the layer num of the window win at the next Expose.
+*/
+
+void ez_layer_set_dirty (Ez_window win, int num)
+{
+    Ez_layer *layer;
+    if (ez_layer_get (win, num, &layer) < 0) return;
+    layer->dirty = 1;
+}
+
+
+/*
+ * Start rendering the layer num of the window win.
+ * Return 1 if the layer is dirty: the layer is then cleared and the next
+ * drawings in win are done in the layer, until ez_layer_end is called.
+ * Return 0 if the layer is up to date (or on error): nothing is to be drawn.
+*/
+
+int ez_layer_begin (Ez_window win, int num)
+{
+    Ez_layer *layer;
+    Ez_uint32 color;
+
+    if (ezx.layer_win != None) {
+        ez_error ("ez_layer_begin: ez_layer_end was not called\n");
+        return 0;
+    }
+    if (ez_layer_get (win, num, &layer) < 0) return 0;
+    if (! layer->dirty && layer->map_w == layer->width &&
+        layer->map_h == layer->height) return 0;
+    if (ez_layer_alloc (layer) < 0) return 0;
+
+    /* Redirect the drawings of win in the layer, like a double buffer */
+#ifdef EZ_BASE_XLIB
+    ezx.layer_dbuf = ezx.dbuf_pix;
+    ezx.layer_dbuf_win = ezx.dbuf_win;
+    ezx.dbuf_pix = layer->map;
+    ezx.dbuf_win = win;
+#elif defined EZ_BASE_WIN32
+    ez_cur_win (None);
+    ezx.layer_dbuf = ezx.dbuf_dc;
+    ezx.layer_dbuf_win = ezx.dbuf_win;
+    ezx.dbuf_dc = layer->hdc;
+    ezx.dbuf_win = win;
+#endif /* EZ_BASE_ */
+    ezx.layer_win = win;
+    ezx.layer_num = num;
+
+    /* Clear the layer */
+    color = ezx.color;
+    ez_set_color (layer->transparent ? ez_magenta : ez_white);
+    ez_fill_rectangle (win, 0, 0, layer->map_w-1, layer->map_h-1);
+    ez_set_color (color);
+
+    layer->dirty = 0;
+    return 1;
+}
+
+
+/*
+ * Stop rendering a layer of the window win.
+*/
+
+void ez_layer_end (Ez_window win)
+{
+    Ez_layer *layer;
+
+    if (ezx.layer_win == None || ezx.layer_win != win) return;
+
+#ifdef EZ_BASE_XLIB
+    ezx.dbuf_pix = ezx.layer_dbuf;
+    ezx.dbuf_win = ezx.layer_dbuf_win;
+#elif defined EZ_BASE_WIN32
+    ez_cur_win (None);
+    ezx.dbuf_dc = ezx.layer_dbuf;
+    ezx.dbuf_win = ezx.layer_dbuf_win;
+#endif /* EZ_BASE_ */
+    ezx.layer_win = None;
+
+    if (ez_layer_get (win, ezx.layer_num, &layer) < 0) return;
+    if (layer->transparent) ez_layer_build_mask (layer);
+}
+
+
+/*
+ * Composite all the layers of the window win in the window, or in its
+ * double buffer during an Expose.
+*/
+
+void ez_layer_compose (Ez_window win)
+{
+    Ez_win_info *info;
+    int i;
+
+    if (ezx.layer_win != None) {
+        ez_error ("ez_layer_compose: ez_layer_end was not called\n");
+        return;
+    }
+    if (ez_info_get (win, &info) < 0) return;
+
+    for (i = 0; i < EZ_LAYER_MAX; i++)
+        if (info->layer[i] != NULL && info->layer[i]->map_w > 0)
+            ez_layer_copy (win, info->layer[i]);
+}
+
+
 /*-------------------- P R I V A T E   F U N C T I O N S --------------------*/
 
 /*
@@ -1088,6 +1284,7 @@ void ez_win_delete (Ez_window win)
 
     ez_window_dbuf (win, 0);
     ez_timer_remove (win);
+    ez_layer_destroy_all (win);
 
     /* Destroy data _after_ ez_window_dbuf (which still uses them) */
     if (ez_info_get (win, &info) == 0) {
@@ -1139,6 +1336,13 @@ void ez_close_disp (void)
     if (ezx.visual->class == PseudoColor)
         XFreeColormap (ezx.display, ezx.pseudoColor.colormap);
 
+    /* The threads which write in the pipe are stopped before, see
+       ez_loader_stop */
+    if (ezx.async) {
+        close (ezx.wake_fd[0]); close (ezx.wake_fd[1]);
+        ezx.async = 0;
+    }
+
     /* Close the display; from now on, do not call functions using it. */
     XCloseDisplay (ezx.display); ezx.display = NULL;
 #endif /* EZ_BASE_ */
@@ -1324,6 +1528,71 @@ struct timeval *ez_timer_delay (void)
 }
 
 
+/*
+ * Asynchronous events, produced by other threads (see ez_image_load_async).
+ * When set, ez_async_next is called by the main loop: it fills ev and
+ * returns 1 if an event is pending, else it returns 0.
+*/
+
+int (*ez_async_next) (Ez_event *ev) = NULL;
+
+
+/*
+ * Install the function next which retrieves the asynchronous events.
+ * Return 0 on success, -1 on error.
+*/
+
+int ez_async_init (int (*next) (Ez_event *ev))
+{
+    if (! ezx.async) {
+#ifdef EZ_BASE_XLIB
+        /* The threads write in this pipe to unblock the select() */
+        if (pipe (ezx.wake_fd) < 0) {
+            ez_error ("ez_async_init: pipe failed\n");
+            return -1;
+        }
+        fcntl (ezx.wake_fd[0], F_SETFL, O_NONBLOCK);
+        fcntl (ezx.wake_fd[1], F_SETFL, O_NONBLOCK);
+#elif defined EZ_BASE_WIN32
+        /* The messages are posted to a message-only window, which stays
+           when the window of an event is destroyed before its delivery */
+        ezx.async_win = CreateWindowEx (0, ezx.wnd_class.lpszClassName, "",
+            0, 0, 0, 0, 0, HWND_MESSAGE, NULL, ezx.hand_prog, NULL);
+        if (ezx.async_win == NULL) {
+            ez_error ("ez_async_init: CreateWindowEx failed\n");
+            return -1;
+        }
+#endif /* EZ_BASE_ */
+        ezx.async = 1;
+    }
+    ez_async_next = next;
+    return 0;
+}
+
+
+/*
+ * Wake up the main loop to retrieve an asynchronous event for win; the
+ * window of the event is given by ez_async_next.
+ * May be called from any thread.
+*/
+
+void ez_async_wakeup (Ez_window win)
+{
+    (void) win;
+    if (! ezx.async) return;
+#ifdef EZ_BASE_XLIB
+    {
+        char c = 0;
+        if (write (ezx.wake_fd[1], &c, 1) < 0) {
+            /* The pipe is full: the main loop is already awake */
+        }
+    }
+#elif defined EZ_BASE_WIN32
+    PostMessage (ezx.async_win, EZ_MSG_ASYNC, 0, 0);
+#endif /* EZ_BASE_ */
+}
+
+
 #ifdef EZ_BASE_XLIB
 
 /*
@@ -1333,8 +1602,9 @@ struct timeval *ez_timer_delay (void)
 
 void ez_event_next (Ez_event *ev)
 {
-    int n, res, fdx = ConnectionNumber(ezx.display);
+    int n, res, fdx = ConnectionNumber(ezx.display), fdmax = fdx;
     fd_set set1;
+    char buf[64];
 
     /* Initialize ev */
     memset (ev, 0, sizeof(Ez_event));
@@ -1344,6 +1614,9 @@ void ez_event_next (Ez_event *ev)
     /* Label allowing to ignore an event and start again waiting */
     start_waiting:
 
+    /* Asynchronous events, posted by other threads */
+    if (ez_async_next != NULL && ez_async_next (ev)) return;
+
     /* Do a XFlush and retrieve the number of events in the queue,
      * without reading and without blocking.
     */
@@ -1364,10 +1637,19 @@ void ez_event_next (Ez_event *ev)
     /* The queue on the client side is empty, we start waiting */
     FD_ZERO (&set1);
     FD_SET (fdx, &set1);
+    if (ezx.async) {
+        FD_SET (ezx.wake_fd[0], &set1);
+        if (ezx.wake_fd[0] > fdmax) fdmax = ezx.wake_fd[0];
+    }
 
-    res = select (fdx+1, &set1, NULL, NULL, ez_timer_delay ());
+    res = select (fdmax+1, &set1, NULL, NULL, ez_timer_delay ());
 
     if (res > 0) {
+        if (ezx.async && FD_ISSET (ezx.wake_fd[0], &set1)) {
+            /* Empty the pipe, then look at the asynchronous events */
+            while (read (ezx.wake_fd[0], buf, sizeof(buf)) > 0) ;
+            if (! FD_ISSET (fdx, &set1)) goto start_waiting;
+        }
         if (FD_ISSET (fdx, &set1)) {
             XNextEvent (ezx.display, &ev->xev);
             if ( (ev->xev.type == Expose) &&
@@ -1509,6 +1791,7 @@ void ez_event_dispatch (Ez_event *ev)
             ev->win    = ev->xev.xconfigure.window;
             ev->width  = ev->xev.xconfigure.width;
             ev->height = ev->xev.xconfigure.height;
+            ez_layer_resize_all (ev->win, ev->width, ev->height);
             break;
 
         /* Intercept window close: see ez_auto_quit() */
@@ -1738,6 +2021,7 @@ LRESULT CALLBACK ez_win_proc (HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam)
             ev.win    = hwnd;
             ev.width  = LOWORD(lParam);
             ev.height = HIWORD(lParam);
+            ez_layer_resize_all (ev.win, ev.width, ev.height);
             break;
 
      case WM_TIMER :
@@ -1745,6 +2029,11 @@ LRESULT CALLBACK ez_win_proc (HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam)
             ev.win    = hwnd;
             break;
 
+        /* An asynchronous event is pending */
+        case EZ_MSG_ASYNC :
+            if (ez_async_next == NULL || ! ez_async_next (&ev)) return 0L;
+            break;
+
         case WM_CLOSE :
             if (ezx.auto_quit) {
                 ez_quit ();
@@ -1875,6 +2164,18 @@ int ez_win_list_find (Ez_window win)
 }
 
 
+/*
+ * Check if the window is a member of the sorted list ezx.win_l
+ * Return 1 if yes, else 0.
+*/
+
+int ez_win_list_has (Ez_window win)
+{
+    int k = ez_win_list_find (win);
+    return k < ezx.win_nb && ezx.win_l[k] == win;
+}
+
+
 /*
  * Insert a window in the sorted list ezx.win_l
  * (win != None, and win not already member of the list)
@@ -2143,6 +2444,274 @@ void ez_dbuf_swap (Ez_window win)
 }
 
 
+/*
+ * Retrieve the layer num of the window win.
+ * Return 0 on success, -1 on error.
+*/
+
+int ez_layer_get (Ez_window win, int num, Ez_layer **layer)
+{
+    Ez_win_info *info;
+
+    if (num < 0 || num >= EZ_LAYER_MAX) {
+        ez_error ("ez_layer_get: bad num\n");
+        return -1;
+    }
+    if (ez_info_get (win, &info) < 0) return -1;
+    *layer = info->layer[num];
+    if (*layer == NULL) {
+        ez_error ("ez_layer_get: layer %d not created\n", num);
+        return -1;
+    }
+    return 0;
+}
+
+
+/*
+ * Allocate the offscreen drawing of a layer at the size of its window.
+ * Return 0 on success, -1 on error.
+*/
+
+int ez_layer_alloc (Ez_layer *layer)
+{
+#ifdef EZ_BASE_WIN32
+    HDC root_dc;
+#endif /* EZ_BASE_ */
+
+    if (layer->map_w == layer->width && layer->map_h == layer->height)
+        return 0;
+    ez_layer_free (layer);
+    if (layer->width <= 0 || layer->height <= 0) return -1;
+
+#ifdef EZ_BASE_XLIB
+
+    layer->map = XCreatePixmap (ezx.display, ezx.root_win,
+        layer->width, layer->height, ezx.depth);
+    if (layer->map == None) {
+        ez_error ("ez_layer_alloc: can't create pixmap\n");
+        return -1;
+    }
+
+#elif defined EZ_BASE_WIN32
+
+    root_dc = GetDC (NULL);
+    if (root_dc == NULL) return -1;
+    layer->hdc  = CreateCompatibleDC (root_dc);
+    layer->hmap = CreateCompatibleBitmap (root_dc, layer->width, layer->height);
+    if (layer->transparent) {
+        layer->hdc_mask = CreateCompatibleDC (root_dc);
+        layer->hmask = CreateBitmap (layer->width, layer->height, 1, 1, NULL);
+    }
+    ReleaseDC (NULL, root_dc);
+
+    if (layer->hdc == NULL || layer->hmap == NULL || (layer->transparent &&
+        (layer->hdc_mask == NULL || layer->hmask == NULL))) {
+        ez_error ("ez_layer_alloc: can't create bitmap\n");
+        ez_layer_free (layer);
+        return -1;
+    }
+    layer->hold = (HBITMAP) SelectObject (layer->hdc, layer->hmap);
+    if (layer->transparent)
+        layer->hold_mask = (HBITMAP) SelectObject (layer->hdc_mask, layer->hmask);
+
+#endif /* EZ_BASE_ */
+
+    layer->map_w = layer->width;
+    layer->map_h = layer->height;
+    layer->dirty = 1;
+    return 0;
+}
+
+
+/*
+ * Free the offscreen drawing of a layer.
+*/
+
+void ez_layer_free (Ez_layer *layer)
+{
+#ifdef EZ_BASE_XLIB
+    if (layer->map  != None) XFreePixmap (ezx.display, layer->map );
+    if (layer->mask != None) XFreePixmap (ezx.display, layer->mask);
+    layer->map = layer->mask = None;
+#elif defined EZ_BASE_WIN32
+    if (layer->hold != NULL) SelectObject (layer->hdc, layer->hold);
+    if (layer->hold_mask != NULL) SelectObject (layer->hdc_mask, layer->hold_mask);
+    if (layer->hmap  != NULL) DeleteObject (layer->hmap );
+    if (layer->hmask != NULL) DeleteObject (layer->hmask);
+    if (layer->hdc      != NULL) DeleteDC (layer->hdc     );
+    if (layer->hdc_mask != NULL) DeleteDC (layer->hdc_mask);
+    layer->hdc = layer->hdc_mask = NULL;
+    layer->hmap = layer->hmask = NULL;
+    layer->hold = layer->hold_mask = NULL;
+#endif /* EZ_BASE_ */
+    layer->map_w = layer->map_h = 0;
+}
+
+
+/*
+ * Store the new size of the window win in its layers; the layers having a
+ * different size are dirty. Called on ConfigureNotify.
+*/
+
+void ez_layer_resize_all (Ez_window win, int w, int h)
+{
+    Ez_win_info *info;
+    int i;
+
+    if (ez_prop_get (win, ezx.info_prop, (void **) &info) < 0 || info == NULL)
+        return;
+
+    for (i = 0; i < EZ_LAYER_MAX; i++) {
+        Ez_layer *layer = info->layer[i];
+        if (layer == NULL || (layer->width == w && layer->height == h))
+            continue;
+        layer->width = w; layer->height = h;
+        layer->dirty = 1;
+    }
+}
+
+
+/*
+ * Destroy all the layers of the window win.
+*/
+
+void ez_layer_destroy_all (Ez_window win)
+{
+    int i;
+    for (i = 0; i < EZ_LAYER_MAX; i++)
+        ez_layer_destroy (win, i);
+}
+
+
+/*
+ * Build the mask of a transparent layer, from its magenta pixels.
+ * Return 0 on success, -1 on error.
+*/
+
+int ez_layer_build_mask (Ez_layer *layer)
+{
+#ifdef EZ_BASE_XLIB
+
+    XImage *xi;
+    Ez_uint8 *data;
+    Ez_uint32 one = 1, planes, key = ez_magenta;
+    int x, y, w = layer->map_w, h = layer->map_h, bpl = (w+7)/8;
+
+    if (layer->mask != None) {
+        XFreePixmap (ezx.display, layer->mask);
+        layer->mask = None;
+    }
+
+    xi = XGetImage (ezx.display, layer->map, 0, 0, w, h, AllPlanes, ZPixmap);
+    if (xi == NULL) {
+        ez_error ("ez_layer_build_mask: can't get image\n");
+        return -1;
+    }
+
+    data = calloc (bpl*h, 1);
+    if (data == NULL) {
+        ez_error ("ez_layer_build_mask: out of memory\n");
+        XDestroyImage (xi);
+        return -1;
+    }
+
+    planes = ezx.depth >= 32 ? 0xffffffff : ((Ez_uint32) 1 << ezx.depth) - 1;
+
+    /* Read the pixels directly when they have the byte order of the host */
+    if (xi->bits_per_pixel == 32 &&
+        xi->byte_order == (*(Ez_uint8 *) &one ? LSBFirst : MSBFirst)) {
+        for (y = 0; y < h; y++) {
+            Ez_uint32 *p = (Ez_uint32 *) (xi->data + y*xi->bytes_per_line);
+            for (x = 0; x < w; x++)
+                if ((p[x] & planes) != key) data[y*bpl + x/8] |= 1 << (x%8);
+        }
+    } else {
+        for (y = 0; y < h; y++)
+        for (x = 0; x < w; x++)
+            if ((XGetPixel (xi, x, y) & planes) != key)
+                data[y*bpl + x/8] |= 1 << (x%8);
+    }
+
+    layer->mask = XCreateBitmapFromData (ezx.display, layer->map,
+        (char *) data, w, h);
+    free (data);
+    XDestroyImage (xi);
+
+    if (layer->mask == None) {
+        ez_error ("ez_layer_build_mask: can't create bitmap\n");
+        return -1;
+    }
+
+#elif defined EZ_BASE_WIN32
+
+    COLORREF bk, fg;
+    int w = layer->map_w, h = layer->map_h;
+
+    /* Magenta pixels become 1 in the mask, other pixels become 0 */
+    bk = SetBkColor (layer->hdc, ez_magenta);
+    BitBlt (layer->hdc_mask, 0, 0, w, h, layer->hdc, 0, 0, SRCCOPY);
+
+    /* Magenta pixels become black in the layer, to be merged by SRCPAINT */
+    SetBkColor (layer->hdc, RGB (0, 0, 0));
+    fg = SetTextColor (layer->hdc, RGB (255, 255, 255));
+    BitBlt (layer->hdc, 0, 0, w, h, layer->hdc_mask, 0, 0, SRCAND);
+
+    SetBkColor (layer->hdc, bk);
+    SetTextColor (layer->hdc, fg);
+
+#endif /* EZ_BASE_ */
+
+    return 0;
+}
+
+
+/*
+ * Copy a layer in the window win, or in its double buffer.
+*/
+
+void ez_layer_copy (Ez_window win, Ez_layer *layer)
+{
+#ifdef EZ_BASE_XLIB
+
+    if (win == ezx.dbuf_win) win = ezx.dbuf_pix;
+
+    if (layer->transparent) {
+        if (layer->mask == None) return;
+        XSetClipOrigin (ezx.display, ezx.gc, 0, 0);
+        XSetClipMask (ezx.display, ezx.gc, layer->mask);
+    }
+
+    XCopyArea (ezx.display, layer->map, win, ezx.gc, 0, 0,
+        layer->map_w, layer->map_h, 0, 0);
+
+    if (layer->transparent)
+        XSetClipMask (ezx.display, ezx.gc, None);
+
+#elif defined EZ_BASE_WIN32
+
+    ez_cur_win (win);
+
+    if (layer->transparent) {
+        COLORREF bk, fg;
+
+        /* Clear the opaque pixels, then merge the layer */
+        bk = SetBkColor (ezx.hdc, RGB (255, 255, 255));
+        fg = SetTextColor (ezx.hdc, RGB (0, 0, 0));
+        BitBlt (ezx.hdc, 0, 0, layer->map_w, layer->map_h,
+            layer->hdc_mask, 0, 0, SRCAND);
+        SetBkColor (ezx.hdc, bk);
+        SetTextColor (ezx.hdc, fg);
+        BitBlt (ezx.hdc, 0, 0, layer->map_w, layer->map_h,
+            layer->hdc, 0, 0, SRCPAINT);
+    } else {
+        BitBlt (ezx.hdc, 0, 0, layer->map_w, layer->map_h,
+            layer->hdc, 0, 0, SRCCOPY);
+    }
+
+#endif /* EZ_BASE_ */
+}
+
+
 /*
  * Initialize the fonts.
 */
@@ -2847,6 +3416,7 @@ char *ez_win_msg_name (unsigned int m)
         case 0x038F : return "WM_PENWINLAST";
         case 0x8000 : return "WM_APP";
         case EZ_MSG_PAINT : return "EZ_MSG_PAINT";
+        case EZ_MSG_ASYNC : return "EZ_MSG_ASYNC";
     }
     return "*** UNKNOWN ***";
 }
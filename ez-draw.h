@@ -144,6 +144,7 @@ typedef struct {
     Visual *visual;                 /* For colors */
     Ez_PseudoColor pseudoColor;     /* Palette indexed on 256 colors */
     Ez_TrueColor   trueColor;       /* RGB channels stored in the pixels */
+    int wake_fd[2];                 /* Pipe to wake up ez_event_next */
 #elif defined EZ_BASE_WIN32
     HINSTANCE hand_prog;            /* Handle on the program */
     WNDCLASSEX wnd_class;           /* Extended window class */
@@ -162,6 +163,7 @@ typedef struct {
     struct timeval start_time;      /* Initial date */
     LARGE_INTEGER start_count;      /* Counter to compute time */
     double perf_freq;               /* Frequency to compute time */
+    HWND async_win;                 /* Message-only window for EZ_MSG_ASYNC */
 #endif /* EZ_BASE_ */
     int display_width;              /* Display width */
     int display_height;             /* Display height */
@@ -180,6 +182,11 @@ typedef struct {
     int mouse_b;                    /* Mouse button pressed */
     Ez_window win_l[EZ_WIN_MAX];    /* Windows list */
     int win_nb;                     /* Windows number */
+    Ez_window layer_win;            /* Window whose layer is being rendered */
+    int layer_num;                  /* Number of this layer */
+    Ez_window layer_dbuf_win;       /* Double-buffered window saved by layer */
+    XdbeBackBuffer layer_dbuf;      /* Double buffer saved by layer */
+    int async;                      /* ez_async_init was called */
 } Ez_X;
 
 #ifdef EZ_BASE_WIN32
@@ -196,11 +203,11 @@ typedef struct {
 /* Timer */
 #define  EZ_TIMER1        208
 /* Private messages */
-enum { EZ_MSG_PAINT = WM_APP+1, EZ_MSG_LAST };
+enum { EZ_MSG_PAINT = WM_APP+1, EZ_MSG_ASYNC, EZ_MSG_LAST };
 #endif /* EZ_BASE_ */
 
 /* Additional events */
-enum { WindowClose = LASTEvent+1, TimerNotify, EzLastEvent };
+enum { WindowClose = LASTEvent+1, TimerNotify, ImageLoaded, EzLastEvent };
 
 
 typedef struct {
@@ -213,18 +220,38 @@ typedef struct {
     char   key_name[80];            /* For printing: "XK_Space", "XK_q", .. */
     char   key_string[80];          /* Corresponding string: " ", "q", etc */
     int    key_count;               /* String length */
+    struct Ez_image *image;         /* ImageLoaded: image, or NULL on error */
+    int tag;                        /* ImageLoaded: see ez_image_load_async */
     XEvent xev;                     /* Original event */
 } Ez_event;
 
 /* Type of a callback */
 typedef void (*Ez_func)(Ez_event *ev);
 
+/* Offscreen layers of a window */
+#define EZ_LAYER_MAX 8
+
+typedef struct {
+#ifdef EZ_BASE_XLIB
+    Pixmap map, mask;               /* Offscreen drawing and its mask */
+#elif defined EZ_BASE_WIN32
+    HDC hdc, hdc_mask;              /* Memory DCs of the drawing and mask */
+    HBITMAP hmap, hmask;            /* Offscreen drawing and its mask */
+    HBITMAP hold, hold_mask;        /* Bitmaps initially selected in DCs */
+#endif /* EZ_BASE_ */
+    int map_w, map_h;               /* Size of the offscreen drawing */
+    int width, height;              /* Size of the window */
+    int transparent;                /* Magenta pixels are not composited */
+    int dirty;                      /* Must be rendered again */
+} Ez_layer;
+
 /* Data associated to a window using a xid or a property */
 typedef struct {
     Ez_func func;                   /* Callback of window */
     void *data;                     /* User-data associated to window */
     XdbeBackBuffer dbuf;            /* Back-buffer of window */
     int show;                       /* For delayed display */
+    Ez_layer *layer[EZ_LAYER_MAX];  /* Stack of layers, bottom first */
 } Ez_win_info;
 
 
@@ -270,6 +297,13 @@ void ez_set_nfont (int num);
 void ez_draw_text (Ez_window win, Ez_Align align, int x1, int y1,
     const char *format, ...);
 
+int  ez_layer_create (Ez_window win, int num, int transparent);
+void ez_layer_destroy (Ez_window win, int num);
+void ez_layer_set_dirty (Ez_window win, int num);
+int  ez_layer_begin (Ez_window win, int num);
+void ez_layer_end (Ez_window win);
+void ez_layer_compose (Ez_window win);
+
 
 /* Private functions */
 #ifdef EZ_PRIVATE_DEFS
@@ -297,6 +331,10 @@ int ez_timer_add (Ez_window win, int delay);
 int ez_timer_remove (Ez_window win);
 struct timeval *ez_timer_delay (void) ;
 
+extern int (*ez_async_next) (Ez_event *ev);
+int ez_async_init (int (*next) (Ez_event *ev));
+void ez_async_wakeup (Ez_window win);
+
 #ifdef EZ_BASE_XLIB
 void ez_event_next (Ez_event *ev);
 Bool ez_predicat_expose (Display *display, XEvent *xev, XPointer arg);
@@ -314,6 +352,7 @@ void ez_update_pen (void) ;
 void ez_random_init (void) ;
 
 int ez_win_list_find (Ez_window win);
+int ez_win_list_has (Ez_window win);
 int ez_win_list_insert (Ez_window win);
 int ez_win_list_remove (Ez_window win);
 
@@ -333,6 +372,14 @@ int ez_dbuf_get (Ez_window win, XdbeBackBuffer *dbuf);
 void ez_dbuf_preswap (Ez_window win);
 void ez_dbuf_swap (Ez_window win);
 
+int ez_layer_get (Ez_window win, int num, Ez_layer **layer);
+int ez_layer_alloc (Ez_layer *layer);
+void ez_layer_free (Ez_layer *layer);
+void ez_layer_resize_all (Ez_window win, int w, int h);
+void ez_layer_destroy_all (Ez_window win);
+int ez_layer_build_mask (Ez_layer *layer);
+void ez_layer_copy (Ez_window win, Ez_layer *layer);
+
 void ez_font_init (void) ;
 void ez_font_delete (void) ;
 int ez_color_init (void) ;
@@ -13,12 +13,67 @@
 #define EZ_PRIVATE_DEFS 1
 #include "ez-image.h"
 
+#ifdef EZ_SIMD_X86
+#include <immintrin.h>
+#endif
+
+#include <sys/stat.h>
+#ifdef EZ_BASE_XLIB
+#include <sys/mman.h>
+#include <unistd.h>
+#include <fcntl.h>
+#endif /* EZ_BASE_ */
+
 /* Contains internal parameters of ez-draw.c */
 extern Ez_X ezx;
 
 /* Counters for debugging */
 int ez_image_count = 0, ez_pixmap_count = 0;
 
+/* Sprites waiting to be drawn by ez_sprite_batch_end */
+Ez_sprite_batch ez_batch;
+
+/* Images being sorted by ez_atlas_compare */
+Ez_image **ez_atlas_img;
+
+/* Global opacity of ez_image_composite */
+int ez_comp_alpha = 255;
+
+#ifdef EZ_BASE_XLIB
+/* Layout of the pixels in the XImages, see ez_xi_layout_init */
+Ez_xi_layout ez_xi_layout;
+#endif /* EZ_BASE_ */
+
+/* Cache of transformed images */
+Ez_tcache ez_tcache = { .budget = EZ_TCACHE_BUDGET };
+
+/* Cache of decoded image files */
+Ez_icache ez_icache = { .budget = EZ_ICACHE_BUDGET };
+
+/* Pool of pixel buffers */
+Ez_pool ez_pool = { .budget = EZ_POOL_BUDGET };
+
+/* Lock of the pool and counters, shared with the loading threads */
+#ifdef EZ_BASE_XLIB
+pthread_mutex_t ez_image_mutex = PTHREAD_MUTEX_INITIALIZER;
+#elif defined EZ_BASE_WIN32
+LONG volatile ez_image_spin = 0;
+#endif /* EZ_BASE_ */
+
+/* Threads of ez_image_load_async */
+Ez_loader ez_loader;
+
+/* Decoded lazy images */
+Ez_lazy_list ez_lazy_list;
+
+/* Row kernels for the processor, see ez_row_get_kernels */
+Ez_row_kernels ez_row_kernels;
+#ifdef EZ_BASE_XLIB
+pthread_once_t ez_row_once = PTHREAD_ONCE_INIT;
+#elif defined EZ_BASE_WIN32
+LONG volatile ez_row_once = 0;          /* 1 while initialized, 2 when done */
+#endif /* EZ_BASE_ */
+
 
 /*---------------------- P U B L I C   I N T E R F A C E --------------------*/
 
@@ -34,12 +89,31 @@ Ez_image *ez_image_new (void)
         ez_error ("ez_image_new: out of memory\n");
         return NULL;
     }
+    ez_image_lock ();
     ez_image_count++;
+    ez_image_unlock ();
 
     img->width = img->height = 0;
     img->pixels_rgba = NULL;
+    img->stride = 0;
+    img->pixels_mem = NULL;
+    img->parent = NULL;
+    img->refcount = 1;
+    img->views = img->vprev = img->vnext = NULL;
+    img->lazy = NULL;
+    img->cow = 0;
+    img->pack = NULL;
+    img->tcache = NULL;
     img->has_alpha = 0;
     img->opacity = 128;
+    img->has_mipmap = 0;
+    img->mipmap = NULL;
+    img->premultiplied = 0;
+    img->dirty_x = img->dirty_y = img->dirty_w = img->dirty_h = 0;
+#ifdef EZ_BASE_XLIB
+    img->xmask = None;
+    img->xmask_opacity = 0;
+#endif /* EZ_BASE_ */
 
     return img;
 }
@@ -52,10 +126,36 @@ Ez_image *ez_image_new (void)
 void ez_image_destroy (Ez_image *img)
 {
     if (img == NULL) return;
-    if (img->pixels_rgba != NULL) free (img->pixels_rgba);
+
+    /* The image is kept while it has views */
+    if (--img->refcount > 0) return;
+
+    ez_tcache_purge (img);
+    ez_image_destroy (img->mipmap);
+#ifdef EZ_BASE_XLIB
+    ez_image_free_xmask (img);
+#endif /* EZ_BASE_ */
+    if (img->lazy != NULL) {
+        if (img->pixels_rgba != NULL) {
+            ez_image_lock ();
+            ez_lazy_unlink (img);
+            ez_image_unlock ();
+        }
+        free (img->lazy->filename);
+        free (img->lazy);
+    }
+    if (img->parent != NULL) {
+        ez_image_unlink_view (img);
+        ez_image_destroy (img->parent);
+    } else if (img->pixels_mem != NULL)
+        ez_pool_free (img->pixels_mem,
+            (size_t) img->stride * img->height + EZ_IMAGE_ALIGN);
+    else if (img->pack != NULL) ez_pack_release (img->pack);
     free (img);
 
+    ez_image_lock ();
     ez_image_count--;
+    ez_image_unlock ();
     if (ez_image_debug ())
         printf ("ez_image_destroy  count = %d\n", ez_image_count);
 }
@@ -68,24 +168,82 @@ void ez_image_destroy (Ez_image *img)
 
 Ez_image *ez_image_create (int w, int h)
 {
-    Ez_image *img;
+    return ez_image_create_pixels (w, h, 1);
+}
 
-    if (w < 0 || h < 0) {
-        ez_error ("ez_image_create: bad size\n");
-        return NULL;
-    }
 
-    img = ez_image_new ();
-    if (img == NULL) return NULL;
+/*
+ * Create an image having width w and height h, whose pixels are not
+ * initialized; this is faster when all the pixels will be overwritten.
+ * Return the image, else NULL.
+*/
 
-    img->pixels_rgba = calloc (w*h*4, 1);
-    if (img->pixels_rgba == NULL) {
-        ez_error ("ez_image_create: out of memory\n");
-        return NULL;
-    }
-    img->width = w; img->height = h;
+Ez_image *ez_image_create_uninit (int w, int h)
+{
+    return ez_image_create_pixels (w, h, 0);
+}
 
-    return img;
+
+/*
+ * Create a view of the region x,y,w,h of img: an image which shares the
+ * pixels of img, without copy. The region is confined to img. img is
+ * kept until all its views are destroyed.
+ * Return the view, else NULL.
+*/
+
+Ez_image *ez_image_view (Ez_image *img, int x, int y, int w, int h)
+{
+    Ez_image *res;
+
+    if (ez_image_confine_sub_coords (img, &x, &y, &w, &h) < 0) return NULL;
+
+    res = ez_image_new ();
+    if (res == NULL) return NULL;
+
+    res->width = w; res->height = h;
+    res->stride = img->stride;
+    res->pixels_rgba = EZ_IMAGE_PIXEL (img, x, y);
+    res->has_alpha = img->has_alpha;
+    res->opacity   = img->opacity;
+    res->premultiplied = img->premultiplied;
+    res->cow = img->cow;
+
+    /* The view refers to the image which owns the pixels */
+    res->parent = img->parent != NULL ? img->parent : img;
+    res->parent->refcount++;
+    ez_image_link_view (res);
+
+    return res;
+}
+
+
+int ez_image_is_view (Ez_image *img)
+{
+    if (img == NULL) return 0;
+    return img->parent != NULL;
+}
+
+
+/*
+ * Insert the view img in the list of the views of its parent, or remove
+ * it; a modification of the pixels is told to all the views, see
+ * ez_image_add_dirty.
+*/
+
+void ez_image_link_view (Ez_image *img)
+{
+    img->vprev = NULL;
+    img->vnext = img->parent->views;
+    if (img->vnext != NULL) img->vnext->vprev = img;
+    img->parent->views = img;
+}
+
+void ez_image_unlink_view (Ez_image *img)
+{
+    if (img->vprev != NULL) img->vprev->vnext = img->vnext;
+    else img->parent->views = img->vnext;
+    if (img->vnext != NULL) img->vnext->vprev = img->vprev;
+    img->vprev = img->vnext = NULL;
 }
 
 
@@ -98,12 +256,14 @@ Ez_image *ez_image_dup (Ez_image *img)
 {
     Ez_image *res;
 
-    if (img == NULL) return NULL;
-    res = ez_image_create (img->width, img->height);
+    if (ez_image_pixels (img) < 0) return NULL;
+    res = ez_image_create_uninit (img->width, img->height);
     if (res == NULL) return NULL;
-    memcpy (res->pixels_rgba, img->pixels_rgba, img->width * img->height * 4);
-    res->has_alpha = img->has_alpha;
-    res->opacity   = img->opacity;
+    ez_image_copy_sub (img, res, 0, 0);
+    res->has_alpha  = img->has_alpha;
+    res->opacity    = img->opacity;
+    res->premultiplied = img->premultiplied;
+    res->has_mipmap = img->has_mipmap;
     return res;
 }
 
@@ -114,24 +274,58 @@ Ez_image *ez_image_dup (Ez_image *img)
  */
 
 Ez_image *ez_image_load (const char *filename)
+{
+    return ez_image_load_scratch (filename, NULL);
+}
+
+
+/*
+ * Same as ez_image_load, but the temporary buffers of the decoder are taken
+ * in sc and kept there for the next loadings; sc can be NULL. A scratch must
+ * not be used by several threads at the same time.
+ * Return the image, else NULL.
+*/
+
+Ez_image *ez_image_load_scratch (const char *filename, Ez_scratch *sc)
+{
+    return ez_image_load_reduced (filename, sc, 1);
+}
+
+
+/*
+ * Load an image, decoding a JPEG file at 1/scale of its size, for scale
+ * in 1, 2, 4, 8; the other formats are loaded at full size.
+ * Return the image, else NULL.
+*/
+
+Ez_image *ez_image_load_reduced (const char *filename, Ez_scratch *sc,
+    int scale)
 {
     Ez_image *img;
-    int nbytes;
+    Ez_uint8 *data;
+    int w, h, y, nbytes;
     double time1 = 0, time2 = 0;
 
-    img = ez_image_new ();
-    if (img == NULL) return NULL;
-
     if (ez_image_debug()) time1 = ez_get_time ();
 
     /* Loading with stbi */
-    img->pixels_rgba = ez_stbi_load (filename, &img->width, &img->height,
-        &nbytes, EZ_STBI_RGB_ALPHA);
-    if (img->pixels_rgba == NULL) {
+    data = ez_stbi_load_scale (filename, sc, scale, &w, &h, &nbytes,
+        EZ_STBI_RGB_ALPHA);
+    if (data == NULL) {
         ez_error ("ez_load_image: can't load file \"%s\"\n", filename);
-        ez_image_destroy (img);
         return NULL;
     }
+
+    /* The rows are copied in the aligned rows of the image */
+    img = ez_image_create_uninit (w, h);
+    if (img == NULL) {
+        ez_scratch_free (sc, data);
+        return NULL;
+    }
+    for (y = 0; y < h; y++)
+        memcpy (EZ_IMAGE_PIXEL (img, 0, y), data + (size_t) y*w*4, w*4);
+    ez_scratch_free (sc, data);
+
     /* An alpha channel is present in the file? */
     img->has_alpha = nbytes == 4;
 
@@ -148,1290 +342,5985 @@ Ez_image *ez_image_load (const char *filename)
 
 
 /*
- * Properties has_alpha and opacity
+ * Load an image from the file filename, reduced to fit in max_w x max_h
+ * while keeping its aspect ratio; a smaller image is not enlarged. A JPEG
+ * file is decoded directly at 1/2, 1/4 or 1/8 of its size in the DCT
+ * domain, which takes 4 to 64 times less memory than a full loading; the
+ * Huffman decoding of the whole file remains, so it is only 2 to 3 times
+ * faster. Then the result is resized to the exact size.
+ * Return the image, else NULL.
 */
 
-void ez_image_set_alpha (Ez_image *img, int has_alpha)
+Ez_image *ez_image_load_scaled (const char *filename, int max_w, int max_h)
 {
-    if (img == NULL) return;
-    img->has_alpha = has_alpha ? 1 : 0;
-}
+    Ez_image *img, *res;
+    int w, h, comp, tw, th, scale;
+    double factor;
 
+    if (filename == NULL) return NULL;
+    if (max_w <= 0 || max_h <= 0) {
+        ez_error ("ez_image_load_scaled: bad size %d x %d\n", max_w, max_h);
+        return NULL;
+    }
+    if (!ez_stbi_info (filename, &w, &h, &comp)) {
+        ez_error ("ez_image_load_scaled: can't read file \"%s\"\n", filename);
+        return NULL;
+    }
 
-int ez_image_has_alpha (Ez_image *img)
-{
-    if (img == NULL) return 0;
-    return img->has_alpha ? 1 : 0;
-}
-
+    /* Final size */
+    factor = (double) max_w / w;
+    if ((double) max_h / h < factor) factor = (double) max_h / h;
+    if (factor >= 1) return ez_image_load (filename);
+    tw = w * factor + 0.5; if (tw < 1) tw = 1; if (tw > max_w) tw = max_w;
+    th = h * factor + 0.5; if (th < 1) th = 1; if (th > max_h) th = max_h;
 
-void ez_image_set_opacity (Ez_image *img, int opacity)
-{
-    if (img == NULL) return;
-    img->opacity = opacity;
-}
+    /* Largest reduction of the decoder keeping at least the final size */
+    for (scale = 8; scale > 1; scale /= 2)
+        if ((w + scale-1) / scale >= tw && (h + scale-1) / scale >= th) break;
 
+    img = ez_image_load_reduced (filename, NULL, scale);
+    if (img == NULL || (img->width == tw && img->height == th)) return img;
 
-int ez_image_get_opacity (Ez_image *img)
-{
-    if (img == NULL) return 0;
-    return img->opacity;
+    res = ez_image_resize (img, tw, th, EZ_RESIZE_AREA);
+    ez_image_destroy (img);
+    return res;
 }
 
 
 /*
- * Display an image or a rectangular region of the image img in the
- * window win, with the upper left corner of the image at the x,y
- * coordinates in the window.
- *
- * If img->has_alpha is true, apply transparency.
+ * Create an image from the file filename without decoding it: width,
+ * height and has_alpha are read in the header of the file. The pixels are
+ * decoded when they are first needed by a function of this module, or by
+ * ez_image_decode. Return the image, else NULL.
 */
 
-void ez_image_paint (Ez_window win, Ez_image *img, int x, int y)
+Ez_image *ez_image_load_lazy (const char *filename)
 {
-    if (img == NULL) return;
-    ez_image_paint_sub (win, img, x, y, 0, 0, img->width, img->height);
-}
-
+    Ez_image *img;
+    int w, h, comp;
 
-void ez_image_paint_sub (Ez_window win, Ez_image *img, int x, int y,
-    int src_x, int src_y, int w, int h)
-{
-    int src_x_old = src_x, src_y_old = src_y;
+    if (filename == NULL) return NULL;
+    if (!ez_stbi_info (filename, &w, &h, &comp)) {
+        ez_error ("ez_image_load_lazy: can't read file \"%s\"\n", filename);
+        return NULL;
+    }
 
-    if (win == None) return;
+    img = ez_image_new ();
+    if (img == NULL) return NULL;
+    img->lazy = malloc (sizeof(Ez_lazy));
+    if (img->lazy != NULL) img->lazy->filename = malloc (strlen (filename)+1);
+    if (img->lazy == NULL || img->lazy->filename == NULL) {
+        ez_error ("ez_image_load_lazy: out of memory\n");
+        if (img->lazy != NULL) { free (img->lazy); img->lazy = NULL; }
+        ez_image_destroy (img);
+        return NULL;
+    }
+    strcpy (img->lazy->filename, filename);
+    img->lazy->prev = img->lazy->next = NULL;
+    img->lazy->modified = 0;
 
-    if (ez_image_confine_sub_coords (img, &src_x, &src_y, &w, &h) < 0) return;
-    x += src_x - src_x_old;
-    y += src_y - src_y_old;
+    img->width = w; img->height = h;
+    img->has_alpha = comp == 4;
 
-#ifdef EZ_BASE_XLIB
-    if (win == ezx.dbuf_win) win = ezx.dbuf_pix;
-    ez_image_draw_xi (win, img, x, y, src_x, src_y, w, h);
-#elif defined EZ_BASE_WIN32
-    ez_cur_win (win);
-    ez_image_draw_dib (ezx.hdc, img, x, y, src_x, src_y, w, h);
-#endif /* EZ_BASE_ */
+    if (ez_image_debug ())
+        printf ("ez_image_load_lazy  file \"%s\"  w = %d  h = %d  n = %d\n",
+            filename, w, h, comp);
+    return img;
 }
 
 
 /*
- * Print a rectangular region of the image img in the terminal.
+ * Decode the pixels of a lazy image now; this is needed before reading
+ * img->pixels_rgba directly. Does nothing for the other images.
+ * Return 0 on success, -1 on error.
 */
 
-void ez_image_print (Ez_image *img, int src_x, int src_y, int w, int h)
+int ez_image_decode (Ez_image *img)
 {
-    if (ez_image_confine_sub_coords (img, &src_x, &src_y, &w, &h) < 0) return;
-
-    printf ("Image: width %d  height %d  has_alpha %s  opacity %d\n",
-        img->width, img->height, img->has_alpha?"true":"false", img->opacity);
-    printf ("Region: src_x %d  src_y %d  width %d  height %d\n",
-        src_x, src_y, w, h);
-
-    ez_image_print_rgba (img, src_x, src_y, w, h);
+    return ez_image_pixels (img);
 }
 
 
 /*
- * Fill an image with RGBA color
+ * Free the pixels of the lazy image img, which will be decoded again from
+ * the file when needed; the modifications of the pixels are lost.
+ * Return 0 on success, -1 if img is not lazy or has views.
 */
 
-void ez_image_fill_rgba (Ez_image *img, Ez_uint8 r, Ez_uint8 g, Ez_uint8 b, Ez_uint8 a)
+int ez_image_unload (Ez_image *img)
 {
-    if (img == NULL) return;
+    if (img == NULL || img->lazy == NULL || img->refcount > 1) return -1;
+    if (img->pixels_rgba == NULL) return 0;
 
-    ez_image_comp_fill_rgba (img, r, g, b, a);
+    ez_image_lock ();
+    ez_lazy_unlink (img);
+    ez_image_unlock ();
+    ez_lazy_free_pixels (img);
+    return 0;
 }
 
 
 /*
- * Superimpose a region of image src into the image dst. If src image has an
- * alpha channel, apply transparency.
- * If the coordinates go beyond the images src or dst, just the common region
- * is superimposed.
+ * Free the pixels of the lazy image img, already removed from
+ * ez_lazy_list, and what was computed from them.
 */
 
-void ez_image_blend (Ez_image *dst, Ez_image *src, int dst_x, int dst_y)
+void ez_lazy_free_pixels (Ez_image *img)
 {
-    if (src == NULL) return;
-    ez_image_blend_sub (dst, src, dst_x, dst_y, 0, 0, src->width, src->height);
+    ez_tcache_purge (img);
+    ez_image_destroy (img->mipmap);
+    img->mipmap = NULL;
+#ifdef EZ_BASE_XLIB
+    ez_image_free_xmask (img);
+#endif /* EZ_BASE_ */
+
+    ez_pool_free (img->pixels_mem,
+        (size_t) img->stride * img->height + EZ_IMAGE_ALIGN);
+    img->pixels_rgba = img->pixels_mem = NULL;
+    img->stride = 0;
+    img->premultiplied = 0;
+    img->lazy->modified = 0;
+    ez_image_clear_dirty (img);
 }
 
 
-void ez_image_blend_sub (Ez_image *dst, Ez_image *src, int dst_x, int dst_y,
-    int src_x, int src_y, int w, int h)
+/*
+ * Tell if the pixels of img are present: always true except for a lazy
+ * image not yet decoded, or unloaded.
+*/
+
+int ez_image_is_decoded (Ez_image *img)
 {
-    int src_x_old = src_x, src_y_old = src_y, dst_x_old, dst_y_old;
+    if (img == NULL) return 0;
+    return img->pixels_rgba != NULL || img->width == 0 || img->height == 0;
+}
 
-    if (ez_image_confine_sub_coords (src, &src_x, &src_y, &w, &h) < 0) return;
-    dst_x += src_x - src_x_old; dst_x_old = dst_x;
-    dst_y += src_y - src_y_old; dst_y_old = dst_y;
-    if (ez_image_confine_sub_coords (dst, &dst_x, &dst_y, &w, &h) < 0) return;
-    src_x += dst_x - dst_x_old;
-    src_y += dst_y - dst_y_old;
 
-    if (src->has_alpha)
-         ez_image_comp_blend (dst, src, dst_x, dst_y, src_x, src_y, w, h);
-    else ez_image_comp_over  (dst, src, dst_x, dst_y, src_x, src_y, w, h);
+/*
+ * Set the memory budget of the decoded lazy images, in bytes: beyond it,
+ * the least recently used ones are unloaded (except the two last ones,
+ * which may be in use, and the modified ones, which are only unloaded by
+ * ez_image_unload). The default is 0, which means no limit.
+*/
+
+void ez_image_lazy_set_budget (long bytes)
+{
+    ez_image_lock ();
+    ez_lazy_list.budget = bytes < 0 ? 0 : bytes;
+    ez_image_unlock ();
+    ez_lazy_trim ();
 }
 
 
 /*
- * Extract a rectangular region of an image.
- * Return new image, else NULL.
+ * Load an image from the file filename through a cache: the file is
+ * decoded once, and the images returned for it share its pixels. The key
+ * is the name of the file, with its date and size, so a modified file is
+ * decoded again. The functions of this module which modify the pixels
+ * first give the image its own copy, see ez_image_unshare.
+ * The image is destroyed as usual with ez_image_destroy.
+ * Return the image, else NULL.
 */
 
-Ez_image *ez_image_extract (Ez_image *img, int src_x, int src_y, int w, int h)
+Ez_image *ez_image_load_cached (const char *filename)
 {
+    Ez_icache_entry *entry;
     Ez_image *res;
+    struct stat st;
+    unsigned long hash;
 
-    if (ez_image_confine_sub_coords (img, &src_x, &src_y, &w, &h) < 0)
+    if (filename == NULL) return NULL;
+    if (stat (filename, &st) < 0) {
+        ez_error ("ez_image_load_cached: can't read file \"%s\"\n", filename);
         return NULL;
+    }
 
-    res = ez_image_create (w, h);
-    if (res == NULL) return NULL;
-    res->has_alpha = img->has_alpha;
-    res->opacity   = img->opacity;
+    hash = ez_icache_hash (filename);
+    for (entry = ez_icache.bucket[hash]; entry != NULL; entry = entry->hnext)
+        if (strcmp (entry->filename, filename) == 0) break;
 
-    ez_image_copy_sub (img, res, src_x, src_y);
+    /* The file was modified since it was decoded */
+    if (entry != NULL && (entry->mtime != (long) st.st_mtime ||
+                          entry->size  != (long) st.st_size)) {
+        ez_icache_remove (entry);
+        entry = NULL;
+    }
+
+    if (entry != NULL) {
+        ez_icache.hits++;
+        if (entry != ez_icache.first) {
+            ez_icache_unlink (entry);
+            ez_icache_link (entry);
+        }
+    } else {
+        ez_icache.misses++;
+        entry = malloc (sizeof (Ez_icache_entry));
+        if (entry != NULL) entry->filename = malloc (strlen (filename)+1);
+        if (entry == NULL || entry->filename == NULL) {
+            ez_error ("ez_image_load_cached: out of memory\n");
+            free (entry);
+            return NULL;
+        }
+        entry->img = ez_image_load (filename);
+        if (entry->img == NULL) {
+            free (entry->filename); free (entry);
+            return NULL;
+        }
+        strcpy (entry->filename, filename);
+        entry->mtime = (long) st.st_mtime;
+        entry->size  = (long) st.st_size;
+        entry->bytes = (long) entry->img->stride * entry->img->height;
+        entry->hash = hash;
+        entry->hnext = ez_icache.bucket[hash];
+        ez_icache.bucket[hash] = entry;
+        ez_icache_link (entry);
+        ez_icache.nb++;
+        ez_icache.bytes += entry->bytes;
+    }
+
+    /* A view of the whole image, whose pixels are copied on write */
+    res = ez_image_view (entry->img, 0, 0, entry->img->width,
+        entry->img->height);
+    if (res == NULL) return NULL;
+    res->cow = 1;
+    res->has_mipmap = entry->img->has_mipmap;
 
+    ez_icache_evict ();
     return res;
 }
 
 
 /*
- * Vertical or horizontal symmetry.
- * Return new image, else NULL.
+ * Give img its own copy of the pixels, if they are shared with the cache
+ * of ez_image_load_cached; this must be done before modifying directly
+ * img->pixels_rgba. Does nothing for the other images.
+ * Return 0 on success, -1 on error.
 */
 
-Ez_image *ez_image_sym_ver (Ez_image *img)
+int ez_image_unshare (Ez_image *img)
 {
-    Ez_image *res;
-
-    if (img == NULL) return NULL;
+    Ez_image *parent;
+    Ez_uint8 *src;
+    int stride, y;
 
-    res = ez_image_create (img->width, img->height);
-    if (res == NULL) return NULL;
-    res->has_alpha = img->has_alpha;
-    res->opacity   = img->opacity;
+    if (img == NULL) return -1;
+    if (!img->cow) return 0;
+
+    parent = img->parent;
+    src = img->pixels_rgba;
+    stride = img->stride;
+    if (ez_image_alloc_pixels (img, img->width, img->height, 0) < 0) {
+        ez_error ("ez_image_unshare: out of memory\n");
+        img->stride = stride;
+        return -1;
+    }
+    for (y = 0; y < img->height; y++)
+        memcpy (img->pixels_rgba + y*img->stride, src + y*stride,
+            (size_t) img->width*4);
 
-    ez_image_comp_symv (img, res);
-    return res;
+    ez_image_unlink_view (img);
+    img->parent = NULL;
+    img->cow = 0;
+    ez_image_destroy (parent);
+#ifdef EZ_BASE_XLIB
+    ez_image_free_xmask (img);
+#endif /* EZ_BASE_ */
+    return 0;
 }
 
 
-Ez_image *ez_image_sym_hor (Ez_image *img)
+/*
+ * Set the memory budget of the cache of ez_image_load_cached, in bytes;
+ * the default is EZ_ICACHE_BUDGET. The images still in use keep their
+ * pixels when their entry is freed.
+*/
+
+void ez_image_cache_set_budget (long bytes)
 {
-    Ez_image *res;
+    ez_icache.budget = bytes < 0 ? 0 : bytes;
+    ez_icache_evict ();
+}
 
-    if (img == NULL) return NULL;
 
-    res = ez_image_create (img->width, img->height);
-    if (res == NULL) return NULL;
-    res->has_alpha = img->has_alpha;
-    res->opacity   = img->opacity;
+/*
+ * Get the statistics of the cache of ez_image_load_cached: number of hits
+ * and misses since the start, memory used in bytes and number of entries.
+ * Each argument can be NULL.
+*/
 
-    ez_image_comp_symh (img, res);
-    return res;
+void ez_image_cache_get_stats (long *hits, long *misses, long *bytes,
+    int *nb)
+{
+    if (hits   != NULL) *hits   = ez_icache.hits;
+    if (misses != NULL) *misses = ez_icache.misses;
+    if (bytes  != NULL) *bytes  = ez_icache.bytes;
+    if (nb     != NULL) *nb     = ez_icache.nb;
 }
 
 
 /*
- * Scale an image.
- * Return new image, else NULL.
+ * Free all the entries of the cache of ez_image_load_cached.
 */
 
-Ez_image *ez_image_scale (Ez_image *img, double factor)
+void ez_image_cache_clear (void)
 {
-    Ez_image *res;
-
-    if (img == NULL) return NULL;
-
-    if (factor <= 0) {
-        ez_error ("ez_image_scale: bad scale factor %f\n", factor);
-        return NULL;
-    }
-    if (factor == 1)
-        return ez_image_dup (img);
-
-    res = ez_image_create (img->width*factor, img->height*factor);
-    if (res == NULL) return NULL;
-    res->has_alpha = 1;
-    res->opacity   = img->opacity;
-
-    if (factor > 1)
-         ez_image_expand (img, res, factor);
-    else ez_image_shrink (img, res, factor);
-    return res;
+    while (ez_icache.last != NULL)
+        ez_icache_remove (ez_icache.last);
 }
 
 
 /*
- * Rotate image img for angle theta in degrees.
- * Return a new image whose size is adjusted to contain the result, or NULL
- * on error. The outer parts of the original image become transparent.
+ * Create an empty scratch for ez_image_load_scratch.
+ * Return the scratch, else NULL.
 */
 
-Ez_image *ez_image_rotate (Ez_image *img, double theta, int quality)
+Ez_scratch *ez_scratch_create (void)
 {
-    int w, h;
-    Ez_image *res;
-
-    if (img == NULL) return NULL;
-
-    ez_rotate_get_size (theta, img->width, img->height, &w, &h);
-
-    res = ez_image_create (w, h);
-    if (res == NULL) return NULL;
-    res->has_alpha = 1;
-    res->opacity   = img->opacity;
-
-    if (quality)
-         ez_image_rotate_bilinear (img, res, theta);
-    else ez_image_rotate_nearest  (img, res, theta);
-    return res;
+    Ez_scratch *sc = calloc (1, sizeof(Ez_scratch));
+    if (sc == NULL) ez_error ("ez_scratch_create: out of memory\n");
+    return sc;
 }
 
 
 /*
- * Compute for a point having coordinates src_x,src_y in the source image, the
- * corresponding coordinates dst_x,dst_y of the point in the destination image.
+ * Free the scratch sc and its buffers.
 */
 
-void ez_image_rotate_point (Ez_image *img, double theta, int src_x, int src_y,
-    int *dst_x, int *dst_y)
+void ez_scratch_destroy (Ez_scratch *sc)
 {
-    if (img == NULL || dst_x == NULL || dst_y == NULL) return;
-
-    ez_rotate_get_coords (theta, img->width, img->height, src_x, src_y,
-        dst_x, dst_y);
+    int i;
+    if (sc == NULL) return;
+    for (i = 0; i < EZ_SCRATCH_SLOTS; i++)
+        free (sc->block[i]);
+    free (sc);
 }
 
 
 /*
- * Allocate a pixmap, initialized to default value.
- * Return the pixmap, else NULL.
+ * Load the image file filename in background, by a pool of threads.
+ * When the loading is done, the main loop sends to the window win an
+ * ImageLoaded event, with ev->image the image (or NULL on error) and
+ * ev->tag the tag given here. The callback becomes the owner of the image.
+ * The images of a destroyed window are freed.
+ * Return 0 on success, -1 on error.
 */
 
-Ez_pixmap *ez_pixmap_new (void)
+int ez_image_load_async (const char *filename, Ez_window win, int tag)
 {
-    Ez_pixmap *pix = malloc (sizeof(Ez_pixmap));
-    if (pix == NULL) {
-        ez_error ("ez_pixmap_new: out of memory\n");
-        return NULL;
+    Ez_load_job *job;
+
+    if (filename == NULL || ! ez_win_list_has (win)) {
+        ez_error ("ez_image_load_async: bad window or file name\n");
+        return -1;
     }
-    ez_pixmap_count++;
+    if (ez_loader.quit) return -1;
+    if (ez_loader.thread_nb == 0 && ez_loader_start () < 0) return -1;
 
-    pix->width = pix->height = 0;
+    job = malloc (sizeof(Ez_load_job));
+    if (job != NULL) job->filename = malloc (strlen (filename) + 1);
+    if (job == NULL || job->filename == NULL) {
+        ez_error ("ez_image_load_async: out of memory\n");
+        free (job);
+        return -1;
+    }
+    strcpy (job->filename, filename);
+    job->win = win;
+    job->tag = tag;
+    job->img = NULL;
+
+    ez_loader_lock ();
+    ez_loader_push (&ez_loader.todo, &ez_loader.todo_last, job);
+    ez_loader_unlock ();
 #ifdef EZ_BASE_XLIB
-    pix->map = None;
-    pix->mask = None;
+    pthread_cond_signal (&ez_loader.cond);
 #elif defined EZ_BASE_WIN32
-    pix->hmap = NULL;
-    pix->has_alpha = 0;
+    ReleaseSemaphore (ez_loader.sem, 1, NULL);
 #endif /* EZ_BASE_ */
-
-    return pix;
+    return 0;
 }
 
 
 /*
- * Destroy the pixmap and free memory.
+ * Load the n image files filenames in parallel, one thread by processor,
+ * and store the images in img; img[i] is NULL if the file i can't be
+ * loaded. Return the number of loaded images.
 */
 
-void ez_pixmap_destroy (Ez_pixmap *pix)
+int ez_image_load_many (const char **filenames, int n, Ez_image **img)
 {
-    if (pix == NULL) return;
+    Ez_load_many many;
+    int i, nb = 0, started = 0, thread_nb = ez_cpu_nb ();
+#ifdef EZ_BASE_XLIB
+    pthread_t thread[EZ_RESAMPLE_THREADS_MAX];
+#elif defined EZ_BASE_WIN32
+    HANDLE thread[EZ_RESAMPLE_THREADS_MAX];
+#endif /* EZ_BASE_ */
 
+    if (filenames == NULL || img == NULL || n <= 0) return 0;
+    if (thread_nb > n) thread_nb = n;
+
+    many.filenames = filenames; many.img = img;
+    many.n = n; many.next = 0;
+    ez_image_debug ();              /* Initialized before the threads */
+
+    /* The caller loads too; a thread which cannot be started is ignored,
+       the started threads are thread[0..started-1] */
+    for (i = 1; i < thread_nb; i++) {
 #ifdef EZ_BASE_XLIB
-    if (pix->map  != None) XFreePixmap (ezx.display, pix->map );
-    if (pix->mask != None) XFreePixmap (ezx.display, pix->mask);
+        if (pthread_create (&thread[started], NULL, ez_load_many_thread,
+            &many) == 0) started++;
 #elif defined EZ_BASE_WIN32
-    if (pix->hmap != NULL) DeleteObject (pix->hmap);
+        thread[started] = CreateThread (NULL, 0, ez_load_many_thread, &many,
+            0, NULL);
+        if (thread[started] != NULL) started++;
 #endif /* EZ_BASE_ */
-    free (pix);
+    }
 
-    ez_pixmap_count--;
-    if (ez_image_debug ())
-        printf ("ez_pixmap_destroy  count = %d\n", ez_pixmap_count);
+    ez_load_many_thread (&many);
+
+    for (i = 0; i < started; i++) {
+#ifdef EZ_BASE_XLIB
+        pthread_join (thread[i], NULL);
+#elif defined EZ_BASE_WIN32
+        WaitForSingleObject (thread[i], INFINITE);
+        CloseHandle (thread[i]);
+#endif /* EZ_BASE_ */
+    }
+
+    for (i = 0; i < n; i++)
+        if (img[i] != NULL) nb++;
+    return nb;
 }
 
 
 /*
- * Create a pixmap from an image img.
- * Return the pixmap, else NULL.
+ * Save the image img in the file filename, in QOI format: this is a
+ * lossless format, quickly decoded by ez_image_load. The alpha channel
+ * is saved if img->has_alpha is true.
+ * Return 0 on success, else -1.
 */
 
-Ez_pixmap *ez_pixmap_create_from_image (Ez_image *img)
+int ez_image_save_qoi (Ez_image *img, const char *filename)
 {
-    Ez_pixmap *pix;
-
-    if (img == NULL) return NULL;
-    pix = ez_pixmap_new ();
-    if (pix == NULL) return NULL;
-
-    pix->width  = img->width;
-    pix->height = img->height;
+    Ez_image *tmp = NULL;
+    Ez_uint8 *data;
+    FILE *f;
+    size_t len;
+    int res = 0;
 
-#ifdef EZ_BASE_XLIB
-    if (ez_pixmap_build_map (pix, img) < 0) {
-        ez_error ("ez_pixmap_create_from_image: can't create map\n");
-        goto free_pix;
-    }
-    if (img->has_alpha) {
-        pix->mask = ez_xmask_create (ezx.root_win, img, 0, 0,
-            img->width, img->height);
-        if (pix->mask == None) {
-            ez_error ("ez_pixmap_create_from_image: can't create mask\n");
-            goto free_pix;
-        }
+    if (ez_image_pixels (img) < 0 || img->width == 0 || img->height == 0) {
+        ez_error ("ez_image_save_qoi: bad image\n");
+        return -1;
     }
-#elif defined EZ_BASE_WIN32
-    if (ez_pixmap_build_hmap (pix, img) < 0) {
-        ez_error ("ez_pixmap_create_from_image: can't create hmap\n");
-        goto free_pix;
+
+    /* The colors are saved not multiplied by alpha */
+    if (img->premultiplied) {
+        tmp = ez_image_dup (img);
+        if (tmp == NULL) return -1;
+        ez_image_unpremultiply (tmp);
+        img = tmp;
     }
-    pix->has_alpha = img->has_alpha;
 
-#endif /* EZ_BASE_ */
+    data = ez_qoi_encode (img, &len);
+    ez_image_destroy (tmp);
+    if (data == NULL) {
+        ez_error ("ez_image_save_qoi: out of memory\n");
+        return -1;
+    }
 
-    return pix;
+    f = fopen (filename, "wb");
+    if (f == NULL) {
+        ez_error ("ez_image_save_qoi: can't create file \"%s\"\n", filename);
+        free (data);
+        return -1;
+    }
+    if (fwrite (data, 1, len, f) != len) res = -1;
+    if (fclose (f) != 0) res = -1;
+    if (res < 0)
+        ez_error ("ez_image_save_qoi: can't write file \"%s\"\n", filename);
 
-  free_pix:
-    ez_pixmap_destroy (pix);
-    return NULL;
+    free (data);
+    return res;
 }
 
 
 /*
- * Display the pixmap pix in the window win.
- * The top left corner of the pixmap is displayed at the x,y coordinates
- * in the window.
+ * Set the memory budget of the pool of pixel buffers, in bytes: this is
+ * the maximum size of the buffers kept for reuse after the destruction of
+ * their images. The default is EZ_POOL_BUDGET; 0 disables the pool.
 */
 
-void ez_pixmap_paint (Ez_window win, Ez_pixmap *pix, int x, int y)
+void ez_image_pool_set_budget (long bytes)
 {
-    if (win == None) return;
-
-#ifdef EZ_BASE_XLIB
-    if (win == ezx.dbuf_win) win = ezx.dbuf_pix;
-    ez_pixmap_draw_area (win, pix, x, y);
-#elif defined EZ_BASE_WIN32
-    ez_cur_win (win);
-    ez_pixmap_draw_hmap (ezx.hdc, pix, x, y);
-#endif /* EZ_BASE_ */
+    ez_pool.budget = bytes < 0 ? 0 : bytes;
+    ez_pool_trim (ez_pool.budget);
 }
 
 
 /*
- * Display the pixmap pix repeatedly in the window win.
- * The pixmap is displayed as a wallpaper in the window region bounded
- * by coordinates x,y (top left corner) and x+w-1,y+h-1 (bottom right corner).
+ * Get the statistics of the pool of pixel buffers: bytes in use by the
+ * images and XImages, maximum of bytes in use since the start, bytes kept
+ * for reuse, number of allocations served from the pool or not.
+ * Each argument can be NULL.
 */
 
-void ez_pixmap_tile (Ez_window win, Ez_pixmap *pix, int x, int y, int w, int h)
+void ez_image_pool_get_stats (long *live, long *peak, long *pooled,
+    long *hits, long *misses)
 {
-    if (win == None || w <= 0 || h <= 0) return;
-
-#ifdef EZ_BASE_XLIB
-    if (win == ezx.dbuf_win) win = ezx.dbuf_pix;
-    ez_pixmap_tile_area (win, pix, x, y, w, h);
-#elif defined EZ_BASE_WIN32
-    ez_cur_win (win);
-    ez_pixmap_tile_hmap (ezx.hdc, pix, x, y, w, h);
-#endif /* EZ_BASE_ */
+    ez_image_lock ();
+    if (live   != NULL) *live   = ez_pool.live;
+    if (peak   != NULL) *peak   = ez_pool.peak;
+    if (pooled != NULL) *pooled = ez_pool.pooled;
+    if (hits   != NULL) *hits   = ez_pool.hits;
+    if (misses != NULL) *misses = ez_pool.misses;
+    ez_image_unlock ();
 }
 
 
-/*-------------------- P R I V A T E   F U N C T I O N S --------------------*/
-
 /*
- * Unique test of the definition of the environment variable EZ_IMAGE_DEBUG
+ * Free the buffers kept in the pool.
 */
 
-int ez_image_debug (void)
+void ez_image_pool_clear (void)
 {
-    static int debug = -1;
-    if (debug < 0) debug = getenv ("EZ_IMAGE_DEBUG") != NULL;
-    return debug;
+    ez_pool_trim (0);
 }
 
 
 /*
- * Confine coordinates of sub-image inside img
+ * Properties has_alpha and opacity
 */
 
-int ez_image_confine_sub_coords (Ez_image *img, int *src_x, int *src_y,
-    int *w, int *h)
+void ez_image_set_alpha (Ez_image *img, int has_alpha)
 {
-    if (img == NULL) return -1;
-
-    if (ez_confine_coord (src_x, w, img->width) < 0 ||
-        ez_confine_coord (src_y, h, img->height) < 0) {
-        if (ez_image_debug ())
-            printf ("ez_image_confine_sub_coords empty region "
-                    "src_x = %d  src_y = %d  w = %d  h = %d\n",
-                *src_x, *src_y, *w, *h);
-        return -1;
-    }
-    return 0;
+    if (img == NULL) return;
+    img->has_alpha = has_alpha ? 1 : 0;
 }
 
-int ez_confine_coord (int *t, int *r, int tmax)
+
+int ez_image_has_alpha (Ez_image *img)
 {
-    if (*t < 0) { *r += *t; *t = 0; }
-    if (*t+*r > tmax) *r = tmax -*t;
-    return *r > 0 ? 0 : -1;
+    if (img == NULL) return 0;
+    return img->has_alpha ? 1 : 0;
 }
 
 
+void ez_image_set_opacity (Ez_image *img, int opacity)
+{
+    if (img == NULL) return;
+    img->opacity = opacity;
 #ifdef EZ_BASE_XLIB
+    if (img->xmask_opacity != opacity) ez_image_free_xmask (img);
+#endif /* EZ_BASE_ */
+}
 
-/*
- * Display sub-image with transparency.
-*/
 
-void ez_image_draw_xi (Ez_window win, Ez_image *img, int x, int y,
-    int src_x, int src_y, int w, int h)
+int ez_image_get_opacity (Ez_image *img)
 {
-    XImage *xi = NULL;
-    Pixmap mask = None;
-    ez_xi_func xi_func;
+    if (img == NULL) return 0;
+    return img->opacity;
+}
 
-    xi_func = ez_xi_get_func ();
-    xi = ez_xi_create (img, src_x, src_y, w, h, xi_func);
-    if (xi == NULL) return;
 
-    if (img->has_alpha) {
-        mask = ez_xmask_create (win, img, src_x, src_y, w, h);
-        if (mask == None) goto free_xi;
-        XSetClipOrigin (ezx.display, ezx.gc, x, y);
-        XSetClipMask (ezx.display, ezx.gc, mask);
-    }
+/*
+ * Property has_mipmap: if true, the image is shrunk by a factor <= 0.5 from
+ * a pyramid of halved images, computed when needed. The levels are freed
+ * each time the property is set, or by ez_image_touch.
+*/
 
-    XPutImage (ezx.display, win, ezx.gc, xi, 0, 0, x, y, w, h);
+void ez_image_set_mipmap (Ez_image *img, int has_mipmap)
+{
+    if (img == NULL) return;
+    ez_image_destroy (img->mipmap);
+    img->mipmap = NULL;
+    img->has_mipmap = has_mipmap ? 1 : 0;
+}
 
-    if (img->has_alpha) {
-        XSetClipOrigin (ezx.display, ezx.gc, 0, 0);
-        XSetClipMask (ezx.display, ezx.gc, None);
-        XFreePixmap (ezx.display, mask);
-    }
 
-  free_xi:
-    XDestroyImage (xi);
+int ez_image_has_mipmap (Ez_image *img)
+{
+    if (img == NULL) return 0;
+    return img->has_mipmap ? 1 : 0;
 }
 
 
 /*
- * Creation of ximage
+ * Convert the pixels of img to premultiplied alpha (the colors are
+ * multiplied by alpha), or back to straight alpha. Blending premultiplied
+ * images is faster. The alpha channel of an image without has_alpha is
+ * not significant (it is 0 for ez_image_create): it is set to 255, and
+ * the colors are kept.
 */
 
-XImage *ez_xi_create (Ez_image *img, int src_x, int src_y, int w, int h,
-    ez_xi_func xi_func)
+void ez_image_premultiply (Ez_image *img)
 {
-    XImage *xi = NULL;
+    Ez_row_kernels *kernels;
+    int x, y;
 
-    if (xi_func == NULL) {
-        ez_error ("ez_xi_create: NULL xi_func\n");
-        return NULL;
-    }
+    if (ez_image_pixels (img) < 0 || img->premultiplied) return;
+    if (ez_image_unshare (img) < 0) return;
+    kernels = ez_row_get_kernels ();
+    for (y = 0; y < img->height; y++)
+        if (img->has_alpha)
+            kernels->premul (img->pixels_rgba + y*img->stride,
+                img->pixels_rgba + y*img->stride, img->width);
+        else for (x = 0; x < img->width; x++)
+            img->pixels_rgba[y*img->stride + x*4 + 3] = 255;
+    img->premultiplied = 1;
+    ez_image_touch (img);
+}
 
-    /* We must first create xi to obtain informations to create data */
-    xi = XCreateImage (ezx.display, ezx.visual, ezx.depth, ZPixmap, 0,
-        NULL, w, h, 32, 0);
-    if (xi == NULL) {
-        ez_error ("ez_xi_create: can't create XImage\n");
-        return NULL;
+
+void ez_image_unpremultiply (Ez_image *img)
+{
+    int y;
+
+    if (img == NULL || !img->premultiplied) return;
+    if (ez_image_unshare (img) < 0) return;
+    for (y = 0; y < img->height; y++)
+        ez_unpremul_row (img->pixels_rgba + y*img->stride,
+            img->pixels_rgba + y*img->stride, img->width);
+    img->premultiplied = 0;
+    ez_image_touch (img);
+}
+
+
+int ez_image_is_premultiplied (Ez_image *img)
+{
+    if (img == NULL) return 0;
+    return img->premultiplied ? 1 : 0;
+}
+
+
+/*
+ * Tell that the pixels of img have been modified: free what was computed
+ * from them (mask, mipmap levels, transformed images), and add the whole
+ * image to the dirty region. The functions of this module which modify an
+ * image call it themselves, or ez_image_add_dirty.
+*/
+
+void ez_image_touch (Ez_image *img)
+{
+    if (img == NULL) return;
+    ez_image_add_dirty (img, 0, 0, img->width, img->height);
+}
+
+
+/*
+ * Dirty region: the bounding rectangle of the regions modified since the
+ * last ez_image_clear_dirty, used by ez_pixmap_update_dirty.
+ * ez_image_add_dirty tells that the region x,y,w,h of img was modified.
+ * The pixels of a view are those of its parent: the region is added to
+ * the parent and to all its views which overlap it, whichever image was
+ * written, and what was computed from them is freed.
+*/
+
+void ez_image_add_dirty (Ez_image *img, int x, int y, int w, int h)
+{
+    Ez_image *view;
+    int off;
+
+    if (ez_image_confine_sub_coords (img, &x, &y, &w, &h) < 0) return;
+
+    /* The coordinates in the parent */
+    if (img->parent != NULL) {
+        off = img->pixels_rgba - img->parent->pixels_rgba;
+        x += off % img->stride / 4;
+        y += off / img->stride;
+        img = img->parent;
     }
+    ez_image_mark_dirty (img, x, y, w, h);
 
-    if (ez_image_debug())
-        printf ("ez_xi_create  w = %d  h = %d  depth = %d  bpp = %d\n",
-            w, h, ezx.depth, xi->bits_per_pixel);
+    for (view = img->views; view != NULL; view = view->vnext) {
+        off = view->pixels_rgba - img->pixels_rgba;
+        ez_image_mark_dirty (view, x - off % img->stride / 4,
+            y - off / img->stride, w, h);
+    }
+}
 
-    xi->data = calloc (xi->bytes_per_line * h, 1);
-    if (xi->data == NULL)  {
-        ez_error ("ez_xi_create: out of memory\n");
-        XDestroyImage (xi);
+
+/*
+ * Add the region x,y,w,h, confined to img, to the dirty region of img
+ * alone, and free what was computed from its pixels.
+*/
+
+void ez_image_mark_dirty (Ez_image *img, int x, int y, int w, int h)
+{
+    int x2, y2;
+
+    if (ez_confine_coord (&x, &w, img->width) < 0 ||
+        ez_confine_coord (&y, &h, img->height) < 0) return;
+    if (img->lazy != NULL) img->lazy->modified = 1;
+
+    if (img->dirty_w > 0) {
+        x2 = x+w; y2 = y+h;
+        if (x2 < img->dirty_x + img->dirty_w) x2 = img->dirty_x + img->dirty_w;
+        if (y2 < img->dirty_y + img->dirty_h) y2 = img->dirty_y + img->dirty_h;
+        if (x > img->dirty_x) x = img->dirty_x;
+        if (y > img->dirty_y) y = img->dirty_y;
+        w = x2 - x; h = y2 - y;
+    }
+    img->dirty_x = x; img->dirty_y = y;
+    img->dirty_w = w; img->dirty_h = h;
+
+    ez_tcache_purge (img);
+    ez_image_set_mipmap (img, img->has_mipmap);
+#ifdef EZ_BASE_XLIB
+    ez_image_free_xmask (img);
+#endif /* EZ_BASE_ */
+}
+
+
+/*
+ * Get the dirty region in x,y,w,h. Return 1 if it is not empty, else 0.
+*/
+
+int ez_image_get_dirty (Ez_image *img, int *x, int *y, int *w, int *h)
+{
+    if (img == NULL) return 0;
+    *x = img->dirty_x; *y = img->dirty_y;
+    *w = img->dirty_w; *h = img->dirty_h;
+    return img->dirty_w > 0;
+}
+
+
+void ez_image_clear_dirty (Ez_image *img)
+{
+    if (img == NULL) return;
+    img->dirty_x = img->dirty_y = img->dirty_w = img->dirty_h = 0;
+}
+
+
+/*
+ * Display an image or a rectangular region of the image img in the
+ * window win, with the upper left corner of the image at the x,y
+ * coordinates in the window.
+ *
+ * If img->has_alpha is true, apply transparency.
+*/
+
+void ez_image_paint (Ez_window win, Ez_image *img, int x, int y)
+{
+    if (img == NULL) return;
+    ez_image_paint_sub (win, img, x, y, 0, 0, img->width, img->height);
+}
+
+
+void ez_image_paint_sub (Ez_window win, Ez_image *img, int x, int y,
+    int src_x, int src_y, int w, int h)
+{
+    int src_x_old = src_x, src_y_old = src_y;
+
+    if (win == None) return;
+
+    if (ez_image_confine_sub_coords (img, &src_x, &src_y, &w, &h) < 0) return;
+    x += src_x - src_x_old;
+    y += src_y - src_y_old;
+
+    /* The display needs straight alpha */
+    if (img->premultiplied) {
+        Ez_image *tmp = ez_image_extract (img, src_x, src_y, w, h);
+        if (tmp == NULL) return;
+        ez_image_unpremultiply (tmp);
+        ez_image_paint (win, tmp, x, y);
+        ez_image_destroy (tmp);
+        return;
+    }
+
+#ifdef EZ_BASE_XLIB
+    if (win == ezx.dbuf_win) win = ezx.dbuf_pix;
+    ez_image_draw_xi (win, img, x, y, src_x, src_y, w, h);
+#elif defined EZ_BASE_WIN32
+    ez_cur_win (win);
+    ez_image_draw_dib (ezx.hdc, img, x, y, src_x, src_y, w, h);
+#endif /* EZ_BASE_ */
+}
+
+
+/*
+ * Print a rectangular region of the image img in the terminal.
+*/
+
+void ez_image_print (Ez_image *img, int src_x, int src_y, int w, int h)
+{
+    if (ez_image_confine_sub_coords (img, &src_x, &src_y, &w, &h) < 0) return;
+
+    printf ("Image: width %d  height %d  has_alpha %s  opacity %d\n",
+        img->width, img->height, img->has_alpha?"true":"false", img->opacity);
+    printf ("Region: src_x %d  src_y %d  width %d  height %d\n",
+        src_x, src_y, w, h);
+
+    ez_image_print_rgba (img, src_x, src_y, w, h);
+}
+
+
+/*
+ * Fill an image with RGBA color
+*/
+
+void ez_image_fill_rgba (Ez_image *img, Ez_uint8 r, Ez_uint8 g, Ez_uint8 b, Ez_uint8 a)
+{
+    if (ez_image_pixels (img) < 0 || ez_image_unshare (img) < 0) return;
+
+    if (img->premultiplied) {
+        r = EZ_DIV255 (r*a); g = EZ_DIV255 (g*a); b = EZ_DIV255 (b*a);
+    }
+    ez_image_comp_fill_rgba (img, r, g, b, a);
+    ez_image_touch (img);
+}
+
+
+/*
+ * Superimpose a region of image src into the image dst. If src image has an
+ * alpha channel, apply transparency.
+ * If the coordinates go beyond the images src or dst, just the common region
+ * is superimposed.
+*/
+
+void ez_image_blend (Ez_image *dst, Ez_image *src, int dst_x, int dst_y)
+{
+    if (src == NULL) return;
+    ez_image_blend_sub (dst, src, dst_x, dst_y, 0, 0, src->width, src->height);
+}
+
+
+void ez_image_blend_sub (Ez_image *dst, Ez_image *src, int dst_x, int dst_y,
+    int src_x, int src_y, int w, int h)
+{
+    if (ez_image_confine_comp_coords (dst, src, &dst_x, &dst_y, &src_x, &src_y,
+        &w, &h) < 0) return;
+    if (ez_image_unshare (dst) < 0) return;
+
+    if (src->has_alpha)
+         ez_image_comp_blend (dst, src, dst_x, dst_y, src_x, src_y, w, h);
+    else ez_image_comp_over  (dst, src, dst_x, dst_y, src_x, src_y, w, h);
+    ez_image_add_dirty (dst, dst_x, dst_y, w, h);
+}
+
+
+/*
+ * Compose a region of image src into the image dst with the operator op:
+ * EZ_COMP_SRC, _OVER, _IN, _OUT, _ATOP, _XOR (Porter-Duff operators) or
+ * EZ_COMP_ADD, _MULTIPLY, _SCREEN, _DARKEN, _LIGHTEN (blend modes).
+ * The pixels of src are first multiplied by the global opacity, see
+ * ez_image_set_comp_alpha. If src has no alpha channel, it is opaque.
+ * If the coordinates go beyond the images src or dst, just the common region
+ * is composed.
+*/
+
+void ez_image_composite (Ez_image *dst, Ez_image *src, int op,
+    int dst_x, int dst_y, int src_x, int src_y, int w, int h)
+{
+    if (dst == NULL || src == NULL) return;
+
+    if (op < 0 || op >= EZ_COMP_NB) {
+        ez_error ("ez_image_composite: bad operator %d\n", op);
+        return;
+    }
+    if (ez_image_confine_comp_coords (dst, src, &dst_x, &dst_y, &src_x, &src_y,
+        &w, &h) < 0) return;
+    if (ez_image_unshare (dst) < 0) return;
+
+    ez_image_comp_op (dst, src, op, dst_x, dst_y, src_x, src_y, w, h);
+    ez_image_add_dirty (dst, dst_x, dst_y, w, h);
+}
+
+
+/*
+ * Set the global opacity of ez_image_composite, from 0 to 255 (default).
+*/
+
+void ez_image_set_comp_alpha (int alpha)
+{
+    ez_comp_alpha = alpha < 0 ? 0 : alpha > 255 ? 255 : alpha;
+}
+
+
+/*
+ * Extract a rectangular region of an image.
+ * Return new image, else NULL.
+*/
+
+Ez_image *ez_image_extract (Ez_image *img, int src_x, int src_y, int w, int h)
+{
+    Ez_image *res;
+
+    if (ez_image_confine_sub_coords (img, &src_x, &src_y, &w, &h) < 0)
+        return NULL;
+
+    res = ez_image_create_uninit (w, h);
+    if (res == NULL) return NULL;
+    res->has_alpha = img->has_alpha;
+    res->opacity   = img->opacity;
+    res->premultiplied = img->premultiplied;
+
+    ez_image_copy_sub (img, res, src_x, src_y);
+
+    return res;
+}
+
+
+/*
+ * Vertical or horizontal symmetry.
+ * Return new image, else NULL.
+*/
+
+Ez_image *ez_image_sym_ver (Ez_image *img)
+{
+    Ez_image *res;
+
+    if (ez_image_pixels (img) < 0) return NULL;
+
+    res = ez_image_create_uninit (img->width, img->height);
+    if (res == NULL) return NULL;
+    res->has_alpha = img->has_alpha;
+    res->opacity   = img->opacity;
+    res->premultiplied = img->premultiplied;
+
+    ez_image_comp_symv (img, res);
+    return res;
+}
+
+
+Ez_image *ez_image_sym_hor (Ez_image *img)
+{
+    Ez_image *res;
+
+    if (ez_image_pixels (img) < 0) return NULL;
+
+    res = ez_image_create_uninit (img->width, img->height);
+    if (res == NULL) return NULL;
+    res->has_alpha = img->has_alpha;
+    res->opacity   = img->opacity;
+    res->premultiplied = img->premultiplied;
+
+    ez_image_comp_symh (img, res);
+    return res;
+}
+
+
+/*
+ * Scale an image.
+ * Return new image, else NULL.
+*/
+
+Ez_image *ez_image_scale (Ez_image *img, double factor)
+{
+    Ez_image *res;
+
+    if (ez_image_pixels (img) < 0) return NULL;
+
+    if (factor <= 0) {
+        ez_error ("ez_image_scale: bad scale factor %f\n", factor);
         return NULL;
     }
-    /* xi->data will be freed by XDestroyImage */
+    if (factor == 1)
+        return ez_image_dup (img);
+
+    res = ez_image_create_uninit (img->width*factor, img->height*factor);
+    if (res == NULL) return NULL;
+    res->has_alpha = 1;
+    res->opacity   = img->opacity;
+    res->premultiplied = img->premultiplied;
+
+    if (factor > 1)
+         ez_image_expand (img, res, factor);
+    else ez_image_shrink (ez_mipmap_select (img, factor, factor), res);
+    return res;
+}
+
+
+/*
+ * Resize image img to w x h with filter EZ_RESIZE_NEAREST, _BILINEAR,
+ * _BICUBIC, _LANCZOS3 or _AREA.
+ * Return a new image, or NULL on error.
+*/
+
+Ez_image *ez_image_resize (Ez_image *img, int w, int h, int filter)
+{
+    Ez_image *res;
+
+    if (ez_image_pixels (img) < 0) return NULL;
+
+    if (w <= 0 || h <= 0) {
+        ez_error ("ez_image_resize: bad size %d x %d\n", w, h);
+        return NULL;
+    }
+    if (filter < EZ_RESIZE_NEAREST || filter > EZ_RESIZE_AREA) {
+        ez_error ("ez_image_resize: bad filter %d\n", filter);
+        return NULL;
+    }
+
+    res = ez_image_create_uninit (w, h);
+    if (res == NULL) return NULL;
+    res->has_alpha = img->has_alpha;
+    res->opacity   = img->opacity;
+    res->premultiplied = img->premultiplied;
+
+    img = ez_mipmap_select (img, (double) w / img->width,
+                                 (double) h / img->height);
+    if (ez_image_resize_to (img, res, filter) < 0) {
+        ez_image_destroy (res);
+        return NULL;
+    }
+    return res;
+}
+
+
+/*
+ * Rotate image img for angle theta in degrees.
+ * Return a new image whose size is adjusted to contain the result, or NULL
+ * on error. The outer parts of the original image become transparent.
+*/
+
+Ez_image *ez_image_rotate (Ez_image *img, double theta, int quality)
+{
+    int w, h;
+    Ez_image *res;
+
+    if (ez_image_pixels (img) < 0) return NULL;
+
+    ez_rotate_get_size (theta, img->width, img->height, &w, &h);
+
+    res = ez_image_create (w, h);
+    if (res == NULL) return NULL;
+    res->has_alpha = 1;
+    res->opacity   = img->opacity;
+    res->premultiplied = img->premultiplied;
+
+    if (quality)
+         ez_image_rotate_bilinear (img, res, theta);
+    else ez_image_rotate_nearest  (img, res, theta);
+    return res;
+}
+
+
+/*
+ * Compute for a point having coordinates src_x,src_y in the source image, the
+ * corresponding coordinates dst_x,dst_y of the point in the destination image.
+*/
+
+void ez_image_rotate_point (Ez_image *img, double theta, int src_x, int src_y,
+    int *dst_x, int *dst_y)
+{
+    if (img == NULL || dst_x == NULL || dst_y == NULL) return;
+
+    ez_rotate_get_coords (theta, img->width, img->height, src_x, src_y,
+        dst_x, dst_y);
+}
+
+
+/*
+ * Transform image img by the affine matrix m: the point x,y of img is sent
+ * to m[0]*x + m[1]*y + m[2], m[3]*x + m[4]*y + m[5]. The pixel x,y of an
+ * image covers the square x..x+1, y..y+1.
+ *
+ * The result has the size of the bounding box of the transformed image; if
+ * bbox is not NULL, bbox[0],bbox[1] receive the position of its top left
+ * corner, and bbox[2],bbox[3] its width and height. The outer parts of the
+ * original image become transparent.
+ *
+ * quality is EZ_TRANSFORM_NEAREST (fast), EZ_TRANSFORM_BILINEAR (smooth) or
+ * EZ_TRANSFORM_AREA (smooth, and averages the pixels when shrinking).
+ * Return a new image, else NULL.
+*/
+
+Ez_image *ez_image_transform (Ez_image *img, const double m[6], int quality,
+    int bbox[4])
+{
+    double det, inv[6], cx[4], cy[4], x1, y1, x2, y2;
+    int i, bx, by, w, h;
+    Ez_image *res;
+
+    if (m == NULL || ez_image_pixels (img) < 0) return NULL;
+
+    det = m[0]*m[4] - m[1]*m[3];
+    if (fabs (det) < 1e-12) {
+        ez_error ("ez_image_transform: matrix not invertible\n");
+        return NULL;
+    }
+    inv[0] =  m[4]/det; inv[1] = -m[1]/det; inv[2] = (m[1]*m[5] - m[4]*m[2])/det;
+    inv[3] = -m[3]/det; inv[4] =  m[0]/det; inv[5] = (m[3]*m[2] - m[0]*m[5])/det;
+
+    /* Bounding box of the transformed corners */
+    for (i = 0; i < 4; i++) {
+        double sx = (i & 1) ? img->width : 0, sy = (i & 2) ? img->height : 0;
+        cx[i] = m[0]*sx + m[1]*sy + m[2];
+        cy[i] = m[3]*sx + m[4]*sy + m[5];
+    }
+    x1 = x2 = cx[0]; y1 = y2 = cy[0];
+    for (i = 1; i < 4; i++) {
+        if (cx[i] < x1) x1 = cx[i]; else if (cx[i] > x2) x2 = cx[i];
+        if (cy[i] < y1) y1 = cy[i]; else if (cy[i] > y2) y2 = cy[i];
+    }
+    bx = floor (x1 + 1e-9); w = (int) ceil (x2 - 1e-9) - bx;
+    by = floor (y1 + 1e-9); h = (int) ceil (y2 - 1e-9) - by;
+    if (w < 1) w = 1;
+    if (h < 1) h = 1;
+
+    res = ez_image_create (w, h);
+    if (res == NULL) return NULL;
+    res->has_alpha = 1;
+    res->opacity   = img->opacity;
+    res->premultiplied = img->premultiplied;
+
+    /* Pixel centers of res, in the coordinates of img */
+    inv[2] += inv[0]*(bx+0.5) + inv[1]*(by+0.5);
+    inv[5] += inv[3]*(bx+0.5) + inv[4]*(by+0.5);
+
+    if (quality == EZ_TRANSFORM_AREA &&
+        (inv[0]*inv[0] + inv[3]*inv[3] > 1 || inv[1]*inv[1] + inv[4]*inv[4] > 1))
+         ez_image_transform_area     (img, res, inv);
+    else if (quality != EZ_TRANSFORM_NEAREST)
+         ez_image_transform_bilinear (img, res, inv);
+    else ez_image_transform_nearest  (img, res, inv);
+
+    if (bbox != NULL) {
+        bbox[0] = bx; bbox[1] = by;
+        bbox[2] = w;  bbox[3] = h;
+    }
+    return res;
+}
+
+
+/*
+ * Cache of transformed images.
+ *
+ * ez_transform_cache_image returns the image img scaled by factor, rotated
+ * by theta degrees, then mirrored if sym_hor and/or sym_ver are true; see
+ * ez_image_transform for quality. The result is kept in a cache, so that
+ * the next call with the same parameters costs one lookup. The factor is
+ * rounded to 1/EZ_TCACHE_SCALE_Q and theta to 1/EZ_TCACHE_ANGLE_Q degree.
+ *
+ * The result belongs to the cache: it must not be destroyed or modified,
+ * and it remains valid until the next call to a cache function, or until
+ * img is destroyed. When the memory used exceeds the budget, the least
+ * recently used results are freed.
+ * Return the transformed image, else NULL.
+*/
+
+Ez_image *ez_transform_cache_image (Ez_image *img, double factor, double theta,
+    int sym_hor, int sym_ver, int quality)
+{
+    Ez_tcache_entry *entry;
+
+    entry = ez_tcache_lookup (img, factor, theta, sym_hor, sym_ver, quality);
+    return entry == NULL ? NULL : entry->img;
+}
+
+
+/*
+ * Same as ez_transform_cache_image, but return the result as a pixmap,
+ * which is faster to display repeatedly.
+ * Return the transformed pixmap, else NULL.
+*/
+
+Ez_pixmap *ez_transform_cache_pixmap (Ez_image *img, double factor,
+    double theta, int sym_hor, int sym_ver, int quality)
+{
+    Ez_tcache_entry *entry;
+
+    entry = ez_tcache_lookup (img, factor, theta, sym_hor, sym_ver, quality);
+    if (entry == NULL) return NULL;
+
+    if (entry->pix == NULL) {
+        entry->pix = ez_pixmap_create_from_image (entry->img);
+        if (entry->pix == NULL) return NULL;
+        entry->bytes += (long) entry->img->width * entry->img->height * 4;
+        ez_tcache.bytes += (long) entry->img->width * entry->img->height * 4;
+        ez_tcache_evict ();
+    }
+    return entry->pix;
+}
+
+
+/*
+ * Set the memory budget of the cache of transformed images, in bytes;
+ * the default is EZ_TCACHE_BUDGET.
+*/
+
+void ez_transform_cache_set_budget (long bytes)
+{
+    ez_tcache.budget = bytes < 0 ? 0 : bytes;
+    ez_tcache_evict ();
+}
+
+
+/*
+ * Get the statistics of the cache of transformed images: number of hits
+ * and misses since the start, memory used in bytes and number of entries.
+ * Each argument can be NULL.
+*/
+
+void ez_transform_cache_get_stats (long *hits, long *misses, long *bytes,
+    int *nb)
+{
+    if (hits   != NULL) *hits   = ez_tcache.hits;
+    if (misses != NULL) *misses = ez_tcache.misses;
+    if (bytes  != NULL) *bytes  = ez_tcache.bytes;
+    if (nb     != NULL) *nb     = ez_tcache.nb;
+}
+
+
+/*
+ * Free all the entries of the cache of transformed images.
+*/
+
+void ez_transform_cache_clear (void)
+{
+    while (ez_tcache.last != NULL)
+        ez_tcache_remove (ez_tcache.last);
+}
+
+
+/*
+ * Allocate a pixmap, initialized to default value.
+ * Return the pixmap, else NULL.
+*/
+
+Ez_pixmap *ez_pixmap_new (void)
+{
+    Ez_pixmap *pix = malloc (sizeof(Ez_pixmap));
+    if (pix == NULL) {
+        ez_error ("ez_pixmap_new: out of memory\n");
+        return NULL;
+    }
+    ez_pixmap_count++;
+
+    pix->width = pix->height = 0;
+#ifdef EZ_BASE_XLIB
+    pix->map = None;
+    pix->mask = None;
+#elif defined EZ_BASE_WIN32
+    pix->hmap = NULL;
+    pix->has_alpha = 0;
+#endif /* EZ_BASE_ */
+
+    return pix;
+}
+
+
+/*
+ * Destroy the pixmap and free memory.
+*/
+
+void ez_pixmap_destroy (Ez_pixmap *pix)
+{
+    if (pix == NULL) return;
+
+#ifdef EZ_BASE_XLIB
+    if (pix->map  != None) XFreePixmap (ezx.display, pix->map );
+    if (pix->mask != None) XFreePixmap (ezx.display, pix->mask);
+#elif defined EZ_BASE_WIN32
+    if (pix->hmap != NULL) DeleteObject (pix->hmap);
+#endif /* EZ_BASE_ */
+    free (pix);
+
+    ez_pixmap_count--;
+    if (ez_image_debug ())
+        printf ("ez_pixmap_destroy  count = %d\n", ez_pixmap_count);
+}
+
+
+/*
+ * Create a pixmap from an image img.
+ * Return the pixmap, else NULL.
+*/
+
+Ez_pixmap *ez_pixmap_create_from_image (Ez_image *img)
+{
+    Ez_pixmap *pix;
+
+    if (ez_image_pixels (img) < 0) return NULL;
+    pix = ez_pixmap_new ();
+    if (pix == NULL) return NULL;
+
+    pix->width  = img->width;
+    pix->height = img->height;
+
+    /* The display needs straight alpha */
+    if (img->premultiplied) {
+        Ez_pixmap *res;
+        Ez_image *tmp = ez_image_dup (img);
+        ez_pixmap_destroy (pix);
+        if (tmp == NULL) return NULL;
+        ez_image_unpremultiply (tmp);
+        res = ez_pixmap_create_from_image (tmp);
+        ez_image_destroy (tmp);
+        return res;
+    }
+
+#ifdef EZ_BASE_XLIB
+    if (ez_pixmap_build_map (pix, img) < 0) {
+        ez_error ("ez_pixmap_create_from_image: can't create map\n");
+        goto free_pix;
+    }
+    if (img->has_alpha) {
+        pix->mask = ez_xmask_create (ezx.root_win, img, 0, 0,
+            img->width, img->height);
+        if (pix->mask == None) {
+            ez_error ("ez_pixmap_create_from_image: can't create mask\n");
+            goto free_pix;
+        }
+    }
+#elif defined EZ_BASE_WIN32
+    if (ez_pixmap_build_hmap (pix, img) < 0) {
+        ez_error ("ez_pixmap_create_from_image: can't create hmap\n");
+        goto free_pix;
+    }
+    pix->has_alpha = img->has_alpha;
+
+#endif /* EZ_BASE_ */
+
+    return pix;
+
+  free_pix:
+    ez_pixmap_destroy (pix);
+    return NULL;
+}
+
+
+/*
+ * Upload again the region x,y,w,h of img in the pixmap pix, which was
+ * created from img: just the pixels and the mask of this region are sent.
+ * Return 0 on success, else -1.
+*/
+
+int ez_pixmap_update (Ez_pixmap *pix, Ez_image *img, int x, int y,
+    int w, int h)
+{
+    int status;
+
+    if (pix == NULL || img == NULL) return -1;
+    if (pix->width != img->width || pix->height != img->height) {
+        ez_error ("ez_pixmap_update: the sizes of pix and img differ\n");
+        return -1;
+    }
+    if (ez_image_confine_sub_coords (img, &x, &y, &w, &h) < 0) return 0;
+
+    /* The display needs straight alpha */
+    if (img->premultiplied) {
+        Ez_image *tmp = ez_image_extract (img, x, y, w, h);
+        if (tmp == NULL) return -1;
+        ez_image_unpremultiply (tmp);
+        status = ez_pixmap_put_area (pix, tmp, 0, 0, x, y, w, h);
+        ez_image_destroy (tmp);
+        return status;
+    }
+
+    return ez_pixmap_put_area (pix, img, x, y, x, y, w, h);
+}
+
+
+/*
+ * Upload the dirty region of img in pix, then clear it.
+ * Return 0 on success, else -1.
+*/
+
+int ez_pixmap_update_dirty (Ez_pixmap *pix, Ez_image *img)
+{
+    int x, y, w, h;
+
+    if (!ez_image_get_dirty (img, &x, &y, &w, &h)) return 0;
+    if (ez_pixmap_update (pix, img, x, y, w, h) < 0) return -1;
+    ez_image_clear_dirty (img);
+    return 0;
+}
+
+
+/*
+ * Display the pixmap pix in the window win.
+ * The top left corner of the pixmap is displayed at the x,y coordinates
+ * in the window.
+*/
+
+void ez_pixmap_paint (Ez_window win, Ez_pixmap *pix, int x, int y)
+{
+    if (win == None) return;
+
+#ifdef EZ_BASE_XLIB
+    if (win == ezx.dbuf_win) win = ezx.dbuf_pix;
+    ez_pixmap_draw_area (win, pix, x, y, 0, 0, pix->width, pix->height);
+#elif defined EZ_BASE_WIN32
+    ez_cur_win (win);
+    ez_pixmap_draw_hmap (ezx.hdc, pix, x, y, 0, 0, pix->width, pix->height);
+#endif /* EZ_BASE_ */
+}
+
+
+/*
+ * Display a rectangular region of the pixmap pix in the window win.
+ * The region in the pixmap is bounded by coordinates src_x,src_y (top left
+ * corner) and src_x+w-1,src_y+h-1 (bottom right corner); its top left
+ * corner is displayed at the x,y coordinates in the window.
+*/
+
+void ez_pixmap_paint_sub (Ez_window win, Ez_pixmap *pix, int x, int y,
+    int src_x, int src_y, int w, int h)
+{
+    int src_x_old = src_x, src_y_old = src_y;
+
+    if (win == None || pix == NULL) return;
+
+    if (ez_confine_coord (&src_x, &w, pix->width ) < 0 ||
+        ez_confine_coord (&src_y, &h, pix->height) < 0) return;
+    x += src_x - src_x_old;
+    y += src_y - src_y_old;
+
+#ifdef EZ_BASE_XLIB
+    if (win == ezx.dbuf_win) win = ezx.dbuf_pix;
+    ez_pixmap_draw_area (win, pix, x, y, src_x, src_y, w, h);
+#elif defined EZ_BASE_WIN32
+    ez_cur_win (win);
+    ez_pixmap_draw_hmap (ezx.hdc, pix, x, y, src_x, src_y, w, h);
+#endif /* EZ_BASE_ */
+}
+
+
+/*
+ * Display the pixmap pix repeatedly in the window win.
+ * The pixmap is displayed as a wallpaper in the window region bounded
+ * by coordinates x,y (top left corner) and x+w-1,y+h-1 (bottom right corner).
+*/
+
+void ez_pixmap_tile (Ez_window win, Ez_pixmap *pix, int x, int y, int w, int h)
+{
+    if (win == None || w <= 0 || h <= 0) return;
+
+#ifdef EZ_BASE_XLIB
+    if (win == ezx.dbuf_win) win = ezx.dbuf_pix;
+    ez_pixmap_tile_area (win, pix, x, y, w, h);
+#elif defined EZ_BASE_WIN32
+    ez_cur_win (win);
+    ez_pixmap_tile_hmap (ezx.hdc, pix, x, y, w, h);
+#endif /* EZ_BASE_ */
+}
+
+
+/*
+ * Start a batch of sprites for the window win.
+ * The pixmaps given to ez_sprite_batch_add are not displayed immediately,
+ * but all together by ez_sprite_batch_end: the sprites are then grouped by
+ * pixmap to minimize the number of requests, while the sprites which overlap
+ * keep their drawing order.
+*/
+
+void ez_sprite_batch_begin (Ez_window win)
+{
+    if (ez_batch.active)
+        ez_error ("ez_sprite_batch_begin: ez_sprite_batch_end was not called\n");
+
+    ez_batch.active = 1;
+    ez_batch.win = win;
+    ez_batch.sprite_nb = 0;
+    ez_batch.pix_nb = 0;
+}
+
+
+/*
+ * Add the pixmap pix in the current batch of sprites; its top left corner
+ * will be displayed at the x,y coordinates in the window.
+*/
+
+void ez_sprite_batch_add (Ez_pixmap *pix, int x, int y)
+{
+    if (pix == NULL) return;
+    ez_sprite_batch_push (pix, 0, 0, pix->width, pix->height, x, y);
+}
+
+
+/*
+ * Add a rectangular region of the pixmap pix in the current batch of
+ * sprites, as for ez_pixmap_paint_sub.
+*/
+
+void ez_sprite_batch_add_sub (Ez_pixmap *pix, int x, int y,
+    int src_x, int src_y, int w, int h)
+{
+    int src_x_old = src_x, src_y_old = src_y;
+
+    if (pix == NULL) return;
+
+    if (ez_confine_coord (&src_x, &w, pix->width ) < 0 ||
+        ez_confine_coord (&src_y, &h, pix->height) < 0) return;
+    ez_sprite_batch_push (pix, src_x, src_y, w, h,
+        x + src_x - src_x_old, y + src_y - src_y_old);
+}
+
+
+/*
+ * Display all the sprites of the current batch, then end the batch.
+*/
+
+void ez_sprite_batch_end (void)
+{
+    Ez_window win = ez_batch.win;
+    int win_w, win_h, i, j;
+
+    if (!ez_batch.active) {
+        ez_error ("ez_sprite_batch_end: ez_sprite_batch_begin was not called\n");
+        return;
+    }
+    ez_batch.active = 0;
+    if (win == None || ez_batch.sprite_nb == 0) return;
+
+    ez_window_get_size (win, &win_w, &win_h);
+    if (ez_sprite_batch_level (win_w, win_h) < 0) return;
+
+    qsort (ez_batch.sprite, ez_batch.sprite_nb, sizeof (Ez_sprite),
+        ez_sprite_compare);
+
+#ifdef EZ_BASE_XLIB
+    if (win == ezx.dbuf_win) win = ezx.dbuf_pix;
+#elif defined EZ_BASE_WIN32
+    ez_cur_win (win);
+#endif /* EZ_BASE_ */
+
+    for (i = 0; i < ez_batch.sprite_nb; i = j) {
+        for (j = i+1; j < ez_batch.sprite_nb &&
+             ez_batch.sprite[j].level == ez_batch.sprite[i].level &&
+             ez_batch.sprite[j].pix_num == ez_batch.sprite[i].pix_num; j++) ;
+#ifdef EZ_BASE_XLIB
+        ez_sprite_draw_group (win, ez_batch.sprite+i, j-i, win_w, win_h);
+#elif defined EZ_BASE_WIN32
+        ez_sprite_draw_group (ezx.hdc, ez_batch.sprite+i, j-i);
+#endif /* EZ_BASE_ */
+    }
+}
+
+
+/*
+ * Create an atlas from the n images img[0..n-1]: the images are packed in
+ * a few large pixmaps, called pages, to reduce the number of server
+ * resources. The image img[num] is then displayed by ez_atlas_paint with
+ * the same num. The images can be freed after the call.
+ * Return the atlas, else NULL.
+*/
+
+Ez_atlas *ez_atlas_create (Ez_image **img, int n)
+{
+    Ez_atlas *atlas;
+    int *order = NULL, i, page_w = EZ_ATLAS_PAGE_W, page_h = EZ_ATLAS_PAGE_H,
+        shelf_x = 0, shelf_y = 0, shelf_h = 0;
+
+    if (img == NULL || n <= 0) {
+        ez_error ("ez_atlas_create: bad arguments\n");
+        return NULL;
+    }
+    for (i = 0; i < n; i++) {
+        if (img[i] == NULL) {
+            ez_error ("ez_atlas_create: img[%d] is NULL\n", i);
+            return NULL;
+        }
+        if (img[i]->width  > page_w) page_w = img[i]->width;
+        if (img[i]->height > page_h) page_h = img[i]->height;
+    }
+
+    atlas = calloc (1, sizeof (Ez_atlas));
+    if (atlas == NULL) goto out_of_memory;
+    atlas->item = calloc (n, sizeof (Ez_atlas_item));
+    order = malloc (n * sizeof (int));
+    if (atlas->item == NULL || order == NULL) goto out_of_memory;
+    atlas->item_nb = n;
+
+    /* Shelf packing, by decreasing heights */
+    for (i = 0; i < n; i++) order[i] = i;
+    ez_atlas_img = img;
+    qsort (order, n, sizeof (int), ez_atlas_compare);
+
+    for (i = 0; i < n; i++) {
+        Ez_atlas_item *item = atlas->item + order[i];
+        item->width  = img[order[i]]->width;
+        item->height = img[order[i]]->height;
+
+        if (shelf_x + item->width > page_w) {
+            shelf_y += shelf_h;
+            shelf_x = shelf_h = 0;
+        }
+        if (shelf_y + item->height > page_h) {
+            atlas->page_nb++;
+            shelf_x = shelf_y = shelf_h = 0;
+        }
+        item->page = atlas->page_nb;
+        item->x = shelf_x;
+        item->y = shelf_y;
+        shelf_x += item->width;
+        if (item->height > shelf_h) shelf_h = item->height;
+    }
+    atlas->page_nb++;
+    free (order); order = NULL;
+
+    atlas->page = calloc (atlas->page_nb, sizeof (Ez_pixmap *));
+    if (atlas->page == NULL) goto out_of_memory;
+
+    for (i = 0; i < atlas->page_nb; i++) {
+        atlas->page[i] = ez_atlas_build_page (atlas, img, i);
+        if (atlas->page[i] == NULL) {
+            ez_error ("ez_atlas_create: can't build page %d\n", i);
+            ez_atlas_destroy (atlas);
+            return NULL;
+        }
+    }
+
+    if (ez_image_debug ())
+        printf ("ez_atlas_create: %d images in %d pages\n", n, atlas->page_nb);
+
+    return atlas;
+
+  out_of_memory:
+    ez_error ("ez_atlas_create: out of memory\n");
+    free (order);
+    ez_atlas_destroy (atlas);
+    return NULL;
+}
+
+
+/*
+ * Destroy an atlas and its pages.
+*/
+
+void ez_atlas_destroy (Ez_atlas *atlas)
+{
+    int i;
+
+    if (atlas == NULL) return;
+    if (atlas->page != NULL)
+        for (i = 0; i < atlas->page_nb; i++)
+            ez_pixmap_destroy (atlas->page[i]);
+    free (atlas->page);
+    free (atlas->item);
+    free (atlas);
+}
+
+
+/*
+ * Display the image num of the atlas in the window win.
+ * The top left corner of the image is displayed at the x,y coordinates
+ * in the window.
+*/
+
+void ez_atlas_paint (Ez_window win, Ez_atlas *atlas, int num, int x, int y)
+{
+    Ez_atlas_item *item;
+
+    if (atlas == NULL || num < 0 || num >= atlas->item_nb) return;
+    item = atlas->item + num;
+    ez_pixmap_paint_sub (win, atlas->page[item->page], x, y,
+        item->x, item->y, item->width, item->height);
+}
+
+
+/*
+ * Add the image num of the atlas in the current batch of sprites.
+ * As the images of a page share the same pixmap, they are drawn together.
+*/
+
+void ez_atlas_batch_add (Ez_atlas *atlas, int num, int x, int y)
+{
+    Ez_atlas_item *item;
+
+    if (atlas == NULL || num < 0 || num >= atlas->item_nb) return;
+    item = atlas->item + num;
+    ez_sprite_batch_push (atlas->page[item->page], item->x, item->y,
+        item->width, item->height, x, y);
+}
+
+
+/*
+ * Write in the file filename a pack of the n images img[0..n-1], having
+ * names names[0..n-1]: the pixels are stored as they are in memory, in
+ * rows aligned on EZ_IMAGE_ALIGN bytes, after an index of the images.
+ * The pack can then be mapped in memory by ez_pack_open, without decoding.
+ * Return 0 on success, else -1.
+*/
+
+int ez_pack_build (const char *filename, const char **names, Ez_image **img,
+    int n)
+{
+    static const Ez_uint8 zero[EZ_IMAGE_ALIGN];
+    Ez_pack_header header;
+    Ez_pack_entry *entry;
+    FILE *f;
+    size_t offset, pos;
+    int i, y, res = -1;
+
+    if (names == NULL || img == NULL || n < 0) {
+        ez_error ("ez_pack_build: bad arguments\n");
+        return -1;
+    }
+    entry = calloc (n > 0 ? n : 1, sizeof (Ez_pack_entry));
+    if (entry == NULL) {
+        ez_error ("ez_pack_build: out of memory\n");
+        return -1;
+    }
+
+    /* The index */
+    offset = sizeof (Ez_pack_header) + n * sizeof (Ez_pack_entry);
+    for (i = 0; i < n; i++) {
+        if (img[i] == NULL || names[i] == NULL ||
+            strlen (names[i]) >= EZ_PACK_NAME) {
+            ez_error ("ez_pack_build: bad image or name %d\n", i);
+            goto free_entry;
+        }
+        if (ez_image_pixels (img[i]) < 0) goto free_entry;
+        strcpy (entry[i].name, names[i]);
+        entry[i].width  = img[i]->width;
+        entry[i].height = img[i]->height;
+        entry[i].stride = (img[i]->width*4 + EZ_IMAGE_ALIGN-1) /
+            EZ_IMAGE_ALIGN * EZ_IMAGE_ALIGN;
+        entry[i].flags  = (img[i]->has_alpha ? EZ_PACK_ALPHA : 0) |
+            (img[i]->premultiplied ? EZ_PACK_PREMUL : 0);
+        offset = (offset + EZ_IMAGE_ALIGN-1) / EZ_IMAGE_ALIGN * EZ_IMAGE_ALIGN;
+        entry[i].offset = offset;
+        offset += (size_t) entry[i].stride * entry[i].height;
+        if (offset > 0xffffffffUL) {
+            ez_error ("ez_pack_build: pack too large\n");
+            goto free_entry;
+        }
+    }
+
+    f = fopen (filename, "wb");
+    if (f == NULL) {
+        ez_error ("ez_pack_build: can't create file \"%s\"\n", filename);
+        goto free_entry;
+    }
+
+    memcpy (header.magic, EZ_PACK_MAGIC, 4);
+    header.order = EZ_PACK_ORDER;
+    header.version = EZ_PACK_VERSION;
+    header.entry_nb = n;
+    fwrite (&header, sizeof (Ez_pack_header), 1, f);
+    fwrite (entry, sizeof (Ez_pack_entry), n, f);
+    pos = sizeof (Ez_pack_header) + n * sizeof (Ez_pack_entry);
+
+    /* The pixels, with the padding of the rows; a lazy image may have been
+       unloaded by the decoding of the next ones */
+    for (i = 0; i < n; i++) {
+        if (ez_image_pixels (img[i]) < 0) break;
+        fwrite (zero, 1, entry[i].offset - pos, f);
+        for (y = 0; y < img[i]->height; y++) {
+            fwrite (EZ_IMAGE_PIXEL (img[i], 0, y), 4, img[i]->width, f);
+            fwrite (zero, 1, entry[i].stride - img[i]->width*4, f);
+        }
+        pos = entry[i].offset + (size_t) entry[i].stride * entry[i].height;
+    }
+
+    if (ferror (f) | fclose (f) || i < n) {
+        ez_error ("ez_pack_build: can't write file \"%s\"\n", filename);
+        goto free_entry;
+    }
+    res = 0;
+
+  free_entry:
+    free (entry);
+    return res;
+}
+
+
+/*
+ * Open a pack of images built by ez_pack_build: the file is mapped in
+ * memory, so that the pixels are only read when they are used.
+ * Return the pack, else NULL.
+*/
+
+Ez_pack *ez_pack_open (const char *filename)
+{
+    Ez_pack *pack;
+
+    pack = calloc (1, sizeof (Ez_pack));
+    if (pack == NULL) {
+        ez_error ("ez_pack_open: out of memory\n");
+        return NULL;
+    }
+    pack->refcount = 1;
+    if (ez_pack_map (pack, filename) < 0) {
+        ez_error ("ez_pack_open: can't map file \"%s\"\n", filename);
+        free (pack);
+        return NULL;
+    }
+    if (ez_pack_check (pack) < 0) {
+        ez_error ("ez_pack_open: bad pack file \"%s\"\n", filename);
+        ez_pack_close (pack);
+        return NULL;
+    }
+
+    if (ez_image_debug ())
+        printf ("ez_pack_open  file \"%s\"  %d images  %lu bytes\n",
+            filename, pack->entry_nb, (unsigned long) pack->size);
+
+    return pack;
+}
+
+
+/*
+ * Close a pack. The file stays mapped until the images obtained from the
+ * pack are destroyed.
+*/
+
+void ez_pack_close (Ez_pack *pack)
+{
+    if (pack == NULL) return;
+    ez_pack_release (pack);
+}
+
+
+/*
+ * Get the image having name name in the pack. The pixels of the image are
+ * those of the pack, without copy; if they are modified, the file is not
+ * changed, but the other images obtained for this name are.
+ * Return the image, which must be destroyed by ez_image_destroy, else NULL.
+*/
+
+Ez_image *ez_pack_get_image (Ez_pack *pack, const char *name)
+{
+    Ez_pack_entry *entry;
+    Ez_image *img;
+    int i;
+
+    if (pack == NULL || name == NULL) return NULL;
+    for (i = 0; i < pack->entry_nb; i++)
+        if (strcmp (pack->entry[i].name, name) == 0) break;
+    if (i == pack->entry_nb) {
+        ez_error ("ez_pack_get_image: no image \"%s\"\n", name);
+        return NULL;
+    }
+    entry = pack->entry + i;
+
+    img = ez_image_new ();
+    if (img == NULL) return NULL;
+    img->width  = entry->width;
+    img->height = entry->height;
+    img->stride = entry->stride;
+    img->pixels_rgba = pack->data + entry->offset;
+    img->has_alpha = (entry->flags & EZ_PACK_ALPHA) != 0;
+    img->premultiplied = (entry->flags & EZ_PACK_PREMUL) != 0;
+
+    /* The image keeps the pack mapped */
+    img->pack = pack;
+    ez_image_lock ();
+    pack->refcount++;
+    ez_image_unlock ();
+
+    return img;
+}
+
+
+/*-------------------- P R I V A T E   F U N C T I O N S --------------------*/
+
+/*
+ * Unique test of the definition of the environment variable EZ_IMAGE_DEBUG
+*/
+
+int ez_image_debug (void)
+{
+    static int debug = -1;
+    if (debug < 0) debug = getenv ("EZ_IMAGE_DEBUG") != NULL;
+    return debug;
+}
+
+
+/*
+ * Confine coordinates of sub-image inside img
+*/
+
+/*
+ * Create an image of size w x h, whose pixels are initialized to 0 if zero
+ * is true. Return the image, else NULL.
+*/
+
+Ez_image *ez_image_create_pixels (int w, int h, int zero)
+{
+    Ez_image *img;
+
+    if (w < 0 || h < 0) {
+        ez_error ("ez_image_create: bad size\n");
+        return NULL;
+    }
+
+    img = ez_image_new ();
+    if (img == NULL) return NULL;
+
+    if (ez_image_alloc_pixels (img, w, h, zero) < 0) {
+        ez_error ("ez_image_create: out of memory\n");
+        ez_image_destroy (img);
+        return NULL;
+    }
+
+    return img;
+}
+
+
+/*
+ * Allocate the pixels of img, of size w x h, in the pool; they are
+ * initialized to 0 if zero is true. Each row is padded to a multiple of
+ * EZ_IMAGE_ALIGN bytes, and the first row is aligned on EZ_IMAGE_ALIGN
+ * bytes, for the SIMD kernels.
+ * Return 0 on success, else -1.
+*/
+
+int ez_image_alloc_pixels (Ez_image *img, int w, int h, int zero)
+{
+    size_t size;
+
+    img->stride = (w*4 + EZ_IMAGE_ALIGN-1) / EZ_IMAGE_ALIGN * EZ_IMAGE_ALIGN;
+    size = (size_t) img->stride * h;
+    img->pixels_mem = ez_pool_alloc (size + EZ_IMAGE_ALIGN, zero);
+    if (img->pixels_mem == NULL) return -1;
+
+    img->pixels_rgba = img->pixels_mem + (EZ_IMAGE_ALIGN -
+        (size_t) img->pixels_mem % EZ_IMAGE_ALIGN) % EZ_IMAGE_ALIGN;
+    img->width = w; img->height = h;
+    return 0;
+}
+
+
+/*
+ * Pool of pixel buffers. The sizes are rounded up to classes, 4 per power
+ * of 2, so that a buffer can be reused by an image of close size; the
+ * buffers freed are kept in a list per class, within the budget.
+ * Return the size of the class of size, and its number in *num.
+*/
+
+size_t ez_pool_class (size_t size, int *num)
+{
+    size_t base = EZ_POOL_MIN/2;
+    int k = 0, j;
+
+    if (size < EZ_POOL_MIN) size = EZ_POOL_MIN;
+    while (base*2 < size) { base *= 2; k++; }
+    j = (int) (((size - base)*4 + base-1) / base);   /* 1..4 */
+    *num = k*4 + j-1;
+    return base + j*base/4;
+}
+
+
+/*
+ * Allocate a buffer of size bytes, from the pool if possible, initialized
+ * to 0 if zero is true. Return the buffer, else NULL.
+*/
+
+void *ez_pool_alloc (size_t size, int zero)
+{
+    size_t class_size;
+    void *p;
+    int num;
+
+    class_size = ez_pool_class (size, &num);
+    if (num >= EZ_POOL_CLASSES) return NULL;
+
+    ez_image_lock ();
+    p = ez_pool.free_list[num];
+    if (p != NULL) {
+        ez_pool.free_list[num] = *(void **) p;
+        ez_pool.pooled -= class_size;
+        ez_pool.hits++;
+        ez_pool.live += class_size;
+        if (ez_pool.peak < ez_pool.live) ez_pool.peak = ez_pool.live;
+    }
+    ez_image_unlock ();
+
+    if (p != NULL) {
+        if (zero) memset (p, 0, size);
+        return p;
+    }
+
+    /* calloc gets fresh pages from the system already zeroed */
+    p = zero ? calloc (class_size, 1) : malloc (class_size);
+    if (p == NULL) return NULL;
+
+    ez_image_lock ();
+    ez_pool.misses++;
+    ez_pool.live += class_size;
+    if (ez_pool.peak < ez_pool.live) ez_pool.peak = ez_pool.live;
+    ez_image_unlock ();
+    return p;
+}
+
+
+/*
+ * Give back the buffer p of size bytes, allocated by ez_pool_alloc; it is
+ * kept for reuse if the budget allows it.
+*/
+
+void ez_pool_free (void *p, size_t size)
+{
+    size_t class_size;
+    int num;
+
+    if (p == NULL) return;
+    class_size = ez_pool_class (size, &num);
+
+    ez_image_lock ();
+    ez_pool.live -= class_size;
+    if (ez_pool.pooled + (long) class_size <= ez_pool.budget) {
+        *(void **) p = ez_pool.free_list[num];
+        ez_pool.free_list[num] = p;
+        ez_pool.pooled += class_size;
+        p = NULL;
+    }
+    ez_image_unlock ();
+
+    free (p);
+}
+
+
+/*
+ * Free the buffers of the pool, starting with the largest classes, until
+ * the pool has at most budget bytes.
+*/
+
+void ez_pool_trim (long budget)
+{
+    size_t class_size;
+    void *p;
+    int num, k;
+
+    ez_image_lock ();
+    for (num = EZ_POOL_CLASSES-1; num >= 0 && ez_pool.pooled > budget; num--)
+        while (ez_pool.free_list[num] != NULL && ez_pool.pooled > budget) {
+            p = ez_pool.free_list[num];
+            ez_pool.free_list[num] = *(void **) p;
+            k = num/4;
+            class_size = ((size_t) EZ_POOL_MIN/2 << k) / 4 * (4 + num%4 + 1);
+            ez_pool.pooled -= class_size;
+            free (p);
+        }
+    ez_image_unlock ();
+}
+
+
+/*
+ * Make sure that the pixels of img are present: a lazy image is decoded
+ * if needed. Called by the functions which read or write the pixels.
+ * Return 0 on success, -1 on error.
+*/
+
+int ez_image_pixels (Ez_image *img)
+{
+    if (img == NULL) return -1;
+    if (img->lazy == NULL) return 0;
+    if (img->pixels_rgba == NULL) return ez_lazy_decode (img);
+
+    /* Most recently used first */
+    ez_image_lock ();
+    if (ez_lazy_list.first != img) {
+        ez_lazy_unlink (img);
+        ez_lazy_link (img);
+    }
+    ez_image_unlock ();
+    return 0;
+}
+
+
+/*
+ * Decode the file of the lazy image img; the pixels of the loaded image
+ * are moved in img. Return 0 on success, -1 on error.
+*/
+
+int ez_lazy_decode (Ez_image *img)
+{
+    Ez_image *tmp = ez_image_load (img->lazy->filename);
+
+    if (tmp == NULL) return -1;
+    if (tmp->width != img->width || tmp->height != img->height) {
+        ez_error ("ez_lazy_decode: file \"%s\" has changed\n",
+            img->lazy->filename);
+        ez_image_destroy (tmp);
+        return -1;
+    }
+
+    img->pixels_rgba = tmp->pixels_rgba;
+    img->pixels_mem  = tmp->pixels_mem;
+    img->stride      = tmp->stride;
+    img->premultiplied = 0;
+    tmp->pixels_mem = NULL;         /* tmp no longer owns the pixels */
+    ez_image_destroy (tmp);
+
+    ez_image_lock ();
+    ez_lazy_link (img);
+    ez_image_unlock ();
+    ez_lazy_trim ();
+    return 0;
+}
+
+
+/*
+ * Insert the decoded lazy image img at the head of ez_lazy_list, or
+ * remove it. Called with ez_image_lock held.
+*/
+
+void ez_lazy_link (Ez_image *img)
+{
+    img->lazy->prev = NULL;
+    img->lazy->next = ez_lazy_list.first;
+    if (ez_lazy_list.first != NULL) ez_lazy_list.first->lazy->prev = img;
+    else ez_lazy_list.last = img;
+    ez_lazy_list.first = img;
+    ez_lazy_list.bytes += (long) img->stride * img->height;
+}
+
+void ez_lazy_unlink (Ez_image *img)
+{
+    Ez_lazy *lazy = img->lazy;
+    if (lazy->prev != NULL) lazy->prev->lazy->next = lazy->next;
+    else ez_lazy_list.first = lazy->next;
+    if (lazy->next != NULL) lazy->next->lazy->prev = lazy->prev;
+    else ez_lazy_list.last = lazy->prev;
+    lazy->prev = lazy->next = NULL;
+    ez_lazy_list.bytes -= (long) img->stride * img->height;
+}
+
+
+/*
+ * Unload the least recently used lazy images until the budget is met.
+ * The two most recent ones are kept: a function can work on a source and
+ * a destination. The images having views are kept too, and the modified
+ * ones, whose pixels could not be decoded again.
+*/
+
+void ez_lazy_trim (void)
+{
+    Ez_image *img, *prev, *next, *victims = NULL;
+
+    /* The victims are chained by lazy->next, then freed without the lock */
+    ez_image_lock ();
+    if (ez_lazy_list.budget > 0)
+        for (img = ez_lazy_list.last; img != NULL &&
+             ez_lazy_list.bytes > ez_lazy_list.budget; img = prev) {
+            prev = img->lazy->prev;
+            if (img == ez_lazy_list.first || prev == ez_lazy_list.first)
+                break;
+            if (img->lazy->modified || img->refcount > 1) continue;
+            ez_lazy_unlink (img);
+            img->lazy->next = victims;
+            victims = img;
+        }
+    ez_image_unlock ();
+
+    for (img = victims; img != NULL; img = next) {
+        next = img->lazy->next;
+        img->lazy->next = NULL;
+        ez_lazy_free_pixels (img);
+    }
+}
+
+
+/*
+ * Take a buffer of size bytes in the scratch sc: the smallest free block
+ * which is large enough, else a free block which is enlarged, else a new
+ * block. When sc is NULL or full, the buffer is allocated by malloc.
+ * Return the buffer, else NULL.
+*/
+
+void *ez_scratch_alloc (Ez_scratch *sc, size_t size)
+{
+    int i, k = -1;
+
+    if (sc == NULL) return malloc (size);
+
+    /* The smallest free block large enough */
+    for (i = 0; i < EZ_SCRATCH_SLOTS; i++)
+        if (! sc->used[i] && sc->size[i] >= size &&
+            (k < 0 || sc->size[i] < sc->size[k])) k = i;
+
+    /* Else an empty slot, else the largest free block, enlarged */
+    for (i = 0; i < EZ_SCRATCH_SLOTS && k < 0; i++)
+        if (sc->block[i] == NULL) k = i;
+    if (k < 0)
+        for (i = 0; i < EZ_SCRATCH_SLOTS; i++)
+            if (! sc->used[i] && (k < 0 || sc->size[i] > sc->size[k])) k = i;
+    if (k < 0) return malloc (size);
+
+    if (sc->size[k] < size) {
+        /* The content is lost: free then malloc avoids a copy */
+        free (sc->block[k]);
+        sc->size[k] = 0;
+        sc->block[k] = malloc (size);
+        if (sc->block[k] == NULL) return NULL;
+        sc->size[k] = size;
+    }
+    sc->used[k] = 1;
+    return sc->block[k];
+}
+
+
+/*
+ * Enlarge the buffer p, taken by ez_scratch_alloc, to size bytes,
+ * keeping its content. Return the buffer, else NULL (p is then kept).
+*/
+
+void *ez_scratch_realloc (Ez_scratch *sc, void *p, size_t size)
+{
+    void *q;
+    int i;
+
+    if (p == NULL) return ez_scratch_alloc (sc, size);
+    if (sc != NULL)
+        for (i = 0; i < EZ_SCRATCH_SLOTS; i++)
+            if (sc->used[i] && sc->block[i] == p) {
+                if (sc->size[i] >= size) return p;
+                q = realloc (p, size);
+                if (q == NULL) return NULL;
+                sc->block[i] = q;
+                sc->size[i] = size;
+                return q;
+            }
+    return realloc (p, size);
+}
+
+
+/*
+ * Give back the buffer p, taken by ez_scratch_alloc; it is kept in sc
+ * for the next allocations.
+*/
+
+void ez_scratch_free (Ez_scratch *sc, void *p)
+{
+    int i;
+
+    if (p == NULL) return;
+    if (sc != NULL)
+        for (i = 0; i < EZ_SCRATCH_SLOTS; i++)
+            if (sc->used[i] && sc->block[i] == p) {
+                sc->used[i] = 0;
+                return;
+            }
+    free (p);
+}
+
+
+/*
+ * Free the blocks of sc which are not in use, to give back the memory
+ * kept after the loading of a large image.
+*/
+
+void ez_scratch_trim (Ez_scratch *sc)
+{
+    int i;
+
+    if (sc == NULL) return;
+    for (i = 0; i < EZ_SCRATCH_SLOTS; i++)
+        if (! sc->used[i]) {
+            free (sc->block[i]);
+            sc->block[i] = NULL;
+            sc->size[i] = 0;
+        }
+}
+
+
+/*
+ * Lock and unlock the data shared by the threads of ez_image_load_async
+ * and ez_image_load_many: the pool, the counters and the list of the
+ * decoded lazy images. Not recursive.
+*/
+
+void ez_image_lock (void)
+{
+#ifdef EZ_BASE_XLIB
+    pthread_mutex_lock (&ez_image_mutex);
+#elif defined EZ_BASE_WIN32
+    while (InterlockedExchange (&ez_image_spin, 1) != 0) Sleep (0);
+#endif /* EZ_BASE_ */
+}
+
+void ez_image_unlock (void)
+{
+#ifdef EZ_BASE_XLIB
+    pthread_mutex_unlock (&ez_image_mutex);
+#elif defined EZ_BASE_WIN32
+    InterlockedExchange (&ez_image_spin, 0);
+#endif /* EZ_BASE_ */
+}
+
+
+/*
+ * Number of processors, at most EZ_RESAMPLE_THREADS_MAX.
+*/
+
+int ez_cpu_nb (void)
+{
+    static int nproc = 0;
+
+    if (nproc == 0) {
+#ifdef EZ_BASE_XLIB
+        nproc = (int) sysconf (_SC_NPROCESSORS_ONLN);
+#elif defined EZ_BASE_WIN32
+        SYSTEM_INFO info;
+        GetSystemInfo (&info);
+        nproc = (int) info.dwNumberOfProcessors;
+#endif /* EZ_BASE_ */
+        if (nproc < 1) nproc = 1;
+        if (nproc > EZ_RESAMPLE_THREADS_MAX) nproc = EZ_RESAMPLE_THREADS_MAX;
+    }
+    return nproc;
+}
+
+
+/*
+ * Lock and unlock the queues of ez_loader.
+*/
+
+void ez_loader_lock (void)
+{
+#ifdef EZ_BASE_XLIB
+    pthread_mutex_lock (&ez_loader.mutex);
+#elif defined EZ_BASE_WIN32
+    EnterCriticalSection (&ez_loader.mutex);
+#endif /* EZ_BASE_ */
+}
+
+void ez_loader_unlock (void)
+{
+#ifdef EZ_BASE_XLIB
+    pthread_mutex_unlock (&ez_loader.mutex);
+#elif defined EZ_BASE_WIN32
+    LeaveCriticalSection (&ez_loader.mutex);
+#endif /* EZ_BASE_ */
+}
+
+
+/*
+ * Add job at the end of the queue first..last, or remove the first job.
+*/
+
+void ez_loader_push (Ez_load_job **first, Ez_load_job **last, Ez_load_job *job)
+{
+    job->next = NULL;
+    if (*first == NULL) *first = job;
+    else (*last)->next = job;
+    *last = job;
+}
+
+Ez_load_job *ez_loader_pop (Ez_load_job **first, Ez_load_job **last)
+{
+    Ez_load_job *job = *first;
+    if (job == NULL) return NULL;
+    *first = job->next;
+    if (*first == NULL) *last = NULL;
+    return job;
+}
+
+
+/*
+ * Start the threads of ez_image_load_async, one by processor, and plug
+ * ez_loader_next in the main loop. The threads are stopped at the end of
+ * the program by ez_loader_stop.
+ * Return 0 on success, -1 on error.
+*/
+
+int ez_loader_start (void)
+{
+    int i, n = ez_cpu_nb ();
+#ifdef EZ_BASE_XLIB
+    pthread_t thread;
+#elif defined EZ_BASE_WIN32
+    HANDLE thread;
+#endif /* EZ_BASE_ */
+
+    if (n > EZ_LOADER_THREADS_MAX) n = EZ_LOADER_THREADS_MAX;
+    if (ez_async_init (ez_loader_next) < 0) return -1;
+    ez_image_debug ();              /* Initialized before the threads */
+
+    /* Created once, even if the threads are started again after a failure;
+       ez_loader_stop is called before ez_close_disp, set by ez_init */
+    if (! ez_loader.init) {
+#ifdef EZ_BASE_XLIB
+        pthread_mutex_init (&ez_loader.mutex, NULL);
+        pthread_cond_init (&ez_loader.cond, NULL);
+#elif defined EZ_BASE_WIN32
+        ez_loader.sem = CreateSemaphore (NULL, 0, 0x7fffffff, NULL);
+        if (ez_loader.sem == NULL) {
+            ez_error ("ez_loader_start: can't create the semaphore\n");
+            return -1;
+        }
+        InitializeCriticalSection (&ez_loader.mutex);
+#endif /* EZ_BASE_ */
+        ez_loader.init = 1;
+        atexit (ez_loader_stop);
+    }
+
+    for (i = 0; i < n; i++) {
+#ifdef EZ_BASE_XLIB
+        if (pthread_create (&thread, NULL, ez_loader_thread, NULL) != 0) break;
+        pthread_detach (thread);
+#elif defined EZ_BASE_WIN32
+        thread = CreateThread (NULL, 0, ez_loader_thread, NULL, 0, NULL);
+        if (thread == NULL) break;
+        CloseHandle (thread);
+#endif /* EZ_BASE_ */
+        ez_loader_lock ();
+        ez_loader.thread_nb++;
+        ez_loader_unlock ();
+    }
+
+    if (ez_loader.thread_nb == 0) {
+        ez_error ("ez_loader_start: can't start the threads\n");
+        return -1;
+    }
+    return 0;
+}
+
+
+/*
+ * A thread of ez_image_load_async: load the files of the queue todo, and
+ * give the images to the main loop in the queue done.
+*/
+
+#ifdef EZ_BASE_XLIB
+void *ez_loader_thread (void *arg)
+#elif defined EZ_BASE_WIN32
+DWORD WINAPI ez_loader_thread (LPVOID arg)
+#endif /* EZ_BASE_ */
+{
+    Ez_load_job *job;
+    Ez_window win;
+    Ez_scratch *sc = ez_scratch_create ();  /* Kept by the thread */
+    int idle;
+    (void) arg;
+
+    for (;;) {
+#ifdef EZ_BASE_XLIB
+        pthread_mutex_lock (&ez_loader.mutex);
+        while (ez_loader.todo == NULL && ! ez_loader.quit)
+            pthread_cond_wait (&ez_loader.cond, &ez_loader.mutex);
+        job = ez_loader_pop (&ez_loader.todo, &ez_loader.todo_last);
+        pthread_mutex_unlock (&ez_loader.mutex);
+#elif defined EZ_BASE_WIN32
+        WaitForSingleObject (ez_loader.sem, INFINITE);
+        ez_loader_lock ();
+        job = ez_loader_pop (&ez_loader.todo, &ez_loader.todo_last);
+        ez_loader_unlock ();
+#endif /* EZ_BASE_ */
+
+        /* Without job when ez_loader_stop wakes up the threads */
+        if (job == NULL) {
+            if (ez_loader.quit) break;
+            continue;
+        }
+
+        job->img = ez_image_load_scratch (job->filename, sc);
+
+        /* Once in done, the job can be freed by the main loop */
+        win = job->win;
+        ez_loader_lock ();
+        ez_loader_push (&ez_loader.done, &ez_loader.done_last, job);
+        idle = ez_loader.todo == NULL;
+        ez_loader_unlock ();
+        ez_async_wakeup (win);
+
+        /* The buffers are reused during a burst of loadings, then freed
+           while the thread waits */
+        if (idle) ez_scratch_trim (sc);
+    }
+
+    ez_scratch_destroy (sc);
+    ez_loader_lock ();
+    ez_loader.thread_nb--;
+    ez_loader_unlock ();
+#ifdef EZ_BASE_XLIB
+    pthread_cond_broadcast (&ez_loader.cond);
+    return NULL;
+#elif defined EZ_BASE_WIN32
+    return 0;
+#endif /* EZ_BASE_ */
+}
+
+
+/*
+ * Stop the threads of ez_image_load_async; called after exit (atexit
+ * function set by ez_loader_start). The files not yet loaded are dropped,
+ * the threads end their current loading, then the images not yet sent
+ * are freed.
+*/
+
+void ez_loader_stop (void)
+{
+    Ez_load_job *job;
+    int n;
+
+    ez_loader_lock ();
+    ez_loader.quit = 1;
+    while ((job = ez_loader_pop (&ez_loader.todo, &ez_loader.todo_last))
+        != NULL) {
+        free (job->filename); free (job);
+    }
+    n = ez_loader.thread_nb;
+    ez_loader_unlock ();
+
+#ifdef EZ_BASE_XLIB
+    pthread_mutex_lock (&ez_loader.mutex);
+    pthread_cond_broadcast (&ez_loader.cond);
+    while ((n = ez_loader.thread_nb) > 0)
+        pthread_cond_wait (&ez_loader.cond, &ez_loader.mutex);
+    pthread_mutex_unlock (&ez_loader.mutex);
+#elif defined EZ_BASE_WIN32
+    if (n > 0) ReleaseSemaphore (ez_loader.sem, n, NULL);
+    for (;;) {
+        ez_loader_lock ();
+        n = ez_loader.thread_nb;
+        ez_loader_unlock ();
+        if (n == 0) break;
+        Sleep (1);
+    }
+#endif /* EZ_BASE_ */
+
+    while ((job = ez_loader_pop (&ez_loader.done, &ez_loader.done_last))
+        != NULL) {
+        ez_image_destroy (job->img);
+        free (job->filename); free (job);
+    }
+}
+
+
+/*
+ * Called by the main loop, see ez_async_next: retrieve a loaded image and
+ * fill ev with an ImageLoaded event. Return 1 if an event is filled, else 0.
+*/
+
+int ez_loader_next (Ez_event *ev)
+{
+    Ez_load_job *job;
+
+    for (;;) {
+        ez_loader_lock ();
+        job = ez_loader_pop (&ez_loader.done, &ez_loader.done_last);
+        ez_loader_unlock ();
+        if (job == NULL) return 0;
+
+        /* The window was destroyed meanwhile */
+        if (! ez_win_list_has (job->win)) {
+            ez_image_destroy (job->img);
+            free (job->filename); free (job);
+            continue;
+        }
+
+        ev->type  = ImageLoaded;
+        ev->win   = job->win;
+        ev->image = job->img;
+        ev->tag   = job->tag;
+        free (job->filename); free (job);
+        return 1;
+    }
+}
+
+
+/*
+ * A thread of ez_image_load_many: load the next files until the end.
+*/
+
+#ifdef EZ_BASE_XLIB
+void *ez_load_many_thread (void *arg)
+#elif defined EZ_BASE_WIN32
+DWORD WINAPI ez_load_many_thread (LPVOID arg)
+#endif /* EZ_BASE_ */
+{
+    Ez_load_many *many = arg;
+    Ez_scratch *sc = ez_scratch_create ();
+    int i;
+
+    for (;;) {
+        ez_image_lock ();
+        i = many->next++;
+        ez_image_unlock ();
+        if (i >= many->n) break;
+        many->img[i] = many->filenames[i] == NULL ? NULL :
+            ez_image_load_scratch (many->filenames[i], sc);
+    }
+    ez_scratch_destroy (sc);
+#ifdef EZ_BASE_XLIB
+    return NULL;
+#elif defined EZ_BASE_WIN32
+    return 0;
+#endif /* EZ_BASE_ */
+}
+
+
+int ez_image_confine_sub_coords (Ez_image *img, int *src_x, int *src_y,
+    int *w, int *h)
+{
+    if (ez_image_pixels (img) < 0) return -1;
+
+    if (ez_confine_coord (src_x, w, img->width) < 0 ||
+        ez_confine_coord (src_y, h, img->height) < 0) {
+        if (ez_image_debug ())
+            printf ("ez_image_confine_sub_coords empty region "
+                    "src_x = %d  src_y = %d  w = %d  h = %d\n",
+                *src_x, *src_y, *w, *h);
+        return -1;
+    }
+    return 0;
+}
+
+int ez_confine_coord (int *t, int *r, int tmax)
+{
+    if (*t < 0) { *r += *t; *t = 0; }
+    if (*t+*r > tmax) *r = tmax -*t;
+    return *r > 0 ? 0 : -1;
+}
+
+
+/*
+ * Confine the region w x h at src_x,src_y in src, moved at dst_x,dst_y in
+ * dst, to the common part of src and dst.
+ * Return 0 on success, -1 if the region is empty.
+*/
+
+int ez_image_confine_comp_coords (Ez_image *dst, Ez_image *src,
+    int *dst_x, int *dst_y, int *src_x, int *src_y, int *w, int *h)
+{
+    int src_x_old = *src_x, src_y_old = *src_y, dst_x_old, dst_y_old;
+
+    if (ez_image_confine_sub_coords (src, src_x, src_y, w, h) < 0) return -1;
+    *dst_x += *src_x - src_x_old; dst_x_old = *dst_x;
+    *dst_y += *src_y - src_y_old; dst_y_old = *dst_y;
+    if (ez_image_confine_sub_coords (dst, dst_x, dst_y, w, h) < 0) return -1;
+    *src_x += *dst_x - dst_x_old;
+    *src_y += *dst_y - dst_y_old;
+    return 0;
+}
+
+
+#ifdef EZ_BASE_XLIB
+
+/*
+ * Display sub-image with transparency.
+*/
+
+void ez_image_draw_xi (Ez_window win, Ez_image *img, int x, int y,
+    int src_x, int src_y, int w, int h)
+{
+    XImage *xi = NULL;
+    Pixmap mask = None;
+    ez_xi_func xi_func;
+
+    xi_func = ez_xi_get_func ();
+    xi = ez_xi_create (img, src_x, src_y, w, h, xi_func);
+    if (xi == NULL) return;
+
+    /* The mask of the whole image is cached, then placed by the clip
+       origin; the pixels of a view may be modified by its parent, so its
+       mask is not cached, except for a view of ez_image_load_cached whose
+       shared pixels are read-only: its mask is freed by ez_image_unshare */
+    if (img->has_alpha && img->parent != NULL && !img->cow) {
+        mask = ez_xmask_create (win, img, src_x, src_y, w, h);
+        if (mask == None) goto free_xi;
+        XSetClipOrigin (ezx.display, ezx.gc, x, y);
+        XSetClipMask (ezx.display, ezx.gc, mask);
+    } else if (img->has_alpha) {
+        if (img->xmask != None && img->xmask_opacity != img->opacity)
+            ez_image_free_xmask (img);
+        if (img->xmask == None) {
+            img->xmask = ez_xmask_create (ezx.root_win, img, 0, 0,
+                img->width, img->height);
+            if (img->xmask == None) goto free_xi;
+            img->xmask_opacity = img->opacity;
+        }
+        XSetClipOrigin (ezx.display, ezx.gc, x - src_x, y - src_y);
+        XSetClipMask (ezx.display, ezx.gc, img->xmask);
+    }
+
+    XPutImage (ezx.display, win, ezx.gc, xi, 0, 0, x, y, w, h);
+
+    if (img->has_alpha) {
+        XSetClipOrigin (ezx.display, ezx.gc, 0, 0);
+        XSetClipMask (ezx.display, ezx.gc, None);
+        if (mask != None) XFreePixmap (ezx.display, mask);
+    }
+
+  free_xi:
+    ez_xi_destroy (xi);
+}
+
+
+/*
+ * Creation of ximage
+*/
+
+XImage *ez_xi_create (Ez_image *img, int src_x, int src_y, int w, int h,
+    ez_xi_func xi_func)
+{
+    XImage *xi = NULL;
+    double time1 = 0;
+
+    if (xi_func == NULL) {
+        ez_error ("ez_xi_create: NULL xi_func\n");
+        return NULL;
+    }
+
+    /* We must first create xi to obtain informations to create data */
+    xi = XCreateImage (ezx.display, ezx.visual, ezx.depth, ZPixmap, 0,
+        NULL, w, h, 32, 0);
+    if (xi == NULL) {
+        ez_error ("ez_xi_create: can't create XImage\n");
+        return NULL;
+    }
+
+    if (ez_image_debug())
+        printf ("ez_xi_create  w = %d  h = %d  depth = %d  bpp = %d\n",
+            w, h, ezx.depth, xi->bits_per_pixel);
+
+    /* The specialized functions write all the pixels */
+    xi->data = ez_pool_alloc ((size_t) xi->bytes_per_line * h,
+        xi_func == ez_xi_fill_default);
+    if (xi->data == NULL)  {
+        ez_error ("ez_xi_create: out of memory\n");
+        XDestroyImage (xi);
+        return NULL;
+    }
+    /* xi->data will be freed by ez_xi_destroy */
+
+    /* Draw pixels in xi->data */
+    if (ez_image_debug()) time1 = ez_get_time ();
+    xi_func (xi, img, src_x, src_y, w, h);
+    if (ez_image_debug())
+        printf ("ez_xi_create fill %.3f ms\n", (ez_get_time() - time1)*1000);
+
+    return xi;
+}
+
+
+/*
+ * Destroy an XImage created by ez_xi_create; its data go back to the pool.
+*/
+
+void ez_xi_destroy (XImage *xi)
+{
+    if (xi == NULL) return;
+    ez_pool_free (xi->data, (size_t) xi->bytes_per_line * xi->height);
+    xi->data = NULL;
+    XDestroyImage (xi);
+}
+
+
+/*
+ * Choose once the fastest function to fill the XImages, from the layout of
+ * the pixels given by the visual; the function is checked on a test image
+ * against ez_xi_fill_default.
+*/
+
+ez_xi_func ez_xi_get_func (void)
+{
+    static ez_xi_func xi_func = NULL;
+    ez_xi_func fast = NULL;
+    Ez_image *img;
+    XImage *xi1, *xi2;
+
+    if (xi_func != NULL) return xi_func;
+    xi_func = ez_xi_fill_default;
+
+    img = ez_xi_test_create ();
+    if (img == NULL) return xi_func;
+    xi1 = ez_xi_create (img, 0, 0, img->width, img->height, ez_xi_fill_default);
+
+    if (xi1 != NULL && ez_xi_layout_init (xi1) == 0) {
+        switch (ez_xi_layout.bpp) {
+            case 32 : fast = ez_xi_fill_32; break;
+            case 24 : fast = ez_xi_fill_24; break;
+            case 16 : fast = ez_xi_fill_16; break;
+        }
+#ifdef EZ_SIMD_X86
+        __builtin_cpu_init ();
+        if (ez_xi_layout.bpp == 32 && ez_xi_layout.bytewise) {
+            if (__builtin_cpu_supports ("avx2"))
+                 fast = ez_xi_fill_32_avx2;
+            else if (__builtin_cpu_supports ("ssse3"))
+                 fast = ez_xi_fill_32_ssse3;
+        } else if (ez_xi_layout.bpp == 24 && __builtin_cpu_supports ("ssse3"))
+            fast = ez_xi_fill_24_ssse3;
+        else if (ez_xi_layout.bpp == 16 && __builtin_cpu_supports ("sse2"))
+            fast = ez_xi_fill_16_sse2;
+#endif /* EZ_SIMD_X86 */
+    }
+
+    if (fast != NULL) {
+        xi2 = ez_xi_create (img, 0, 0, img->width, img->height, fast);
+        if (ez_xi_diff (xi1, xi2) == 0) xi_func = fast;
+        if (xi2 != NULL) ez_xi_destroy (xi2);
+    }
+
+    if (ez_image_debug ())
+        printf ("ez_xi_get_func: bpp %d  %s\n", ez_xi_layout.bpp,
+            xi_func == ez_xi_fill_default ? "default" : "specialized");
+
+    if (xi1 != NULL) ez_xi_destroy (xi1);
+    ez_image_destroy (img);
+    return xi_func;
+}
+
+
+/*
+ * Fill ez_xi_layout from the XImage xi and the masks of the visual.
+ * Return 0 if a specialized function can be used, else -1.
+*/
+
+int ez_xi_layout_init (XImage *xi)
+{
+    Ez_xi_layout *lay = &ez_xi_layout;
+    Ez_channel *chan[3] = { &ezx.trueColor.red, &ezx.trueColor.green,
+                            &ezx.trueColor.blue };
+    Ez_uint32 one = 1;
+    int c, k, p, nbytes, byte;
+
+    if (ez_get_RGB != ez_get_RGB_true_color) return -1;
+
+    lay->bpp = xi->bits_per_pixel;
+    if (lay->bpp != 32 && lay->bpp != 24 && lay->bpp != 16) return -1;
+    nbytes = lay->bpp / 8;
+
+    /* Whole words are stored in host order, then swapped if needed */
+    lay->swap = (xi->byte_order == LSBFirst) != (*(Ez_uint8 *) &one == 1);
+
+    lay->bytewise = 1;
+    for (c = 0; c < 3; c++) {
+        lay->shift[c] = chan[c]->shift;
+        lay->loss[c]  = 8 - (int) chan[c]->length;
+        if (lay->loss[c] < 0 || lay->loss[c] > 7 ||
+            lay->shift[c] + 8 - lay->loss[c] > lay->bpp) return -1;
+        if (lay->loss[c] != 0 || lay->shift[c] % 8 != 0) lay->bytewise = 0;
+    }
+    if (lay->bpp == 24 && !lay->bytewise) return -1;
+
+    /* Byte k of a pixel in xi gets the byte index[k] of the RGBA pixel, or
+       nothing if index[k] = 0x80 */
+    for (k = 0; k < 4; k++) lay->index[k] = 0x80;
+    if (lay->bytewise)
+        for (c = 0; c < 3; c++) {
+            byte = lay->shift[c] / 8;
+            k = xi->byte_order == LSBFirst ? byte : nbytes-1 - byte;
+            lay->index[k] = c;
+        }
+
+    /* The same for 4 pixels, for the SIMD byte shuffles */
+    for (k = 0; k < 16; k++) lay->shuffle[k] = 0x80;
+    for (p = 0; p < 4; p++)
+        for (k = 0; k < nbytes; k++)
+            if (lay->index[k] != 0x80)
+                lay->shuffle[p*nbytes + k] = p*4 + lay->index[k];
+
+    return 0;
+}
+
+
+void ez_xi_fill_default (XImage *xi, Ez_image *img, int src_x, int src_y,
+    int w, int h)
+{
+    int x, y, tx, ty, pitch = img->stride/4;
+    Ez_uint8 cr, cg, cb;
+
+    for (y = 0, ty = src_y * pitch; y < h; y++, ty += pitch)
+    for (x = 0, tx = (ty + src_x)*4; x < w; x++, tx += 4) {
+        cr = img->pixels_rgba[tx];
+        cg = img->pixels_rgba[tx+1];
+        cb = img->pixels_rgba[tx+2];
+        XPutPixel (xi, x, y, ez_get_RGB (cr, cg, cb));
+    }
+}
+
+
+/*
+ * Specialized functions for the layouts of ez_xi_layout; a pixel is built
+ * in a word, with the shifts of the channels, and stored at once.
+*/
+
+#define EZ_XI_PIXEL(lay, p) \
+    ((Ez_uint32) (p)[0] >> (lay)->loss[0] << (lay)->shift[0] | \
+     (Ez_uint32) (p)[1] >> (lay)->loss[1] << (lay)->shift[1] | \
+     (Ez_uint32) (p)[2] >> (lay)->loss[2] << (lay)->shift[2])
+
+#define EZ_SWAP32(v) \
+    ((v) >> 24 | ((v) >> 8 & 0xff00) | ((v) << 8 & 0xff0000) | (v) << 24)
+#define EZ_SWAP16(v) ((Ez_uint16) ((v) >> 8 | (v) << 8))
+
+void ez_xi_fill_32 (XImage *xi, Ez_image *img, int src_x, int src_y,
+    int w, int h)
+{
+    Ez_xi_layout *lay = &ez_xi_layout;
+    int x, y;
+    Ez_uint8 *src_p;
+    Ez_uint32 *dst_p, v;
+
+    for (y = 0; y < h; y++) {
+        src_p = EZ_IMAGE_PIXEL (img, src_x, src_y+y);
+        dst_p = (Ez_uint32 *) (xi->data + y*xi->bytes_per_line);
+        for (x = 0; x < w; x++, src_p += 4) {
+            v = EZ_XI_PIXEL (lay, src_p);
+            dst_p[x] = lay->swap ? EZ_SWAP32 (v) : v;
+        }
+    }
+}
+
+
+void ez_xi_fill_24 (XImage *xi, Ez_image *img, int src_x, int src_y,
+    int w, int h)
+{
+    Ez_xi_layout *lay = &ez_xi_layout;
+    int x, y, i0 = lay->index[0], i1 = lay->index[1], i2 = lay->index[2];
+    Ez_uint8 *src_p, *dst_p;
+
+    for (y = 0; y < h; y++) {
+        src_p = EZ_IMAGE_PIXEL (img, src_x, src_y+y);
+        dst_p = (Ez_uint8 *) xi->data + y*xi->bytes_per_line;
+        for (x = 0; x < w; x++, src_p += 4, dst_p += 3) {
+            dst_p[0] = src_p[i0];
+            dst_p[1] = src_p[i1];
+            dst_p[2] = src_p[i2];
+        }
+    }
+}
+
+
+void ez_xi_fill_16 (XImage *xi, Ez_image *img, int src_x, int src_y,
+    int w, int h)
+{
+    Ez_xi_layout *lay = &ez_xi_layout;
+    int x, y;
+    Ez_uint8 *src_p;
+    Ez_uint16 *dst_p, v;
+
+    for (y = 0; y < h; y++) {
+        src_p = EZ_IMAGE_PIXEL (img, src_x, src_y+y);
+        dst_p = (Ez_uint16 *) (xi->data + y*xi->bytes_per_line);
+        for (x = 0; x < w; x++, src_p += 4) {
+            v = EZ_XI_PIXEL (lay, src_p);
+            dst_p[x] = lay->swap ? EZ_SWAP16 (v) : v;
+        }
+    }
+}
+
+
+#ifdef EZ_SIMD_X86
+
+/*
+ * SSSE3 and AVX2: 4 or 8 pixels are rearranged by one byte shuffle.
+ * The remaining pixels are done by the C functions.
+*/
+
+__attribute__((target("ssse3")))
+void ez_xi_fill_32_ssse3 (XImage *xi, Ez_image *img, int src_x, int src_y,
+    int w, int h)
+{
+    __m128i shuf = _mm_loadu_si128 ((__m128i *) ez_xi_layout.shuffle);
+    int x, y;
+    Ez_uint8 *src_p, *dst_p;
+
+    for (y = 0; y < h; y++) {
+        src_p = EZ_IMAGE_PIXEL (img, src_x, src_y+y);
+        dst_p = (Ez_uint8 *) xi->data + y*xi->bytes_per_line;
+        for (x = 0; x+4 <= w; x += 4, src_p += 16, dst_p += 16)
+            _mm_storeu_si128 ((__m128i *) dst_p, _mm_shuffle_epi8 (
+                _mm_loadu_si128 ((__m128i *) src_p), shuf));
+        for (; x < w; x++, src_p += 4, dst_p += 4)
+            ez_xi_shuffle_pixel (dst_p, src_p, 4);
+    }
+}
+
+
+__attribute__((target("avx2")))
+void ez_xi_fill_32_avx2 (XImage *xi, Ez_image *img, int src_x, int src_y,
+    int w, int h)
+{
+    __m128i shuf4 = _mm_loadu_si128 ((__m128i *) ez_xi_layout.shuffle);
+    __m256i shuf = _mm256_broadcastsi128_si256 (shuf4);
+    int x, y;
+    Ez_uint8 *src_p, *dst_p;
+
+    for (y = 0; y < h; y++) {
+        src_p = EZ_IMAGE_PIXEL (img, src_x, src_y+y);
+        dst_p = (Ez_uint8 *) xi->data + y*xi->bytes_per_line;
+        for (x = 0; x+8 <= w; x += 8, src_p += 32, dst_p += 32)
+            _mm256_storeu_si256 ((__m256i *) dst_p, _mm256_shuffle_epi8 (
+                _mm256_loadu_si256 ((__m256i *) src_p), shuf));
+        for (; x < w; x++, src_p += 4, dst_p += 4)
+            ez_xi_shuffle_pixel (dst_p, src_p, 4);
+    }
+}
+
+
+/*
+ * 24 bpp: 16 bytes are stored for 4 pixels, and the 4 last bytes are
+ * overwritten by the next pixels; so the last pixels of a row are done
+ * one by one.
+*/
+
+__attribute__((target("ssse3")))
+void ez_xi_fill_24_ssse3 (XImage *xi, Ez_image *img, int src_x, int src_y,
+    int w, int h)
+{
+    __m128i shuf = _mm_loadu_si128 ((__m128i *) ez_xi_layout.shuffle);
+    int x, y;
+    Ez_uint8 *src_p, *dst_p;
+
+    for (y = 0; y < h; y++) {
+        src_p = EZ_IMAGE_PIXEL (img, src_x, src_y+y);
+        dst_p = (Ez_uint8 *) xi->data + y*xi->bytes_per_line;
+        for (x = 0; x+6 <= w; x += 4, src_p += 16, dst_p += 12)
+            _mm_storeu_si128 ((__m128i *) dst_p, _mm_shuffle_epi8 (
+                _mm_loadu_si128 ((__m128i *) src_p), shuf));
+        for (; x < w; x++, src_p += 4, dst_p += 3)
+            ez_xi_shuffle_pixel (dst_p, src_p, 3);
+    }
+}
+
+
+/*
+ * SSE2, 16 bpp: the channels of 8 pixels are shifted and masked in 32 bits,
+ * then packed in 16 bits; packs_epi32 saturates, so the words are first
+ * sign extended.
+*/
+
+__attribute__((target("sse2")))
+static __m128i ez_xi_pixels_sse2 (__m128i p, __m128i *sh_r, __m128i *sh_l,
+    __m128i *mask)
+{
+    __m128i v = _mm_setzero_si128 ();
+    int c;
+
+    for (c = 0; c < 3; c++)
+        v = _mm_or_si128 (v, _mm_sll_epi32 (_mm_and_si128 (
+            _mm_srl_epi32 (p, sh_r[c]), mask[c]), sh_l[c]));
+    return _mm_srai_epi32 (_mm_slli_epi32 (v, 16), 16);
+}
+
+
+__attribute__((target("sse2")))
+void ez_xi_fill_16_sse2 (XImage *xi, Ez_image *img, int src_x, int src_y,
+    int w, int h)
+{
+    Ez_xi_layout *lay = &ez_xi_layout;
+    __m128i sh_r[3], sh_l[3], mask[3], v;
+    int x, y, c;
+    Ez_uint8 *src_p;
+    Ez_uint16 *dst_p;
+
+    for (c = 0; c < 3; c++) {
+        sh_r[c] = _mm_cvtsi32_si128 (8*c + lay->loss[c]);
+        sh_l[c] = _mm_cvtsi32_si128 (lay->shift[c]);
+        mask[c] = _mm_set1_epi32 (0xff >> lay->loss[c]);
+    }
+
+    for (y = 0; y < h; y++) {
+        src_p = EZ_IMAGE_PIXEL (img, src_x, src_y+y);
+        dst_p = (Ez_uint16 *) (xi->data + y*xi->bytes_per_line);
+        for (x = 0; x+8 <= w; x += 8, src_p += 32) {
+            v = _mm_packs_epi32 (
+                ez_xi_pixels_sse2 (_mm_loadu_si128 ((__m128i *) src_p),
+                    sh_r, sh_l, mask),
+                ez_xi_pixels_sse2 (_mm_loadu_si128 ((__m128i *) (src_p+16)),
+                    sh_r, sh_l, mask));
+            if (lay->swap)
+                v = _mm_or_si128 (_mm_slli_epi16 (v, 8), _mm_srli_epi16 (v, 8));
+            _mm_storeu_si128 ((__m128i *) (dst_p + x), v);
+        }
+        for (; x < w; x++, src_p += 4) {
+            Ez_uint16 u = EZ_XI_PIXEL (lay, src_p);
+            dst_p[x] = lay->swap ? EZ_SWAP16 (u) : u;
+        }
+    }
+}
+
+#endif /* EZ_SIMD_X86 */
+
+
+/*
+ * Store the pixel src_p in the nbytes of dst_p, by ez_xi_layout.index.
+*/
+
+void ez_xi_shuffle_pixel (Ez_uint8 *dst_p, Ez_uint8 *src_p, int nbytes)
+{
+    int k, i;
+
+    for (k = 0; k < nbytes; k++) {
+        i = ez_xi_layout.index[k];
+        dst_p[k] = i == 0x80 ? 0 : src_p[i];
+    }
+}
+
+
+Ez_image *ez_xi_test_create (void)
+{
+    /* Wide enough for the SIMD loops and the remaining pixels; with more
+       than 256 pixels and odd factors, each channel takes all the values */
+    int w = 37, h = 13, x, y, t;
+    Ez_uint8 *p;
+    Ez_image *img = ez_image_create (w, h);
+    if (img == NULL) return NULL;
+
+    for (y = 0; y < h; y++)
+    for (x = 0, p = EZ_IMAGE_PIXEL (img, 0, y); x < w; x++, p += 4) {
+        t = y*w + x;
+        p[0] = t*11 % 256;
+        p[1] = t*31 % 256;
+        p[2] = t* 7 % 256;
+    }
+
+    return img;
+}
+
+
+/*
+ * Compare the pixels of two XImages of the same size; the padding at the
+ * end of the rows is not written by the fill functions, so it is skipped.
+ * Return 0 if they are equal, else -1.
+*/
+
+int ez_xi_diff (XImage *xi1, XImage *xi2)
+{
+    int nrow, y;
+    if (xi1 == NULL || xi2 == NULL) return -1;
+    if (xi1->width != xi2->width || xi1->height != xi2->height ||
+        xi1->bits_per_pixel != xi2->bits_per_pixel) return -1;
+
+    nrow = (xi1->width * xi1->bits_per_pixel + 7) / 8;
+    for (y = 0; y < xi1->height; y++)
+        if (memcmp (xi1->data + y*xi1->bytes_per_line,
+                    xi2->data + y*xi2->bytes_per_line, nrow) != 0) return -1;
+
+    return 0;
+}
+
+
+/*
+ * Free the mask cached by ez_image_draw_xi.
+*/
+
+void ez_image_free_xmask (Ez_image *img)
+{
+    if (img->xmask == None) return;
+    if (ezx.display != NULL) XFreePixmap (ezx.display, img->xmask);
+    img->xmask = None;
+}
+
+
+/*
+ * Create a cutting mask from alpha channel and opacity threshold
+*/
+
+Pixmap ez_xmask_create (Ez_window win, Ez_image *img, int src_x, int src_y,
+    int w, int h)
+{
+    Pixmap mask = None;
+    Ez_uint8 *data = NULL;
+    int bytes_per_line = (w+7)/8;
+    double time1 = 0, time2 = 0, time3 = 0;
+
+    data = calloc (bytes_per_line*h, 1);
+    if (data == NULL) {
+        ez_error ("ez_xmask_create: out of memory\n");
+        return None;
+    }
+
+    if (ez_image_debug()) time1 = ez_get_time ();
+
+    ez_xmask_fill (data, img, src_x, src_y, w, h);
+
+    if (ez_image_debug()) time2 = ez_get_time ();
+
+    mask = XCreateBitmapFromData (ezx.display, win, (char*) data, w, h);
+    if (mask == None)
+        ez_error ("ez_xmask_create: can't create bitmap");
+
+    if (ez_image_debug()) {
+        time3 = ez_get_time ();
+        printf ("ez_xmask_create   fill %.3f ms   bitmap %.3f ms\n",
+            (time2-time1)*1000, (time3-time2)*1000);
+    }
+
+    free (data);
+    return mask;
+}
+
+
+/*
+ * Set the bit of each pixel whose alpha is >= opacity, in the rows of
+ * (w+7)/8 bytes of data, which is zeroed. The rows are done by
+ * ez_xmask_row, 16 or 32 pixels at once.
+*/
+
+void ez_xmask_fill (Ez_uint8 *data, Ez_image *img,
+    int src_x, int src_y, int w, int h)
+{
+    static void (*mask_row) (Ez_uint8 *, Ez_uint8 *, int, int) = NULL;
+    int y, bpl = (w+7)/8, opacity = img->opacity;
+
+    if (opacity > 255) return;
+    if (opacity < 0) opacity = 0;
+
+    if (mask_row == NULL) {
+        mask_row = ez_xmask_row_c;
+#ifdef EZ_SIMD_X86
+        __builtin_cpu_init ();
+        if (__builtin_cpu_supports ("avx2"))
+             mask_row = ez_xmask_row_avx2;
+        else if (__builtin_cpu_supports ("sse2"))
+             mask_row = ez_xmask_row_sse2;
+#endif /* EZ_SIMD_X86 */
+    }
+
+    for (y = 0; y < h; y++)
+        mask_row (data + y*bpl,
+            EZ_IMAGE_PIXEL (img, src_x, src_y+y), w, opacity);
+}
+
+
+void ez_xmask_row_c (Ez_uint8 *dst_p, Ez_uint8 *src_p, int w, int opacity)
+{
+    int x;
+
+    for (x = 0; x < w; x++, src_p += 4)
+        if (src_p[3] >= opacity) dst_p[x/8] |= 1 << (x%8);
+}
+
+
+#ifdef EZ_SIMD_X86
+
+/*
+ * The alphas of 16 pixels are gathered in bytes by shifts and packs, then
+ * compared to opacity; movemask gives the bits in the order of the mask.
+*/
+
+__attribute__((target("sse2")))
+void ez_xmask_row_sse2 (Ez_uint8 *dst_p, Ez_uint8 *src_p, int w, int opacity)
+{
+    __m128i op = _mm_set1_epi8 ((char) opacity), a, b;
+    int x, bits;
+
+    for (x = 0; x+16 <= w; x += 16, src_p += 64, dst_p += 2) {
+        a = _mm_packs_epi32 (
+            _mm_srli_epi32 (_mm_loadu_si128 ((__m128i *) src_p), 24),
+            _mm_srli_epi32 (_mm_loadu_si128 ((__m128i *) (src_p+16)), 24));
+        b = _mm_packs_epi32 (
+            _mm_srli_epi32 (_mm_loadu_si128 ((__m128i *) (src_p+32)), 24),
+            _mm_srli_epi32 (_mm_loadu_si128 ((__m128i *) (src_p+48)), 24));
+        a = _mm_packus_epi16 (a, b);
+        bits = _mm_movemask_epi8 (_mm_cmpeq_epi8 (_mm_max_epu8 (a, op), a));
+        dst_p[0] = bits;
+        dst_p[1] = bits >> 8;
+    }
+    ez_xmask_row_c (dst_p, src_p, w-x, opacity);
+}
+
+
+/*
+ * The packs work in each 128 bits lane, so the 4 bytes groups are put
+ * back in order by a permutation.
+*/
+
+__attribute__((target("avx2")))
+void ez_xmask_row_avx2 (Ez_uint8 *dst_p, Ez_uint8 *src_p, int w, int opacity)
+{
+    __m256i op = _mm256_set1_epi8 ((char) opacity), a, b,
+            perm = _mm256_setr_epi32 (0, 4, 1, 5, 2, 6, 3, 7);
+    Ez_uint32 bits;
+    int x;
+
+    for (x = 0; x+32 <= w; x += 32, src_p += 128, dst_p += 4) {
+        a = _mm256_packs_epi32 (
+            _mm256_srli_epi32 (_mm256_loadu_si256 ((__m256i *) src_p), 24),
+            _mm256_srli_epi32 (_mm256_loadu_si256 ((__m256i *) (src_p+32)), 24));
+        b = _mm256_packs_epi32 (
+            _mm256_srli_epi32 (_mm256_loadu_si256 ((__m256i *) (src_p+64)), 24),
+            _mm256_srli_epi32 (_mm256_loadu_si256 ((__m256i *) (src_p+96)), 24));
+        a = _mm256_permutevar8x32_epi32 (_mm256_packus_epi16 (a, b), perm);
+        bits = _mm256_movemask_epi8 (
+            _mm256_cmpeq_epi8 (_mm256_max_epu8 (a, op), a));
+        dst_p[0] = bits;       dst_p[1] = bits >> 8;
+        dst_p[2] = bits >> 16; dst_p[3] = bits >> 24;
+    }
+    ez_xmask_row_sse2 (dst_p, src_p, w-x, opacity);
+}
+
+#endif /* EZ_SIMD_X86 */
+
+#elif defined EZ_BASE_WIN32
+
+/*
+ * Display a sub-image with transparency.
+ * DIB = Device Independent Bitmap
+*/
+
+void ez_image_draw_dib (HDC hdc_dst, Ez_image *img, int x, int y,
+    int src_x, int src_y, int w, int h)
+{
+    HDC hdc = NULL;
+    HBITMAP hbitmap = NULL;
+    BITMAPINFO bmi;
+    Ez_uint8 *data;
+
+    /* Create a DC for the bitmap */
+    hdc = CreateCompatibleDC(hdc_dst);
+    if (hdc == NULL) {
+        ez_error ("ez_image_draw_dib: can't create compatible DC\n");
+        return;
+    }
+
+    ZeroMemory(&bmi, sizeof(BITMAPINFO));
+    bmi.bmiHeader.biSize = sizeof(BITMAPINFOHEADER);
+    bmi.bmiHeader.biWidth = w;
+    bmi.bmiHeader.biHeight = -h;  /* negative height for Origin at top left */
+    bmi.bmiHeader.biPlanes = 1;
+    bmi.bmiHeader.biBitCount = 32;
+    bmi.bmiHeader.biCompression = BI_RGB;
+    bmi.bmiHeader.biSizeImage = w * h * 4;
+
+    hbitmap = CreateDIBSection (hdc_dst, &bmi, DIB_RGB_COLORS, (void **) &data, NULL, 0);
+    if (hbitmap == NULL) {
+        ez_error ("ez_image_draw_dib: can't create DIB Section\n");
+        goto final;
+    }
+    SelectObject (hdc, hbitmap);
+
+    if (!img->has_alpha)
+         ez_dib_fill_noalpha   (data, img, src_x, src_y, w, h);
+    else if (img->opacity >= 0)
+         ez_dib_fill_opacity   (data, img, src_x, src_y, w, h);
+    else ez_dib_fill_truealpha (data, img, src_x, src_y, w, h);
+
+    if (img->has_alpha) {
+        BLENDFUNCTION bf;
+
+        bf.BlendOp = AC_SRC_OVER;
+        bf.BlendFlags = 0;
+        bf.AlphaFormat = AC_SRC_ALPHA;  /* alpha channel premultiplied */
+        bf.SourceConstantAlpha = 0xff;
+
+        if (AlphaBlend (hdc_dst, x, y, w, h, hdc, 0, 0, w, h, bf) == FALSE)
+            ez_error ("ez_image_draw_dib: AlphaBlend failed\n");
+    } else {
+        if (BitBlt (hdc_dst, x, y, w, h, hdc, 0, 0, SRCCOPY ) == 0)
+            ez_error ("ez_image_draw_dib: bitblt failed\n");
+    }
+
+  final:
+    if (hbitmap != NULL) DeleteObject (hbitmap);
+    if (hdc != NULL) DeleteDC (hdc);
+}
+
+
+void ez_dib_fill_noalpha (Ez_uint8 *data, Ez_image *img, int src_x, int src_y,
+    int w, int h)
+{
+    int x, y, tx, ty, i, j, pitch = img->stride/4, dj = w*4;
+    double time1 = 0;
+
+    if (ez_image_debug()) time1 = ez_get_time ();
+
+    for (y = 0, ty = src_y * pitch,  j = 0; y < h; y++, ty += pitch, j += dj)
+    for (x = 0, tx = (ty + src_x)*4, i = j; x < w; x++, tx += 4, i += 4) {
+        data[i+3] = 0xff;
+        data[i+2] = img->pixels_rgba[tx];
+        data[i+1] = img->pixels_rgba[tx+1];
+        data[i  ] = img->pixels_rgba[tx+2];
+    }
+
+    if (ez_image_debug())
+        printf ("ez_dib_fill_noalpha %.3f ms\n", (ez_get_time() - time1)*1000);
+}
+
+
+void ez_dib_fill_opacity (Ez_uint8 *data, Ez_image *img, int src_x, int src_y,
+    int w, int h)
+{
+    int x, y, tx, ty, i, j, pitch = img->stride/4, dj = w*4;
+    double time1 = 0;
+
+    if (ez_image_debug()) time1 = ez_get_time ();
+
+    for (y = 0, ty = src_y * pitch,  j = 0; y < h; y++, ty += pitch, j += dj)
+    for (x = 0, tx = (ty + src_x)*4, i = j; x < w; x++, tx += 4, i += 4) {
+        if (img->pixels_rgba[tx+3] >= img->opacity) {
+            data[i+3] = 0xff;
+            data[i+2] = img->pixels_rgba[tx];
+            data[i+1] = img->pixels_rgba[tx+1];
+            data[i  ] = img->pixels_rgba[tx+2];
+        } else {
+            data[i+3] = 0;
+            data[i+2] = 0;
+            data[i+1] = 0;
+            data[i  ] = 0;
+        }
+    }
+
+    if (ez_image_debug())
+        printf ("ez_dib_fill_opacity %.3f ms\n", (ez_get_time() - time1)*1000);
+}
+
+
+void ez_dib_fill_truealpha (Ez_uint8 *data, Ez_image *img, int src_x, int src_y,
+    int w, int h)
+{
+    int x, y, tx, ty, i, j, pitch = img->stride/4, dj = w*4, a;
+    double time1 = 0;
+
+    if (ez_image_debug()) time1 = ez_get_time ();
+
+    for (y = 0, ty = src_y * pitch,  j = 0; y < h; y++, ty += pitch, j += dj)
+    for (x = 0, tx = (ty + src_x)*4, i = j; x < w; x++, tx += 4, i += 4) {
+        data[i+3] = a = img->pixels_rgba[tx+3];
+        data[i+2] = img->pixels_rgba[tx  ]*a/255;
+        data[i+1] = img->pixels_rgba[tx+1]*a/255;
+        data[i  ] = img->pixels_rgba[tx+2]*a/255;
+    }
+
+    if (ez_image_debug())
+        printf ("ez_dib_fill_truealpha %.3f ms\n", (ez_get_time() - time1)*1000);
+}
+
+#endif /* EZ_BASE_ */
+
+
+/*
+ * Print a rectangular region of the image img in the terminal.
+*/
+
+void ez_image_print_rgba (Ez_image *img, int src_x, int src_y, int w, int h)
+{
+    int x, y;
+    Ez_uint8 *p;
+
+    printf (" y,x ");
+    for (x = src_x; x < src_x+w; x++)
+        printf ("|      %4d      ", x);
+    printf ("\n");
+
+    for (y = src_y; y < src_y+h; y++) {
+        printf ("%4d ", y);
+        for (x = src_x; x < src_x+w; x++) {
+            p = EZ_IMAGE_PIXEL (img, x, y);
+            printf ("| %3d %3d %3d %3d", p[0], p[1], p[2], p[3]);
+        }
+        printf ("\n");
+    }
+}
+
+
+/*
+ * Fill image with a RGBA color
+*/
+
+void ez_image_comp_fill_rgba (Ez_image *img, Ez_uint8 r, Ez_uint8 g, Ez_uint8 b,
+    Ez_uint8 a)
+{
+    int x, y;
+    Ez_uint8 *p;
+
+    for (y = 0; y < img->height; y++)
+    for (x = 0, p = EZ_IMAGE_PIXEL (img, 0, y); x < img->width; x++, p += 4) {
+        p[0] = r;
+        p[1] = g;
+        p[2] = b;
+        p[3] = a;
+    }
+}
+
+
+/*
+ * Superimpose src into dst, without transparency
+*/
+
+void ez_image_comp_over (Ez_image *dst, Ez_image *src, int dst_x, int dst_y,
+    int src_x, int src_y, int w, int h)
+{
+    int y;
+    Ez_uint8 *src_p = EZ_IMAGE_PIXEL (src, src_x, src_y),
+             *dst_p = EZ_IMAGE_PIXEL (dst, dst_x, dst_y);
+    Ez_row_kernels *kernels = ez_row_get_kernels ();
+
+    for (y = 0; y < h; y++, src_p += src->stride, dst_p += dst->stride) {
+        if (src->premultiplied == dst->premultiplied)
+            memcpy (dst_p, src_p, w*4);
+        else if (dst->premultiplied)
+             kernels->premul (dst_p, src_p, w);
+        else ez_unpremul_row (dst_p, src_p, w);
+    }
+}
+
+
+/*
+ * Superimpose src into dst, with transparency. If dst is premultiplied,
+ * the rows are blended by the SIMD kernels, else in straight alpha; a row
+ * of src is converted if needed in a temporary row.
+*/
+
+void ez_image_comp_blend (Ez_image *dst, Ez_image *src, int dst_x, int dst_y,
+    int src_x, int src_y, int w, int h)
+{
+    int y;
+    Ez_uint8 *src_p = EZ_IMAGE_PIXEL (src, src_x, src_y),
+             *dst_p = EZ_IMAGE_PIXEL (dst, dst_x, dst_y),
+             *tmp = NULL;
+    Ez_row_kernels *kernels = ez_row_get_kernels ();
+
+    if (src->premultiplied != dst->premultiplied) {
+        tmp = malloc (w*4);
+        if (tmp == NULL) {
+            ez_error ("ez_image_comp_blend: out of memory\n");
+            return;
+        }
+    }
+
+    for (y = 0; y < h; y++, src_p += src->stride, dst_p += dst->stride) {
+        if (dst->premultiplied) {
+            if (tmp != NULL) kernels->premul (tmp, src_p, w);
+            kernels->blend (dst_p, tmp != NULL ? tmp : src_p, w);
+        } else {
+            if (tmp != NULL) ez_unpremul_row (tmp, src_p, w);
+            ez_blend_row_straight (dst_p, tmp != NULL ? tmp : src_p, w);
+        }
+    }
+    free (tmp);
+}
+
+
+/*
+ * Rows of n pixels in premultiplied alpha. x*a/255 is computed without
+ * division by EZ_DIV255, exact for x, a in 0..255. dst_p may be src_p.
+*/
+
+void ez_premul_row_c (Ez_uint8 *dst_p, Ez_uint8 *src_p, int n)
+{
+    int i, a;
+
+    for (i = 0; i < n; i++, src_p += 4, dst_p += 4) {
+        a = src_p[3];
+        dst_p[0] = EZ_DIV255 (src_p[0] * a);
+        dst_p[1] = EZ_DIV255 (src_p[1] * a);
+        dst_p[2] = EZ_DIV255 (src_p[2] * a);
+        dst_p[3] = a;
+    }
+}
+
+
+/*
+ * The division by alpha uses a table of 16 bits reciprocals.
+*/
+
+void ez_unpremul_row (Ez_uint8 *dst_p, Ez_uint8 *src_p, int n)
+{
+    static unsigned int recip[256];
+    unsigned int i, a, r, g, b;
+
+    if (recip[1] == 0)
+        for (a = 1; a < 256; a++) recip[a] = (255*65536 + a/2) / a;
+
+    for (i = 0; i < (unsigned) n; i++, src_p += 4, dst_p += 4) {
+        a = src_p[3];
+        r = (src_p[0] * recip[a] + 32768) >> 16;
+        g = (src_p[1] * recip[a] + 32768) >> 16;
+        b = (src_p[2] * recip[a] + 32768) >> 16;
+        dst_p[0] = r > 255 ? 255 : r;
+        dst_p[1] = g > 255 ? 255 : g;
+        dst_p[2] = b > 255 ? 255 : b;
+        dst_p[3] = a;
+    }
+}
+
+
+/*
+ * Source-over of the row src_p on the row dst_p, both in straight alpha.
+ * Only the partly transparent pixels of src need divisions.
+*/
+
+void ez_blend_row_straight (Ez_uint8 *dst_p, Ez_uint8 *src_p, int n)
+{
+    int i, sa, w, den;
+
+    for (i = 0; i < n; i++, src_p += 4, dst_p += 4) {
+        sa = src_p[3];
+        if (sa == 0) continue;
+        if (sa == 255 || dst_p[3] == 0) {
+            memcpy (dst_p, src_p, 4);
+            continue;
+        }
+        /* Weight of dst, and result alpha times 255 */
+        w = dst_p[3] * (255 - sa);
+        den = sa*255 + w;
+        dst_p[0] = (src_p[0]*sa*255 + dst_p[0]*w + den/2) / den;
+        dst_p[1] = (src_p[1]*sa*255 + dst_p[1]*w + den/2) / den;
+        dst_p[2] = (src_p[2]*sa*255 + dst_p[2]*w + den/2) / den;
+        dst_p[3] = (den + 127) / 255;
+    }
+}
+
+
+/*
+ * Source-over of the row src_p on the row dst_p, both premultiplied:
+ * dst = src + dst * (255 - src_alpha) / 255 for the 4 channels. The sums
+ * are saturated to 255 as in the SIMD kernels, for the colors greater
+ * than alpha.
+*/
+
+#define EZ_ADDS_U8(a, b)  ((a) + (b) > 255 ? 255 : (a) + (b))
+
+void ez_blend_row_c (Ez_uint8 *dst_p, Ez_uint8 *src_p, int n)
+{
+    int i, k;
+
+    for (i = 0; i < n; i++, src_p += 4, dst_p += 4) {
+        k = 255 - src_p[3];
+        if (k == 0) {
+            memcpy (dst_p, src_p, 4);
+            continue;
+        }
+        dst_p[0] = EZ_ADDS_U8 (src_p[0], EZ_DIV255 (dst_p[0] * k));
+        dst_p[1] = EZ_ADDS_U8 (src_p[1], EZ_DIV255 (dst_p[1] * k));
+        dst_p[2] = EZ_ADDS_U8 (src_p[2], EZ_DIV255 (dst_p[2] * k));
+        dst_p[3] = EZ_ADDS_U8 (src_p[3], EZ_DIV255 (dst_p[3] * k));
+    }
+}
+
+#undef EZ_ADDS_U8
+
+
+/*
+ * Compose src into dst with operator op. The rows are composed in
+ * premultiplied alpha; the rows of an image in straight alpha, or of src
+ * without alpha channel, are converted in temporary rows. For dst in
+ * straight alpha, only the pixels changed by op are converted back, so
+ * that the others are not degraded by the rounding of the conversions.
+*/
+
+void ez_image_comp_op (Ez_image *dst, Ez_image *src, int op,
+    int dst_x, int dst_y, int src_x, int src_y, int w, int h)
+{
+    int x, y, x1;
+    Ez_uint8 *src_p = EZ_IMAGE_PIXEL (src, src_x, src_y),
+             *dst_p = EZ_IMAGE_PIXEL (dst, dst_x, dst_y),
+             *tmp_s, *tmp_d, *tmp_o, *s_p, *d_p;
+    Ez_row_kernels *kernels = ez_row_get_kernels ();
+
+    tmp_s = malloc (w*4*3);
+    if (tmp_s == NULL) {
+        ez_error ("ez_image_comp_op: out of memory\n");
+        return;
+    }
+    tmp_d = tmp_s + w*4;
+    tmp_o = tmp_d + w*4;
+
+    for (y = 0; y < h; y++, src_p += src->stride, dst_p += dst->stride) {
+        s_p = src_p;
+        if (!src->has_alpha) {
+            memcpy (tmp_s, src_p, w*4);
+            for (x = 3; x < w*4; x += 4) tmp_s[x] = 255;
+            s_p = tmp_s;
+        } else if (!src->premultiplied) {
+            kernels->premul (tmp_s, src_p, w);
+            s_p = tmp_s;
+        }
+        if (dst->premultiplied) {
+            kernels->composite (op, dst_p, s_p, w, ez_comp_alpha);
+            continue;
+        }
+        kernels->premul (tmp_d, dst_p, w);
+        memcpy (tmp_o, tmp_d, w*4);
+        kernels->composite (op, tmp_d, s_p, w, ez_comp_alpha);
+
+        /* Convert back the runs of changed pixels */
+        for (x = 0; x < w; ) {
+            d_p = tmp_d + x*4;
+            if (memcmp (d_p, tmp_o + x*4, 4) == 0) { x++; continue; }
+            for (x1 = x++; x < w && memcmp (tmp_d + x*4, tmp_o + x*4, 4); x++);
+            ez_unpremul_row (dst_p + x1*4, d_p, x-x1);
+        }
+    }
+    free (tmp_s);
+}
+
+
+/*
+ * Compose the row src_p into the row dst_p, both premultiplied, with
+ * operator op, after multiplying src by alpha. In the formulas, the values
+ * are in 0..1; s, d are a channel and sa, da the alpha of src and dst.
+*/
+
+void ez_comp_row_c (int op, Ez_uint8 *dst_p, Ez_uint8 *src_p, int n,
+    int alpha)
+{
+    int i, c, s, d, sa, da, sd, ds, r;
+
+    for (i = 0; i < n; i++, src_p += 4, dst_p += 4) {
+        sa = EZ_DIV255 (src_p[3] * alpha);
+        da = dst_p[3];
+        for (c = 0; c < 4; c++) {
+            s = c == 3 ? sa : EZ_DIV255 (src_p[c] * alpha);
+            d = dst_p[c];
+            switch (op) {
+                case EZ_COMP_SRC  : r = s; break;
+                case EZ_COMP_OVER : r = s + EZ_DIV255 (d * (255-sa)); break;
+                case EZ_COMP_IN   : r = EZ_DIV255 (s * da); break;
+                case EZ_COMP_OUT  : r = EZ_DIV255 (s * (255-da)); break;
+                case EZ_COMP_ATOP : r = EZ_DIV255 (s * da) +
+                                        EZ_DIV255 (d * (255-sa)); break;
+                case EZ_COMP_XOR  : r = EZ_DIV255 (s * (255-da)) +
+                                        EZ_DIV255 (d * (255-sa)); break;
+                case EZ_COMP_ADD  : r = s + d; break;
+                case EZ_COMP_SCREEN : r = s + d - EZ_DIV255 (s * d); break;
+                default :
+                    /* s*(1-da) + d*(1-sa) + f(s,d); f(sa,da) = sa*da */
+                    r = EZ_DIV255 (s * (255-da)) + EZ_DIV255 (d * (255-sa));
+                    sd = EZ_DIV255 (s * da); ds = EZ_DIV255 (d * sa);
+                    if (c == 3 || op == EZ_COMP_MULTIPLY)
+                         r += EZ_DIV255 (s * d);
+                    else if (op == EZ_COMP_DARKEN)
+                         r += sd < ds ? sd : ds;
+                    else r += sd > ds ? sd : ds;
+            }
+            dst_p[c] = r > 255 ? 255 : r;
+        }
+    }
+}
+
+
+/*
+ * Extract a rectangular region from an image
+*/
+
+void ez_image_copy_sub (Ez_image *src, Ez_image *dest , int src_x, int src_y)
+{
+    int y;
+
+    for (y = 0; y < dest->height; y++)
+        memcpy (EZ_IMAGE_PIXEL (dest, 0, y), EZ_IMAGE_PIXEL (src, src_x, src_y+y),
+            dest->width*4);
+}
+
+
+/*
+ * Transformations
+*/
+
+void ez_image_comp_symv (Ez_image *src, Ez_image *dst)
+{
+    int dst_h = dst->height, dst_w = dst->width, x, y;
+    Ez_uint32 *src_p, *dst_p;
+
+    for (y = 0; y < dst_h; y++) {
+        src_p = (Ez_uint32 *) EZ_IMAGE_PIXEL (src, dst_w-1, y);
+        dst_p = (Ez_uint32 *) EZ_IMAGE_PIXEL (dst, 0, y);
+        for (x = 0; x < dst_w; x++)
+            dst_p[x] = *src_p--;
+    }
+}
+
+
+void ez_image_comp_symh (Ez_image *src, Ez_image *dst)
+{
+    int dst_h = dst->height, y;
+
+    for (y = 0; y < dst_h; y++)
+        memcpy (EZ_IMAGE_PIXEL (dst, 0, y), EZ_IMAGE_PIXEL (src, 0, dst_h-1-y),
+            dst->width*4);
+}
+
+
+void ez_image_expand (Ez_image *src, Ez_image *dst, double factor)
+{
+    int x, y;
+
+    for (y = 0; y < dst->height; y++)
+    for (x = 0; x < dst->width ; x++)
+        ez_bilinear_4points (src, EZ_IMAGE_PIXEL (dst, x, y),
+            x/factor, y/factor);
+}
+
+
+void ez_image_shrink (Ez_image *src, Ez_image *dst)
+{
+    double time1 = 0;
+
+    if (ez_image_debug()) time1 = ez_get_time ();
+
+    ez_image_resize_to (src, dst, EZ_RESIZE_AREA);
+
+    if (ez_image_debug())
+        printf ("ez_image_shrink %.3f ms\n", (ez_get_time() - time1)*1000);
+}
+
+
+void ez_rotate_get_size (double theta, int src_w, int src_h, int *dst_w, int *dst_h)
+{
+    double a = theta*M_PI/180, c = cos(a), s = sin(a),
+           w1 = fabs (c*src_w - s*src_h), h1 = fabs (s*src_w + c*src_h),
+           w2 = fabs (c*src_w + s*src_h), h2 = fabs (s*src_w - c*src_h);
+    *dst_w = EZ_ROUND (w1 > w2 ? w1 : w2);
+    *dst_h = EZ_ROUND (h1 > h2 ? h1 : h2);
+}
+
+
+void ez_rotate_get_coords (double theta, int src_w, int src_h, int src_x, int src_y,
+    int *dst_x, int *dst_y)
+{
+    double a = theta*M_PI/180, c = cos(a), s = sin(a);
+    double sx[4], sy[4], tx[4], ty[4], minx, miny;
+    int i;
+
+    /* Corners coordinates relative to the rotation center src */
+    sx[0] = 0     - src_x; sy[0] = 0     - src_y;
+    sx[1] = src_w - src_x; sy[1] = 0     - src_y;
+    sx[2] = src_w - src_x; sy[2] = src_h - src_y;
+    sx[3] = 0     - src_x; sy[3] = src_h - src_y;
+
+    /* Corners rotation */
+    for (i = 0; i < 4; i++) {
+        tx[i] = c*sx[i] - s*sy[i];
+        ty[i] = s*sx[i] + c*sy[i];
+    }
+
+    /* Research of min */
+    minx = tx[0];
+    miny = ty[0];
+    for (i = 1; i < 4; i++) {
+        if (tx[i] < minx) minx = tx[i];
+        if (ty[i] < miny) miny = ty[i];
+    }
+
+    *dst_x = EZ_ROUND (-minx);
+    *dst_y = EZ_ROUND (-miny);
+}
+
+
+/*
+ * Rotation kernels. The source coordinates of each row are computed once,
+ * then walked in 16.16 fixed point by ez_affine_row_nearest/bilinear.
+*/
+
+void ez_image_rotate_nearest (Ez_image *src, Ez_image *dst, double theta)
+{
+    double a = theta*M_PI/180, c = cos(-a), s = sin(-a);
+    int y, dy, dst_x, dst_y, du = EZ_FIX16 (c), dv = EZ_FIX16 (s);
+    Ez_row_kernels *kernels = ez_row_get_kernels ();
+
+    /* We set the rotation center to 0,0 and we retrieve the center
+       coordinates dst_x,dst_y in dst */
+    ez_rotate_get_coords (theta, src->width, src->height, 0, 0, &dst_x, &dst_y);
+
+    /* The antecedent is rounded to the closest integer by adding 0.5 */
+    for (y = 0, dy = -dst_y; y < dst->height; y++, dy++)
+        ez_affine_row_nearest (src, dst, y,
+            EZ_FIX16 (-c*dst_x - s*dy + 0.5), EZ_FIX16 (-s*dst_x + c*dy + 0.5),
+            du, dv, 0, kernels);
+}
+
+
+void ez_image_rotate_bilinear (Ez_image *src, Ez_image *dst, double theta)
+{
+    double a = theta*M_PI/180, c = cos(-a), s = sin(-a);
+    int y, dy, dst_x, dst_y, du = EZ_FIX16 (c), dv = EZ_FIX16 (s);
+    Ez_row_kernels *kernels = ez_row_get_kernels ();
+
+    /* We set the rotation center to 0,0 and we retrieve the center
+       coordinates dst_x,dst_y in dst */
+    ez_rotate_get_coords (theta, src->width, src->height, 0, 0, &dst_x, &dst_y);
+
+    for (y = 0, dy = -dst_y; y < dst->height; y++, dy++)
+        ez_affine_row_bilinear (src, dst, y,
+            EZ_FIX16 (-c*dst_x - s*dy), EZ_FIX16 (-s*dst_x + c*dy),
+            du, dv, 0, kernels);
+}
+
+
+void ez_bilinear_4points (Ez_image *src, Ez_uint8 *dst_p, double sx, double sy)
+{
+    double rx0, rx1, ry0, ry1, r00, r01, r10, r11;
+    int x0, y0, x1, y1, k00, k01, k10, k11,
+        src_w = src->width, src_h = src->height;
+    Ez_uint8 *src_p = src->pixels_rgba;
+
+    /* Antecedent outside? */
+    if (sx < -0.5 || sx >= src_w-0.5 || sy < -0.5 || sy >= src_h-0.5) {
+        dst_p[0] = dst_p[1] = dst_p[2] = dst_p[3] = 0;
+        return;
+    }
+
+    /* Neighbors of real antecedent reel on the grid */
+    x0 = sx < 0 ? sx-1 : sx; x1 = x0+1;
+    y0 = sy < 0 ? sy-1 : sy; y1 = y0+1;
+
+    /* Real distance */
+    rx0 = sx-x0; rx1 = x1-sx;
+    ry0 = sy-y0; ry1 = y1-sy;
+    r00 = ry0*rx0; r01 = ry0*rx1;
+    r10 = ry1*rx0; r11 = ry1*rx1;
+
+    /* Neighbours offsets */
+    k00 = y0 * src->stride + x0*4; k01 = k00 + 4;
+    k10 = k00 + src->stride;       k11 = k10 + 4;
+
+    /* Neighbour outside? We take the neighbour inside */
+    if      (x0 < 0     ) k00 = k01, k10 = k11;
+    else if (x1 >= src_w) k01 = k00, k11 = k10;
+    if      (y0 < 0     ) k00 = k10, k01 = k11;
+    else if (y1 >= src_h) k10 = k00, k11 = k01;
+
+    /* Bilinear interpolation of colors and alpha channel */
+    dst_p[0] = r11*src_p[k00  ] + r10*src_p[k01  ] + r01*src_p[k10  ] + r00*src_p[k11  ];
+    dst_p[1] = r11*src_p[k00+1] + r10*src_p[k01+1] + r01*src_p[k10+1] + r00*src_p[k11+1];
+    dst_p[2] = r11*src_p[k00+2] + r10*src_p[k01+2] + r01*src_p[k10+2] + r00*src_p[k11+2];
+    dst_p[3] = r11*src_p[k00+3] + r10*src_p[k01+3] + r01*src_p[k10+3] + r00*src_p[k11+3];
+}
+
+
+/*
+ * Separable resampling.
+ *
+ * The pixel i of a row (or column) of dst is computed from the pixels
+ * start[i]..start[i]+count[i]-1 of src, with the weights
+ * weight[i*taps]..weight[i*taps+count[i]-1], whose sum is 1 << EZ_WEIGHT_BITS.
+ * The rows of src are first resampled horizontally in a ring buffer of
+ * rows in fixed point 8.8; then the rows of dst are resampled vertically.
+ * The 4 channels are computed together in integer. The rows in 8.8 are
+ * clamped to 0..255<<8, so that the sums cannot overflow.
+*/
+
+int ez_weights_alloc (Ez_weights *wt, int n, int taps)
+{
+    wt->size = n; wt->taps = taps;
+    wt->start  = malloc (n * sizeof (int));
+    wt->count  = malloc (n * sizeof (int));
+    wt->weight = calloc ((size_t) n * taps, sizeof (int));
+    if (wt->start == NULL || wt->count == NULL || wt->weight == NULL) {
+        ez_error ("ez_weights_alloc: out of memory\n");
+        ez_weights_free (wt);
+        return -1;
+    }
+    return 0;
+}
+
+
+void ez_weights_free (Ez_weights *wt)
+{
+    free (wt->start);  wt->start  = NULL;
+    free (wt->count);  wt->count  = NULL;
+    free (wt->weight); wt->weight = NULL;
+}
+
+
+/*
+ * Convert the real weights of the pixel i, whose sum is not null, to
+ * integers whose sum is exactly 1 << EZ_WEIGHT_BITS.
+*/
+
+void ez_weights_normalize (Ez_weights *wt, int i, double *w)
+{
+    double sum = 0;
+    int k, total = 0, kmax = 0, *p = wt->weight + i*wt->taps;
+
+    for (k = 0; k < wt->count[i]; k++) sum += w[k];
+    for (k = 0; k < wt->count[i]; k++) {
+        p[k] = (int) floor (w[k] / sum * (1 << EZ_WEIGHT_BITS) + 0.5);
+        total += p[k];
+        if (p[k] > p[kmax]) kmax = k;
+    }
+    p[kmax] += (1 << EZ_WEIGHT_BITS) - total;
+}
+
+
+/*
+ * Weights of the area filter: the pixel i of dst covers the interval
+ * i*scale..(i+1)*scale of src, and each pixel of src is weighted by its
+ * overlap with this interval.
+ * Return 0 on success, -1 on error.
+*/
+
+int ez_weights_area (Ez_weights *wt, int src_n, int dst_n)
+{
+    double scale = (double) src_n / dst_n, a, b, *w;
+    int i, j, j1, j2, taps = (int) ceil (scale) + 1;
+
+    if (ez_weights_alloc (wt, dst_n, taps) < 0) return -1;
+    w = malloc (taps * sizeof (double));
+    if (w == NULL) {
+        ez_error ("ez_weights_area: out of memory\n");
+        ez_weights_free (wt);
+        return -1;
+    }
+
+    for (i = 0; i < dst_n; i++) {
+        a = i * scale; b = (i+1) * scale;
+        if (b > src_n) b = src_n;
+        j1 = (int) floor (a);
+        j2 = (int) ceil (b);
+        if (j2 > src_n) j2 = src_n;
+        if (j2 <= j1) j2 = j1+1;
+        for (j = j1; j < j2; j++)
+            w[j-j1] = (b < j+1 ? b : j+1) - (a > j ? a : j);
+        wt->start[i] = j1;
+        wt->count[i] = j2 - j1;
+        ez_weights_normalize (wt, i, w);
+    }
+    free (w);
+    return 0;
+}
+
+
+/*
+ * Value of the kernel of filter at distance t.
+*/
+
+double ez_resize_kernel (int filter, double t)
+{
+    t = fabs (t);
+    switch (filter) {
+        case EZ_RESIZE_BILINEAR :
+            return t < 1 ? 1-t : 0;
+        case EZ_RESIZE_BICUBIC :            /* Catmull-Rom, a = -0.5 */
+            if (t < 1) return (1.5*t - 2.5)*t*t + 1;
+            if (t < 2) return ((-0.5*t + 2.5)*t - 4)*t + 2;
+            return 0;
+        case EZ_RESIZE_LANCZOS3 :
+            if (t < 1e-8) return 1;
+            if (t >= 3) return 0;
+            return 3 * sin (M_PI*t) * sin (M_PI*t/3) / (M_PI*M_PI*t*t);
+    }
+    return 0;
+}
+
+
+/*
+ * Weights of filter for src_n pixels resized to dst_n. The pixel i of dst
+ * is centered on (i+0.5)*scale-0.5 in src; when shrinking, the kernel is
+ * stretched by scale. The taps outside src are folded on the edge pixels.
+ * Return 0 on success, -1 on error.
+*/
+
+int ez_weights_filter (Ez_weights *wt, int src_n, int dst_n, int filter)
+{
+    double scale = (double) src_n / dst_n, stretch, radius, center, *w;
+    int i, j, j1, j2, k, taps;
+
+    if (filter == EZ_RESIZE_AREA)
+        return ez_weights_area (wt, src_n, dst_n);
+
+    if (filter == EZ_RESIZE_NEAREST) {
+        if (ez_weights_alloc (wt, dst_n, 1) < 0) return -1;
+        for (i = 0; i < dst_n; i++) {
+            j = (int) floor ((i + 0.5) * scale);
+            wt->start[i] = j < src_n ? j : src_n-1;
+            wt->count[i] = 1;
+            wt->weight[i] = 1 << EZ_WEIGHT_BITS;
+        }
+        return 0;
+    }
+
+    radius = filter == EZ_RESIZE_BILINEAR ? 1 :
+             filter == EZ_RESIZE_BICUBIC  ? 2 : 3;
+    stretch = scale > 1 ? scale : 1;
+    radius *= stretch;
+    taps = (int) ceil (2*radius) + 1;
+    if (taps > src_n) taps = src_n;
+
+    if (ez_weights_alloc (wt, dst_n, taps) < 0) return -1;
+    w = malloc (taps * sizeof (double));
+    if (w == NULL) {
+        ez_error ("ez_weights_filter: out of memory\n");
+        ez_weights_free (wt);
+        return -1;
+    }
+
+    for (i = 0; i < dst_n; i++) {
+        center = (i + 0.5) * scale - 0.5;
+        j1 = (int) floor (center - radius) + 1;
+        j2 = (int) ceil  (center + radius) - 1;
+        wt->start[i] = j1 < 0 ? 0 : j1 >= src_n ? src_n-1 : j1;
+        k = (j2 < src_n ? j2 : src_n-1) - wt->start[i] + 1;
+        wt->count[i] = k < 1 ? 1 : k > taps ? taps : k;
+        for (k = 0; k < wt->count[i]; k++) w[k] = 0;
+        for (j = j1; j <= j2; j++) {
+            k = (j < 0 ? 0 : j >= src_n ? src_n-1 : j) - wt->start[i];
+            if (k >= wt->count[i]) k = wt->count[i]-1;
+            w[k] += ez_resize_kernel (filter, (j - center) / stretch);
+        }
+        ez_weights_normalize (wt, i, w);
+    }
+    free (w);
+    return 0;
+}
+
+
+/*
+ * Resample horizontally a row of src in a row of 4 channels in 8.8.
+*/
+
+void ez_resample_row_c (Ez_uint8 *src_p, int *dst_p, Ez_weights *wx)
+{
+    int i, k, n, *w, r, g, b, a;
+    Ez_uint8 *p;
+
+    for (i = 0; i < wx->size; i++, dst_p += 4) {
+        p = src_p + wx->start[i]*4;
+        w = wx->weight + i*wx->taps;
+        n = wx->count[i];
+        r = g = b = a = 1 << (EZ_WEIGHT_BITS-9);
+        for (k = 0; k < n; k++, p += 4) {
+            r += w[k] * p[0];
+            g += w[k] * p[1];
+            b += w[k] * p[2];
+            a += w[k] * p[3];
+        }
+        dst_p[0] = EZ_RESAMPLE_CLAMP (r >> (EZ_WEIGHT_BITS-8));
+        dst_p[1] = EZ_RESAMPLE_CLAMP (g >> (EZ_WEIGHT_BITS-8));
+        dst_p[2] = EZ_RESAMPLE_CLAMP (b >> (EZ_WEIGHT_BITS-8));
+        dst_p[3] = EZ_RESAMPLE_CLAMP (a >> (EZ_WEIGHT_BITS-8));
+    }
+}
+
+
+/*
+ * Compute the rows y1..y2-1 of dst, using the weights wx for the columns
+ * and wy for the rows.
+ * Return 0 on success, -1 on error.
+*/
+
+int ez_image_resample (Ez_image *src, Ez_image *dst, Ez_weights *wx,
+    Ez_weights *wy, int y1, int y2)
+{
+    int ring_n = wy->taps, row_n = dst->width*4, *ring, *tag, *acc, *row,
+        x, y, k, sy, w, shift = EZ_WEIGHT_BITS + 8;
+    Ez_uint8 *dst_p;
+    Ez_row_kernels *kernels = ez_row_get_kernels ();
+
+    /* ring_n rows of the ring buffer, then the accumulator row */
+    ring = malloc ((size_t) (ring_n+1) * row_n * sizeof (int));
+    tag  = malloc (ring_n * sizeof (int));
+    if (ring == NULL || tag == NULL) {
+        ez_error ("ez_image_resample: out of memory\n");
+        free (ring); free (tag);
+        return -1;
+    }
+    for (k = 0; k < ring_n; k++) tag[k] = -1;
+    acc = ring + ring_n*row_n;
+
+    for (y = y1; y < y2; y++) {
+
+        for (x = 0; x < row_n; x++) acc[x] = 1 << (shift-1);
+
+        for (k = 0; k < wy->count[y]; k++) {
+
+            /* Row of src resampled horizontally once, kept in the ring */
+            sy = wy->start[y] + k;
+            row = ring + (sy % ring_n)*row_n;
+            if (tag[sy % ring_n] != sy) {
+                kernels->resample (src->pixels_rgba + sy*src->stride, row, wx);
+                tag[sy % ring_n] = sy;
+            }
+
+            /* row_n is a multiple of 4: one pixel by step */
+            w = wy->weight[y*wy->taps + k];
+            for (x = 0; x < row_n; x += 4) {
+                acc[x  ] += w * row[x  ];
+                acc[x+1] += w * row[x+1];
+                acc[x+2] += w * row[x+2];
+                acc[x+3] += w * row[x+3];
+            }
+        }
+
+        dst_p = dst->pixels_rgba + y*dst->stride;
+        for (x = 0; x < row_n; x++) {
+            k = acc[x] >> shift;
+            dst_p[x] = k < 0 ? 0 : k > 255 ? 255 : k;
+        }
+    }
+
+    free (ring); free (tag);
+    return 0;
+}
+
+
+/*
+ * Number of threads to resample nrows rows: one by processor, with at
+ * least EZ_RESAMPLE_BAND_MIN rows by thread.
+*/
+
+int ez_resample_thread_nb (int nrows)
+{
+    int n, nproc = ez_cpu_nb ();
+
+    n = nrows / EZ_RESAMPLE_BAND_MIN;
+    return n < 1 ? 1 : n > nproc ? nproc : n;
+}
+
+
+#ifdef EZ_BASE_XLIB
+void *ez_resample_thread (void *arg)
+{
+    Ez_resample_band *band = arg;
+    band->result = ez_image_resample (band->src, band->dst, band->wx,
+        band->wy, band->y1, band->y2);
+    return NULL;
+}
+#elif defined EZ_BASE_WIN32
+DWORD WINAPI ez_resample_thread (LPVOID arg)
+{
+    Ez_resample_band *band = arg;
+    band->result = ez_image_resample (band->src, band->dst, band->wx,
+        band->wy, band->y1, band->y2);
+    return 0;
+}
+#endif /* EZ_BASE_ */
+
+
+/*
+ * Resample src in dst with weights wx, wy; the rows of dst are split in
+ * bands, each computed by a thread. The band 0 is computed by the caller.
+ * Return 0 on success, -1 on error.
+*/
+
+int ez_image_resample_bands (Ez_image *src, Ez_image *dst, Ez_weights *wx,
+    Ez_weights *wy)
+{
+    Ez_resample_band band[EZ_RESAMPLE_THREADS_MAX];
+    int i, n = ez_resample_thread_nb (dst->height), result = 0,
+        started[EZ_RESAMPLE_THREADS_MAX];
+#ifdef EZ_BASE_XLIB
+    pthread_t thread[EZ_RESAMPLE_THREADS_MAX];
+#elif defined EZ_BASE_WIN32
+    HANDLE thread[EZ_RESAMPLE_THREADS_MAX];
+#endif /* EZ_BASE_ */
+
+    ez_row_get_kernels ();       /* Initialized before the threads */
+
+    for (i = 0; i < n; i++) {
+        band[i].src = src; band[i].dst = dst;
+        band[i].wx = wx;   band[i].wy = wy;
+        band[i].y1 = (long) dst->height *  i    / n;
+        band[i].y2 = (long) dst->height * (i+1) / n;
+        band[i].result = -1;
+    }
+
+    /* A thread which cannot be started is computed by the caller */
+    for (i = 1; i < n; i++) {
+#ifdef EZ_BASE_XLIB
+        started[i] = pthread_create (&thread[i], NULL, ez_resample_thread,
+            &band[i]) == 0;
+#elif defined EZ_BASE_WIN32
+        thread[i] = CreateThread (NULL, 0, ez_resample_thread, &band[i], 0, NULL);
+        started[i] = thread[i] != NULL;
+#endif /* EZ_BASE_ */
+    }
+
+    ez_resample_thread (&band[0]);
+
+    for (i = 1; i < n; i++) {
+        if (!started[i]) {
+            ez_resample_thread (&band[i]);
+            continue;
+        }
+#ifdef EZ_BASE_XLIB
+        pthread_join (thread[i], NULL);
+#elif defined EZ_BASE_WIN32
+        WaitForSingleObject (thread[i], INFINITE);
+        CloseHandle (thread[i]);
+#endif /* EZ_BASE_ */
+    }
+
+    for (i = 0; i < n; i++)
+        if (band[i].result < 0) result = -1;
+    return result;
+}
+
+
+/*
+ * Resize src in dst, whose size is already set, with filter.
+ * Return 0 on success, -1 on error.
+*/
+
+int ez_image_resize_to (Ez_image *src, Ez_image *dst, int filter)
+{
+    Ez_weights wx, wy;
+    int result;
+
+    if (src->width == 0 || src->height == 0 ||
+        dst->width == 0 || dst->height == 0) return 0;
+
+    if (ez_weights_filter (&wx, src->width,  dst->width,  filter) < 0)
+        return -1;
+    if (ez_weights_filter (&wy, src->height, dst->height, filter) < 0) {
+        ez_weights_free (&wx);
+        return -1;
+    }
+    result = ez_image_resample_bands (src, dst, &wx, &wy);
+    ez_weights_free (&wx);
+    ez_weights_free (&wy);
+    return result;
+}
+
+
+/*
+ * Return the next level of the mipmap of img, of half size, computing it
+ * if needed; or NULL if img has a size 1x1 or on error.
+ * The whole pyramid takes at most a third of the size of the image.
+*/
+
+Ez_image *ez_mipmap_next (Ez_image *img)
+{
+    Ez_image *res;
+
+    if (img->mipmap != NULL) return img->mipmap;
+    if (img->width <= 1 && img->height <= 1) return NULL;
+
+    res = ez_image_create_uninit ((img->width+1)/2, (img->height+1)/2);
+    if (res == NULL) return NULL;
+    res->has_alpha  = img->has_alpha;
+    res->opacity    = img->opacity;
+    res->premultiplied = img->premultiplied;
+    res->has_mipmap = 1;
+
+    ez_mipmap_halve (img, res);
+    img->mipmap = res;
+    return res;
+}
+
+
+/*
+ * Average the blocks of 2x2 pixels of src in dst; on an odd size, the last
+ * column or row of src is repeated.
+*/
+
+void ez_mipmap_halve (Ez_image *src, Ez_image *dst)
+{
+    int x, y, c, x0, x1, sw = src->width;
+    Ez_uint8 *r0, *r1, *dst_p;
+
+    for (y = 0; y < dst->height; y++) {
+        r0 = EZ_IMAGE_PIXEL (src, 0, 2*y);
+        r1 = 2*y+1 < src->height ? r0 + src->stride : r0;
+        dst_p = EZ_IMAGE_PIXEL (dst, 0, y);
+        for (x = 0; x < dst->width; x++, dst_p += 4) {
+            x0 = 2*x*4;
+            x1 = 2*x+1 < sw ? x0+4 : x0;
+            for (c = 0; c < 4; c++)
+                dst_p[c] = (r0[x0+c] + r0[x1+c] + r1[x0+c] + r1[x1+c] + 2) >> 2;
+        }
+    }
+}
+
+
+/*
+ * Choose the level of the mipmap of img to shrink it by factors fx, fy:
+ * the smallest level which is still larger than the result, so that the
+ * remaining factors are in 0.5..1. Return img if it has no mipmap.
+*/
+
+Ez_image *ez_mipmap_select (Ez_image *img, double fx, double fy)
+{
+    Ez_image *level = img, *next;
+    double w = img->width * fx, h = img->height * fy;
+
+    if (!img->has_mipmap) return img;
+
+    while ((next = ez_mipmap_next (level)) != NULL &&
+           next->width >= w && next->height >= h)
+        level = next;
+    return level;
+}
+
+
+/*
+ * Affine transformation kernels. inv maps the center of each pixel of dst
+ * to the coordinates in src where the pixel is sampled. These coordinates
+ * are walked along each row in 16.16 fixed point, so the images must be
+ * smaller than 32768 pixels.
+*/
+
+void ez_image_transform_nearest (Ez_image *src, Ez_image *dst, const double inv[6])
+{
+    int y, du = EZ_FIX16 (inv[0]), dv = EZ_FIX16 (inv[3]);
+    Ez_row_kernels *kernels = ez_row_get_kernels ();
+
+    for (y = 0; y < dst->height; y++)
+        ez_affine_row_nearest (src, dst, y, EZ_FIX16 (inv[1]*y + inv[2]),
+            EZ_FIX16 (inv[4]*y + inv[5]), du, dv, !src->has_alpha, kernels);
+}
+
+
+void ez_image_transform_bilinear (Ez_image *src, Ez_image *dst, const double inv[6])
+{
+    int y, du = EZ_FIX16 (inv[0]), dv = EZ_FIX16 (inv[3]);
+    Ez_row_kernels *kernels = ez_row_get_kernels ();
+
+    /* The neighbors of the sample are between the pixel centers */
+    for (y = 0; y < dst->height; y++)
+        ez_affine_row_bilinear (src, dst, y, EZ_FIX16 (inv[1]*y + inv[2] - 0.5),
+            EZ_FIX16 (inv[4]*y + inv[5] - 0.5), du, dv, !src->has_alpha,
+            kernels);
+}
+
+
+/*
+ * Restrict the interval x1..x2-1 to the x such that lo <= a + x*d < hi.
+*/
+
+void ez_fix_span (int a, int d, int lo, int hi, int *x1, int *x2)
+{
+    long long n1, n2;
+
+    if (d == 0) {
+        if (a < lo || a >= hi) *x2 = *x1;
+        return;
+    }
+    if (d > 0) {
+        n1 = ez_div_floor ((long long) lo - a + d - 1, d);     /* ceil */
+        n2 = ez_div_floor ((long long) hi - a + d - 1, d);
+    } else {
+        n1 = ez_div_floor ((long long) a - hi, -d) + 1;
+        n2 = ez_div_floor ((long long) a - lo, -d) + 1;
+    }
+    if (n1 > *x1) *x1 = n1 > *x2 ? *x2 : n1;
+    if (n2 < *x2) *x2 = n2 < *x1 ? *x1 : n2;
+}
+
+
+long long ez_div_floor (long long a, long long b)
+{
+    return a >= 0 ? a / b : -((-a + b - 1) / b);
+}
+
+
+/*
+ * Compute the row y of dst by nearest neighbor: the pixel x of the row is
+ * the pixel (u + x*du) >> 16, (v + x*dv) >> 16 of src, or is transparent if
+ * it is outside src. The row is first clipped to the span of pixels inside
+ * src, so the kernel has no edge tests. If opaque is true, the alpha
+ * channel is set to 255.
+*/
+
+void ez_affine_row_nearest (Ez_image *src, Ez_image *dst, int y,
+    int u, int v, int du, int dv, int opaque, Ez_row_kernels *kernels)
+{
+    Ez_uint32 *dst_p = (Ez_uint32 *) (dst->pixels_rgba + y*dst->stride);
+    int x, x1 = 0, x2 = dst->width;
+
+    ez_fix_span (u, du, 0, src->width  << 16, &x1, &x2);
+    ez_fix_span (v, dv, 0, src->height << 16, &x1, &x2);
+
+    memset (dst_p, 0, x1*4);
+    memset (dst_p + x2, 0, (dst->width - x2)*4);
+    if (x1 >= x2) return;
+
+    kernels->nearest ((Ez_uint32 *) src->pixels_rgba,
+        src->stride/4, dst_p + x1, u + x1*du, v + x1*dv, du, dv, x2-x1);
+
+    if (opaque)
+        for (x = x1; x < x2; x++) ((Ez_uint8 *) (dst_p + x))[3] = 255;
+}
+
+
+/*
+ * Compute the row y of dst by bilinear interpolation: the pixel x of the row
+ * is interpolated at u + x*du, v + x*dv in src, the pixel centers being at
+ * integer coordinates. The pixels whose 4 neighbors are inside src are
+ * computed by the kernel without edge tests; on the border, the neighbors
+ * outside are replaced by the neighbors inside, and the samples further
+ * than half a pixel from src are transparent.
+*/
+
+void ez_affine_row_bilinear (Ez_image *src, Ez_image *dst, int y,
+    int u, int v, int du, int dv, int opaque, Ez_row_kernels *kernels)
+{
+    Ez_uint8 *dst_p = dst->pixels_rgba + y*dst->stride;
+    int x, x1 = 0, x2 = dst->width, xi, xj,
+        src_w = src->width, src_h = src->height;
+
+    ez_fix_span (u, du, -32768, (src_w << 16) - 32768, &x1, &x2);
+    ez_fix_span (v, dv, -32768, (src_h << 16) - 32768, &x1, &x2);
+
+    memset (dst_p, 0, x1*4);
+    memset (dst_p + x2*4, 0, (dst->width - x2)*4);
+    if (x1 >= x2) return;
+
+    xi = x1; xj = x2;
+    ez_fix_span (u, du, 0, (src_w-1) << 16, &xi, &xj);
+    ez_fix_span (v, dv, 0, (src_h-1) << 16, &xi, &xj);
+    if (xi >= xj) xi = xj = x2;
+
+    for (x = x1; x < xi; x++)
+        ez_bilinear_edge (src, dst_p + x*4, u + x*du, v + x*dv);
+    if (xi < xj)
+        kernels->bilinear (src->pixels_rgba, src->stride/4,
+            dst_p + xi*4, u + xi*du, v + xi*dv, du, dv, xj-xi);
+    for (x = xj; x < x2; x++)
+        ez_bilinear_edge (src, dst_p + x*4, u + x*du, v + x*dv);
+
+    if (opaque)
+        for (x = x1; x < x2; x++) dst_p[x*4+3] = 255;
+}
+
+
+/*
+ * Bilinear interpolation of a pixel on the border of src, at u,v in 16.16,
+ * with u,v >= -0.5.
+*/
+
+void ez_bilinear_edge (Ez_image *src, Ez_uint8 *dst_p, int u, int v)
+{
+    int x0 = ((u + 65536) >> 16) - 1, y0 = ((v + 65536) >> 16) - 1,
+        fx = (u >> 8) & 255, fy = (v >> 8) & 255,
+        src_w = src->width, src_h = src->height, k00, k01, k10, k11, i, h0, h1;
+    Ez_uint8 *src_p = src->pixels_rgba;
+
+    k00 = y0 * src->stride + x0*4; k01 = k00 + 4;
+    k10 = k00 + src->stride;       k11 = k10 + 4;
+
+    /* Neighbour outside? We take the neighbour inside */
+    if      (x0 < 0       ) k00 = k01, k10 = k11;
+    else if (x0+1 >= src_w) k01 = k00, k11 = k10;
+    if      (y0 < 0       ) k00 = k10, k01 = k11;
+    else if (y0+1 >= src_h) k10 = k00, k11 = k01;
+
+    for (i = 0; i < 4; i++) {
+        h0 = (src_p[k00+i]*(256-fx) + src_p[k01+i]*fx + 128) >> 8;
+        h1 = (src_p[k10+i]*(256-fx) + src_p[k11+i]*fx + 128) >> 8;
+        dst_p[i] = (h0*(256-fy) + h1*fy + 128) >> 8;
+    }
+}
+
+
+/*
+ * Row kernels, without edge tests; src_pitch is the number of pixels
+ * between two rows of src. The scalar versions are portable, the
+ * SSE2 and AVX2 versions are chosen at runtime on x86 with gcc.
+*/
+
+void ez_row_nearest_c (Ez_uint32 *src_p, int src_pitch, Ez_uint32 *dst_p,
+    int u, int v, int du, int dv, int n)
+{
+    for (; n > 0; n--, u += du, v += dv)
+        *dst_p++ = src_p[(v >> 16) * src_pitch + (u >> 16)];
+}
+
+
+void ez_row_bilinear_c (Ez_uint8 *src_p, int src_pitch, Ez_uint8 *dst_p,
+    int u, int v, int du, int dv, int n)
+{
+    int i, fx, fy, h0, h1;
+    Ez_uint8 *p, *q;
+
+    for (; n > 0; n--, u += du, v += dv, dst_p += 4) {
+        p = src_p + ((v >> 16) * src_pitch + (u >> 16))*4;
+        q = p + src_pitch*4;
+        fx = (u >> 8) & 255;
+        fy = (v >> 8) & 255;
+        for (i = 0; i < 4; i++) {
+            h0 = (p[i]*(256-fx) + p[i+4]*fx + 128) >> 8;
+            h1 = (q[i]*(256-fx) + q[i+4]*fx + 128) >> 8;
+            dst_p[i] = (h0*(256-fy) + h1*fy + 128) >> 8;
+        }
+    }
+}
+
+
+#ifdef EZ_SIMD_X86
+
+/*
+ * SSE2: the 4 channels of the 2 rows of neighbors are interpolated
+ * together in 16 bits lanes; 4 pixels are stored at once.
+*/
+
+__attribute__((target("sse2")))
+static __m128i ez_bilinear_sse2 (Ez_uint8 *src_p, int src_pitch, int u, int v)
+{
+    Ez_uint8 *p = src_p + ((v >> 16) * src_pitch + (u >> 16))*4;
+    __m128i zero = _mm_setzero_si128(), round = _mm_set1_epi16 (128),
+            fx = _mm_set1_epi16 ((u >> 8) & 255),
+            fy = _mm_set1_epi16 ((v >> 8) & 255),
+            k256 = _mm_set1_epi16 (256), a, b, h;
+
+    /* p00 p10 p01 p11 */
+    a = _mm_unpacklo_epi32 (_mm_loadl_epi64 ((__m128i *) p),
+                            _mm_loadl_epi64 ((__m128i *) (p + src_pitch*4)));
+    b = _mm_unpackhi_epi8 (a, zero);
+    a = _mm_unpacklo_epi8 (a, zero);
+
+    /* Horizontal, then vertical interpolation */
+    h = _mm_add_epi16 (_mm_mullo_epi16 (a, _mm_sub_epi16 (k256, fx)),
+                       _mm_mullo_epi16 (b, fx));
+    h = _mm_srli_epi16 (_mm_add_epi16 (h, round), 8);
+    h = _mm_add_epi16 (_mm_mullo_epi16 (h, _mm_sub_epi16 (k256, fy)),
+                       _mm_mullo_epi16 (_mm_srli_si128 (h, 8), fy));
+    return _mm_srli_epi16 (_mm_add_epi16 (h, round), 8);
+}
+
+
+__attribute__((target("sse2")))
+void ez_row_bilinear_sse2 (Ez_uint8 *src_p, int src_pitch, Ez_uint8 *dst_p,
+    int u, int v, int du, int dv, int n)
+{
+    __m128i r0, r1, r2, r3;
+
+    for (; n >= 4; n -= 4, dst_p += 16) {
+        r0 = ez_bilinear_sse2 (src_p, src_pitch, u, v); u += du; v += dv;
+        r1 = ez_bilinear_sse2 (src_p, src_pitch, u, v); u += du; v += dv;
+        r2 = ez_bilinear_sse2 (src_p, src_pitch, u, v); u += du; v += dv;
+        r3 = ez_bilinear_sse2 (src_p, src_pitch, u, v); u += du; v += dv;
+        _mm_storeu_si128 ((__m128i *) dst_p,
+            _mm_packus_epi16 (_mm_unpacklo_epi64 (r0, r1),
+                              _mm_unpacklo_epi64 (r2, r3)));
+    }
+    ez_row_bilinear_c (src_p, src_pitch, dst_p, u, v, du, dv, n);
+}
+
+
+/*
+ * AVX2: 8 pixels at once, the neighbors are gathered.
+*/
+
+__attribute__((target("avx2")))
+void ez_row_nearest_avx2 (Ez_uint32 *src_p, int src_pitch, Ez_uint32 *dst_p,
+    int u, int v, int du, int dv, int n)
+{
+    __m256i steps = _mm256_setr_epi32 (0, 1, 2, 3, 4, 5, 6, 7),
+            vu = _mm256_add_epi32 (_mm256_set1_epi32 (u),
+                     _mm256_mullo_epi32 (steps, _mm256_set1_epi32 (du))),
+            vv = _mm256_add_epi32 (_mm256_set1_epi32 (v),
+                     _mm256_mullo_epi32 (steps, _mm256_set1_epi32 (dv))),
+            du8 = _mm256_set1_epi32 (du*8), dv8 = _mm256_set1_epi32 (dv*8),
+            w = _mm256_set1_epi32 (src_pitch), idx;
+
+    for (; n >= 8; n -= 8, dst_p += 8, u += du*8, v += dv*8) {
+        idx = _mm256_add_epi32 (
+                  _mm256_mullo_epi32 (_mm256_srai_epi32 (vv, 16), w),
+                  _mm256_srai_epi32 (vu, 16));
+        _mm256_storeu_si256 ((__m256i *) dst_p,
+            _mm256_i32gather_epi32 ((const int *) src_p, idx, 4));
+        vu = _mm256_add_epi32 (vu, du8);
+        vv = _mm256_add_epi32 (vv, dv8);
+    }
+    ez_row_nearest_c (src_p, src_pitch, dst_p, u, v, du, dv, n);
+}
+
+
+__attribute__((target("avx2")))
+void ez_row_bilinear_avx2 (Ez_uint8 *src_p, int src_pitch, Ez_uint8 *dst_p,
+    int u, int v, int du, int dv, int n)
+{
+    __m256i steps = _mm256_setr_epi32 (0, 1, 2, 3, 4, 5, 6, 7),
+            vu = _mm256_add_epi32 (_mm256_set1_epi32 (u),
+                     _mm256_mullo_epi32 (steps, _mm256_set1_epi32 (du))),
+            vv = _mm256_add_epi32 (_mm256_set1_epi32 (v),
+                     _mm256_mullo_epi32 (steps, _mm256_set1_epi32 (dv))),
+            du8 = _mm256_set1_epi32 (du*8), dv8 = _mm256_set1_epi32 (dv*8),
+            w = _mm256_set1_epi32 (src_pitch), one = _mm256_set1_epi32 (1),
+            m255 = _mm256_set1_epi32 (255), k256 = _mm256_set1_epi16 (256),
+            round = _mm256_set1_epi16 (128), zero = _mm256_setzero_si256 (),
+            idx, fx, fy, p00, p01, p10, p11, fxl, fxh, fyl, fyh, t, b, rl, rh;
+    const int *src_i = (const int *) src_p;
+
+    for (; n >= 8; n -= 8, dst_p += 32, u += du*8, v += dv*8) {
+        idx = _mm256_add_epi32 (
+                  _mm256_mullo_epi32 (_mm256_srai_epi32 (vv, 16), w),
+                  _mm256_srai_epi32 (vu, 16));
+        p00 = _mm256_i32gather_epi32 (src_i, idx, 4);
+        p01 = _mm256_i32gather_epi32 (src_i, _mm256_add_epi32 (idx, one), 4);
+        idx = _mm256_add_epi32 (idx, w);
+        p10 = _mm256_i32gather_epi32 (src_i, idx, 4);
+        p11 = _mm256_i32gather_epi32 (src_i, _mm256_add_epi32 (idx, one), 4);
+
+        /* Weights repeated in the 4 channels of each pixel */
+        fx = _mm256_and_si256 (_mm256_srai_epi32 (vu, 8), m255);
+        fy = _mm256_and_si256 (_mm256_srai_epi32 (vv, 8), m255);
+        fx = _mm256_or_si256 (fx, _mm256_slli_epi32 (fx, 16));
+        fy = _mm256_or_si256 (fy, _mm256_slli_epi32 (fy, 16));
+        fxl = _mm256_unpacklo_epi32 (fx, fx); fxh = _mm256_unpackhi_epi32 (fx, fx);
+        fyl = _mm256_unpacklo_epi32 (fy, fy); fyh = _mm256_unpackhi_epi32 (fy, fy);
+
+#define EZ_LERP(a, b, f) \
+        _mm256_srli_epi16 (_mm256_add_epi16 (_mm256_add_epi16 ( \
+            _mm256_mullo_epi16 (a, _mm256_sub_epi16 (k256, f)), \
+            _mm256_mullo_epi16 (b, f)), round), 8)
+
+        t = EZ_LERP (_mm256_unpacklo_epi8 (p00, zero),
+                     _mm256_unpacklo_epi8 (p01, zero), fxl);
+        b = EZ_LERP (_mm256_unpacklo_epi8 (p10, zero),
+                     _mm256_unpacklo_epi8 (p11, zero), fxl);
+        rl = EZ_LERP (t, b, fyl);
+        t = EZ_LERP (_mm256_unpackhi_epi8 (p00, zero),
+                     _mm256_unpackhi_epi8 (p01, zero), fxh);
+        b = EZ_LERP (_mm256_unpackhi_epi8 (p10, zero),
+                     _mm256_unpackhi_epi8 (p11, zero), fxh);
+        rh = EZ_LERP (t, b, fyh);
+#undef EZ_LERP
+
+        _mm256_storeu_si256 ((__m256i *) dst_p, _mm256_packus_epi16 (rl, rh));
+        vu = _mm256_add_epi32 (vu, du8);
+        vv = _mm256_add_epi32 (vv, dv8);
+    }
+    ez_row_bilinear_c (src_p, src_pitch, dst_p, u, v, du, dv, n);
+}
+
+
+/*
+ * SSE2: the taps are taken by pairs; the channels of 2 neighbor pixels
+ * are interleaved in 16 bits, then multiplied by their weights and
+ * summed with pmaddwd. The weights must fit in 16 bits.
+*/
+
+__attribute__((target("sse2")))
+void ez_resample_row_sse2 (Ez_uint8 *src_p, int *dst_p, Ez_weights *wx)
+{
+    int i, k, n, *w;
+    Ez_uint8 *p;
+    __m128i zero = _mm_setzero_si128 (),
+        round = _mm_set1_epi32 (1 << (EZ_WEIGHT_BITS-9)),
+        max = _mm_set1_epi32 (255 << 8), acc, x;
+
+    for (i = 0; i < wx->size; i++, dst_p += 4) {
+        p = src_p + wx->start[i]*4;
+        w = wx->weight + i*wx->taps;
+        n = wx->count[i];
+        acc = round;
+        for (k = 0; k+1 < n; k += 2, p += 8) {
+            x = _mm_unpacklo_epi8 (_mm_loadl_epi64 ((__m128i *) p), zero);
+            x = _mm_unpacklo_epi16 (x, _mm_srli_si128 (x, 8));
+            acc = _mm_add_epi32 (acc, _mm_madd_epi16 (x,
+                _mm_set1_epi32 ((int) ((unsigned) w[k+1] << 16 | (w[k] & 0xffff)))));
+        }
+        if (k < n) {
+            x = _mm_unpacklo_epi8 (_mm_cvtsi32_si128 (*(int *) p), zero);
+            x = _mm_unpacklo_epi16 (x, zero);
+            acc = _mm_add_epi32 (acc, _mm_madd_epi16 (x,
+                _mm_set1_epi32 (w[k] & 0xffff)));
+        }
+        /* Clamp to 0..255<<8, the weights of a filter may be negative */
+        acc = _mm_srai_epi32 (acc, EZ_WEIGHT_BITS-8);
+        acc = _mm_andnot_si128 (_mm_srai_epi32 (acc, 31), acc);
+        x = _mm_cmpgt_epi32 (acc, max);
+        acc = _mm_or_si128 (_mm_andnot_si128 (x, acc), _mm_and_si128 (x, max));
+        _mm_storeu_si128 ((__m128i *) dst_p, acc);
+    }
+}
+
+
+/*
+ * SSE2 and AVX2: the pixels are unpacked in 16 bits, the alpha of each
+ * pixel is broadcast on its 4 channels, and x*a/255 is computed as in
+ * EZ_DIV255. The remaining pixels are done by the C kernels.
+*/
+
+#define EZ_DIV255_EPI16(x, add, srli) \
+    srli (add (x, srli (x, 8)), 8)
+
+__attribute__((target("sse2")))
+static __m128i ez_premul_sse2 (__m128i c, __m128i keep, __m128i one)
+{
+    __m128i a = _mm_shufflehi_epi16 (_mm_shufflelo_epi16 (c, 0xff), 0xff);
+    /* a is 255 on the alpha channel, so that alpha is unchanged */
+    a = _mm_or_si128 (_mm_and_si128 (a, keep), _mm_andnot_si128 (keep,
+        _mm_set1_epi16 (255)));
+    c = _mm_add_epi16 (_mm_mullo_epi16 (c, a), one);
+    return EZ_DIV255_EPI16 (c, _mm_add_epi16, _mm_srli_epi16);
+}
+
+
+__attribute__((target("sse2")))
+void ez_premul_row_sse2 (Ez_uint8 *dst_p, Ez_uint8 *src_p, int n)
+{
+    __m128i zero = _mm_setzero_si128 (), one = _mm_set1_epi16 (0x80),
+        keep = _mm_set_epi16 (0, -1, -1, -1, 0, -1, -1, -1), s;
+    int i;
+
+    for (i = 0; i+4 <= n; i += 4, src_p += 16, dst_p += 16) {
+        s = _mm_loadu_si128 ((__m128i *) src_p);
+        s = _mm_packus_epi16 (
+            ez_premul_sse2 (_mm_unpacklo_epi8 (s, zero), keep, one),
+            ez_premul_sse2 (_mm_unpackhi_epi8 (s, zero), keep, one));
+        _mm_storeu_si128 ((__m128i *) dst_p, s);
+    }
+    ez_premul_row_c (dst_p, src_p, n-i);
+}
+
+
+__attribute__((target("sse2")))
+static __m128i ez_blend_sse2 (__m128i s, __m128i d, __m128i one)
+{
+    __m128i k = _mm_shufflehi_epi16 (_mm_shufflelo_epi16 (s, 0xff), 0xff);
+    k = _mm_sub_epi16 (_mm_set1_epi16 (255), k);
+    d = _mm_add_epi16 (_mm_mullo_epi16 (d, k), one);
+    return EZ_DIV255_EPI16 (d, _mm_add_epi16, _mm_srli_epi16);
+}
+
+
+__attribute__((target("sse2")))
+void ez_blend_row_sse2 (Ez_uint8 *dst_p, Ez_uint8 *src_p, int n)
+{
+    __m128i zero = _mm_setzero_si128 (), one = _mm_set1_epi16 (0x80), s, d;
+    int i;
+
+    for (i = 0; i+4 <= n; i += 4, src_p += 16, dst_p += 16) {
+        s = _mm_loadu_si128 ((__m128i *) src_p);
+        d = _mm_loadu_si128 ((__m128i *) dst_p);
+        d = _mm_packus_epi16 (
+            ez_blend_sse2 (_mm_unpacklo_epi8 (s, zero),
+                           _mm_unpacklo_epi8 (d, zero), one),
+            ez_blend_sse2 (_mm_unpackhi_epi8 (s, zero),
+                           _mm_unpackhi_epi8 (d, zero), one));
+        _mm_storeu_si128 ((__m128i *) dst_p, _mm_adds_epu8 (s, d));
+    }
+    ez_blend_row_c (dst_p, src_p, n-i);
+}
+
+
+__attribute__((target("avx2")))
+static __m256i ez_premul_avx2 (__m256i c, __m256i keep, __m256i one)
+{
+    __m256i a = _mm256_shufflehi_epi16 (_mm256_shufflelo_epi16 (c, 0xff), 0xff);
+    a = _mm256_or_si256 (_mm256_and_si256 (a, keep), _mm256_andnot_si256 (keep,
+        _mm256_set1_epi16 (255)));
+    c = _mm256_add_epi16 (_mm256_mullo_epi16 (c, a), one);
+    return EZ_DIV255_EPI16 (c, _mm256_add_epi16, _mm256_srli_epi16);
+}
+
+
+__attribute__((target("avx2")))
+void ez_premul_row_avx2 (Ez_uint8 *dst_p, Ez_uint8 *src_p, int n)
+{
+    __m256i zero = _mm256_setzero_si256 (), one = _mm256_set1_epi16 (0x80),
+        keep = _mm256_set_epi16 (0, -1, -1, -1, 0, -1, -1, -1,
+                                 0, -1, -1, -1, 0, -1, -1, -1), s;
+    int i;
+
+    /* unpack and pack work in each 128 bits lane, so the order is kept */
+    for (i = 0; i+8 <= n; i += 8, src_p += 32, dst_p += 32) {
+        s = _mm256_loadu_si256 ((__m256i *) src_p);
+        s = _mm256_packus_epi16 (
+            ez_premul_avx2 (_mm256_unpacklo_epi8 (s, zero), keep, one),
+            ez_premul_avx2 (_mm256_unpackhi_epi8 (s, zero), keep, one));
+        _mm256_storeu_si256 ((__m256i *) dst_p, s);
+    }
+    ez_premul_row_c (dst_p, src_p, n-i);
+}
 
-    /* Draw pixels in xi->data */
-    xi_func (xi, img, src_x, src_y, w, h);
 
-    return xi;
+__attribute__((target("avx2")))
+static __m256i ez_blend_avx2 (__m256i s, __m256i d, __m256i one)
+{
+    __m256i k = _mm256_shufflehi_epi16 (_mm256_shufflelo_epi16 (s, 0xff), 0xff);
+    k = _mm256_sub_epi16 (_mm256_set1_epi16 (255), k);
+    d = _mm256_add_epi16 (_mm256_mullo_epi16 (d, k), one);
+    return EZ_DIV255_EPI16 (d, _mm256_add_epi16, _mm256_srli_epi16);
 }
 
 
-ez_xi_func ez_xi_get_func (void)
+__attribute__((target("avx2")))
+void ez_blend_row_avx2 (Ez_uint8 *dst_p, Ez_uint8 *src_p, int n)
 {
-    static ez_xi_func xi_func = NULL;
-
-    if (xi_func != NULL) return xi_func;
-    xi_func = ez_xi_fill_default;
+    __m256i zero = _mm256_setzero_si256 (), one = _mm256_set1_epi16 (0x80),
+        s, d;
+    int i;
 
-    if (ezx.depth == 24)
-    {
-        Ez_image *img = ez_xi_test_create ();
-        XImage *xi1 = ez_xi_create (img, 0, 0, img->width, img->height,
-            ez_xi_fill_default);
-        XImage *xi2 = ez_xi_create (img, 0, 0, img->width, img->height,
-            ez_xi_fill_24);
+    for (i = 0; i+8 <= n; i += 8, src_p += 32, dst_p += 32) {
+        s = _mm256_loadu_si256 ((__m256i *) src_p);
+        d = _mm256_loadu_si256 ((__m256i *) dst_p);
+        d = _mm256_packus_epi16 (
+            ez_blend_avx2 (_mm256_unpacklo_epi8 (s, zero),
+                           _mm256_unpacklo_epi8 (d, zero), one),
+            ez_blend_avx2 (_mm256_unpackhi_epi8 (s, zero),
+                           _mm256_unpackhi_epi8 (d, zero), one));
+        _mm256_storeu_si256 ((__m256i *) dst_p, _mm256_adds_epu8 (s, d));
+    }
+    ez_blend_row_c (dst_p, src_p, n-i);
+}
 
-        if (ez_xi_diff (xi1, xi2) == 0)
-            xi_func = ez_xi_fill_24;
 
-        XDestroyImage (xi1);
-        XDestroyImage (xi2);
-        ez_image_destroy (img);
-    }
+/*
+ * SSE2 compositing: 2 pixels in 16 bits by vector, the formulas of
+ * ez_comp_row_c with EZ_DIV255 on the products. The sums above 255 are
+ * saturated when packing. Each operator has its own loop.
+*/
 
-    return xi_func;
+__attribute__((target("sse2")))
+static __m128i ez_mul255_sse2 (__m128i a, __m128i b)
+{
+    a = _mm_add_epi16 (_mm_mullo_epi16 (a, b), _mm_set1_epi16 (0x80));
+    return EZ_DIV255_EPI16 (a, _mm_add_epi16, _mm_srli_epi16);
 }
 
 
-void ez_xi_fill_default (XImage *xi, Ez_image *img, int src_x, int src_y,
-    int w, int h)
+__attribute__((target("sse2")))
+static __m128i ez_alpha_sse2 (__m128i c)
 {
-    int x, y, tx, ty, img_w = img->width;
-    Ez_uint8 cr, cg, cb;
-    double time1 = 0;
+    return _mm_shufflehi_epi16 (_mm_shufflelo_epi16 (c, 0xff), 0xff);
+}
 
-    if (ez_image_debug()) time1 = ez_get_time ();
 
-    for (y = 0, ty = src_y * img_w; y < h; y++, ty += img_w)
-    for (x = 0, tx = (ty + src_x)*4; x < w; x++, tx += 4) {
-        cr = img->pixels_rgba[tx];
-        cg = img->pixels_rgba[tx+1];
-        cb = img->pixels_rgba[tx+2];
-        XPutPixel (xi, x, y, ez_get_RGB (cr, cg, cb));
+__attribute__((target("sse2")))
+static __m128i ez_comp_sse2 (int op, __m128i s, __m128i d)
+{
+    __m128i sa = ez_alpha_sse2 (s), da = ez_alpha_sse2 (d),
+            full = _mm_set1_epi16 (255),
+            isa = _mm_sub_epi16 (full, sa), ida = _mm_sub_epi16 (full, da),
+            keep = _mm_set_epi16 (0, -1, -1, -1, 0, -1, -1, -1), sd, ds, f;
+
+    switch (op) {
+        case EZ_COMP_SRC  : return s;
+        case EZ_COMP_OVER : return _mm_add_epi16 (s, ez_mul255_sse2 (d, isa));
+        case EZ_COMP_IN   : return ez_mul255_sse2 (s, da);
+        case EZ_COMP_OUT  : return ez_mul255_sse2 (s, ida);
+        case EZ_COMP_ATOP : return _mm_add_epi16 (ez_mul255_sse2 (s, da),
+                                                  ez_mul255_sse2 (d, isa));
+        case EZ_COMP_XOR  : return _mm_add_epi16 (ez_mul255_sse2 (s, ida),
+                                                  ez_mul255_sse2 (d, isa));
+        case EZ_COMP_ADD  : return _mm_add_epi16 (s, d);
+        case EZ_COMP_SCREEN : return _mm_sub_epi16 (_mm_add_epi16 (s, d),
+                                                    ez_mul255_sse2 (s, d));
     }
+    f = ez_mul255_sse2 (s, d);
+    if (op != EZ_COMP_MULTIPLY) {
+        sd = ez_mul255_sse2 (s, da);
+        ds = ez_mul255_sse2 (d, sa);
+        sd = op == EZ_COMP_DARKEN ? _mm_min_epi16 (sd, ds) : _mm_max_epi16 (sd, ds);
+        /* The alpha channel is always sa*da */
+        f = _mm_or_si128 (_mm_and_si128 (keep, sd), _mm_andnot_si128 (keep, f));
+    }
+    return _mm_add_epi16 (_mm_add_epi16 (ez_mul255_sse2 (s, ida),
+                          ez_mul255_sse2 (d, isa)), f);
+}
 
-    if (ez_image_debug())
-        printf ("ez_xi_fill_default %.3f ms\n", (ez_get_time() - time1)*1000);
+
+#define EZ_COMP_ROW_SSE2(name, op) \
+__attribute__((target("sse2"))) \
+static void name (Ez_uint8 *dst_p, Ez_uint8 *src_p, int n, int alpha) \
+{ \
+    __m128i zero = _mm_setzero_si128 (), a16 = _mm_set1_epi16 (alpha), \
+        s, d, s0, s1; \
+    int i; \
+    for (i = 0; i+4 <= n; i += 4, src_p += 16, dst_p += 16) { \
+        s = _mm_loadu_si128 ((__m128i *) src_p); \
+        d = _mm_loadu_si128 ((__m128i *) dst_p); \
+        s0 = _mm_unpacklo_epi8 (s, zero); \
+        s1 = _mm_unpackhi_epi8 (s, zero); \
+        if (alpha < 255) { \
+            s0 = ez_mul255_sse2 (s0, a16); \
+            s1 = ez_mul255_sse2 (s1, a16); \
+        } \
+        d = _mm_packus_epi16 ( \
+            ez_comp_sse2 (op, s0, _mm_unpacklo_epi8 (d, zero)), \
+            ez_comp_sse2 (op, s1, _mm_unpackhi_epi8 (d, zero))); \
+        _mm_storeu_si128 ((__m128i *) dst_p, d); \
+    } \
+    ez_comp_row_c (op, dst_p, src_p, n-i, alpha); \
 }
 
+EZ_COMP_ROW_SSE2 (ez_comp_src_sse2,      EZ_COMP_SRC)
+EZ_COMP_ROW_SSE2 (ez_comp_over_sse2,     EZ_COMP_OVER)
+EZ_COMP_ROW_SSE2 (ez_comp_in_sse2,       EZ_COMP_IN)
+EZ_COMP_ROW_SSE2 (ez_comp_out_sse2,      EZ_COMP_OUT)
+EZ_COMP_ROW_SSE2 (ez_comp_atop_sse2,     EZ_COMP_ATOP)
+EZ_COMP_ROW_SSE2 (ez_comp_xor_sse2,      EZ_COMP_XOR)
+EZ_COMP_ROW_SSE2 (ez_comp_add_sse2,      EZ_COMP_ADD)
+EZ_COMP_ROW_SSE2 (ez_comp_multiply_sse2, EZ_COMP_MULTIPLY)
+EZ_COMP_ROW_SSE2 (ez_comp_screen_sse2,   EZ_COMP_SCREEN)
+EZ_COMP_ROW_SSE2 (ez_comp_darken_sse2,   EZ_COMP_DARKEN)
+EZ_COMP_ROW_SSE2 (ez_comp_lighten_sse2,  EZ_COMP_LIGHTEN)
 
-/* Speed gain compared to fill_default: 50% */
 
-void ez_xi_fill_24 (XImage *xi, Ez_image *img, int src_x, int src_y,
-    int w, int h)
+void ez_comp_row_sse2 (int op, Ez_uint8 *dst_p, Ez_uint8 *src_p, int n,
+    int alpha)
 {
-    int x, y, tx, ty, i, j, img_w = img->width,
-        dj = xi->bytes_per_line,
-        di = xi->bits_per_pixel / 8,
-        ir = ezx.trueColor.red.shift   / 8,
-        ig = ezx.trueColor.green.shift / 8,
-        ib = ezx.trueColor.blue.shift  / 8;
-    Ez_uint8 *data = (Ez_uint8 *) xi->data;
-    double time1 = 0;
+    static void (*rows[EZ_COMP_NB]) (Ez_uint8 *, Ez_uint8 *, int, int) = {
+        ez_comp_src_sse2, ez_comp_over_sse2, ez_comp_in_sse2,
+        ez_comp_out_sse2, ez_comp_atop_sse2, ez_comp_xor_sse2,
+        ez_comp_add_sse2, ez_comp_multiply_sse2, ez_comp_screen_sse2,
+        ez_comp_darken_sse2, ez_comp_lighten_sse2 };
 
-    if (ez_image_debug()) time1 = ez_get_time ();
+    rows[op] (dst_p, src_p, n, alpha);
+}
 
-    for (y = 0, ty = src_y * img_w, j = 0; y < h; y++, ty += img_w, j += dj)
-    for (x = 0, tx = (ty + src_x)*4, i = j; x < w; x++, tx += 4, i += di) {
-        data[i+ir] = img->pixels_rgba[tx];
-        data[i+ig] = img->pixels_rgba[tx+1];
-        data[i+ib] = img->pixels_rgba[tx+2];
-    }
+#endif /* EZ_SIMD_X86 */
 
-    if (ez_image_debug())
-        printf ("ez_xi_fill_24 %.3f ms\n", (ez_get_time() - time1)*1000);
+
+/*
+ * Choose once the fastest row kernels supported by the processor. They
+ * are used by the resampling, the rotations and the compositing, which
+ * can run in several threads: only the initialization is synchronized,
+ * then the table is read without lock.
+*/
+
+Ez_row_kernels *ez_row_get_kernels (void)
+{
+#ifdef EZ_BASE_XLIB
+    pthread_once (&ez_row_once, ez_row_init_kernels);
+#elif defined EZ_BASE_WIN32
+    if (ez_row_once != 2) {
+        if (InterlockedCompareExchange (&ez_row_once, 1, 0) == 0) {
+            ez_row_init_kernels ();
+            InterlockedExchange (&ez_row_once, 2);
+        } else while (InterlockedCompareExchange (&ez_row_once, 2, 2) != 2)
+            Sleep (0);
+    }
+#endif /* EZ_BASE_ */
+    return &ez_row_kernels;
 }
 
 
-Ez_image *ez_xi_test_create (void)
+void ez_row_init_kernels (void)
 {
-    int w = 9, h = 13, t, tmax = w*h*4;
-    Ez_image *img = ez_image_create (w, h);
-    if (img == NULL) return NULL;
+    ez_row_kernels.nearest  = ez_row_nearest_c;
+    ez_row_kernels.bilinear = ez_row_bilinear_c;
+    ez_row_kernels.resample = ez_resample_row_c;
+    ez_row_kernels.premul   = ez_premul_row_c;
+    ez_row_kernels.blend    = ez_blend_row_c;
+    ez_row_kernels.composite = ez_comp_row_c;
 
-    for (t = 0; t < tmax; t += 4) {
-        img->pixels_rgba[t  ] = t*11/256;
-        img->pixels_rgba[t+1] = t*31/256;
-        img->pixels_rgba[t+2] = t* 7/256;
+#ifdef EZ_SIMD_X86
+    __builtin_cpu_init ();
+    if (__builtin_cpu_supports ("avx2")) {
+        ez_row_kernels.nearest  = ez_row_nearest_avx2;
+        ez_row_kernels.bilinear = ez_row_bilinear_avx2;
+        ez_row_kernels.premul   = ez_premul_row_avx2;
+        ez_row_kernels.blend    = ez_blend_row_avx2;
+    } else if (__builtin_cpu_supports ("sse2")) {
+        ez_row_kernels.bilinear = ez_row_bilinear_sse2;
+        ez_row_kernels.premul   = ez_premul_row_sse2;
+        ez_row_kernels.blend    = ez_blend_row_sse2;
+    }
+    if (__builtin_cpu_supports ("sse2")) {
+        ez_row_kernels.resample  = ez_resample_row_sse2;
+        ez_row_kernels.composite = ez_comp_row_sse2;
     }
+#endif /* EZ_SIMD_X86 */
 
-    return img;
+    if (ez_image_debug ())
+        printf ("ez_row_get_kernels: %s\n",
+            ez_row_kernels.bilinear == ez_row_bilinear_c ? "C" :
+            ez_row_kernels.nearest  == ez_row_nearest_c  ? "SSE2" : "AVX2");
 }
 
 
-int ez_xi_diff (XImage *xi1, XImage *xi2)
+/*
+ * Average the pixels of src under the footprint of each pixel of dst,
+ * approximated by a box whose sides are the steps of the sampling in src.
+ * The colors are weighted by alpha, so that the transparent pixels do not
+ * darken the result.
+*/
+
+void ez_image_transform_area (Ez_image *src, Ez_image *dst, const double inv[6])
+{
+    double sw = sqrt (inv[0]*inv[0] + inv[3]*inv[3]),
+           sh = sqrt (inv[1]*inv[1] + inv[4]*inv[4]), area, sum[4], a, d;
+    int x, y, u, v, du = EZ_FIX16 (inv[0]), dv = EZ_FIX16 (inv[3]),
+        src_w = src->width, src_h = src->height, alpha = src->has_alpha,
+        premul = src->premultiplied,
+        rw, rh, sx, sy, sx1, sx2, sy1, sy2, wx, wy, wxy;
+    Ez_uint8 *dst_p, *p;
+
+    /* Half sides of the box, at least half a pixel */
+    rw = EZ_FIX16 (sw < 1 ? 0.5 : sw/2);
+    rh = EZ_FIX16 (sh < 1 ? 0.5 : sh/2);
+    area = (double) (2*rw >> 8) * (2*rh >> 8);
+
+    for (y = 0; y < dst->height; y++) {
+        u = EZ_FIX16 (inv[1]*y + inv[2]);
+        v = EZ_FIX16 (inv[4]*y + inv[5]);
+        dst_p = EZ_IMAGE_PIXEL (dst, 0, y);
+        for (x = 0; x < dst->width; x++, u += du, v += dv, dst_p += 4) {
+            sum[0] = sum[1] = sum[2] = sum[3] = 0;
+
+            sx1 = u - rw < 0 ? 0 : (u - rw) >> 16;
+            sy1 = v - rh < 0 ? 0 : (v - rh) >> 16;
+            sx2 = (u + rw - 1) >> 16; if (sx2 >= src_w) sx2 = src_w-1;
+            sy2 = (v + rh - 1) >> 16; if (sy2 >= src_h) sy2 = src_h-1;
+
+            for (sy = sy1; sy <= sy2; sy++) {
+                /* Vertical coverage of the pixel by the box, in 8 bits */
+                wy = ((sy+1) << 16 < v + rh ? (sy+1) << 16 : v + rh) -
+                     (sy << 16 > v - rh ? sy << 16 : v - rh);
+                if (wy <= 0) continue;
+                for (sx = sx1; sx <= sx2; sx++) {
+                    wx = ((sx+1) << 16 < u + rw ? (sx+1) << 16 : u + rw) -
+                         (sx << 16 > u - rw ? sx << 16 : u - rw);
+                    if (wx <= 0) continue;
+                    wxy = (wx >> 8) * (wy >> 8);
+                    p = EZ_IMAGE_PIXEL (src, sx, sy);
+                    a = (double) wxy * (alpha ? p[3] : 255);
+                    if (premul) {
+                        sum[0] += (double) wxy * p[0] * 255;
+                        sum[1] += (double) wxy * p[1] * 255;
+                        sum[2] += (double) wxy * p[2] * 255;
+                    } else {
+                        sum[0] += a * p[0];
+                        sum[1] += a * p[1];
+                        sum[2] += a * p[2];
+                    }
+                    sum[3] += a;
+                }
+            }
+
+            if (sum[3] <= 0) {
+                dst_p[0] = dst_p[1] = dst_p[2] = dst_p[3] = 0;
+                continue;
+            }
+            /* Premultiplied: the colors are averaged like alpha */
+            d = premul ? area * 255 : sum[3];
+            dst_p[0] = sum[0] / d + 0.5;
+            dst_p[1] = sum[1] / d + 0.5;
+            dst_p[2] = sum[2] / d + 0.5;
+            a = sum[3] / area + 0.5;
+            dst_p[3] = a > 255 ? 255 : a;
+        }
+    }
+}
+
+
+/*
+ * Operations on Ez_pixmap
+*/
+
+#ifdef EZ_BASE_XLIB
+
+int ez_pixmap_build_map (Ez_pixmap *pix, Ez_image *img)
 {
-    int ntot, i;
-    if (xi1 == NULL || xi2 == NULL) return -1;
+    XImage *xi = NULL;
+    ez_xi_func xi_func;
+
+    pix->map = XCreatePixmap (ezx.display, ezx.root_win,
+        img->width, img->height, ezx.depth);
+    if (pix->map == None) return -1;
+
+    xi_func = ez_xi_get_func ();
+    xi = ez_xi_create (img, 0, 0, img->width, img->height, xi_func);
+    if (xi == NULL) return -1;
 
-    ntot = xi1->bytes_per_line * xi1->height;
-    for (i = 0; i < ntot; i++)
-        if (xi1->data[i] != xi2->data[i]) return -1;
+    XPutImage (ezx.display, pix->map, ezx.gc, xi, 0, 0, 0, 0,
+        img->width, img->height);
+    ez_xi_destroy (xi);
 
     return 0;
 }
 
 
 /*
- * Create a cutting mask from alpha channel and opacity threshold
+ * Put the region src_x,src_y,w,h of img at x,y in the map and the mask of
+ * pix. If pix had no mask, a mask where all the pixels are displayed is
+ * first created.
 */
 
-Pixmap ez_xmask_create (Ez_window win, Ez_image *img, int src_x, int src_y,
-    int w, int h)
+int ez_pixmap_put_area (Ez_pixmap *pix, Ez_image *img, int src_x, int src_y,
+    int x, int y, int w, int h)
 {
-    Pixmap mask = None;
-    Ez_uint8 *data = NULL;
+    XImage *xi = NULL;
+    GC gc;
+    Ez_uint8 *data;
     int bytes_per_line = (w+7)/8;
-    double time1 = 0, time2 = 0, time3 = 0;
+
+    xi = ez_xi_create (img, src_x, src_y, w, h, ez_xi_get_func ());
+    if (xi == NULL) return -1;
+    XPutImage (ezx.display, pix->map, ezx.gc, xi, 0, 0, x, y, w, h);
+    ez_xi_destroy (xi);
+
+    if (!img->has_alpha) {
+        if (pix->mask != None) XFreePixmap (ezx.display, pix->mask);
+        pix->mask = None;
+        return 0;
+    }
 
     data = calloc (bytes_per_line*h, 1);
     if (data == NULL) {
-        ez_error ("ez_xmask_create: out of memory\n");
-        return None;
+        ez_error ("ez_pixmap_put_area: out of memory\n");
+        return -1;
     }
+    ez_xmask_fill (data, img, src_x, src_y, w, h);
 
-    if (ez_image_debug()) time1 = ez_get_time ();
+    /* Same layout as the data of XCreateBitmapFromData */
+    xi = XCreateImage (ezx.display, ezx.visual, 1, XYBitmap, 0, (char*) data,
+        w, h, 8, bytes_per_line);
+    if (xi == NULL) {
+        ez_error ("ez_pixmap_put_area: can't create XImage\n");
+        free (data);
+        return -1;
+    }
+    xi->byte_order = xi->bitmap_bit_order = LSBFirst;
 
-    ez_xmask_fill (data, img, src_x, src_y, w, h);
+    if (pix->mask == None) {
+        pix->mask = XCreatePixmap (ezx.display, ezx.root_win,
+            pix->width, pix->height, 1);
+        if (pix->mask == None) {
+            ez_error ("ez_pixmap_put_area: can't create mask\n");
+            XDestroyImage (xi);
+            return -1;
+        }
+        gc = XCreateGC (ezx.display, pix->mask, 0, NULL);
+        XSetForeground (ezx.display, gc, 1);
+        XFillRectangle (ezx.display, pix->mask, gc, 0, 0,
+            pix->width, pix->height);
+    } else gc = XCreateGC (ezx.display, pix->mask, 0, NULL);
+
+    XSetForeground (ezx.display, gc, 1);
+    XSetBackground (ezx.display, gc, 0);
+    XPutImage (ezx.display, pix->mask, gc, xi, 0, 0, x, y, w, h);
+    XFreeGC (ezx.display, gc);
+    XDestroyImage (xi);
 
-    if (ez_image_debug()) time2 = ez_get_time ();
+    return 0;
+}
 
-    mask = XCreateBitmapFromData (ezx.display, win, (char*) data, w, h);
-    if (mask == None)
-        ez_error ("ez_xmask_create: can't create bitmap");
 
-    if (ez_image_debug()) {
-        time3 = ez_get_time ();
-        printf ("ez_xmask_create   fill %.3f ms   bitmap %.3f ms\n",
-            (time2-time1)*1000, (time3-time2)*1000);
+void ez_pixmap_draw_area (Ez_window win, Ez_pixmap *pix, int x, int y,
+    int src_x, int src_y, int w, int h)
+{
+    if (pix->mask != None) {
+        XSetClipOrigin (ezx.display, ezx.gc, x - src_x, y - src_y);
+        XSetClipMask (ezx.display, ezx.gc, pix->mask);
     }
 
-    free (data);
-    return mask;
+    XCopyArea(ezx.display, pix->map, win, ezx.gc, src_x, src_y,
+        w, h, x, y);
+
+    if (pix->mask != None) {
+        XSetClipOrigin (ezx.display, ezx.gc, 0, 0);
+        XSetClipMask (ezx.display, ezx.gc, None);
+    }
 }
 
 
-void ez_xmask_fill (Ez_uint8 *data, Ez_image *img,
-    int src_x, int src_y, int w, int h)
+void ez_pixmap_tile_area (Ez_window win, Ez_pixmap *pix, int x, int y, int w, int h)
 {
+    int nx, ny;
+
+    for (ny = 0; ny < h; ny += pix->height)
+    for (nx = 0; nx < w; nx += pix->width)
+    {
+        if (pix->mask != None) {
+            XSetClipOrigin (ezx.display, ezx.gc, x+nx, y+ny);
+            XSetClipMask (ezx.display, ezx.gc, pix->mask);
+        }
 
-    int tx, mx, y, ty, i, j, bpl = (w+7)/8, img_w = img->width;
+        XCopyArea(ezx.display, pix->map, win, ezx.gc, 0, 0,
+            nx+pix->width  <= w ? pix->width  : w-nx,
+            ny+pix->height <= h ? pix->height : h-ny,
+            x+nx, y+ny);
+    }
 
-    for (y = 0, ty = src_y * img_w ; y < h ; y++, ty += img_w)
-    for (tx = (ty+src_x)*4+3, mx = tx+w*4, i = y*bpl, j = 0 ; tx < mx ; tx += 4, j++) {
-        if (j == 8) { i++; j = 0; }
-        if (img->pixels_rgba[tx] < img->opacity) continue;
-        data[i] |= 1 << j;
+    if (pix->mask != None) {
+        XSetClipOrigin (ezx.display, ezx.gc, 0, 0);
+        XSetClipMask (ezx.display, ezx.gc, None);
     }
 }
 
 #elif defined EZ_BASE_WIN32
 
+int ez_pixmap_build_hmap (Ez_pixmap *pix, Ez_image *img)
+{
+    HDC root_dc = NULL, pix_dc = NULL;
+    int status = -1;
+
+    root_dc = GetDC (NULL);
+    if (root_dc == NULL) return -1;
+
+    pix->hmap = CreateCompatibleBitmap (root_dc, img->width, img->height);
+    if (pix->hmap == NULL) goto final;
+
+    pix_dc = CreateCompatibleDC (root_dc);
+    if (pix_dc == NULL) goto final;
+    SelectObject (pix_dc, pix->hmap);
+
+    ez_image_draw_dib (pix_dc, img, 0, 0, 0, 0, img->width, img->height);
+    status = 0;
+
+  final :
+    if (root_dc != NULL) ReleaseDC (NULL, root_dc);
+    if (pix_dc != NULL) DeleteDC (pix_dc);
+
+    return status;
+}
+
+
 /*
- * Display a sub-image with transparency.
- * DIB = Device Independent Bitmap
+ * Put the region src_x,src_y,w,h of img at x,y in the hmap of pix. The
+ * region is cleared first, as the bitmap created by ez_pixmap_build_hmap.
 */
 
-void ez_image_draw_dib (HDC hdc_dst, Ez_image *img, int x, int y,
+int ez_pixmap_put_area (Ez_pixmap *pix, Ez_image *img, int src_x, int src_y,
+    int x, int y, int w, int h)
+{
+    HDC root_dc = NULL, pix_dc = NULL;
+    int status = -1;
+
+    root_dc = GetDC (NULL);
+    if (root_dc == NULL) return -1;
+
+    pix_dc = CreateCompatibleDC (root_dc);
+    if (pix_dc == NULL) goto final;
+    SelectObject (pix_dc, pix->hmap);
+
+    PatBlt (pix_dc, x, y, w, h, BLACKNESS);
+    ez_image_draw_dib (pix_dc, img, x, y, src_x, src_y, w, h);
+    pix->has_alpha = img->has_alpha;
+    status = 0;
+
+  final :
+    if (root_dc != NULL) ReleaseDC (NULL, root_dc);
+    if (pix_dc != NULL) DeleteDC (pix_dc);
+
+    return status;
+}
+
+
+void ez_pixmap_draw_hmap (HDC hdc_dst, Ez_pixmap *pix, int x, int y,
     int src_x, int src_y, int w, int h)
 {
     HDC hdc = NULL;
-    HBITMAP hbitmap = NULL;
-    BITMAPINFO bmi;
-    Ez_uint8 *data;
 
     /* Create a DC for the bitmap */
     hdc = CreateCompatibleDC(hdc_dst);
     if (hdc == NULL) {
-        ez_error ("ez_image_draw_dib: can't create compatible DC\n");
+        ez_error ("ez_pixmap_draw_hmap: can't create compatible DC\n");
         return;
     }
+    SelectObject (hdc, pix->hmap);
 
-    ZeroMemory(&bmi, sizeof(BITMAPINFO));
-    bmi.bmiHeader.biSize = sizeof(BITMAPINFOHEADER);
-    bmi.bmiHeader.biWidth = w;
-    bmi.bmiHeader.biHeight = -h;  /* negative height for Origin at top left */
-    bmi.bmiHeader.biPlanes = 1;
-    bmi.bmiHeader.biBitCount = 32;
-    bmi.bmiHeader.biCompression = BI_RGB;
-    bmi.bmiHeader.biSizeImage = w * h * 4;
+    if (pix->has_alpha) {
+        BLENDFUNCTION bf;
 
-    hbitmap = CreateDIBSection (hdc_dst, &bmi, DIB_RGB_COLORS, (void **) &data, NULL, 0);
-    if (hbitmap == NULL) {
-        ez_error ("ez_image_draw_dib: can't create DIB Section\n");
-        goto final;
+        bf.BlendOp = AC_SRC_OVER;
+        bf.BlendFlags = 0;
+        bf.AlphaFormat = AC_SRC_ALPHA;  /* Alpha channel premultiplied */
+        bf.SourceConstantAlpha = 0xff;
+
+        if (AlphaBlend (hdc_dst, x, y, w, h, hdc,
+                src_x, src_y, w, h, bf) == FALSE)
+            ez_error ("ez_pixmap_draw_hmap: AlphaBlend failed\n");
+    } else {
+        if (BitBlt (hdc_dst, x, y, w, h, hdc,
+                src_x, src_y, SRCCOPY ) == 0)
+            ez_error ("ez_pixmap_draw_hmap: bitblt failed\n");
     }
-    SelectObject (hdc, hbitmap);
 
-    if (!img->has_alpha)
-         ez_dib_fill_noalpha   (data, img, src_x, src_y, w, h);
-    else if (img->opacity >= 0)
-         ez_dib_fill_opacity   (data, img, src_x, src_y, w, h);
-    else ez_dib_fill_truealpha (data, img, src_x, src_y, w, h);
+    if (hdc != NULL) DeleteDC (hdc);
+}
+
+
+void ez_pixmap_tile_hmap (HDC hdc_dst, Ez_pixmap *pix, int x, int y, int w, int h)
+{
+    HDC hdc = NULL;
+    int nx, ny, nw, nh;
+    BLENDFUNCTION bf;
 
-    if (img->has_alpha) {
-        BLENDFUNCTION bf;
+    /* Create a DC for the bitmap */
+    hdc = CreateCompatibleDC(hdc_dst);
+    if (hdc == NULL) {
+        ez_error ("ez_pixmap_tile_hmap: can't create compatible DC\n");
+        return;
+    }
+    SelectObject (hdc, pix->hmap);
 
+    if (pix->has_alpha) {
         bf.BlendOp = AC_SRC_OVER;
         bf.BlendFlags = 0;
-        bf.AlphaFormat = AC_SRC_ALPHA;  /* alpha channel premultiplied */
+        bf.AlphaFormat = AC_SRC_ALPHA;  /* Alpha channel premultiplied */
         bf.SourceConstantAlpha = 0xff;
+    }
 
-        if (AlphaBlend (hdc_dst, x, y, w, h, hdc, 0, 0, w, h, bf) == FALSE)
-            ez_error ("ez_image_draw_dib: AlphaBlend failed\n");
-    } else {
-        if (BitBlt (hdc_dst, x, y, w, h, hdc, 0, 0, SRCCOPY ) == 0)
-            ez_error ("ez_image_draw_dib: bitblt failed\n");
+    for (ny = 0; ny < h; ny += pix->height)
+    for (nx = 0; nx < w; nx += pix->width)
+    {
+        nw = nx+pix->width  <= w ? pix->width  : w-nx;
+        nh = ny+pix->height <= h ? pix->height : h-ny;
+
+        if (pix->has_alpha) {
+            if (AlphaBlend (hdc_dst, x+nx, y+ny, nw, nh, hdc,
+                    0, 0, nw, nh, bf) == FALSE) {
+                ez_error ("ez_pixmap_tile_hmap: AlphaBlend failed\n");
+                goto final;
+            }
+        } else {
+            if (BitBlt (hdc_dst, x+nx, y+ny, nw, nh, hdc, 0, 0, SRCCOPY ) == 0) {
+                ez_error ("ez_pixmap_tile_hmap: bitblt failed\n");
+                goto final;
+            }
+        }
     }
 
   final:
-    if (hbitmap != NULL) DeleteObject (hbitmap);
     if (hdc != NULL) DeleteDC (hdc);
 }
 
+#endif /* EZ_BASE_ */
 
-void ez_dib_fill_noalpha (Ez_uint8 *data, Ez_image *img, int src_x, int src_y,
-    int w, int h)
+
+/*
+ * Append a sprite, from the sub-area src_x,src_y,w,h of the pixmap pix,
+ * in the current batch.
+ * Return 0 on success, -1 on error.
+*/
+
+int ez_sprite_batch_push (Ez_pixmap *pix, int src_x, int src_y, int w, int h,
+    int x, int y)
 {
-    int x, y, tx, ty, i, j, img_w = img->width, dj = w*4;
-    double time1 = 0;
+    Ez_sprite *sprite;
+    int num;
 
-    if (ez_image_debug()) time1 = ez_get_time ();
+    if (!ez_batch.active) {
+        ez_error ("ez_sprite_batch_add: ez_sprite_batch_begin was not called\n");
+        return -1;
+    }
+    if (w <= 0 || h <= 0) return 0;
 
-    for (y = 0, ty = src_y * img_w,  j = 0; y < h; y++, ty += img_w, j += dj)
-    for (x = 0, tx = (ty + src_x)*4, i = j; x < w; x++, tx += 4, i += 4) {
-        data[i+3] = 0xff;
-        data[i+2] = img->pixels_rgba[tx];
-        data[i+1] = img->pixels_rgba[tx+1];
-        data[i  ] = img->pixels_rgba[tx+2];
+    if (ez_batch.sprite_nb == ez_batch.sprite_max) {
+        int max = ez_batch.sprite_max > 0 ? ez_batch.sprite_max*2 : 256;
+        Ez_sprite *tmp = realloc (ez_batch.sprite, max * sizeof (Ez_sprite));
+        if (tmp == NULL) {
+            ez_error ("ez_sprite_batch_add: out of memory\n");
+            return -1;
+        }
+        ez_batch.sprite = tmp; ez_batch.sprite_max = max;
+    }
+
+    /* Number of the pixmap in the batch; the same pixmap is often repeated */
+    num = ez_batch.pix_nb-1;
+    if (num < 0 || ez_batch.pix[num] != pix) {
+        for (num = 0; num < ez_batch.pix_nb; num++)
+            if (ez_batch.pix[num] == pix) break;
+        if (num == ez_batch.pix_nb) {
+            if (ez_batch.pix_nb == ez_batch.pix_max) {
+                int max = ez_batch.pix_max > 0 ? ez_batch.pix_max*2 : 16;
+                Ez_pixmap **tmp = realloc (ez_batch.pix, max * sizeof (Ez_pixmap *));
+                if (tmp == NULL) {
+                    ez_error ("ez_sprite_batch_add: out of memory\n");
+                    return -1;
+                }
+                ez_batch.pix = tmp; ez_batch.pix_max = max;
+            }
+            ez_batch.pix[ez_batch.pix_nb++] = pix;
+        }
     }
 
-    if (ez_image_debug())
-        printf ("ez_dib_fill_noalpha %.3f ms\n", (ez_get_time() - time1)*1000);
+    sprite = ez_batch.sprite + ez_batch.sprite_nb;
+    sprite->pix = pix; sprite->pix_num = num;
+    sprite->src_x = src_x; sprite->src_y = src_y;
+    sprite->w = w; sprite->h = h;
+    sprite->x = x; sprite->y = y;
+    sprite->num = ez_batch.sprite_nb++;
+    return 0;
 }
 
 
-void ez_dib_fill_opacity (Ez_uint8 *data, Ez_image *img, int src_x, int src_y,
-    int w, int h)
+/*
+ * Compute the level of each sprite of the batch: a sprite is above every
+ * previous sprite it may overlap, so that the sprites of a same level can be
+ * drawn in any order. The overlaps are detected on a grid of cells of
+ * EZ_SPRITE_CELL pixels, which store the level above their last sprite.
+ * The sprites outside the window of size win_w,win_h are removed.
+ * Return 0 on success, -1 on error.
+*/
+
+int ez_sprite_batch_level (int win_w, int win_h)
 {
-    int x, y, tx, ty, i, j, img_w = img->width, dj = w*4;
-    double time1 = 0;
+    int grid_w = (win_w + EZ_SPRITE_CELL-1) / EZ_SPRITE_CELL,
+        grid_h = (win_h + EZ_SPRITE_CELL-1) / EZ_SPRITE_CELL,
+        i, n = 0, cx, cy, cx1, cy1, cx2, cy2, level;
 
-    if (ez_image_debug()) time1 = ez_get_time ();
+    if (grid_w <= 0 || grid_h <= 0) return -1;
 
-    for (y = 0, ty = src_y * img_w,  j = 0; y < h; y++, ty += img_w, j += dj)
-    for (x = 0, tx = (ty + src_x)*4, i = j; x < w; x++, tx += 4, i += 4) {
-        if (img->pixels_rgba[tx+3] >= img->opacity) {
-            data[i+3] = 0xff;
-            data[i+2] = img->pixels_rgba[tx];
-            data[i+1] = img->pixels_rgba[tx+1];
-            data[i  ] = img->pixels_rgba[tx+2];
-        } else {
-            data[i+3] = 0;
-            data[i+2] = 0;
-            data[i+1] = 0;
-            data[i  ] = 0;
+    if (grid_w * grid_h > ez_batch.cell_max) {
+        int *tmp = realloc (ez_batch.cell, grid_w * grid_h * sizeof (int));
+        if (tmp == NULL) {
+            ez_error ("ez_sprite_batch_end: out of memory\n");
+            return -1;
         }
+        ez_batch.cell = tmp; ez_batch.cell_max = grid_w * grid_h;
     }
+    memset (ez_batch.cell, 0, grid_w * grid_h * sizeof (int));
 
-    if (ez_image_debug())
-        printf ("ez_dib_fill_opacity %.3f ms\n", (ez_get_time() - time1)*1000);
-}
+    for (i = 0; i < ez_batch.sprite_nb; i++) {
+        Ez_sprite *sprite = ez_batch.sprite + i;
 
+        if (sprite->x >= win_w || sprite->x + sprite->w <= 0 ||
+            sprite->y >= win_h || sprite->y + sprite->h <= 0) continue;
 
-void ez_dib_fill_truealpha (Ez_uint8 *data, Ez_image *img, int src_x, int src_y,
-    int w, int h)
-{
-    int x, y, tx, ty, i, j, img_w = img->width, dj = w*4, a;
-    double time1 = 0;
+        cx1 = sprite->x < 0 ? 0 : sprite->x / EZ_SPRITE_CELL;
+        cy1 = sprite->y < 0 ? 0 : sprite->y / EZ_SPRITE_CELL;
+        cx2 = (sprite->x + sprite->w - 1) / EZ_SPRITE_CELL;
+        cy2 = (sprite->y + sprite->h - 1) / EZ_SPRITE_CELL;
+        if (cx2 >= grid_w) cx2 = grid_w-1;
+        if (cy2 >= grid_h) cy2 = grid_h-1;
 
-    if (ez_image_debug()) time1 = ez_get_time ();
+        level = 0;
+        for (cy = cy1; cy <= cy2; cy++)
+        for (cx = cx1; cx <= cx2; cx++)
+            if (ez_batch.cell[cy*grid_w+cx] > level)
+                level = ez_batch.cell[cy*grid_w+cx];
 
-    for (y = 0, ty = src_y * img_w,  j = 0; y < h; y++, ty += img_w, j += dj)
-    for (x = 0, tx = (ty + src_x)*4, i = j; x < w; x++, tx += 4, i += 4) {
-        data[i+3] = a = img->pixels_rgba[tx+3];
-        data[i+2] = img->pixels_rgba[tx  ]*a/255;
-        data[i+1] = img->pixels_rgba[tx+1]*a/255;
-        data[i  ] = img->pixels_rgba[tx+2]*a/255;
+        for (cy = cy1; cy <= cy2; cy++)
+        for (cx = cx1; cx <= cx2; cx++)
+            ez_batch.cell[cy*grid_w+cx] = level+1;
+
+        sprite->level = level;
+        ez_batch.sprite[n++] = *sprite;
     }
 
-    if (ez_image_debug())
-        printf ("ez_dib_fill_truealpha %.3f ms\n", (ez_get_time() - time1)*1000);
+    ez_batch.sprite_nb = n;
+    return 0;
 }
 
-#endif /* EZ_BASE_ */
-
 
 /*
- * Print a rectangular region of the image img in the terminal.
+ * Order the sprites by level, then by pixmap, then by order of addition.
 */
 
-void ez_image_print_rgba (Ez_image *img, int src_x, int src_y, int w, int h)
+int ez_sprite_compare (const void *a, const void *b)
 {
-    int x, y;
-    Ez_uint8 *p;
+    const Ez_sprite *sa = a, *sb = b;
 
-    printf (" y,x ");
-    for (x = src_x; x < src_x+w; x++)
-        printf ("|      %4d      ", x);
-    printf ("\n");
-
-    for (y = src_y; y < src_y+h; y++) {
-        printf ("%4d ", y);
-        for (x = src_x; x < src_x+w; x++) {
-            p = img->pixels_rgba + (y*img->width+x)*4;
-            printf ("| %3d %3d %3d %3d", p[0], p[1], p[2], p[3]);
-        }
-        printf ("\n");
-    }
+    if (sa->level   != sb->level  ) return sa->level   < sb->level   ? -1 : 1;
+    if (sa->pix_num != sb->pix_num) return sa->pix_num < sb->pix_num ? -1 : 1;
+    return sa->num < sb->num ? -1 : sa->num > sb->num;
 }
 
 
 /*
- * Fill image with a RGBA color
+ * Order the numbers of images by decreasing heights, then widths,
+ * using the images stored in ez_atlas_img.
 */
 
-void ez_image_comp_fill_rgba (Ez_image *img, Ez_uint8 r, Ez_uint8 g, Ez_uint8 b,
-    Ez_uint8 a)
+int ez_atlas_compare (const void *a, const void *b)
 {
-    int t, tmax4 = img->width * img->height * 4;
+    Ez_image *ia = ez_atlas_img[*(const int *) a],
+             *ib = ez_atlas_img[*(const int *) b];
 
-    for (t = 0; t < tmax4; t += 4) {
-        img->pixels_rgba[t  ] = r;
-        img->pixels_rgba[t+1] = g;
-        img->pixels_rgba[t+2] = b;
-        img->pixels_rgba[t+3] = a;
-    }
+    if (ia->height != ib->height) return ia->height > ib->height ? -1 : 1;
+    if (ia->width  != ib->width ) return ia->width  > ib->width  ? -1 : 1;
+    return *(const int *) a - *(const int *) b;
 }
 
 
 /*
- * Superimpose src into dst, without transparency
+ * Build the pixmap of the page num of an atlas, from the images img.
+ * The alpha channel of each image is thresholded with its own opacity,
+ * so that all the images of the page can share the same mask.
+ * Return the pixmap, else NULL.
 */
 
-void ez_image_comp_over (Ez_image *dst, Ez_image *src, int dst_x, int dst_y,
-    int src_x, int src_y, int w, int h)
+Ez_pixmap *ez_atlas_build_page (Ez_atlas *atlas, Ez_image **img, int num)
 {
-    int x, y, t_src, t_dst;
+    Ez_image *page;
+    Ez_pixmap *pix;
+    int i, x, y, w = 0, h = 0, has_alpha = 0;
 
-    for (y = 0; y < h; y++)
-    for (x = 0; x < w; x++) {
-        t_src = ((y+src_y)*src->width+x+src_x)*4;
-        t_dst = ((y+dst_y)*dst->width+x+dst_x)*4;
+    for (i = 0; i < atlas->item_nb; i++) {
+        Ez_atlas_item *item = atlas->item + i;
+        if (item->page != num) continue;
+        if (item->x + item->width  > w) w = item->x + item->width;
+        if (item->y + item->height > h) h = item->y + item->height;
+        if (img[i]->has_alpha) has_alpha = 1;
+    }
+
+    page = ez_image_create (w, h);
+    if (page == NULL) return NULL;
+    page->has_alpha = has_alpha;
 
-        dst->pixels_rgba[t_dst  ] = src->pixels_rgba[t_src  ];
-        dst->pixels_rgba[t_dst+1] = src->pixels_rgba[t_src+1];
-        dst->pixels_rgba[t_dst+2] = src->pixels_rgba[t_src+2];
-        dst->pixels_rgba[t_dst+3] = src->pixels_rgba[t_src+3];
+    for (i = 0; i < atlas->item_nb; i++) {
+        Ez_atlas_item *item = atlas->item + i;
+        if (item->page != num) continue;
+        if (ez_image_pixels (img[i]) < 0) {
+            ez_image_destroy (page);
+            return NULL;
+        }
+
+        for (y = 0; y < item->height; y++) {
+            Ez_uint8 *src = EZ_IMAGE_PIXEL (img[i], 0, y),
+                     *dst = EZ_IMAGE_PIXEL (page, item->x, item->y+y);
+            memcpy (dst, src, item->width*4);
+            if (!img[i]->has_alpha)
+                for (x = 0; x < item->width; x++) dst[x*4+3] = 255;
+            else if (img[i]->opacity >= 0)
+                for (x = 0; x < item->width; x++)
+                    dst[x*4+3] = dst[x*4+3] >= img[i]->opacity ? 255 : 0;
+#ifdef EZ_BASE_XLIB
+            else for (x = 0; x < item->width; x++) dst[x*4+3] = 255;
+#elif defined EZ_BASE_WIN32
+            else page->opacity = -1;
+#endif /* EZ_BASE_ */
+        }
     }
+
+    pix = ez_pixmap_create_from_image (page);
+    ez_image_destroy (page);
+    return pix;
 }
 
 
 /*
- * Superimpose src into dst, with transparency
+ * Find the entry of the cache of transformed images for these parameters,
+ * and move it first in the LRU list; on a miss, compute the entry.
+ * Return the entry, else NULL.
 */
 
-void ez_image_comp_blend (Ez_image *dst, Ez_image *src, int dst_x, int dst_y,
-    int src_x, int src_y, int w, int h)
+Ez_tcache_entry *ez_tcache_lookup (Ez_image *img, double factor, double theta,
+    int sym_hor, int sym_ver, int quality)
 {
-    int x, y, t_src, t_dst, a_src, a_dst, a_res;
-
-    for (y = 0; y < h; y++)
-    for (x = 0; x < w; x++) {
-        t_src = ((y+src_y)*src->width+x+src_x)*4;
-        t_dst = ((y+dst_y)*dst->width+x+dst_x)*4;
-
-        a_src = src->pixels_rgba[t_src+3];
-        a_dst = dst->pixels_rgba[t_dst+3];
-        a_res = a_src + a_dst * (255-a_src) / 255;
-
-        if (a_res == 0) {
-            dst->pixels_rgba[t_dst  ] = 0;
-            dst->pixels_rgba[t_dst+1] = 0;
-            dst->pixels_rgba[t_dst+2] = 0;
-            dst->pixels_rgba[t_dst+3] = 0;
-            continue;
-        }
+    Ez_tcache_entry *entry;
+    int scale_q, theta_q, sym;
+    unsigned long hash;
 
-        dst->pixels_rgba[t_dst  ] =
-            ( src->pixels_rgba[t_src  ] * a_src +
-              dst->pixels_rgba[t_dst  ] * a_dst * (255-a_src) / 255 ) / a_res;
-        dst->pixels_rgba[t_dst+1] =
-            ( src->pixels_rgba[t_src+1] * a_src +
-              dst->pixels_rgba[t_dst+1] * a_dst * (255-a_src) / 255 ) / a_res;
-        dst->pixels_rgba[t_dst+2] =
-            ( src->pixels_rgba[t_src+2] * a_src +
-              dst->pixels_rgba[t_dst+2] * a_dst * (255-a_src) / 255 ) / a_res;
-        dst->pixels_rgba[t_dst+3] = a_res;
+    if (img == NULL) return NULL;
+    if (factor <= 0) {
+        ez_error ("ez_transform_cache: bad scale factor %f\n", factor);
+        return NULL;
     }
-}
 
+    theta = fmod (theta, 360);
+    if (theta < 0) theta += 360;
+    scale_q = (int) floor (factor * EZ_TCACHE_SCALE_Q + 0.5);
+    theta_q = (int) floor (theta * EZ_TCACHE_ANGLE_Q + 0.5) % (360 * EZ_TCACHE_ANGLE_Q);
+    if (scale_q < 1) scale_q = 1;
+    sym = (sym_hor != 0) | (sym_ver != 0) << 1;
+
+    hash = ez_tcache_hash (img, scale_q, theta_q, sym, quality);
+    for (entry = ez_tcache.bucket[hash]; entry != NULL; entry = entry->hnext)
+        if (entry->src == img && entry->scale_q == scale_q &&
+            entry->theta_q == theta_q && entry->sym == sym &&
+            entry->quality == quality) break;
+
+    if (entry != NULL) {
+        ez_tcache.hits++;
+        if (entry != ez_tcache.first) {
+            ez_tcache_unlink (entry);
+            ez_tcache_link (entry);
+        }
+        return entry;
+    }
 
-/*
- * Extract a rectangular region from an image
-*/
+    ez_tcache.misses++;
+    entry = malloc (sizeof (Ez_tcache_entry));
+    if (entry == NULL) {
+        ez_error ("ez_transform_cache: out of memory\n");
+        return NULL;
+    }
+    entry->src = img;
+    entry->scale_q = scale_q; entry->theta_q = theta_q;
+    entry->sym = sym; entry->quality = quality;
+    entry->pix = NULL;
+    entry->img = ez_tcache_compute (img, (double) scale_q / EZ_TCACHE_SCALE_Q,
+        (double) theta_q / EZ_TCACHE_ANGLE_Q, sym, quality);
+    if (entry->img == NULL) { free (entry); return NULL; }
+    entry->bytes = (long) entry->img->stride * entry->img->height;
 
-void ez_image_copy_sub (Ez_image *src, Ez_image *dest , int src_x, int src_y)
-{
-    int tw4  = dest->width*4,
-        sw4  = src ->width*4,
-        sxy4 = (src_y*src->width + src_x)*4,
-        y, ty, sy;
+    entry->hash = hash;
+    entry->hnext = ez_tcache.bucket[hash];
+    ez_tcache.bucket[hash] = entry;
+    ez_tcache_link (entry);
+    entry->sprev = NULL;
+    entry->snext = img->tcache;
+    if (img->tcache != NULL) img->tcache->sprev = entry;
+    img->tcache = entry;
+    ez_tcache.nb++;
+    ez_tcache.bytes += entry->bytes;
 
-    for (y = ty = 0, sy = sxy4; y < dest->height; y++, ty += tw4, sy += sw4)
-        memcpy (dest->pixels_rgba + ty, src ->pixels_rgba + sy, tw4);
+    ez_tcache_evict ();
+    return entry;
 }
 
 
 /*
- * Transformations
+ * Compute a transformed image: scale, rotation, then symmetries, in a single
+ * pass with ez_image_transform.
+ * Return the new image, else NULL.
 */
 
-void ez_image_comp_symv (Ez_image *src, Ez_image *dst)
+Ez_image *ez_tcache_compute (Ez_image *img, double factor, double theta,
+    int sym, int quality)
 {
-    int dst_h = dst->height, dst_w = dst->width,
-        x, y, ts, td, tw = dst_w;
-    Ez_uint32 *src_p = (Ez_uint32 *)src->pixels_rgba,
-              *dst_p = (Ez_uint32 *)dst->pixels_rgba;
-
-    for (y = 0, td = 0      ; y < dst_h; y++)
-    for (x = 0, ts = td+tw-1; x < dst_w; x++, td++, ts--)
-        dst_p[td] = src_p[ts];
-}
+    double a = theta*M_PI/180, c = cos(a), s = sin(a),
+           fx = (sym & 2) ? -1 : 1, fy = (sym & 1) ? -1 : 1, rx, ry, m[6];
+    Ez_image *src = ez_mipmap_select (img, factor, factor);
 
+    /* Scale factors remaining from the level src of the mipmap */
+    rx = factor * img->width  / src->width;
+    ry = factor * img->height / src->height;
 
-void ez_image_comp_symh (Ez_image *src, Ez_image *dst)
-{
-    int dst_h = dst->height, dst_w = dst->width,
-        y, ts, td, tw4 = dst_w*4, tdm4 = (dst_h-1)*tw4;
+    m[0] = fx*c*rx; m[1] = -fx*s*ry; m[2] = 0;
+    m[3] = fy*s*rx; m[4] =  fy*c*ry; m[5] = 0;
 
-    for (td = y = 0, ts = tdm4; y < dst_h; y++, td += tw4, ts -= tw4)
-        memcpy (dst->pixels_rgba + td, src->pixels_rgba + ts, tw4);
+    return ez_image_transform (src, m, quality, NULL);
 }
 
 
-void ez_image_expand (Ez_image *src, Ez_image *dst, double factor)
+unsigned long ez_tcache_hash (Ez_image *img, int scale_q, int theta_q, int sym,
+    int quality)
 {
-    int x, y, t;
+    unsigned long h = (unsigned long) (size_t) img >> 4;
 
-    for (t = y = 0; y < dst->height; y++)
-    for (    x = 0; x < dst->width ; x++, t+=4)
-        ez_bilinear_4points (src->pixels_rgba, dst->pixels_rgba,
-            src->width, src->height, x/factor, y/factor, t);
+    h = h * 31 + scale_q;
+    h = h * 31 + theta_q;
+    h = h * 31 + (sym << 1 | quality);
+    return (h ^ h >> 11) % EZ_TCACHE_BUCKETS;
 }
 
 
-void ez_image_shrink (Ez_image *src, Ez_image *dst, double factor)
-{
-    int x, y, t;
-
-    for (t = y = 0; y < dst->height; y++)
-    for (    x = 0; x < dst->width ; x++, t+=4)
-        ez_bilinear_pane (src->pixels_rgba, dst->pixels_rgba,
-            src->width, src->height, x/factor, y/factor, t, factor);
-}
-
+/*
+ * Insert an entry first in the LRU list.
+*/
 
-void ez_rotate_get_size (double theta, int src_w, int src_h, int *dst_w, int *dst_h)
+void ez_tcache_link (Ez_tcache_entry *entry)
 {
-    double a = theta*M_PI/180, c = cos(a), s = sin(a),
-           w1 = fabs (c*src_w - s*src_h), h1 = fabs (s*src_w + c*src_h),
-           w2 = fabs (c*src_w + s*src_h), h2 = fabs (s*src_w - c*src_h);
-    *dst_w = EZ_ROUND (w1 > w2 ? w1 : w2);
-    *dst_h = EZ_ROUND (h1 > h2 ? h1 : h2);
+    entry->prev = NULL;
+    entry->next = ez_tcache.first;
+    if (ez_tcache.first != NULL) ez_tcache.first->prev = entry;
+    else ez_tcache.last = entry;
+    ez_tcache.first = entry;
 }
 
 
-void ez_rotate_get_coords (double theta, int src_w, int src_h, int src_x, int src_y,
-    int *dst_x, int *dst_y)
-{
-    double a = theta*M_PI/180, c = cos(a), s = sin(a);
-    double sx[4], sy[4], tx[4], ty[4], minx, miny;
-    int i;
-
-    /* Corners coordinates relative to the rotation center src */
-    sx[0] = 0     - src_x; sy[0] = 0     - src_y;
-    sx[1] = src_w - src_x; sy[1] = 0     - src_y;
-    sx[2] = src_w - src_x; sy[2] = src_h - src_y;
-    sx[3] = 0     - src_x; sy[3] = src_h - src_y;
-
-    /* Corners rotation */
-    for (i = 0; i < 4; i++) {
-        tx[i] = c*sx[i] - s*sy[i];
-        ty[i] = s*sx[i] + c*sy[i];
-    }
-
-    /* Research of min */
-    minx = tx[0];
-    miny = ty[0];
-    for (i = 1; i < 4; i++) {
-        if (tx[i] < minx) minx = tx[i];
-        if (ty[i] < miny) miny = ty[i];
-    }
+/*
+ * Remove an entry from the LRU list.
+*/
 
-    *dst_x = EZ_ROUND (-minx);
-    *dst_y = EZ_ROUND (-miny);
+void ez_tcache_unlink (Ez_tcache_entry *entry)
+{
+    if (entry->prev != NULL) entry->prev->next = entry->next;
+    else ez_tcache.first = entry->next;
+    if (entry->next != NULL) entry->next->prev = entry->prev;
+    else ez_tcache.last = entry->prev;
 }
 
 
-void ez_image_rotate_nearest (Ez_image *src, Ez_image *dst, double theta)
-{
-    double a = theta*M_PI/180, c = cos(-a), s = sin(-a), sx, sy;
-    int x, y, t, dx, dy, xn, yn, dst_x, dst_y,
-        src_w = src->width, src_h = src->height,
-        dst_w = dst->width, dst_h = dst->height;
-    Ez_uint32 *src_p = (Ez_uint32 *)src->pixels_rgba,
-              *dst_p = (Ez_uint32 *)dst->pixels_rgba;
+/*
+ * Remove an entry from the cache and free it.
+*/
 
-    /* We set the rotation center to 0,0 and we retrieve the center
-       coordinates dst_x,dst_y in dst */
-    ez_rotate_get_coords (theta, src_w, src_h, 0, 0, &dst_x, &dst_y);
+void ez_tcache_remove (Ez_tcache_entry *entry)
+{
+    Ez_tcache_entry **p;
 
-    for (t = y = 0, dy = -dst_y; y < dst_h; y++, dy++)
-    for (    x = 0, dx = -dst_x; x < dst_w; x++, dx++, t++)
-    {
-        /* Coordinates of real antecedent and closest integer */
-        sx = c*dx - s*dy; xn = EZ_ROUND(sx);
-        sy = s*dx + c*dy; yn = EZ_ROUND(sy);
+    for (p = &ez_tcache.bucket[entry->hash]; *p != entry; p = &(*p)->hnext) ;
+    *p = entry->hnext;
+    ez_tcache_unlink (entry);
+    if (entry->sprev != NULL) entry->sprev->snext = entry->snext;
+    else entry->src->tcache = entry->snext;
+    if (entry->snext != NULL) entry->snext->sprev = entry->sprev;
+    ez_tcache.nb--;
+    ez_tcache.bytes -= entry->bytes;
 
-        /* Antecedent outside? */
-        if (xn < 0 || xn >= src_w || yn < 0 || yn >= src_h)
-             dst_p[t] = 0;
-        else dst_p[t] = src_p[yn * src_w + xn];
-    }
+    ez_image_destroy (entry->img);
+    ez_pixmap_destroy (entry->pix);
+    free (entry);
 }
 
 
-void ez_image_rotate_bilinear (Ez_image *src, Ez_image *dst, double theta)
-{
-    double a = theta*M_PI/180, c = cos(-a), s = sin(-a), sx, sy;
-    int x, y, t, dx, dy, dst_x, dst_y,
-        src_w = src->width, src_h = src->height,
-        dst_w = dst->width, dst_h = dst->height;
-    Ez_uint8 *src_p = src->pixels_rgba, *dst_p = dst->pixels_rgba;
-
-    /* We set the rotation center to 0,0 and we retrieve the center
-       coordinates dst_x,dst_y in dst */
-    ez_rotate_get_coords (theta, src_w, src_h, 0, 0, &dst_x, &dst_y);
-
-    for (t = y = 0, dy = -dst_y; y < dst_h; y++, dy++)
-    for (    x = 0, dx = -dst_x; x < dst_w; x++, dx++, t+=4)
-    {
-        /* Coordinates of real antecedent */
-        sx = c*dx - s*dy;
-        sy = s*dx + c*dy;
+/*
+ * Free the least recently used entries while the budget is exceeded;
+ * the most recently used entry is kept.
+*/
 
-        ez_bilinear_4points (src_p, dst_p, src_w, src_h, sx, sy, t);
-    }
+void ez_tcache_evict (void)
+{
+    while (ez_tcache.bytes > ez_tcache.budget && ez_tcache.last != NULL &&
+           ez_tcache.last != ez_tcache.first)
+        ez_tcache_remove (ez_tcache.last);
 }
 
 
-void ez_bilinear_4points (Ez_uint8 *src_p, Ez_uint8 *dst_p,
-    int src_w, int src_h, double sx, double sy, int t)
-{
-    double rx0, rx1, ry0, ry1, r00, r01, r10, r11;
-    int x0, y0, x1, y1, k00, k01, k10, k11;
-
-    /* Antecedent outside? */
-    if (sx < -0.5 || sx >= src_w-0.5 || sy < -0.5 || sy >= src_h-0.5) {
-        dst_p[t] = dst_p[t+1] = dst_p[t+2] = dst_p[t+3] = 0;
-        return;
-    }
+/*
+ * Free all the entries computed from the image img, which is destroyed
+ * or modified; they are listed in img->tcache.
+*/
 
-    /* Neighbors of real antecedent reel on the grid */
-    x0 = sx < 0 ? sx-1 : sx; x1 = x0+1;
-    y0 = sy < 0 ? sy-1 : sy; y1 = y0+1;
+void ez_tcache_purge (Ez_image *img)
+{
+    while (img->tcache != NULL)
+        ez_tcache_remove (img->tcache);
+}
 
-    /* Real distance */
-    rx0 = sx-x0; rx1 = x1-sx;
-    ry0 = sy-y0; ry1 = y1-sy;
-    r00 = ry0*rx0; r01 = ry0*rx1;
-    r10 = ry1*rx0; r11 = ry1*rx1;
 
-    /* Neighbours offsets */
-    k00 = (y0 * src_w + x0)*4; k01 = k00 + 4;
-    k10 = k00 + src_w*4;       k11 = k10 + 4;
+/*
+ * Cache of decoded image files, see ez_image_load_cached.
+*/
 
-    /* Neighbour outside? We take the neighbour inside */
-    if      (x0 < 0     ) k00 = k01, k10 = k11;
-    else if (x1 >= src_w) k01 = k00, k11 = k10;
-    if      (y0 < 0     ) k00 = k10, k01 = k11;
-    else if (y1 >= src_h) k10 = k00, k11 = k01;
+unsigned long ez_icache_hash (const char *filename)
+{
+    unsigned long h = 5381;
 
-    /* Bilinear interpolation of colors and alpha channel */
-    dst_p[t  ] = r11*src_p[k00  ] + r10*src_p[k01  ] + r01*src_p[k10  ] + r00*src_p[k11  ];
-    dst_p[t+1] = r11*src_p[k00+1] + r10*src_p[k01+1] + r01*src_p[k10+1] + r00*src_p[k11+1];
-    dst_p[t+2] = r11*src_p[k00+2] + r10*src_p[k01+2] + r01*src_p[k10+2] + r00*src_p[k11+2];
-    dst_p[t+3] = r11*src_p[k00+3] + r10*src_p[k01+3] + r01*src_p[k10+3] + r00*src_p[k11+3];
+    while (*filename) h = h * 33 + (unsigned char) *filename++;
+    return h % EZ_ICACHE_BUCKETS;
 }
 
 
-void ez_bilinear_pane (Ez_uint8 *src_p, Ez_uint8 *dst_p,
-    int src_w, int src_h, double sx, double sy, int t, double factor)
+/*
+ * Insert an entry first in the LRU list.
+*/
+
+void ez_icache_link (Ez_icache_entry *entry)
 {
-    double d = 1/factor, d2 = d*d, r = d/2, v, rx, ry,
-           mx0 = sx-r, my0 = sy-r, mx1 = sx+r, my1 = sy+r;
-    int x, y, i,
-        x0 = EZ_ROUND (mx0), y0 = EZ_ROUND (my0),
-        x1 = EZ_ROUND (mx1), y1 = EZ_ROUND (my1);
+    entry->prev = NULL;
+    entry->next = ez_icache.first;
+    if (ez_icache.first != NULL) ez_icache.first->prev = entry;
+    else ez_icache.last = entry;
+    ez_icache.first = entry;
+}
 
-    if (x0 < 0) x0 = 0; else if (x1 > src_w-1) x1 = src_w-1;
-    if (y0 < 0) y0 = 0; else if (y1 > src_h-1) y1 = src_h-1;
 
-    if (x0 >= x1 || y0 >= y1) {
-        dst_p[t] = dst_p[t+1] = dst_p[t+2] = dst_p[t+3] = 0;
-        return;
-    }
+/*
+ * Remove an entry from the LRU list.
+*/
 
-    for (i = 0; i < 4; i++) {
-        v = 0;
-        for (x = x0; x <= x1; x++)
-        for (y = y0; y <= y1; y++) {
-            rx = x == x0 ? x0+0.5-mx0 : x == x1 ? mx1-x1+0.5 : 1;
-            ry = y == y0 ? y0+0.5-my0 : y == y1 ? my1-y1+0.5 : 1;
-            v += src_p[(y*src_w+x)*4+i] * rx * ry;
-        }
-        dst_p[t+i] = v / d2;
-    }
+void ez_icache_unlink (Ez_icache_entry *entry)
+{
+    if (entry->prev != NULL) entry->prev->next = entry->next;
+    else ez_icache.first = entry->next;
+    if (entry->next != NULL) entry->next->prev = entry->prev;
+    else ez_icache.last = entry->prev;
 }
 
 
 /*
- * Operations on Ez_pixmap
+ * Remove an entry from the cache and free it; the image is kept while
+ * it has views.
 */
 
-#ifdef EZ_BASE_XLIB
-
-int ez_pixmap_build_map (Ez_pixmap *pix, Ez_image *img)
+void ez_icache_remove (Ez_icache_entry *entry)
 {
-    XImage *xi = NULL;
-    ez_xi_func xi_func;
-
-    pix->map = XCreatePixmap (ezx.display, ezx.root_win,
-        img->width, img->height, ezx.depth);
-    if (pix->map == None) return -1;
-
-    xi_func = ez_xi_get_func ();
-    xi = ez_xi_create (img, 0, 0, img->width, img->height, xi_func);
-    if (xi == NULL) return -1;
+    Ez_icache_entry **p;
 
-    XPutImage (ezx.display, pix->map, ezx.gc, xi, 0, 0, 0, 0,
-        img->width, img->height);
-    XDestroyImage (xi);
+    for (p = &ez_icache.bucket[entry->hash]; *p != entry; p = &(*p)->hnext) ;
+    *p = entry->hnext;
+    ez_icache_unlink (entry);
+    ez_icache.nb--;
+    ez_icache.bytes -= entry->bytes;
 
-    return 0;
+    ez_image_destroy (entry->img);
+    free (entry->filename);
+    free (entry);
 }
 
 
-void ez_pixmap_draw_area (Ez_window win, Ez_pixmap *pix, int x, int y)
+/*
+ * Free the least recently used entries while the budget is exceeded;
+ * the most recently used entry is kept.
+*/
+
+void ez_icache_evict (void)
 {
-    if (pix->mask != None) {
-        XSetClipOrigin (ezx.display, ezx.gc, x, y);
-        XSetClipMask (ezx.display, ezx.gc, pix->mask);
-    }
+    while (ez_icache.bytes > ez_icache.budget && ez_icache.last != NULL &&
+           ez_icache.last != ez_icache.first)
+        ez_icache_remove (ez_icache.last);
+}
 
-    XCopyArea(ezx.display, pix->map, win, ezx.gc, 0, 0,
-        pix->width, pix->height, x, y);
 
-    if (pix->mask != None) {
-        XSetClipOrigin (ezx.display, ezx.gc, 0, 0);
-        XSetClipMask (ezx.display, ezx.gc, None);
-    }
-}
+#ifdef EZ_BASE_XLIB
 
+/*
+ * Draw n sprites of a same pixmap, which do not overlap, in the drawable d
+ * of size win_w,win_h. The masks of the sprites are composed in a single
+ * clip mask, so each sprite costs 2 requests instead of 5.
+*/
 
-void ez_pixmap_tile_area (Ez_window win, Ez_pixmap *pix, int x, int y, int w, int h)
+void ez_sprite_draw_group (Drawable d, Ez_sprite *sprite, int n,
+    int win_w, int win_h)
 {
-    int nx, ny;
-
-    for (ny = 0; ny < h; ny += pix->height)
-    for (nx = 0; nx < w; nx += pix->width)
-    {
-        if (pix->mask != None) {
-            XSetClipOrigin (ezx.display, ezx.gc, x+nx, y+ny);
-            XSetClipMask (ezx.display, ezx.gc, pix->mask);
-        }
+    Ez_pixmap *pix = sprite[0].pix;
+    int i, x1, y1, x2, y2;
 
-        XCopyArea(ezx.display, pix->map, win, ezx.gc, 0, 0,
-            nx+pix->width  <= w ? pix->width  : w-nx,
-            ny+pix->height <= h ? pix->height : h-ny,
-            x+nx, y+ny);
+    if (pix->mask == None) {
+        for (i = 0; i < n; i++)
+            XCopyArea (ezx.display, pix->map, d, ezx.gc,
+                sprite[i].src_x, sprite[i].src_y, sprite[i].w, sprite[i].h,
+                sprite[i].x, sprite[i].y);
+        return;
     }
 
-    if (pix->mask != None) {
+    if (n == 1) {
+        XSetClipOrigin (ezx.display, ezx.gc, sprite->x - sprite->src_x,
+            sprite->y - sprite->src_y);
+        XSetClipMask (ezx.display, ezx.gc, pix->mask);
+        XCopyArea (ezx.display, pix->map, d, ezx.gc,
+            sprite->src_x, sprite->src_y, sprite->w, sprite->h,
+            sprite->x, sprite->y);
         XSetClipOrigin (ezx.display, ezx.gc, 0, 0);
         XSetClipMask (ezx.display, ezx.gc, None);
+        return;
     }
-}
-
-#elif defined EZ_BASE_WIN32
-
-int ez_pixmap_build_hmap (Ez_pixmap *pix, Ez_image *img)
-{
-    HDC root_dc = NULL, pix_dc = NULL;
-    int status = -1;
 
-    root_dc = GetDC (NULL);
-    if (root_dc == NULL) return -1;
+    /* Bounding box of the sprites in the window */
+    x1 = win_w; y1 = win_h; x2 = y2 = 0;
+    for (i = 0; i < n; i++) {
+        if (sprite[i].x < x1) x1 = sprite[i].x;
+        if (sprite[i].y < y1) y1 = sprite[i].y;
+        if (sprite[i].x + sprite[i].w > x2) x2 = sprite[i].x + sprite[i].w;
+        if (sprite[i].y + sprite[i].h > y2) y2 = sprite[i].y + sprite[i].h;
+    }
+    if (x1 < 0) x1 = 0;
+    if (y1 < 0) y1 = 0;
+    if (x2 > win_w) x2 = win_w;
+    if (y2 > win_h) y2 = win_h;
+    if (x1 >= x2 || y1 >= y2) return;
 
-    pix->hmap = CreateCompatibleBitmap (root_dc, img->width, img->height);
-    if (pix->hmap == NULL) goto final;
+    if (ez_sprite_mask_alloc (x2-x1, y2-y1) < 0) return;
 
-    pix_dc = CreateCompatibleDC (root_dc);
-    if (pix_dc == NULL) goto final;
-    SelectObject (pix_dc, pix->hmap);
+    /* Compose the masks */
+    XFillRectangle (ezx.display, ez_batch.mask, ez_batch.mask_gc,
+        0, 0, x2-x1, y2-y1);
+    for (i = 0; i < n; i++)
+        XCopyArea (ezx.display, pix->mask, ez_batch.mask, ez_batch.mask_gc,
+            sprite[i].src_x, sprite[i].src_y, sprite[i].w, sprite[i].h,
+            sprite[i].x - x1, sprite[i].y - y1);
 
-    ez_image_draw_dib (pix_dc, img, 0, 0, 0, 0, img->width, img->height);
-    status = 0;
+    XSetClipOrigin (ezx.display, ezx.gc, x1, y1);
+    XSetClipMask (ezx.display, ezx.gc, ez_batch.mask);
 
-  final :
-    if (root_dc != NULL) ReleaseDC (NULL, root_dc);
-    if (pix_dc != NULL) DeleteDC (pix_dc);
+    for (i = 0; i < n; i++)
+        XCopyArea (ezx.display, pix->map, d, ezx.gc,
+            sprite[i].src_x, sprite[i].src_y, sprite[i].w, sprite[i].h,
+            sprite[i].x, sprite[i].y);
 
-    return status;
+    XSetClipOrigin (ezx.display, ezx.gc, 0, 0);
+    XSetClipMask (ezx.display, ezx.gc, None);
 }
 
 
-void ez_pixmap_draw_hmap (HDC hdc_dst, Ez_pixmap *pix, int x, int y)
-{
-    HDC hdc = NULL;
+/*
+ * Allocate the mask used to compose the masks of the sprites, with a size
+ * at least w,h. The mask is kept between the batches.
+ * Return 0 on success, -1 on error.
+*/
 
-    /* Create a DC for the bitmap */
-    hdc = CreateCompatibleDC(hdc_dst);
-    if (hdc == NULL) {
-        ez_error ("ez_pixmap_draw_hmap: can't create compatible DC\n");
-        return;
-    }
-    SelectObject (hdc, pix->hmap);
+int ez_sprite_mask_alloc (int w, int h)
+{
+    if (ez_batch.mask != None && w <= ez_batch.mask_w && h <= ez_batch.mask_h)
+        return 0;
 
-    if (pix->has_alpha) {
-        BLENDFUNCTION bf;
+    if (w < ez_batch.mask_w) w = ez_batch.mask_w;
+    if (h < ez_batch.mask_h) h = ez_batch.mask_h;
+    if (ez_batch.mask != None) XFreePixmap (ezx.display, ez_batch.mask);
+    ez_batch.mask_w = ez_batch.mask_h = 0;
 
-        bf.BlendOp = AC_SRC_OVER;
-        bf.BlendFlags = 0;
-        bf.AlphaFormat = AC_SRC_ALPHA;  /* Alpha channel premultiplied */
-        bf.SourceConstantAlpha = 0xff;
+    ez_batch.mask = XCreatePixmap (ezx.display, ezx.root_win, w, h, 1);
+    if (ez_batch.mask == None) {
+        ez_error ("ez_sprite_mask_alloc: can't create pixmap\n");
+        return -1;
+    }
 
-        if (AlphaBlend (hdc_dst, x, y, pix->width, pix->height, hdc,
-                0, 0, pix->width, pix->height, bf) == FALSE)
-            ez_error ("ez_pixmap_draw_hmap: AlphaBlend failed\n");
-    } else {
-        if (BitBlt (hdc_dst, x, y, pix->width, pix->height, hdc,
-                0, 0, SRCCOPY ) == 0)
-            ez_error ("ez_pixmap_draw_hmap: bitblt failed\n");
+    /* The foreground 0 of this GC is used to clear the mask */
+    if (ez_batch.mask_gc == NULL) {
+        ez_batch.mask_gc = XCreateGC (ezx.display, ez_batch.mask, 0, NULL);
+        if (ez_batch.mask_gc == NULL) {
+            ez_error ("ez_sprite_mask_alloc: can't create GC\n");
+            XFreePixmap (ezx.display, ez_batch.mask);
+            ez_batch.mask = None;
+            return -1;
+        }
+        XSetForeground (ezx.display, ez_batch.mask_gc, 0);
     }
 
-    if (hdc != NULL) DeleteDC (hdc);
+    ez_batch.mask_w = w; ez_batch.mask_h = h;
+    return 0;
 }
 
+#elif defined EZ_BASE_WIN32
+
+/*
+ * Draw n sprites of a same pixmap in hdc_dst, with a single memory DC.
+*/
 
-void ez_pixmap_tile_hmap (HDC hdc_dst, Ez_pixmap *pix, int x, int y, int w, int h)
+void ez_sprite_draw_group (HDC hdc_dst, Ez_sprite *sprite, int n)
 {
+    Ez_pixmap *pix = sprite[0].pix;
     HDC hdc = NULL;
-    int nx, ny, nw, nh;
     BLENDFUNCTION bf;
+    int i;
 
     /* Create a DC for the bitmap */
     hdc = CreateCompatibleDC(hdc_dst);
     if (hdc == NULL) {
-        ez_error ("ez_pixmap_tile_hmap: can't create compatible DC\n");
+        ez_error ("ez_sprite_draw_group: can't create compatible DC\n");
         return;
     }
     SelectObject (hdc, pix->hmap);
@@ -1443,33 +6332,242 @@ void ez_pixmap_tile_hmap (HDC hdc_dst, Ez_pixmap *pix, int x, int y, int w, int
         bf.SourceConstantAlpha = 0xff;
     }
 
-    for (ny = 0; ny < h; ny += pix->height)
-    for (nx = 0; nx < w; nx += pix->width)
-    {
-        nw = nx+pix->width  <= w ? pix->width  : w-nx;
-        nh = ny+pix->height <= h ? pix->height : h-ny;
-
+    for (i = 0; i < n; i++) {
         if (pix->has_alpha) {
-            if (AlphaBlend (hdc_dst, x+nx, y+ny, nw, nh, hdc,
-                    0, 0, nw, nh, bf) == FALSE) {
-                ez_error ("ez_pixmap_tile_hmap: AlphaBlend failed\n");
-                goto final;
+            if (AlphaBlend (hdc_dst, sprite[i].x, sprite[i].y,
+                    sprite[i].w, sprite[i].h, hdc, sprite[i].src_x,
+                    sprite[i].src_y, sprite[i].w, sprite[i].h, bf) == FALSE) {
+                ez_error ("ez_sprite_draw_group: AlphaBlend failed\n");
+                break;
             }
         } else {
-            if (BitBlt (hdc_dst, x+nx, y+ny, nw, nh, hdc, 0, 0, SRCCOPY ) == 0) {
-                ez_error ("ez_pixmap_tile_hmap: bitblt failed\n");
-                goto final;
+            if (BitBlt (hdc_dst, sprite[i].x, sprite[i].y,
+                    sprite[i].w, sprite[i].h, hdc, sprite[i].src_x,
+                    sprite[i].src_y, SRCCOPY) == 0) {
+                ez_error ("ez_sprite_draw_group: bitblt failed\n");
+                break;
             }
         }
     }
 
-  final:
-    if (hdc != NULL) DeleteDC (hdc);
+    DeleteDC (hdc);
+}
+
+#endif /* EZ_BASE_ */
+
+
+/*
+ * Map the file filename in memory, in copy-on-write mode, in pack->data.
+ * Return 0 on success, else -1.
+*/
+
+#ifdef EZ_BASE_XLIB
+
+int ez_pack_map (Ez_pack *pack, const char *filename)
+{
+    struct stat st;
+    void *data;
+    int fd;
+
+    fd = open (filename, O_RDONLY);
+    if (fd < 0) return -1;
+    if (fstat (fd, &st) < 0 || st.st_size < (off_t) sizeof (Ez_pack_header)) {
+        close (fd);
+        return -1;
+    }
+    data = mmap (NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close (fd);
+    if (data == MAP_FAILED) return -1;
+
+    pack->data = data;
+    pack->size = st.st_size;
+    return 0;
+}
+
+
+void ez_pack_unmap (Ez_pack *pack)
+{
+    if (pack->data != NULL) munmap (pack->data, pack->size);
+    pack->data = NULL;
+}
+
+#elif defined EZ_BASE_WIN32
+
+int ez_pack_map (Ez_pack *pack, const char *filename)
+{
+    DWORD size;
+
+    pack->hfile = CreateFileA (filename, GENERIC_READ, FILE_SHARE_READ, NULL,
+        OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (pack->hfile == INVALID_HANDLE_VALUE) return -1;
+
+    size = GetFileSize (pack->hfile, NULL);
+    if (size == INVALID_FILE_SIZE || size < sizeof (Ez_pack_header)) {
+        CloseHandle (pack->hfile);
+        return -1;
+    }
+    pack->hmap = CreateFileMapping (pack->hfile, NULL, PAGE_WRITECOPY,
+        0, 0, NULL);
+    if (pack->hmap == NULL) {
+        CloseHandle (pack->hfile);
+        return -1;
+    }
+    pack->data = MapViewOfFile (pack->hmap, FILE_MAP_COPY, 0, 0, 0);
+    if (pack->data == NULL) {
+        CloseHandle (pack->hmap);
+        CloseHandle (pack->hfile);
+        return -1;
+    }
+
+    pack->size = size;
+    return 0;
+}
+
+
+void ez_pack_unmap (Ez_pack *pack)
+{
+    if (pack->data == NULL) return;
+    UnmapViewOfFile (pack->data);
+    CloseHandle (pack->hmap);
+    CloseHandle (pack->hfile);
+    pack->data = NULL;
 }
 
 #endif /* EZ_BASE_ */
 
 
+/*
+ * Check the header and the index of the pack, and set pack->entry.
+ * Return 0 on success, else -1.
+*/
+
+int ez_pack_check (Ez_pack *pack)
+{
+    Ez_pack_header *header = (Ez_pack_header *) pack->data;
+    Ez_pack_entry *entry;
+    int i;
+
+    if (memcmp (header->magic, EZ_PACK_MAGIC, 4) != 0 ||
+        header->order != EZ_PACK_ORDER || header->version != EZ_PACK_VERSION ||
+        header->entry_nb > (pack->size - sizeof (Ez_pack_header)) /
+            sizeof (Ez_pack_entry))
+        return -1;
+
+    pack->entry = (Ez_pack_entry *) (pack->data + sizeof (Ez_pack_header));
+    pack->entry_nb = header->entry_nb;
+
+    for (i = 0; i < pack->entry_nb; i++) {
+        entry = pack->entry + i;
+        if (entry->name[EZ_PACK_NAME-1] != 0 ||
+            /* width*4, height and stride are used as int */
+            entry->width > 0x7fffffff / 4 || entry->height > 0x7fffffff ||
+            entry->stride > 0x7fffffff ||
+            entry->stride < entry->width*4 || entry->stride % 4 != 0 ||
+            entry->offset % EZ_IMAGE_ALIGN != 0 ||
+            entry->offset > pack->size ||
+            (size_t) entry->stride * entry->height > pack->size - entry->offset)
+            return -1;
+    }
+    return 0;
+}
+
+
+/*
+ * Drop a reference to pack, taken by ez_pack_open or by an image of
+ * ez_pack_get_image; the file is unmapped when the last one is dropped.
+*/
+
+void ez_pack_release (Ez_pack *pack)
+{
+    int refcount;
+
+    ez_image_lock ();
+    refcount = --pack->refcount;
+    ez_image_unlock ();
+    if (refcount > 0) return;
+
+    ez_pack_unmap (pack);
+    free (pack);
+}
+
+
+/*
+ * Encode img in QOI format, see ez_stbi_qoi_load; the alpha is ignored if
+ * img->has_alpha is false.
+ * Return the data, to free, and their size in *len, else NULL.
+*/
+
+Ez_uint8 *ez_qoi_encode (Ez_image *img, size_t *len)
+{
+    Ez_uint8 index[64][4], prev[4] = { 0, 0, 0, 255 }, px[4], *data, *o, *p;
+    int channels = img->has_alpha ? 4 : 3, run = 0, x, y, h;
+    int vr, vg, vb, vg_r, vg_b;
+
+    /* Worst case: each pixel in an OP_RGBA, plus the header and the end */
+    data = malloc ((size_t) img->width * img->height * 5 + 14 + 8);
+    if (data == NULL) return NULL;
+    memset (index, 0, sizeof (index));
+
+    o = data;
+    memcpy (o, "qoif", 4);
+    o[4] = img->width  >> 24; o[5] = img->width  >> 16;
+    o[6] = img->width  >>  8; o[7] = img->width;
+    o[8] = img->height >> 24; o[9] = img->height >> 16;
+    o[10] = img->height >> 8; o[11] = img->height;
+    o[12] = channels;
+    o[13] = 0;                      /* sRGB with linear alpha */
+    o += 14;
+
+    for (y = 0; y < img->height; y++)
+    for (x = 0, p = EZ_IMAGE_PIXEL (img, 0, y); x < img->width; x++, p += 4) {
+        memcpy (px, p, 4);
+        if (channels == 3) px[3] = 255;
+
+        if (memcmp (px, prev, 4) == 0) {
+            if (++run == 62) { *o++ = EZ_QOI_OP_RUN | (run-1); run = 0; }
+            continue;
+        }
+        if (run > 0) { *o++ = EZ_QOI_OP_RUN | (run-1); run = 0; }
+
+        h = EZ_QOI_HASH (px);
+        if (memcmp (index[h], px, 4) == 0) {
+            *o++ = EZ_QOI_OP_INDEX | h;
+        } else if (px[3] == prev[3]) {
+            memcpy (index[h], px, 4);
+            vr = (signed char) (px[0] - prev[0]);
+            vg = (signed char) (px[1] - prev[1]);
+            vb = (signed char) (px[2] - prev[2]);
+            vg_r = vr - vg;
+            vg_b = vb - vg;
+            if (vr >= -2 && vr <= 1 && vg >= -2 && vg <= 1 &&
+                vb >= -2 && vb <= 1) {
+                *o++ = EZ_QOI_OP_DIFF | (vr+2) << 4 | (vg+2) << 2 | (vb+2);
+            } else if (vg_r >= -8 && vg_r <= 7 && vg >= -32 && vg <= 31 &&
+                vg_b >= -8 && vg_b <= 7) {
+                *o++ = EZ_QOI_OP_LUMA | (vg+32);
+                *o++ = (vg_r+8) << 4 | (vg_b+8);
+            } else {
+                *o++ = EZ_QOI_OP_RGB;
+                *o++ = px[0]; *o++ = px[1]; *o++ = px[2];
+            }
+        } else {
+            memcpy (index[h], px, 4);
+            *o++ = EZ_QOI_OP_RGBA;
+            *o++ = px[0]; *o++ = px[1]; *o++ = px[2]; *o++ = px[3];
+        }
+        memcpy (prev, px, 4);
+    }
+    if (run > 0) *o++ = EZ_QOI_OP_RUN | (run-1);
+
+    /* End marker */
+    memcpy (o, "\0\0\0\0\0\0\0\1", 8);
+    o += 8;
+
+    *len = o - data;
+    return data;
+}
+
+
 /*---------------------------------------------------------------------------
  *
  * Image files loading.
@@ -1482,6 +6580,7 @@ void ez_pixmap_tile_hmap (HDC hdc_dst, Ez_pixmap *pix, int x, int y, int w, int
  *    PNG 8-bit-per-channel only
  *    BMP non-1bpp, non-RLE
  *    GIF (*comp always reports as 4-channel)
+ *    QOI (added, not in stb_image.c)
  *
  * Main contributors (see original sources):
  *    Sean Barrett (jpeg, png, bmp)
@@ -1545,15 +6644,7 @@ void ez_pixmap_tile_hmap (HDC hdc_dst, Ez_pixmap *pix, int x, int y, int w, int
   #define EZ_INLINE __forceinline
 #endif
 
-#ifdef _MSC_VER
-#define EZ_STBI_HAS_LROTL
-#endif
-
-#ifdef EZ_STBI_HAS_LROTL
-  #define EZ_LROT(x,y)  _lrotl(x,y)
-#else
-  #define EZ_LROT(x,y)  (((x) << (y)) | ((x) >> (32 - (y))))
-#endif
+typedef unsigned long long Ez_uint64;
 
 
 /*
@@ -1576,6 +6667,10 @@ typedef struct {
 
     Ez_uint8 *img_buffer, *img_buffer_end;
     Ez_uint8 *img_buffer_original;
+
+    Ez_scratch *scratch;            /* Buffers of the decoders, can be NULL */
+    int png_partial;                /* Decode only the beginning of a PNG */
+    int jpeg_scale;                 /* Decode a JPEG at 1/1, 1/2, 1/4, 1/8 */
 } Ez_stbi;
 
 
@@ -1588,6 +6683,9 @@ void ez_stbi_start_mem (Ez_stbi *s, Ez_uint8 const *buffer, int len)
 {
     s->io.read = NULL;
     s->read_from_callbacks = 0;
+    s->scratch = NULL;
+    s->png_partial = 0;
+    s->jpeg_scale = 1;
     s->img_buffer = s->img_buffer_original = (Ez_uint8 *) buffer;
     s->img_buffer_end = (Ez_uint8 *) buffer+len;
 }
@@ -1599,6 +6697,9 @@ void ez_stbi_start_callbacks (Ez_stbi *s, Ez_stbi_io_callbacks *c, void *user)
 {
     s->io = *c;
     s->io_user_data = user;
+    s->scratch = NULL;
+    s->png_partial = 0;
+    s->jpeg_scale = 1;
     s->buflen = sizeof (s->buffer_start);
     s->read_from_callbacks = 1;
     s->img_buffer_original = s->buffer_start;
@@ -1655,6 +6756,9 @@ int       ez_stbi_bmp_info  (Ez_stbi *s, int *x, int *y, int *comp);
 int       ez_stbi_gif_test  (Ez_stbi *s);
 Ez_uint8 *ez_stbi_gif_load  (Ez_stbi *s, int *x, int *y, int *comp, int req_comp);
 int       ez_stbi_gif_info  (Ez_stbi *s, int *x, int *y, int *comp);
+int       ez_stbi_qoi_test  (Ez_stbi *s);
+Ez_uint8 *ez_stbi_qoi_load  (Ez_stbi *s, int *x, int *y, int *comp, int req_comp);
+int       ez_stbi_qoi_info  (Ez_stbi *s, int *x, int *y, int *comp);
 
 
 void ez_stbi_image_free (void *retval_from_stbi_load)
@@ -1670,6 +6774,7 @@ Ez_uint8 *ez_stbi_load_main (Ez_stbi *s, int *x, int *y, int *comp,
     if (ez_stbi_png_test (s))  return ez_stbi_png_load  (s, x, y, comp, req_comp);
     if (ez_stbi_bmp_test (s))  return ez_stbi_bmp_load  (s, x, y, comp, req_comp);
     if (ez_stbi_gif_test (s))  return ez_stbi_gif_load  (s, x, y, comp, req_comp);
+    if (ez_stbi_qoi_test (s))  return ez_stbi_qoi_load  (s, x, y, comp, req_comp);
 
     ez_error ("ez_stbi_load_main: image not of any known type, or corrupt\n");
     return NULL;
@@ -1691,6 +6796,32 @@ Ez_uint8 *ez_stbi_load (char const *filename, int *x, int *y, int *comp,
 }
 
 
+Ez_uint8 *ez_stbi_load_scratch (char const *filename, Ez_scratch *sc,
+    int *x, int *y, int *comp, int req_comp)
+{
+    return ez_stbi_load_scale (filename, sc, 1, x, y, comp, req_comp);
+}
+
+
+Ez_uint8 *ez_stbi_load_scale (char const *filename, Ez_scratch *sc,
+    int scale, int *x, int *y, int *comp, int req_comp)
+{
+    FILE *f = fopen (filename, "rb");
+    Ez_stbi s;
+    Ez_uint8 *result;
+    if (!f) {
+        ez_error ("ez_stbi_load: unable to open file \"%s\"\n", filename);
+        return NULL;
+    }
+    ez_start_file (&s, f);
+    s.scratch = sc;
+    s.jpeg_scale = scale;
+    result = ez_stbi_load_main (&s, x, y, comp, req_comp);
+    fclose (f);
+    return result;
+}
+
+
 Ez_uint8 *ez_stbi_load_from_file (FILE *f, int *x, int *y, int *comp,
     int req_comp)
 {
@@ -1860,8 +6991,8 @@ Ez_uint8 ez_convert_comp_y (int r, int g, int b)
 }
 
 
-Ez_uint8 *ez_convert_format (Ez_uint8 *data, int img_n, int req_comp,
-    Ez_uint x, Ez_uint y)
+Ez_uint8 *ez_convert_format (Ez_scratch *sc, Ez_uint8 *data, int img_n,
+    int req_comp, Ez_uint x, Ez_uint y)
 {
     int i, j;
     Ez_uint8 *good;
@@ -1872,9 +7003,9 @@ Ez_uint8 *ez_convert_format (Ez_uint8 *data, int img_n, int req_comp,
         return NULL;
     }
 
-    good = malloc (req_comp * x * y);
+    good = ez_scratch_alloc (sc, req_comp * x * y);
     if (good == NULL) {
-        free (data);
+        ez_scratch_free (sc, data);
         ez_error ("ez_convert_format: out of memory\n");
         return NULL;
     }
@@ -1916,7 +7047,7 @@ Ez_uint8 *ez_convert_format (Ez_uint8 *data, int img_n, int req_comp,
         #undef CASE
     }
 
-    free (data);
+    ez_scratch_free (sc, data);
     return good;
 }
 
@@ -1959,10 +7090,31 @@ typedef struct {
     Ez_uint8  size[257];
     unsigned int maxcode[18];
     int       delta[17];   /* old 'firstsymbol' - old 'firstcode' */
+    Ez_int16  fast_ac[1 << EZ_FAST_BITS];  /* see ez_build_fast_ac */
 } Ez_huffman;
 
+/* Kernels of the decoder, scalar or SIMD, see ez_jpeg_get_kernels */
 typedef struct {
+    void (*idct_block) (Ez_uint8 *out, int out_stride, short data[64],
+        Ez_uint8 *dequantize);
+    Ez_uint8 *(*resample_h_2) (Ez_uint8 *out, Ez_uint8 *in_near,
+        Ez_uint8 *in_far, int w, int hs);
+    Ez_uint8 *(*resample_hv_2) (Ez_uint8 *out, Ez_uint8 *in_near,
+        Ez_uint8 *in_far, int w, int hs);
+    void (*YCbCr_to_RGB) (Ez_uint8 *out, const Ez_uint8 *y,
+        const Ez_uint8 *pcb, const Ez_uint8 *pcr, int count, int step);
+} Ez_jpeg_kernels;
+
+typedef struct Ez_jpeg {
     Ez_stbi *s;
+    Ez_jpeg_kernels *kernels;
+    /* Size of the decoded blocks: 8, or 4, 2, 1 for a reduced loading,
+       and zigzag index of the last coefficient used by idct */
+    int block, block_last;
+    int (*decode_block) (struct Ez_jpeg *j, short data[64], Ez_huffman *hdc,
+        Ez_huffman *hac, int b);
+    void (*idct) (Ez_uint8 *out, int out_stride, short data[64],
+        Ez_uint8 *dequantize);
     Ez_huffman huff_dc[4];
     Ez_huffman huff_ac[4];
     Ez_uint8 dequant[4][64];
@@ -1986,7 +7138,7 @@ typedef struct {
         Ez_uint8 *linebuf;
     } img_comp[4];
 
-    Ez_uint32  code_buffer; /* jpeg entropy-coded buffer */
+    Ez_uint64  code_buffer; /* jpeg entropy-coded buffer, first bit on top */
     int        code_bits;   /* number of valid bits */
     Ez_uint8   marker;      /* marker seen while filling entropy buffer */
     int        nomore;      /* flag if we saw a marker so must stop */
@@ -1999,6 +7151,13 @@ typedef struct {
 int ez_build_huffman (Ez_huffman *h, int *count)
 {
     int i, j, k=0, code;
+    /* At most 256 symbols */
+    for (i=0; i < 16; ++i) k += count[i];
+    if (k > 256) {
+        ez_error ("ez_build_huffman: corrupt JPEG: too many codes\n");
+        return 0;
+    }
+    k = 0;
     /* Build size list for each symbol (from JPEG spec) */
     for (i=0; i < 16; ++i)
         for (j=0; j < count[i]; ++j)
@@ -2037,33 +7196,76 @@ int ez_build_huffman (Ez_huffman *h, int *count)
             }
         }
     }
-    return 1;
+    return 1;
+}
+
+
+/*
+ * Build the table of the AC codes which are decoded in one lookup: for
+ * the EZ_FAST_BITS next bits, if they hold both a code and the bits of
+ * its value, the entry is (value << 8) + (run << 4) + total length;
+ * else 0. Must be called once the values of h are read.
+*/
+
+void ez_build_fast_ac (Ez_huffman *h)
+{
+    int i;
+    for (i=0; i < (1 << EZ_FAST_BITS); ++i) {
+        int fast = h->fast[i];
+        h->fast_ac[i] = 0;
+        if (fast < 255) {
+            int rs = h->values[fast];
+            int run = rs >> 4, magbits = rs & 15, len = h->size[fast];
+            if (magbits && len + magbits <= EZ_FAST_BITS) {
+                /* The bits of the value follow the code, then extend */
+                int k = ((i << len) & ((1 << EZ_FAST_BITS)-1)) >>
+                        (EZ_FAST_BITS - magbits);
+                if (k < (1 << (magbits-1))) k += 1 - (1 << magbits);
+                if (k >= -128 && k <= 127)
+                    h->fast_ac[i] = (Ez_int16) (k*256 + run*16 + len+magbits);
+            }
+        }
+    }
 }
 
 
+/*
+ * Fill the bit reservoir beyond 56 bits. The bytes are taken directly in
+ * the buffer until a 0xff; the stuffed 0xff 00, the markers and the refill
+ * of the buffer go through the slow path. After a marker, 0s are added.
+*/
+
 void ez_grow_buffer_unsafe (Ez_jpeg *j)
 {
-    do {
-        int b = j->nomore ? 0 : ez_buffer_get8 (j->s);
+    Ez_stbi *s = j->s;
+
+    while (j->code_bits <= 56) {
+        int b;
+        if (!j->nomore) {
+            Ez_uint8 *p = s->img_buffer, *end = s->img_buffer_end;
+            while (j->code_bits <= 56 && p < end && *p != 0xff) {
+                j->code_buffer |= (Ez_uint64) *p++ << (56 - j->code_bits);
+                j->code_bits += 8;
+            }
+            s->img_buffer = p;
+            if (j->code_bits > 56) return;
+        }
+
+        b = j->nomore ? 0 : ez_buffer_get8 (s);
         if (b == 0xff) {
-            int c = ez_buffer_get8 (j->s);
+            int c = ez_buffer_get8 (s);
             if (c != 0) {
                 j->marker = (Ez_uint8) c;
                 j->nomore = 1;
-                return;
+                continue;
             }
         }
-        j->code_buffer |= b << (24 - j->code_bits);
+        j->code_buffer |= (Ez_uint64) b << (56 - j->code_bits);
         j->code_bits += 8;
-    } while (j->code_bits <= 24);
+    }
 }
 
 
-/* (1 << n) - 1 */
-Ez_uint32 bmask[17] = {0, 1, 3, 7, 15, 31, 63, 127, 255, 511, 1023, 2047, 4095,
-    8191, 16383, 32767, 65535};
-
-
 /* Decode a jpeg huffman value from the bitstream */
 
 EZ_INLINE int ez_jpeg_decode (Ez_jpeg *j, Ez_huffman *h)
@@ -2071,16 +7273,15 @@ EZ_INLINE int ez_jpeg_decode (Ez_jpeg *j, Ez_huffman *h)
     unsigned int temp;
     int c, k;
 
+    /* Codes have at most 16 bits */
     if (j->code_bits < 16) ez_grow_buffer_unsafe (j);
 
     /* Look at the top EZ_FAST_BITS and determine what symbol ID it is,
        if the code is <= EZ_FAST_BITS */
-    c = (j->code_buffer >> (32 - EZ_FAST_BITS)) & ((1 << EZ_FAST_BITS)-1);
+    c = (int) (j->code_buffer >> (64 - EZ_FAST_BITS));
     k = h->fast[c];
     if (k < 255) {
         int s = h->size[k];
-        if (s > j->code_bits)
-            return -1;
         j->code_buffer <<= s;
         j->code_bits -= s;
         return h->values[k];
@@ -2092,7 +7293,7 @@ EZ_INLINE int ez_jpeg_decode (Ez_jpeg *j, Ez_huffman *h)
        end; in other words, regardless of the number of bits, it
        wants to be compared against something shifted to have 16;
        that way we don't need to shift inside the loop. */
-    temp = j->code_buffer >> 16;
+    temp = (unsigned int) (j->code_buffer >> 48);
     for (k=EZ_FAST_BITS+1 ; ; ++k)
         if (temp < h->maxcode[k])
             break;
@@ -2102,12 +7303,9 @@ EZ_INLINE int ez_jpeg_decode (Ez_jpeg *j, Ez_huffman *h)
         return -1;
     }
 
-    if (k > j->code_bits)
-        return -1;
-
     /* Convert the huffman code to the symbol id */
-    c = ((j->code_buffer >> (32 - k)) & bmask[k]) + h->delta[k];
-    if (( ((j->code_buffer) >> (32-h->size[c])) & bmask[h->size[c]]) != h->code[c]) {
+    c = (int) (j->code_buffer >> (64 - k)) + h->delta[k];
+    if ((j->code_buffer >> (64 - h->size[c])) != h->code[c]) {
         ez_error ("ez_jpeg_decode: internal error while converting huffman code\n");
         return 0;
     }
@@ -2124,21 +7322,16 @@ EZ_INLINE int ez_jpeg_decode (Ez_jpeg *j, Ez_huffman *h)
 
 EZ_INLINE int ez_jpeg_extend_receive (Ez_jpeg *j, int n)
 {
-    unsigned int m = 1 << (n-1);
-    unsigned int k;
+    int k;
     if (j->code_bits < n) ez_grow_buffer_unsafe (j);
 
-    k = EZ_LROT (j->code_buffer, n);
-    j->code_buffer = k & ~bmask[n];
-    k &= bmask[n];
+    k = (int) (j->code_buffer >> (64 - n));
+    j->code_buffer <<= n;
     j->code_bits -= n;
 
-    /* The following test is probably a random branch that won't
-       predict well. I tried to table accelerate it but failed.
-       maybe it's compiling as a conditional move? */
-    if (k < m)
-         return (-1 << n) + k + 1;
-    else return k;
+    /* The negative values begin with a 0 bit */
+    if (k < (1 << (n-1))) k += 1 - (1 << n);
+    return k;
 }
 
 
@@ -2167,7 +7360,7 @@ int ez_jpeg_decode_block (Ez_jpeg *j, short data[64], Ez_huffman *hdc,
 {
     int diff, dc, k;
     int t = ez_jpeg_decode (j, hdc);
-    if (t < 0) {
+    if (t < 0 || t > 15) {
         ez_error ("ez_jpeg_decode_block: corrupt JPEG: bad huffman code\n");
         return 0;
     }
@@ -2183,8 +7376,21 @@ int ez_jpeg_decode_block (Ez_jpeg *j, short data[64], Ez_huffman *hdc,
     /* Decode AC components, see JPEG spec */
     k = 1;
     do {
-        int r, s;
-        int rs = ez_jpeg_decode (j, hac);
+        int r, s, rs;
+
+        /* Fast path: code and value in one lookup */
+        if (j->code_bits < 16) ez_grow_buffer_unsafe (j);
+        r = hac->fast_ac[j->code_buffer >> (64 - EZ_FAST_BITS)];
+        if (r) {
+            k += (r >> 4) & 15;
+            s = r & 15;
+            j->code_buffer <<= s;
+            j->code_bits -= s;
+            data[dezigzag[k++]] = (short) (r >> 8);
+            continue;
+        }
+
+        rs = ez_jpeg_decode (j, hac);
         if (rs < 0)  {
             ez_error ("ez_jpeg_decode_block: corrupt JPEG: bad huffman code\n");
             return 0;
@@ -2204,6 +7410,93 @@ int ez_jpeg_decode_block (Ez_jpeg *j, short data[64], Ez_huffman *hdc,
 }
 
 
+/*
+ * Decode a block for a reduced loading: only the block*block coefficients
+ * of lowest frequency are used by the reduced IDCT. They are cleared and
+ * decoded up to the zigzag index block_last; the next ones are skipped.
+*/
+
+int ez_jpeg_decode_block_reduced (Ez_jpeg *j, short data[64],
+    Ez_huffman *hdc, Ez_huffman *hac, int b)
+{
+    int diff, dc, k, c, r, s, rs, last = j->block_last;
+    int t = ez_jpeg_decode (j, hdc);
+    if (t < 0 || t > 15) {
+        ez_error ("ez_jpeg_decode_block: corrupt JPEG: bad huffman code\n");
+        return 0;
+    }
+
+    for (k = 0; k < j->block; k++)
+        memset (data + k*8, 0, j->block * sizeof (data[0]));
+
+    diff = t ? ez_jpeg_extend_receive (j, t) : 0;
+    dc = j->img_comp[b].dc_pred + diff;
+    j->img_comp[b].dc_pred = dc;
+    data[0] = (short) dc;
+
+    /* The coefficients up to last which are outside the kept square are
+       stored too, but not read by the IDCT */
+    k = 1;
+    while (k <= last) {
+        if (j->code_bits < 16) ez_grow_buffer_unsafe (j);
+        r = hac->fast_ac[j->code_buffer >> (64 - EZ_FAST_BITS)];
+        if (r) {
+            k += (r >> 4) & 15;
+            s = r & 15;
+            j->code_buffer <<= s;
+            j->code_bits -= s;
+            if (k <= last) data[dezigzag[k]] = (short) (r >> 8);
+            k++;
+            continue;
+        }
+
+        rs = ez_jpeg_decode (j, hac);
+        if (rs < 0)  {
+            ez_error ("ez_jpeg_decode_block: corrupt JPEG: bad huffman code\n");
+            return 0;
+        }
+        s = rs & 15;
+        r = rs >> 4;
+        if (s == 0) {
+            if (rs != 0xf0) return 1; /* end block */
+            k += 16;
+        } else if ((k += r) <= last) {
+            data[dezigzag[k++]] = (short) ez_jpeg_extend_receive (j, s);
+        } else {
+            if (j->code_bits < s) ez_grow_buffer_unsafe (j);
+            j->code_buffer <<= s;
+            j->code_bits -= s;
+            k++;
+        }
+    }
+
+    /* The next ones are skipped: the bits of the code and of the value
+       are dropped at once, without computing the value */
+    while (k < 64) {
+        if (j->code_bits < 32) ez_grow_buffer_unsafe (j);
+        c = hac->fast[j->code_buffer >> (64 - EZ_FAST_BITS)];
+        if (c < 255) {
+            rs = hac->values[c];
+            s = hac->size[c] + (rs & 15);
+        } else {
+            rs = ez_jpeg_decode (j, hac);
+            if (rs < 0)  {
+                ez_error ("ez_jpeg_decode_block: corrupt JPEG: bad huffman code\n");
+                return 0;
+            }
+            s = rs & 15;
+        }
+        j->code_buffer <<= s;
+        j->code_bits -= s;
+        if ((rs & 15) == 0) {
+            if (rs != 0xf0) break; /* end block */
+            k += 16;
+        } else k += (rs >> 4) + 1;
+    }
+    return 1;
+}
+
+
 /* Take a -128..127 value and clamp it and convert to 0..255 */
 
 EZ_INLINE Ez_uint8 ez_jpeg_clamp (int x)
@@ -2327,6 +7620,282 @@ void ez_jpeg_idct_block (Ez_uint8 *out, int out_stride, short data[64],
 }
 
 
+/*
+ * Reduced IDCTs, for the loading at 1/2, 1/4 or 1/8 of the size (see
+ * ez_image_load_scaled): only the n*n lowest frequencies of the block are
+ * used, with a n-point IDCT, giving n*n pixels. The constants are the
+ * cosines scaled by 8192, with the factor C(u)/2 of the 8-point IDCT so
+ * that the mean of the block is kept. As in ez_jpeg_idct_block, the
+ * dequantized coefficients are taken in int; the columns are descaled by
+ * 2^12 to stay in 32 bits in the second pass.
+*/
+
+#define EZ_IDCT_C4  2896                /* cos(pi/4) / 2 */
+#define EZ_IDCT_C2  3784                /* cos(pi/8) / 2 */
+#define EZ_IDCT_C6  1567                /* cos(3pi/8) / 2 */
+
+#define EZ_IDCT_DQ(k)  (data[k] * dequantize[k])
+
+void ez_jpeg_idct_4x4 (Ez_uint8 *out, int out_stride, short data[64],
+    Ez_stbi_dequantize_t *dequantize)
+{
+    int i, e0, e1, o0, o1, val[16], *v;
+
+    /* Columns */
+    for (i = 0, v = val; i < 4; i++, v++) {
+        if (data[8+i] == 0 && data[16+i] == 0 && data[24+i] == 0) {
+            v[0] = v[4] = v[8] = v[12] =
+                (EZ_IDCT_DQ (i) * EZ_IDCT_C4 + 2048) >> 12;
+            continue;
+        }
+        e0 = (EZ_IDCT_DQ (i) + EZ_IDCT_DQ (16+i)) * EZ_IDCT_C4;
+        e1 = (EZ_IDCT_DQ (i) - EZ_IDCT_DQ (16+i)) * EZ_IDCT_C4;
+        o0 = EZ_IDCT_DQ (8+i) * EZ_IDCT_C2 + EZ_IDCT_DQ (24+i) * EZ_IDCT_C6;
+        o1 = EZ_IDCT_DQ (8+i) * EZ_IDCT_C6 - EZ_IDCT_DQ (24+i) * EZ_IDCT_C2;
+        v[0]  = (e0 + o0 + 2048) >> 12;
+        v[4]  = (e1 + o1 + 2048) >> 12;
+        v[8]  = (e1 - o1 + 2048) >> 12;
+        v[12] = (e0 - o0 + 2048) >> 12;
+    }
+
+    /* Rows, scaled by 2^14; the bias 128 << 14 recenters the values */
+    for (i = 0, v = val; i < 4; i++, v += 4, out += out_stride) {
+        e0 = (v[0] + v[2]) * EZ_IDCT_C4 + (128 << 14) + (1 << 13);
+        e1 = (v[0] - v[2]) * EZ_IDCT_C4 + (128 << 14) + (1 << 13);
+        o0 = v[1] * EZ_IDCT_C2 + v[3] * EZ_IDCT_C6;
+        o1 = v[1] * EZ_IDCT_C6 - v[3] * EZ_IDCT_C2;
+        out[0] = ez_jpeg_clamp ((e0 + o0) >> 14);
+        out[1] = ez_jpeg_clamp ((e1 + o1) >> 14);
+        out[2] = ez_jpeg_clamp ((e1 - o1) >> 14);
+        out[3] = ez_jpeg_clamp ((e0 - o0) >> 14);
+    }
+}
+
+
+void ez_jpeg_idct_2x2 (Ez_uint8 *out, int out_stride, short data[64],
+    Ez_stbi_dequantize_t *dequantize)
+{
+    int a0 = EZ_IDCT_DQ (0), a1 = EZ_IDCT_DQ (1),
+        b0 = EZ_IDCT_DQ (8), b1 = EZ_IDCT_DQ (9),
+        v0 = ((a0 + b0) * EZ_IDCT_C4 + 2048) >> 12,
+        v1 = ((a1 + b1) * EZ_IDCT_C4 + 2048) >> 12,
+        v2 = ((a0 - b0) * EZ_IDCT_C4 + 2048) >> 12,
+        v3 = ((a1 - b1) * EZ_IDCT_C4 + 2048) >> 12,
+        bias = (128 << 14) + (1 << 13);
+
+    out[0] = ez_jpeg_clamp (((v0 + v1) * EZ_IDCT_C4 + bias) >> 14);
+    out[1] = ez_jpeg_clamp (((v0 - v1) * EZ_IDCT_C4 + bias) >> 14);
+    out += out_stride;
+    out[0] = ez_jpeg_clamp (((v2 + v3) * EZ_IDCT_C4 + bias) >> 14);
+    out[1] = ez_jpeg_clamp (((v2 - v3) * EZ_IDCT_C4 + bias) >> 14);
+}
+
+
+/* Only the DC coefficient: the mean of the block */
+
+void ez_jpeg_idct_1x1 (Ez_uint8 *out, int out_stride, short data[64],
+    Ez_stbi_dequantize_t *dequantize)
+{
+    (void) out_stride;
+    out[0] = ez_jpeg_clamp (((EZ_IDCT_DQ (0) + 4) >> 3) + 128);
+}
+
+#undef EZ_IDCT_DQ
+
+
+#ifdef EZ_SIMD_X86
+
+/*
+ * SSE2 version of ez_jpeg_idct_block: the 8 rows of the block are
+ * processed at once, with the products of the rotations merged in pairs
+ * for _mm_madd_epi16, then the block is transposed between the two passes.
+ * The results are the same for the coefficients of valid files, whose
+ * dequantized values and sums fit in 16 bits. Out of this range (corrupt
+ * files), the 16-bit values are saturated instead of wrapping, so the
+ * pixels differ from the scalar version but stay bounded.
+*/
+
+/* Constants of the rotations: even elements for x, odd elements for y */
+#define EZ_DCT_CONST(x, y)  _mm_setr_epi16 ((x),(y),(x),(y),(x),(y),(x),(y))
+
+/* out0 = c0[even]*x + c0[odd]*y, out1 = c1[even]*x + c1[odd]*y, 32 bits */
+#define EZ_DCT_ROT(out0, out1, x, y, c0, c1)                          \
+    __m128i c0##lo = _mm_unpacklo_epi16 ((x), (y));                     \
+    __m128i c0##hi = _mm_unpackhi_epi16 ((x), (y));                     \
+    __m128i out0##_l = _mm_madd_epi16 (c0##lo, c0);                     \
+    __m128i out0##_h = _mm_madd_epi16 (c0##hi, c0);                     \
+    __m128i out1##_l = _mm_madd_epi16 (c0##lo, c1);                     \
+    __m128i out1##_h = _mm_madd_epi16 (c0##hi, c1)
+
+/* out = in << 12, 16 bits to 32 bits */
+#define EZ_DCT_WIDEN(out, in)                                           \
+    __m128i out##_l = _mm_srai_epi32 (                                  \
+        _mm_unpacklo_epi16 (_mm_setzero_si128 (), (in)), 4);            \
+    __m128i out##_h = _mm_srai_epi32 (                                  \
+        _mm_unpackhi_epi16 (_mm_setzero_si128 (), (in)), 4)
+
+#define EZ_DCT_WADD(out, a, b)                                          \
+    __m128i out##_l = _mm_add_epi32 (a##_l, b##_l);                     \
+    __m128i out##_h = _mm_add_epi32 (a##_h, b##_h)
+
+#define EZ_DCT_WSUB(out, a, b)                                          \
+    __m128i out##_l = _mm_sub_epi32 (a##_l, b##_l);                     \
+    __m128i out##_h = _mm_sub_epi32 (a##_h, b##_h)
+
+/* Butterfly a/b, add bias, then shift by s and pack */
+#define EZ_DCT_BFLY(out0, out1, a, b, bias, s)                          \
+    {                                                                   \
+        __m128i abiased_l = _mm_add_epi32 (a##_l, bias);                \
+        __m128i abiased_h = _mm_add_epi32 (a##_h, bias);                \
+        EZ_DCT_WADD (sum, abiased, b);                                  \
+        EZ_DCT_WSUB (dif, abiased, b);                                  \
+        out0 = _mm_packs_epi32 (_mm_srai_epi32 (sum_l, s),              \
+                                _mm_srai_epi32 (sum_h, s));             \
+        out1 = _mm_packs_epi32 (_mm_srai_epi32 (dif_l, s),              \
+                                _mm_srai_epi32 (dif_h, s));             \
+    }
+
+#define EZ_DCT_INTERLEAVE8(a, b)                                        \
+    tmp = a; a = _mm_unpacklo_epi8 (a, b); b = _mm_unpackhi_epi8 (tmp, b)
+
+#define EZ_DCT_INTERLEAVE16(a, b)                                       \
+    tmp = a; a = _mm_unpacklo_epi16 (a, b); b = _mm_unpackhi_epi16 (tmp, b)
+
+/* One 1D IDCT on the 8 rows, same steps as EZ_IDCT_1D */
+#define EZ_DCT_PASS(bias, shift)                                        \
+    {                                                                   \
+        /* Even part */                                                 \
+        EZ_DCT_ROT (t2e, t3e, row2, row6, rot0_0, rot0_1);              \
+        __m128i sum04 = _mm_adds_epi16 (row0, row4);                    \
+        __m128i dif04 = _mm_subs_epi16 (row0, row4);                    \
+        EZ_DCT_WIDEN (t0e, sum04);                                      \
+        EZ_DCT_WIDEN (t1e, dif04);                                      \
+        EZ_DCT_WADD (x0, t0e, t3e);                                     \
+        EZ_DCT_WSUB (x3, t0e, t3e);                                     \
+        EZ_DCT_WADD (x1, t1e, t2e);                                     \
+        EZ_DCT_WSUB (x2, t1e, t2e);                                     \
+        /* Odd part */                                                  \
+        EZ_DCT_ROT (y0o, y2o, row7, row3, rot2_0, rot2_1);              \
+        EZ_DCT_ROT (y1o, y3o, row5, row1, rot3_0, rot3_1);              \
+        __m128i sum17 = _mm_adds_epi16 (row1, row7);                    \
+        __m128i sum35 = _mm_adds_epi16 (row3, row5);                    \
+        EZ_DCT_ROT (y4o, y5o, sum17, sum35, rot1_0, rot1_1);            \
+        EZ_DCT_WADD (x4, y0o, y4o);                                     \
+        EZ_DCT_WADD (x5, y1o, y5o);                                     \
+        EZ_DCT_WADD (x6, y2o, y5o);                                     \
+        EZ_DCT_WADD (x7, y3o, y4o);                                     \
+        EZ_DCT_BFLY (row0, row7, x0, x7, bias, shift);                  \
+        EZ_DCT_BFLY (row1, row6, x1, x6, bias, shift);                  \
+        EZ_DCT_BFLY (row2, row5, x2, x5, bias, shift);                  \
+        EZ_DCT_BFLY (row3, row4, x3, x4, bias, shift);                  \
+    }
+
+__attribute__((target("sse2")))
+void ez_jpeg_idct_block_sse2 (Ez_uint8 *out, int out_stride, short data[64],
+    Ez_stbi_dequantize_t *dequantize)
+{
+    __m128i row0, row1, row2, row3, row4, row5, row6, row7, tmp,
+            zero = _mm_setzero_si128 ();
+
+    __m128i rot0_0 = EZ_DCT_CONST (Ez_f2f (0.5411961f),
+        Ez_f2f (0.5411961f) + Ez_f2f (-1.847759065f));
+    __m128i rot0_1 = EZ_DCT_CONST (Ez_f2f (0.5411961f) + Ez_f2f (0.765366865f),
+        Ez_f2f (0.5411961f));
+    __m128i rot1_0 = EZ_DCT_CONST (Ez_f2f (1.175875602f) + Ez_f2f (-0.899976223f),
+        Ez_f2f (1.175875602f));
+    __m128i rot1_1 = EZ_DCT_CONST (Ez_f2f (1.175875602f),
+        Ez_f2f (1.175875602f) + Ez_f2f (-2.562915447f));
+    __m128i rot2_0 = EZ_DCT_CONST (Ez_f2f (-1.961570560f) + Ez_f2f (0.298631336f),
+        Ez_f2f (-1.961570560f));
+    __m128i rot2_1 = EZ_DCT_CONST (Ez_f2f (-1.961570560f),
+        Ez_f2f (-1.961570560f) + Ez_f2f (3.072711026f));
+    __m128i rot3_0 = EZ_DCT_CONST (Ez_f2f (-0.390180644f) + Ez_f2f (2.053119869f),
+        Ez_f2f (-0.390180644f));
+    __m128i rot3_1 = EZ_DCT_CONST (Ez_f2f (-0.390180644f),
+        Ez_f2f (-0.390180644f) + Ez_f2f (1.501321110f));
+
+    /* Rounding biases of the two passes, see ez_jpeg_idct_block */
+    __m128i bias_0 = _mm_set1_epi32 (512);
+    __m128i bias_1 = _mm_set1_epi32 (65536 + (128<<17));
+
+    /* Load and dequantize, the 32-bit products saturated to 16 bits */
+#define EZ_DCT_LOAD(row, k)                                             \
+    {                                                                   \
+        __m128i d = _mm_loadu_si128 ((__m128i *) (data + k*8));         \
+        __m128i q = _mm_unpacklo_epi8 (                                 \
+            _mm_loadl_epi64 ((__m128i *) (dequantize + k*8)), zero);    \
+        __m128i lo = _mm_mullo_epi16 (d, q), hi = _mm_mulhi_epi16 (d, q); \
+        row = _mm_packs_epi32 (_mm_unpacklo_epi16 (lo, hi),             \
+                               _mm_unpackhi_epi16 (lo, hi));            \
+    }
+    EZ_DCT_LOAD (row0, 0); EZ_DCT_LOAD (row1, 1);
+    EZ_DCT_LOAD (row2, 2); EZ_DCT_LOAD (row3, 3);
+    EZ_DCT_LOAD (row4, 4); EZ_DCT_LOAD (row5, 5);
+    EZ_DCT_LOAD (row6, 6); EZ_DCT_LOAD (row7, 7);
+#undef EZ_DCT_LOAD
+
+    /* Columns */
+    EZ_DCT_PASS (bias_0, 10);
+
+    /* Transpose the 8x8 block of 16 bits */
+    EZ_DCT_INTERLEAVE16 (row0, row4);
+    EZ_DCT_INTERLEAVE16 (row1, row5);
+    EZ_DCT_INTERLEAVE16 (row2, row6);
+    EZ_DCT_INTERLEAVE16 (row3, row7);
+    EZ_DCT_INTERLEAVE16 (row0, row2);
+    EZ_DCT_INTERLEAVE16 (row1, row3);
+    EZ_DCT_INTERLEAVE16 (row4, row6);
+    EZ_DCT_INTERLEAVE16 (row5, row7);
+    EZ_DCT_INTERLEAVE16 (row0, row1);
+    EZ_DCT_INTERLEAVE16 (row2, row3);
+    EZ_DCT_INTERLEAVE16 (row4, row5);
+    EZ_DCT_INTERLEAVE16 (row6, row7);
+
+    /* Rows */
+    EZ_DCT_PASS (bias_1, 17);
+
+    {
+        /* Pack with saturation, which clamps to 0..255 */
+        __m128i p0 = _mm_packus_epi16 (row0, row1);
+        __m128i p1 = _mm_packus_epi16 (row2, row3);
+        __m128i p2 = _mm_packus_epi16 (row4, row5);
+        __m128i p3 = _mm_packus_epi16 (row6, row7);
+
+        /* Transpose the 8x8 block of bytes */
+        EZ_DCT_INTERLEAVE8 (p0, p2);
+        EZ_DCT_INTERLEAVE8 (p1, p3);
+        EZ_DCT_INTERLEAVE8 (p0, p1);
+        EZ_DCT_INTERLEAVE8 (p2, p3);
+        EZ_DCT_INTERLEAVE8 (p0, p2);
+        EZ_DCT_INTERLEAVE8 (p1, p3);
+
+        _mm_storel_epi64 ((__m128i *) out, p0); out += out_stride;
+        _mm_storel_epi64 ((__m128i *) out, _mm_shuffle_epi32 (p0, 0x4e));
+        out += out_stride;
+        _mm_storel_epi64 ((__m128i *) out, p2); out += out_stride;
+        _mm_storel_epi64 ((__m128i *) out, _mm_shuffle_epi32 (p2, 0x4e));
+        out += out_stride;
+        _mm_storel_epi64 ((__m128i *) out, p1); out += out_stride;
+        _mm_storel_epi64 ((__m128i *) out, _mm_shuffle_epi32 (p1, 0x4e));
+        out += out_stride;
+        _mm_storel_epi64 ((__m128i *) out, p3); out += out_stride;
+        _mm_storel_epi64 ((__m128i *) out, _mm_shuffle_epi32 (p3, 0x4e));
+    }
+}
+
+#undef EZ_DCT_CONST
+#undef EZ_DCT_ROT
+#undef EZ_DCT_WIDEN
+#undef EZ_DCT_WADD
+#undef EZ_DCT_WSUB
+#undef EZ_DCT_BFLY
+#undef EZ_DCT_INTERLEAVE8
+#undef EZ_DCT_INTERLEAVE16
+#undef EZ_DCT_PASS
+
+#endif /* EZ_SIMD_X86 */
+
+
 #define EZ_MARKER_NONE  0xff
 
 /* If there's a pending marker from the entropy stream, return that
@@ -2383,9 +7952,10 @@ int ez_jpeg_parse_entropy_coded_data (Ez_jpeg *z)
         int h = (z->img_comp[n].y+7) >> 3;
         for (j=0; j < h; ++j) {
             for (i=0; i < w; ++i) {
-                if (!ez_jpeg_decode_block (z, data, z->huff_dc+z->img_comp[n].hd,
+                if (!z->decode_block (z, data, z->huff_dc+z->img_comp[n].hd,
                     z->huff_ac+z->img_comp[n].ha, n)) return 0;
-                ez_jpeg_idct_block (z->img_comp[n].data+z->img_comp[n].w2*j*8+i*8,
+                z->idct (z->img_comp[n].data +
+                    (z->img_comp[n].w2*j + i) * z->block,
                     z->img_comp[n].w2, data, z->dequant[z->img_comp[n].tq]);
 
                 /* Every data block is an MCU, so countdown the restart interval */
@@ -2410,13 +7980,13 @@ int ez_jpeg_parse_entropy_coded_data (Ez_jpeg *z)
                        determined by the basic H and V specified for the component */
                     for (y=0; y < z->img_comp[n].v; ++y) {
                         for (x=0; x < z->img_comp[n].h; ++x) {
-                            int x2 = (i*z->img_comp[n].h + x)*8;
-                            int y2 = (j*z->img_comp[n].v + y)*8;
-                            if (!ez_jpeg_decode_block (z, data,
+                            int x2 = (i*z->img_comp[n].h + x)*z->block;
+                            int y2 = (j*z->img_comp[n].v + y)*z->block;
+                            if (!z->decode_block (z, data,
                                 z->huff_dc+z->img_comp[n].hd,
                                 z->huff_ac+z->img_comp[n].ha, n)) return 0;
 
-                            ez_jpeg_idct_block (
+                            z->idct (
                                 z->img_comp[n].data+z->img_comp[n].w2*y2+x2,
                                 z->img_comp[n].w2, data,
                                 z->dequant[z->img_comp[n].tq]);
@@ -2505,6 +8075,7 @@ int ez_jpeg_process_marker (Ez_jpeg *z, int m)
                 }
                 for (i=0; i < m; ++i)
                     v[i] = ez_buffer_get8u (z->s);
+                if (tc != 0) ez_build_fast_ac (z->huff_ac+th);
                 L -= m;
             }
             return L==0;
@@ -2640,6 +8211,20 @@ int ez_jpeg_process_frame_header (Ez_jpeg *z, int scan)
         if (z->img_comp[i].v > v_max) v_max = z->img_comp[i].v;
     }
 
+    /* The blocks are decoded in 8x8 pixels, or less for a reduced loading */
+    switch (s->jpeg_scale) {
+        case 2 : z->block = 4; z->block_last = 24;
+                 z->idct = ez_jpeg_idct_4x4; break;
+        case 4 : z->block = 2; z->block_last = 4;
+                 z->idct = ez_jpeg_idct_2x2; break;
+        case 8 : z->block = 1; z->block_last = 0;
+                 z->idct = ez_jpeg_idct_1x1; break;
+        default: z->block = 8; z->block_last = 63;
+                 z->idct = z->kernels->idct_block;
+    }
+    z->decode_block = z->block < 8 ? ez_jpeg_decode_block_reduced :
+                                     ez_jpeg_decode_block;
+
     /* Compute interleaved mcu info */
     z->img_h_max = h_max;
     z->img_v_max = v_max;
@@ -2656,12 +8241,13 @@ int ez_jpeg_process_frame_header (Ez_jpeg *z, int scan)
            the bogus oversized data from using interleaved MCUs and their
            big blocks (e.g. a 16x16 iMCU on an image of width 33); we won't
            discard the extra data until colorspace conversion */
-        z->img_comp[i].w2 = z->img_mcu_x * z->img_comp[i].h * 8;
-        z->img_comp[i].h2 = z->img_mcu_y * z->img_comp[i].v * 8;
-        z->img_comp[i].raw_data = malloc (z->img_comp[i].w2 * z->img_comp[i].h2+15);
+        z->img_comp[i].w2 = z->img_mcu_x * z->img_comp[i].h * z->block;
+        z->img_comp[i].h2 = z->img_mcu_y * z->img_comp[i].v * z->block;
+        z->img_comp[i].raw_data = ez_scratch_alloc (z->s->scratch,
+            z->img_comp[i].w2 * z->img_comp[i].h2+15);
         if (z->img_comp[i].raw_data == NULL) {
             for (--i; i >= 0; --i) {
-                free (z->img_comp[i].raw_data);
+                ez_scratch_free (z->s->scratch, z->img_comp[i].raw_data);
                 z->img_comp[i].data = NULL;
             }
             ez_error ("ez_jpeg_process_frame_header: out of memory\n");
@@ -2834,6 +8420,112 @@ Ez_uint8 *ez_jpeg_resample_row_hv_2 (Ez_uint8 *out, Ez_uint8 *in_near,
 }
 
 
+#ifdef EZ_SIMD_X86
+
+/*
+ * SSE2 versions of ez_jpeg_resample_row_h_2 and _hv_2, giving the same
+ * results: 8 input samples at once, widened to 16 bits. The neighbours
+ * are the current samples shifted by one, completed by the samples around.
+ * The last input sample is left to the scalar code, which handles the edge.
+*/
+
+__attribute__((target("sse2")))
+Ez_uint8 *ez_jpeg_resample_row_h_2_sse2 (Ez_uint8 *out, Ez_uint8 *in_near,
+    Ez_uint8 *in_far, int w, int hs)
+{
+    __m128i zero = _mm_setzero_si128 (), bias = _mm_set1_epi16 (2);
+    Ez_uint8 *input = in_near;
+    int i = 0;
+
+    if (w == 1) {
+        out[0] = out[1] = input[0];
+        return out;
+    }
+
+    for (; i < ((w-1) & ~7); i += 8) {
+        __m128i curr = _mm_unpacklo_epi8 (
+                           _mm_loadl_epi64 ((__m128i *) (input + i)), zero);
+        __m128i prev = _mm_insert_epi16 (_mm_slli_si128 (curr, 2),
+                           input[i > 0 ? i-1 : 0], 0);
+        __m128i next = _mm_insert_epi16 (_mm_srli_si128 (curr, 2),
+                           input[i+8], 7);
+        /* 3*curr + neighbour + 2 */
+        __m128i curb = _mm_add_epi16 (_mm_add_epi16 (curr,
+                           _mm_slli_epi16 (curr, 1)), bias);
+        __m128i even = _mm_srli_epi16 (_mm_add_epi16 (curb, prev), 2);
+        __m128i odd  = _mm_srli_epi16 (_mm_add_epi16 (curb, next), 2);
+        _mm_storeu_si128 ((__m128i *) (out + i*2), _mm_packus_epi16 (
+            _mm_unpacklo_epi16 (even, odd), _mm_unpackhi_epi16 (even, odd)));
+    }
+
+    for (; i < w-1; ++i) {
+        int n = 3*input[i]+2;
+        out[i*2+0] = div4 (n + input[i > 0 ? i-1 : 0]);
+        out[i*2+1] = div4 (n + input[i+1]);
+    }
+    out[i*2+0] = div4 (input[w-2]*3 + input[w-1] + 2);
+    out[i*2+1] = input[w-1];
+
+    (void) in_far;
+    (void) hs;
+
+    return out;
+}
+
+
+__attribute__((target("sse2")))
+Ez_uint8 *ez_jpeg_resample_row_hv_2_sse2 (Ez_uint8 *out, Ez_uint8 *in_near,
+    Ez_uint8 *in_far, int w, int hs)
+{
+    __m128i zero = _mm_setzero_si128 (), bias = _mm_set1_epi16 (8);
+    int i = 0, t0, t1;
+
+    if (w == 1) {
+        out[0] = out[1] = div4 (3*in_near[0] + in_far[0] + 2);
+        return out;
+    }
+
+    t1 = 3*in_near[0] + in_far[0];
+    for (; i < ((w-1) & ~7); i += 8) {
+        /* Vertical pass: 3*near + far = 4*near + (far - near) */
+        __m128i farw  = _mm_unpacklo_epi8 (
+                            _mm_loadl_epi64 ((__m128i *) (in_far + i)), zero);
+        __m128i nearw = _mm_unpacklo_epi8 (
+                            _mm_loadl_epi64 ((__m128i *) (in_near + i)), zero);
+        __m128i curr  = _mm_add_epi16 (_mm_slli_epi16 (nearw, 2),
+                            _mm_sub_epi16 (farw, nearw));
+        /* Horizontal pass: 3*curr + neighbour = 4*curr + (neighbour - curr) */
+        __m128i prev = _mm_insert_epi16 (_mm_slli_si128 (curr, 2), t1, 0);
+        __m128i next = _mm_insert_epi16 (_mm_srli_si128 (curr, 2),
+                           3*in_near[i+8] + in_far[i+8], 7);
+        __m128i curb = _mm_add_epi16 (_mm_slli_epi16 (curr, 2), bias);
+        __m128i even = _mm_add_epi16 (_mm_sub_epi16 (prev, curr), curb);
+        __m128i odd  = _mm_add_epi16 (_mm_sub_epi16 (next, curr), curb);
+        _mm_storeu_si128 ((__m128i *) (out + i*2), _mm_packus_epi16 (
+            _mm_srli_epi16 (_mm_unpacklo_epi16 (even, odd), 4),
+            _mm_srli_epi16 (_mm_unpackhi_epi16 (even, odd), 4)));
+        t1 = 3*in_near[i+7] + in_far[i+7];
+    }
+
+    t0 = t1;
+    t1 = 3*in_near[i] + in_far[i];
+    out[i*2] = div16 (3*t1 + t0 + 8);
+    for (++i; i < w; ++i) {
+        t0 = t1;
+        t1 = 3*in_near[i]+in_far[i];
+        out[i*2-1] = div16 (3*t0 + t1 + 8);
+        out[i*2  ] = div16 (3*t1 + t0 + 8);
+    }
+    out[w*2-1] = div4 (t1+2);
+
+    (void) hs;
+
+    return out;
+}
+
+#endif /* EZ_SIMD_X86 */
+
+
 Ez_uint8 *ez_jpeg_resample_row_generic (Ez_uint8 *out, Ez_uint8 *in_near,
     Ez_uint8 *in_far, int w, int hs)
 {
@@ -2879,6 +8571,195 @@ void ez_jpeg_YCbCr_to_RGB_row (Ez_uint8 *out, const Ez_uint8 *y,
 }
 
 
+#ifdef EZ_SIMD_X86
+
+/*
+ * SSE2 and AVX2 versions of ez_jpeg_YCbCr_to_RGB_row for RGBA output,
+ * giving the same results. The 16.16 constants do not fit in 16 bits, so
+ * each one is split into a multiple of 1<<16, added as a shift, and a
+ * remainder which does, for _mm_madd_epi16 on the pairs (cr, cb):
+ *   r = y + cr*26345             + cr<<16
+ *   g = y + cr*18734 - cb*22554  - cr<<16
+ *   b = y            - cb*14942  + cb<<17
+ * The packs with saturation clamp the results to 0..255.
+*/
+
+#define EZ_YCC_R  (Ez_float2fixed (1.40200f) - 65536)
+#define EZ_YCC_GR (65536 - Ez_float2fixed (0.71414f))
+#define EZ_YCC_GB (-Ez_float2fixed (0.34414f))
+#define EZ_YCC_B  (Ez_float2fixed (1.77200f) - 131072)
+
+/* Pair of 16 bits constants for _mm_madd_epi16, cr first */
+#define EZ_YCC_PAIR(c_cr, c_cb) \
+    ((int) ((Ez_uint32) (c_cb) << 16 | ((Ez_uint32) (c_cr) & 0xffff)))
+
+__attribute__((target("sse2")))
+void ez_jpeg_YCbCr_to_RGB_row_sse2 (Ez_uint8 *out, const Ez_uint8 *y,
+    const Ez_uint8 *pcb, const Ez_uint8 *pcr, int count, int step)
+{
+    __m128i zero = _mm_setzero_si128 (), c128 = _mm_set1_epi16 (128),
+            round = _mm_set1_epi32 (32768), alpha = _mm_set1_epi16 (255),
+            k_r = _mm_set1_epi32 (EZ_YCC_PAIR (EZ_YCC_R, 0)),
+            k_g = _mm_set1_epi32 (EZ_YCC_PAIR (EZ_YCC_GR, EZ_YCC_GB)),
+            k_b = _mm_set1_epi32 (EZ_YCC_PAIR (0, EZ_YCC_B));
+    int i = 0;
+
+    if (step == 4)
+        for (; i+8 <= count; i += 8, out += 32) {
+            __m128i y16 = _mm_unpacklo_epi8 (
+                    _mm_loadl_epi64 ((__m128i *) (y + i)), zero),
+                cb16 = _mm_sub_epi16 (_mm_unpacklo_epi8 (
+                    _mm_loadl_epi64 ((__m128i *) (pcb + i)), zero), c128),
+                cr16 = _mm_sub_epi16 (_mm_unpacklo_epi8 (
+                    _mm_loadl_epi64 ((__m128i *) (pcr + i)), zero), c128),
+                crcb_l = _mm_unpacklo_epi16 (cr16, cb16),
+                crcb_h = _mm_unpackhi_epi16 (cr16, cb16),
+                y_l  = _mm_add_epi32 (_mm_unpacklo_epi16 (zero, y16), round),
+                y_h  = _mm_add_epi32 (_mm_unpackhi_epi16 (zero, y16), round),
+                cr_l = _mm_unpacklo_epi16 (zero, cr16),
+                cr_h = _mm_unpackhi_epi16 (zero, cr16),
+                cb_l = _mm_slli_epi32 (_mm_unpacklo_epi16 (zero, cb16), 1),
+                cb_h = _mm_slli_epi32 (_mm_unpackhi_epi16 (zero, cb16), 1),
+                r, g, b, rb, ga, rg, ba;
+
+            r = _mm_packs_epi32 (
+                _mm_srai_epi32 (_mm_add_epi32 (_mm_add_epi32 (y_l, cr_l),
+                    _mm_madd_epi16 (crcb_l, k_r)), 16),
+                _mm_srai_epi32 (_mm_add_epi32 (_mm_add_epi32 (y_h, cr_h),
+                    _mm_madd_epi16 (crcb_h, k_r)), 16));
+            g = _mm_packs_epi32 (
+                _mm_srai_epi32 (_mm_add_epi32 (_mm_sub_epi32 (y_l, cr_l),
+                    _mm_madd_epi16 (crcb_l, k_g)), 16),
+                _mm_srai_epi32 (_mm_add_epi32 (_mm_sub_epi32 (y_h, cr_h),
+                    _mm_madd_epi16 (crcb_h, k_g)), 16));
+            b = _mm_packs_epi32 (
+                _mm_srai_epi32 (_mm_add_epi32 (_mm_add_epi32 (y_l, cb_l),
+                    _mm_madd_epi16 (crcb_l, k_b)), 16),
+                _mm_srai_epi32 (_mm_add_epi32 (_mm_add_epi32 (y_h, cb_h),
+                    _mm_madd_epi16 (crcb_h, k_b)), 16));
+
+            /* r0..r7 b0..b7 and g0..g7 a0..a7, interleaved in RGBA */
+            rb = _mm_packus_epi16 (r, b);
+            ga = _mm_packus_epi16 (g, alpha);
+            rg = _mm_unpacklo_epi8 (rb, ga);
+            ba = _mm_unpackhi_epi8 (rb, ga);
+            _mm_storeu_si128 ((__m128i *) out, _mm_unpacklo_epi16 (rg, ba));
+            _mm_storeu_si128 ((__m128i *) (out+16), _mm_unpackhi_epi16 (rg, ba));
+        }
+
+    ez_jpeg_YCbCr_to_RGB_row (out, y+i, pcb+i, pcr+i, count-i, step);
+}
+
+
+/*
+ * The unpacks and packs work in each 128 bits lane, so the results are in
+ * the order of the pixels except for the final interleaving, which gives
+ * the pixels 0-3 and 8-11 in a register, 4-7 and 12-15 in the other one.
+*/
+
+__attribute__((target("avx2")))
+void ez_jpeg_YCbCr_to_RGB_row_avx2 (Ez_uint8 *out, const Ez_uint8 *y,
+    const Ez_uint8 *pcb, const Ez_uint8 *pcr, int count, int step)
+{
+    __m256i zero = _mm256_setzero_si256 (), c128 = _mm256_set1_epi16 (128),
+            round = _mm256_set1_epi32 (32768), alpha = _mm256_set1_epi16 (255),
+            k_r = _mm256_set1_epi32 (EZ_YCC_PAIR (EZ_YCC_R, 0)),
+            k_g = _mm256_set1_epi32 (EZ_YCC_PAIR (EZ_YCC_GR, EZ_YCC_GB)),
+            k_b = _mm256_set1_epi32 (EZ_YCC_PAIR (0, EZ_YCC_B));
+    int i = 0;
+
+    if (step == 4)
+        for (; i+16 <= count; i += 16, out += 64) {
+            __m256i y16 = _mm256_cvtepu8_epi16 (
+                    _mm_loadu_si128 ((__m128i *) (y + i))),
+                cb16 = _mm256_sub_epi16 (_mm256_cvtepu8_epi16 (
+                    _mm_loadu_si128 ((__m128i *) (pcb + i))), c128),
+                cr16 = _mm256_sub_epi16 (_mm256_cvtepu8_epi16 (
+                    _mm_loadu_si128 ((__m128i *) (pcr + i))), c128),
+                crcb_l = _mm256_unpacklo_epi16 (cr16, cb16),
+                crcb_h = _mm256_unpackhi_epi16 (cr16, cb16),
+                y_l  = _mm256_add_epi32 (_mm256_unpacklo_epi16 (zero, y16), round),
+                y_h  = _mm256_add_epi32 (_mm256_unpackhi_epi16 (zero, y16), round),
+                cr_l = _mm256_unpacklo_epi16 (zero, cr16),
+                cr_h = _mm256_unpackhi_epi16 (zero, cr16),
+                cb_l = _mm256_slli_epi32 (_mm256_unpacklo_epi16 (zero, cb16), 1),
+                cb_h = _mm256_slli_epi32 (_mm256_unpackhi_epi16 (zero, cb16), 1),
+                r, g, b, rb, ga, rg, ba, lo, hi;
+
+            r = _mm256_packs_epi32 (
+                _mm256_srai_epi32 (_mm256_add_epi32 (_mm256_add_epi32 (y_l, cr_l),
+                    _mm256_madd_epi16 (crcb_l, k_r)), 16),
+                _mm256_srai_epi32 (_mm256_add_epi32 (_mm256_add_epi32 (y_h, cr_h),
+                    _mm256_madd_epi16 (crcb_h, k_r)), 16));
+            g = _mm256_packs_epi32 (
+                _mm256_srai_epi32 (_mm256_add_epi32 (_mm256_sub_epi32 (y_l, cr_l),
+                    _mm256_madd_epi16 (crcb_l, k_g)), 16),
+                _mm256_srai_epi32 (_mm256_add_epi32 (_mm256_sub_epi32 (y_h, cr_h),
+                    _mm256_madd_epi16 (crcb_h, k_g)), 16));
+            b = _mm256_packs_epi32 (
+                _mm256_srai_epi32 (_mm256_add_epi32 (_mm256_add_epi32 (y_l, cb_l),
+                    _mm256_madd_epi16 (crcb_l, k_b)), 16),
+                _mm256_srai_epi32 (_mm256_add_epi32 (_mm256_add_epi32 (y_h, cb_h),
+                    _mm256_madd_epi16 (crcb_h, k_b)), 16));
+
+            rb = _mm256_packus_epi16 (r, b);
+            ga = _mm256_packus_epi16 (g, alpha);
+            rg = _mm256_unpacklo_epi8 (rb, ga);
+            ba = _mm256_unpackhi_epi8 (rb, ga);
+            lo = _mm256_unpacklo_epi16 (rg, ba);
+            hi = _mm256_unpackhi_epi16 (rg, ba);
+            _mm256_storeu_si256 ((__m256i *) out,
+                _mm256_permute2x128_si256 (lo, hi, 0x20));
+            _mm256_storeu_si256 ((__m256i *) (out+32),
+                _mm256_permute2x128_si256 (lo, hi, 0x31));
+        }
+
+    ez_jpeg_YCbCr_to_RGB_row_sse2 (out, y+i, pcb+i, pcr+i, count-i, step);
+}
+
+#undef EZ_YCC_R
+#undef EZ_YCC_GR
+#undef EZ_YCC_GB
+#undef EZ_YCC_B
+#undef EZ_YCC_PAIR
+
+#endif /* EZ_SIMD_X86 */
+
+
+/*
+ * Select the kernels of the JPEG decoder for the CPU, the first time.
+ * The decoder can run in several threads, hence the lock.
+*/
+
+Ez_jpeg_kernels *ez_jpeg_get_kernels (void)
+{
+    static Ez_jpeg_kernels kernels = { NULL, NULL, NULL, NULL };
+
+    ez_image_lock ();
+    if (kernels.idct_block == NULL) {
+        kernels.resample_h_2  = ez_jpeg_resample_row_h_2;
+        kernels.resample_hv_2 = ez_jpeg_resample_row_hv_2;
+        kernels.YCbCr_to_RGB  = ez_jpeg_YCbCr_to_RGB_row;
+#ifdef EZ_SIMD_X86
+        __builtin_cpu_init ();
+        if (__builtin_cpu_supports ("sse2")) {
+            kernels.resample_h_2  = ez_jpeg_resample_row_h_2_sse2;
+            kernels.resample_hv_2 = ez_jpeg_resample_row_hv_2_sse2;
+            kernels.YCbCr_to_RGB  = ez_jpeg_YCbCr_to_RGB_row_sse2;
+        }
+        if (__builtin_cpu_supports ("avx2"))
+            kernels.YCbCr_to_RGB  = ez_jpeg_YCbCr_to_RGB_row_avx2;
+        kernels.idct_block = __builtin_cpu_supports ("sse2") ?
+            ez_jpeg_idct_block_sse2 : ez_jpeg_idct_block;
+#else
+        kernels.idct_block = ez_jpeg_idct_block;
+#endif /* EZ_SIMD_X86 */
+    }
+    ez_image_unlock ();
+    return &kernels;
+}
+
+
 /* clean up the temporary component buffers */
 
 void ez_jpeg_cleanup (Ez_jpeg *j)
@@ -2886,11 +8767,11 @@ void ez_jpeg_cleanup (Ez_jpeg *j)
     int i;
     for (i=0; i < j->s->img_n; ++i) {
         if (j->img_comp[i].data) {
-            free (j->img_comp[i].raw_data);
+            ez_scratch_free (j->s->scratch, j->img_comp[i].raw_data);
             j->img_comp[i].data = NULL;
         }
         if (j->img_comp[i].linebuf) {
-            free (j->img_comp[i].linebuf);
+            ez_scratch_free (j->s->scratch, j->img_comp[i].linebuf);
             j->img_comp[i].linebuf = NULL;
         }
     }
@@ -2921,6 +8802,14 @@ Ez_uint8 *ez_jpeg_load_image (Ez_jpeg *z, int *out_x, int *out_y, int *comp,
     /* Load a jpeg image from whichever source */
     if (!ez_jpeg_decode_image (z)) { ez_jpeg_cleanup (z); return NULL; }
 
+    /* Reduced loading: the components are smaller by 8/block */
+    if (z->block < 8) {
+        z->s->img_x = (z->s->img_x * z->block + 7) / 8;
+        z->s->img_y = (z->s->img_y * z->block + 7) / 8;
+        for (n=0; n < z->s->img_n; ++n)
+            z->img_comp[n].y = (z->img_comp[n].y * z->block + 7) / 8;
+    }
+
     /* Determine actual number of components to generate */
     n = req_comp ? req_comp : z->s->img_n;
 
@@ -2943,7 +8832,8 @@ Ez_uint8 *ez_jpeg_load_image (Ez_jpeg *z, int *out_x, int *out_y, int *comp,
 
             /* Allocate line buffer big enough for upsampling off the edges
                with upsample factor of 4 */
-            z->img_comp[k].linebuf = malloc (z->s->img_x + 3);
+            z->img_comp[k].linebuf = ez_scratch_alloc (z->s->scratch,
+                z->s->img_x + 3);
             if (!z->img_comp[k].linebuf) {
                 ez_jpeg_cleanup (z);
                 ez_error ("ez_jpeg_load_image: out of memory\n");
@@ -2959,13 +8849,14 @@ Ez_uint8 *ez_jpeg_load_image (Ez_jpeg *z, int *out_x, int *out_y, int *comp,
 
             if      (r->hs == 1 && r->vs == 1) r->resample = ez_jpeg_resample_row_1;
             else if (r->hs == 1 && r->vs == 2) r->resample = ez_jpeg_resample_row_v_2;
-            else if (r->hs == 2 && r->vs == 1) r->resample = ez_jpeg_resample_row_h_2;
-            else if (r->hs == 2 && r->vs == 2) r->resample = ez_jpeg_resample_row_hv_2;
+            else if (r->hs == 2 && r->vs == 1) r->resample = z->kernels->resample_h_2;
+            else if (r->hs == 2 && r->vs == 2) r->resample = z->kernels->resample_hv_2;
             else                               r->resample = ez_jpeg_resample_row_generic;
         }
 
         /* can't error after this so, this is safe */
-        output = malloc (n * z->s->img_x * z->s->img_y + 1);
+        output = ez_scratch_alloc (z->s->scratch,
+            n * z->s->img_x * z->s->img_y + 1);
         if (!output) {
             ez_jpeg_cleanup (z);
             ez_error ("ez_jpeg_load_image: out of memory\n");
@@ -2992,7 +8883,7 @@ Ez_uint8 *ez_jpeg_load_image (Ez_jpeg *z, int *out_x, int *out_y, int *comp,
             if (n >= 3) {
                 Ez_uint8 *y = coutput[0];
                 if (z->s->img_n == 3) {
-                    ez_jpeg_YCbCr_to_RGB_row (out, y, coutput[1], coutput[2],
+                    z->kernels->YCbCr_to_RGB (out, y, coutput[1], coutput[2],
                         z->s->img_x, n);
                 } else
                     for (i=0; i < z->s->img_x; ++i) {
@@ -3021,6 +8912,7 @@ Ez_uint8 *ez_stbi_jpeg_load (Ez_stbi *s, int *x, int *y, int *comp, int req_comp
 {
     Ez_jpeg j;
     j.s = s;
+    j.kernels = ez_jpeg_get_kernels ();
     return ez_jpeg_load_image (&j, x, y, comp, req_comp);
 }
 
@@ -3038,7 +8930,7 @@ int ez_stbi_jpeg_test (Ez_stbi *s)
 
 int ez_stbi_jpeg_info_raw (Ez_jpeg *j, int *x, int *y, int *comp)
 {
-    if (!ez_jpeg_decode_header (j, EZ_SCAN_HEADER, 1)) {
+    if (!ez_jpeg_decode_header (j, EZ_SCAN_HEADER, 0)) {
         ez_stbi_rewind ( j->s );
         return 0;
     }
@@ -3177,6 +9069,8 @@ typedef struct {
     char *zout_start;
     char *zout_end;
     int   z_expandable;
+    Ez_scratch *scratch;            /* Where zout_start is taken, can be NULL */
+    int   partial;                  /* See Ez_stbi.png_partial */
 
     Ez_zhuffman z_length, z_distance;
 } Ez_zbuf;
@@ -3257,7 +9151,7 @@ int ez_zlib_expand (Ez_zbuf *z, int n)  /* need to make room for n bytes */
     limit = (int) (z->zout_end - z->zout_start);
     while (cur + n > limit)
         limit *= 2;
-    q = realloc (z->zout_start, limit);
+    q = ez_scratch_realloc (z->scratch, z->zout_start, limit);
     if (q == NULL)  {
         ez_error ("ez_zlib_expand: out of memory\n");
         return 0;
@@ -3444,24 +9338,21 @@ int ez_zlib_parse_header (Ez_zbuf *a)
 }
 
 
-/* @TODO: should statically initialize these for optimal thread safety */
-Ez_uint8 default_length[288], default_distance[32];
-
-void ez_zlib_init_defaults (void)
-{
-    int i;   /* use <= to match clearly with spec */
-    for (i=0; i <= 143; ++i)     default_length[i]   = 8;
-    for (   ; i <= 255; ++i)     default_length[i]   = 9;
-    for (   ; i <= 279; ++i)     default_length[i]   = 7;
-    for (   ; i <= 287; ++i)     default_length[i]   = 8;
-
-    for (i=0; i <=  31; ++i)     default_distance[i] = 5;
-}
+/* Statically initialized, so that the threads can decode in parallel */
+#define EZ_REP8(v)  v,v,v,v,v,v,v,v
+#define EZ_REP16(v) EZ_REP8(v),EZ_REP8(v)
+#define EZ_REP32(v) EZ_REP16(v),EZ_REP16(v)
 
+Ez_uint8 default_length[288] = {
+    EZ_REP32(8), EZ_REP32(8), EZ_REP32(8), EZ_REP32(8), EZ_REP16(8),
+                                                 /*   0..143 : 8 */
+    EZ_REP32(9), EZ_REP32(9), EZ_REP32(9), EZ_REP16(9),
+                                                 /* 144..255 : 9 */
+    EZ_REP16(7), EZ_REP8(7),                     /* 256..279 : 7 */
+    EZ_REP8(8)                                   /* 280..287 : 8 */
+};
+Ez_uint8 default_distance[32] = { EZ_REP32(5) };
 
-/* A quick hack to only allow decoding some of a PNG... I should implement
-   real streaming support instead */
-int ez_stbi_png_partial;
 
 int ez_zlib_parse (Ez_zbuf *a, int parse_header)
 {
@@ -3480,7 +9371,6 @@ int ez_zlib_parse (Ez_zbuf *a, int parse_header)
         } else {
             if (type == 1) {
                 /* use fixed code lengths */
-                if (!default_distance[31]) ez_zlib_init_defaults ();
                 if (!ez_zlib_build_huffman (&a->z_length  , default_length  , 288))
                     return 0;
                 if (!ez_zlib_build_huffman (&a->z_distance, default_distance,  32))
@@ -3490,19 +9380,25 @@ int ez_zlib_parse (Ez_zbuf *a, int parse_header)
             }
             if (!ez_zlib_parse_huffman_block (a)) return 0;
         }
-        if (ez_stbi_png_partial && a->zout - a->zout_start > 65536)
+        if (a->partial && a->zout - a->zout_start > 65536)
             break;
     } while (!final);
     return 1;
 }
 
 
-int ez_zlib_do (Ez_zbuf *a, char *obuf, int olen, int exp, int parse_header)
+/* The context s of a PNG decoder gives the scratch and the partial flag;
+   it is NULL for the zlib client functions */
+
+int ez_zlib_do (Ez_zbuf *a, char *obuf, int olen, int exp, int parse_header,
+    Ez_stbi *s)
 {
     a->zout_start = obuf;
     a->zout       = obuf;
     a->zout_end   = obuf + olen;
     a->z_expandable = exp;
+    a->scratch = s != NULL ? s->scratch : NULL;
+    a->partial = s != NULL ? s->png_partial : 0;
 
     return ez_zlib_parse (a, parse_header);
 }
@@ -3515,7 +9411,7 @@ char *ez_stbi_zlib_decode_malloc_guesssize (const char *buffer, int len,
     if (p == NULL) return NULL;
     a.zbuffer = (Ez_uint8 *) buffer;
     a.zbuffer_end = (Ez_uint8 *) buffer + len;
-    if (ez_zlib_do (&a, p, initial_size, 1, 1)) {
+    if (ez_zlib_do (&a, p, initial_size, 1, 1, NULL)) {
         if (outlen) *outlen = (int) (a.zout - a.zout_start);
         return a.zout_start;
     } else {
@@ -3530,19 +9426,20 @@ char *ez_stbi_zlib_decode_malloc (char const *buffer, int len, int *outlen)
 }
 
 
-char *ez_stbi_zlib_decode_malloc_guesssize_headerflag (const char *buffer,
-    int len, int initial_size, int *outlen, int parse_header)
+char *ez_stbi_zlib_decode_malloc_guesssize_headerflag (Ez_stbi *s,
+    const char *buffer, int len, int initial_size, int *outlen,
+    int parse_header)
 {
     Ez_zbuf a;
-    char *p = malloc (initial_size);
+    char *p = ez_scratch_alloc (s->scratch, initial_size);
     if (p == NULL) return NULL;
     a.zbuffer = (Ez_uint8 *) buffer;
     a.zbuffer_end = (Ez_uint8 *) buffer + len;
-    if (ez_zlib_do (&a, p, initial_size, 1, parse_header)) {
+    if (ez_zlib_do (&a, p, initial_size, 1, parse_header, s)) {
         if (outlen) *outlen = (int) (a.zout - a.zout_start);
         return a.zout_start;
     } else {
-        free (a.zout_start);
+        ez_scratch_free (s->scratch, a.zout_start);
         return NULL;
     }
 }
@@ -3554,7 +9451,7 @@ int ez_stbi_zlib_decode_buffer (char *obuffer, int olen, char const *ibuffer,
     Ez_zbuf a;
     a.zbuffer = (Ez_uint8 *) ibuffer;
     a.zbuffer_end = (Ez_uint8 *) ibuffer + ilen;
-    if (ez_zlib_do (&a, obuffer, olen, 0, 1))
+    if (ez_zlib_do (&a, obuffer, olen, 0, 1, NULL))
         return (int) (a.zout - a.zout_start);
     else
         return -1;
@@ -3569,7 +9466,7 @@ char *ez_stbi_zlib_decode_noheader_malloc (char const *buffer, int len,
     if (p == NULL) return NULL;
     a.zbuffer = (Ez_uint8 *) buffer;
     a.zbuffer_end = (Ez_uint8 *) buffer+len;
-    if (ez_zlib_do (&a, p, 16384, 1, 0)) {
+    if (ez_zlib_do (&a, p, 16384, 1, 0, NULL)) {
         if (outlen) *outlen = (int) (a.zout - a.zout_start);
         return a.zout_start;
     } else {
@@ -3585,7 +9482,7 @@ int ez_stbi_zlib_decode_noheader_buffer (char *obuffer, int olen,
     Ez_zbuf a;
     a.zbuffer = (Ez_uint8 *) ibuffer;
     a.zbuffer_end = (Ez_uint8 *) ibuffer + ilen;
-    if (ez_zlib_do (&a, obuffer, olen, 0, 0))
+    if (ez_zlib_do (&a, obuffer, olen, 0, 0, NULL))
         return (int) (a.zout - a.zout_start);
     else
         return -1;
@@ -3676,13 +9573,13 @@ int ez_png_create_image_raw (Ez_png *a, Ez_uint8 *raw, Ez_uint32 raw_len,
         ez_error ("ez_png_create_image_raw: internal error out_n = %d\n", out_n);
         return 0;
     }
-    if (ez_stbi_png_partial) y = 1;
-    a->out = malloc (x * y * out_n);
+    if (s->png_partial) y = 1;
+    a->out = ez_scratch_alloc (s->scratch, x * y * out_n);
     if (!a->out) {
         ez_error ("ez_png_create_image_raw: out of memory\n");
         return 0;
     }
-    if (!ez_stbi_png_partial) {
+    if (!s->png_partial) {
         if (s->img_x == x && s->img_y == y) {
             if (raw_len != (img_n * x + 1) * y) {
                 ez_error ("ez_png_create_image_raw: corrupt PNG: not enough pixels\n");
@@ -3793,11 +9690,11 @@ int ez_png_create_image (Ez_png *a, Ez_uint8 *raw, Ez_uint32 raw_len, int out_n,
     if (!interlaced)
         return ez_png_create_image_raw (a, raw, raw_len, out_n, a->s->img_x,
             a->s->img_y);
-    save = ez_stbi_png_partial;
-    ez_stbi_png_partial = 0;
+    save = a->s->png_partial;
+    a->s->png_partial = 0;
 
     /* De-interlacing */
-    final = malloc (a->s->img_x * a->s->img_y * out_n);
+    final = ez_scratch_alloc (a->s->scratch, a->s->img_x * a->s->img_y * out_n);
     for (p=0; p < 7; ++p) {
         int xorig[] = { 0, 4, 0, 2, 0, 1, 0 };
         int yorig[] = { 0, 0, 4, 0, 2, 0, 1 };
@@ -3809,21 +9706,21 @@ int ez_png_create_image (Ez_png *a, Ez_uint8 *raw, Ez_uint32 raw_len, int out_n,
         y = (a->s->img_y - yorig[p] + yspc[p]-1) / yspc[p];
         if (x && y) {
             if (!ez_png_create_image_raw (a, raw, raw_len, out_n, x, y)) {
-                free (final);
+                ez_scratch_free (a->s->scratch, final);
                 return 0;
             }
             for (j=0; j < y; ++j)
             for (i=0; i < x; ++i)
                 memcpy (final + (j*yspc[p]+yorig[p])*a->s->img_x*out_n +
                     (i*xspc[p]+xorig[p])*out_n, a->out + (j*x+i)*out_n, out_n);
-            free (a->out);
+            ez_scratch_free (a->s->scratch, a->out);
             raw += (x*out_n+1)*y;
             raw_len -= (x*out_n+1)*y;
         }
     }
     a->out = final;
 
-    ez_stbi_png_partial = save;
+    a->s->png_partial = save;
     return 1;
 }
 
@@ -3863,7 +9760,7 @@ int ez_png_expand_palette (Ez_png *a, Ez_uint8 *palette, int len, int pal_img_n)
     Ez_uint32 i, pixel_count = a->s->img_x * a->s->img_y;
     Ez_uint8 *p, *temp_out, *orig = a->out;
 
-    p = malloc (pixel_count * pal_img_n);
+    p = ez_scratch_alloc (a->s->scratch, pixel_count * pal_img_n);
     if (p == NULL) {
         ez_error ("ez_png_expand_palette: out of memory\n");
         return 0;
@@ -3890,7 +9787,7 @@ int ez_png_expand_palette (Ez_png *a, Ez_uint8 *palette, int len, int pal_img_n)
             p += 4;
         }
     }
-    free (a->out);
+    ez_scratch_free (a->s->scratch, a->out);
     a->out = temp_out;
 
     (void) len;
@@ -4066,7 +9963,8 @@ int ez_png_parse_file (Ez_png *z, int scan, int req_comp)
                         idata_limit = c.length > 4096 ? c.length : 4096;
                     while (ioff + c.length > idata_limit)
                         idata_limit *= 2;
-                    p = realloc (z->idata, idata_limit); if (p == NULL) {
+                    p = ez_scratch_realloc (s->scratch, z->idata, idata_limit);
+                    if (p == NULL) {
                         ez_error ("ez_png_parse_file: out of memory\n");
                         return 0;
                     }
@@ -4092,10 +9990,10 @@ int ez_png_parse_file (Ez_png *z, int scan, int req_comp)
                     return 0;
                 }
                 z->expanded = (Ez_uint8 *)
-                    ez_stbi_zlib_decode_malloc_guesssize_headerflag (
+                    ez_stbi_zlib_decode_malloc_guesssize_headerflag (s,
                         (char *) z->idata, ioff, 16384, (int *) &raw_len, 1);
                 if (z->expanded == NULL) return 0; /* zlib should set error */
-                free (z->idata); z->idata = NULL;
+                ez_scratch_free (s->scratch, z->idata); z->idata = NULL;
                 if ((req_comp == s->img_n+1 && req_comp != 3 && !pal_img_n) ||
                     has_trans) s->img_out_n = s->img_n+1;
                 else
@@ -4112,7 +10010,7 @@ int ez_png_parse_file (Ez_png *z, int scan, int req_comp)
                     if (!ez_png_expand_palette (z, palette, pal_len, s->img_out_n))
                         return 0;
                 }
-                free (z->expanded); z->expanded = NULL;
+                ez_scratch_free (s->scratch, z->expanded); z->expanded = NULL;
                 return 1;
             }
 
@@ -4147,7 +10045,7 @@ Ez_uint8 *ez_png_do (Ez_png *p, int *x, int *y, int *n, int req_comp)
         result = p->out;
         p->out = NULL;
         if (req_comp && req_comp != p->s->img_out_n) {
-            result = ez_convert_format (result, p->s->img_out_n, req_comp,
+            result = ez_convert_format (p->s->scratch, result, p->s->img_out_n, req_comp,
                 p->s->img_x, p->s->img_y);
             p->s->img_out_n = req_comp;
             if (result == NULL) return result;
@@ -4156,9 +10054,9 @@ Ez_uint8 *ez_png_do (Ez_png *p, int *x, int *y, int *n, int req_comp)
         *y = p->s->img_y;
         if (n) *n = p->s->img_n;
     }
-    free (p->out);      p->out      = NULL;
-    free (p->expanded); p->expanded = NULL;
-    free (p->idata);    p->idata    = NULL;
+    ez_scratch_free (p->s->scratch, p->out);      p->out      = NULL;
+    ez_scratch_free (p->s->scratch, p->expanded); p->expanded = NULL;
+    ez_scratch_free (p->s->scratch, p->idata);    p->idata    = NULL;
 
     return result;
 }
@@ -4385,7 +10283,7 @@ Ez_uint8 *ez_bmp_load (Ez_stbi *s, int *x, int *y, int *comp, int req_comp)
         target = req_comp;
     else
         target = s->img_n; /* if they want monochrome, we'll post-convert */
-    out = malloc (target * s->img_x * s->img_y);
+    out = ez_scratch_alloc (s->scratch, target * s->img_x * s->img_y);
     if (!out) {
         ez_error ("ez_bmp_load: out of memory\n");
         return NULL;
@@ -4393,7 +10291,7 @@ Ez_uint8 *ez_bmp_load (Ez_stbi *s, int *x, int *y, int *comp, int req_comp)
     if (bpp < 16) {
         int z=0;
         if (psize == 0 || psize > 256) {
-            free (out);
+            ez_scratch_free (s->scratch, out);
             ez_error ("ez_bmp_load: corrupt BMP: bad psize\n");
             return NULL;
         }
@@ -4408,7 +10306,7 @@ Ez_uint8 *ez_bmp_load (Ez_stbi *s, int *x, int *y, int *comp, int req_comp)
         if (bpp == 4) width = (s->img_x + 1) >> 1;
         else if (bpp == 8) width = s->img_x;
         else {
-            free (out);
+            ez_scratch_free (s->scratch, out);
             ez_error ("ez_bmp_load: corrupt BMP: bad pbb\n");
             return NULL;
         }
@@ -4452,7 +10350,7 @@ Ez_uint8 *ez_bmp_load (Ez_stbi *s, int *x, int *y, int *comp, int req_comp)
         }
         if (!easy) {
             if (!mr || !mg || !mb) {
-                free (out);
+                ez_scratch_free (s->scratch, out);
                 ez_error ("ez_bmp_load: corrupt BMP: bad masks\n");
                 return NULL;
             }
@@ -4500,7 +10398,8 @@ Ez_uint8 *ez_bmp_load (Ez_stbi *s, int *x, int *y, int *comp, int req_comp)
     }
 
     if (req_comp && req_comp != target) {
-        out = ez_convert_format (out, target, req_comp, s->img_x, s->img_y);
+        out = ez_convert_format (s->scratch, out, target, req_comp,
+            s->img_x, s->img_y);
         if (out == NULL) return out; /* ez_convert_format frees input on failure */
     }
 
@@ -4810,7 +10709,7 @@ Ez_uint8 *ez_stbi_gif_load_next (Ez_stbi *s, Ez_stbi_gif *g, int *comp,
 
     if (g->out == 0) {
         if (!ez_stbi_gif_header (s, g, comp, 0)) return 0;
-        g->out = malloc (4 * g->w * g->h);
+        g->out = ez_scratch_alloc (s->scratch, 4 * g->w * g->h);
         if (g->out == 0) {
             ez_error ("ez_stbi_gif_load_next: out of memory\n");
             return NULL;
@@ -4820,7 +10719,7 @@ Ez_uint8 *ez_stbi_gif_load_next (Ez_stbi *s, Ez_stbi_gif *g, int *comp,
         /* Animated-gif-only path */
         if (( (g->eflags & 0x1C) >> 2) == 3) {
             old_out = g->out;
-            g->out = malloc (4 * g->w * g->h);
+            g->out = ez_scratch_alloc (s->scratch, 4 * g->w * g->h);
             if (g->out == 0) {
                 ez_error ("ez_stbi_gif_load_next: out of memory\n");
                 return NULL;
@@ -4886,7 +10785,8 @@ Ez_uint8 *ez_stbi_gif_load_next (Ez_stbi *s, Ez_stbi_gif *g, int *comp,
                 if (o == NULL) return NULL;
 
                 if (req_comp && req_comp != 4)
-                    o = ez_convert_format (o, 4, req_comp, g->w, g->h);
+                    o = ez_convert_format (s->scratch, o, 4, req_comp,
+                        g->w, g->h);
                 return o;
             }
 
@@ -4943,6 +10843,123 @@ int ez_stbi_gif_info (Ez_stbi *s, int *x, int *y, int *comp)
 }
 
 
+/*
+ * QOI loader -- the "Quite OK Image" format, see https://qoiformat.org
+ *
+ * The pixels are coded from left to right and top to bottom, relatively to
+ * the previous pixel: same pixel repeated, index in a table of the last
+ * colors seen, small difference, or full value.
+*/
+
+/* ez_buffer_get8 without a call while the buffer is not empty */
+#define EZ_QOI_GET8(s) ((s)->img_buffer < (s)->img_buffer_end ? \
+    *(s)->img_buffer++ : ez_buffer_get8 (s))
+
+
+int ez_qoi_test (Ez_stbi *s)
+{
+    if (ez_buffer_get8 (s) != 'q' || ez_buffer_get8 (s) != 'o' ||
+        ez_buffer_get8 (s) != 'i' || ez_buffer_get8 (s) != 'f') return 0;
+    return 1;
+}
+
+
+int ez_stbi_qoi_test (Ez_stbi *s)
+{
+    int r = ez_qoi_test (s);
+    ez_stbi_rewind (s);
+    return r;
+}
+
+
+int ez_qoi_header (Ez_stbi *s)
+{
+    if (!ez_qoi_test (s)) return 0;
+    s->img_x = ez_buffer_get32 (s);
+    s->img_y = ez_buffer_get32 (s);
+    s->img_n = ez_buffer_get8 (s);
+    ez_buffer_get8 (s);  /* discard colorspace */
+    if (s->img_x == 0 || s->img_y == 0 ||
+        s->img_y > EZ_QOI_PIXELS_MAX / s->img_x) return 0;
+    if (s->img_n != 3 && s->img_n != 4) return 0;
+    return 1;
+}
+
+
+Ez_uint8 *ez_stbi_qoi_load (Ez_stbi *s, int *x, int *y, int *comp, int req_comp)
+{
+    Ez_uint8 index[64][4], px[4] = { 0, 0, 0, 255 }, *out, *o, *end;
+    int b1, b2, vg, run;
+
+    if (!ez_qoi_header (s)) {
+        ez_error ("ez_stbi_qoi_load: corrupt QOI header\n");
+        return NULL;
+    }
+    out = ez_scratch_alloc (s->scratch, (size_t) s->img_x * s->img_y * 4);
+    if (out == NULL) {
+        ez_error ("ez_stbi_qoi_load: out of memory\n");
+        return NULL;
+    }
+    memset (index, 0, sizeof (index));
+
+    end = out + (size_t) s->img_x * s->img_y * 4;
+    for (o = out; o < end; ) {
+        b1 = EZ_QOI_GET8 (s);
+        if (b1 == EZ_QOI_OP_RGB) {
+            px[0] = EZ_QOI_GET8 (s);
+            px[1] = EZ_QOI_GET8 (s);
+            px[2] = EZ_QOI_GET8 (s);
+        } else if (b1 == EZ_QOI_OP_RGBA) {
+            px[0] = EZ_QOI_GET8 (s);
+            px[1] = EZ_QOI_GET8 (s);
+            px[2] = EZ_QOI_GET8 (s);
+            px[3] = EZ_QOI_GET8 (s);
+        } else if ((b1 & EZ_QOI_MASK) == EZ_QOI_OP_INDEX) {
+            memcpy (px, index[b1], 4);
+        } else if ((b1 & EZ_QOI_MASK) == EZ_QOI_OP_DIFF) {
+            px[0] += ((b1 >> 4) & 3) - 2;
+            px[1] += ((b1 >> 2) & 3) - 2;
+            px[2] += ( b1       & 3) - 2;
+        } else if ((b1 & EZ_QOI_MASK) == EZ_QOI_OP_LUMA) {
+            b2 = EZ_QOI_GET8 (s);
+            vg = (b1 & 0x3f) - 32;
+            px[0] += vg - 8 + ((b2 >> 4) & 0x0f);
+            px[1] += vg;
+            px[2] += vg - 8 +  (b2       & 0x0f);
+        } else {
+            /* The run is not stored in index: it is the same pixel */
+            for (run = (b1 & 0x3f) + 1; run > 0 && o < end; run--, o += 4)
+                memcpy (o, px, 4);
+            continue;
+        }
+        memcpy (index[EZ_QOI_HASH (px)], px, 4);
+        memcpy (o, px, 4);
+        o += 4;
+    }
+
+    *x = s->img_x;
+    *y = s->img_y;
+    if (comp) *comp = s->img_n;
+    if (req_comp && req_comp != 4)
+        out = ez_convert_format (s->scratch, out, 4, req_comp,
+            s->img_x, s->img_y);
+    return out;
+}
+
+
+int ez_stbi_qoi_info (Ez_stbi *s, int *x, int *y, int *comp)
+{
+    if (!ez_qoi_header (s)) {
+        ez_stbi_rewind ( s );
+        return 0;
+    }
+    if (x) *x = s->img_x;
+    if (y) *y = s->img_y;
+    if (comp) *comp = s->img_n;
+    return 1;
+}
+
+
 /*
  * Get image dimensions and components without fully decoding
 */
@@ -4953,6 +10970,7 @@ int ez_stbi_info_main (Ez_stbi *s, int *x, int *y, int *comp)
     if (ez_stbi_png_info  (s, x, y, comp)) return 1;
     if (ez_stbi_gif_info  (s, x, y, comp)) return 1;
     if (ez_stbi_bmp_info  (s, x, y, comp)) return 1;
+    if (ez_stbi_qoi_info  (s, x, y, comp)) return 1;
 
     ez_error ("ez_stbi_info_main: image not of any known type, or corrupt\n");
     return 0;
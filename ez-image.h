@@ -19,11 +19,36 @@
 #endif
 
 
-typedef struct {
+/* Alignment of the rows of the images, in bytes */
+#define EZ_IMAGE_ALIGN 64
+
+/* Address of the pixel x,y of an image */
+#define EZ_IMAGE_PIXEL(img, x, y) \
+    ((img)->pixels_rgba + (y)*(img)->stride + (x)*4)
+
+typedef struct Ez_image {
     int width, height;
     Ez_uint8 *pixels_rgba;
+    int stride;                     /* Bytes between two rows */
     int has_alpha;
     int opacity;
+    int has_mipmap;
+    struct Ez_image *mipmap;        /* Next level, half size, or NULL */
+    int premultiplied;              /* Colors multiplied by alpha */
+    int dirty_x, dirty_y, dirty_w, dirty_h;  /* Modified region, or w = 0 */
+    Ez_uint8 *pixels_mem;           /* Allocated memory, or NULL for a view */
+    struct Ez_image *parent;        /* Image viewed, or NULL */
+    int refcount;                   /* 1 + number of views */
+    struct Ez_image *views;         /* Its views, linked by vnext */
+    struct Ez_image *vprev, *vnext; /* In parent->views */
+    struct Ez_lazy *lazy;           /* File to decode, or NULL */
+    int cow;                        /* Pixels shared with the image cache */
+    struct Ez_pack *pack;           /* Pack mapping the pixels, or NULL */
+    struct Ez_tcache_entry *tcache; /* Transformed images computed from it */
+#ifdef EZ_BASE_XLIB
+    Pixmap xmask;                   /* Cached mask of the alpha, or None */
+    int xmask_opacity;              /* Opacity used for xmask */
+#endif /* EZ_BASE_ */
 } Ez_image;
 
 typedef struct {
@@ -36,19 +61,97 @@ typedef struct {
 #endif /* EZ_BASE_ */
 } Ez_pixmap;
 
+typedef struct {
+    int page;                       /* Number of the page */
+    int x, y, width, height;        /* Area in the page */
+} Ez_atlas_item;
+
+typedef struct {
+    Ez_pixmap **page;
+    int page_nb;
+    Ez_atlas_item *item;
+    int item_nb;
+} Ez_atlas;
+
+#define EZ_PACK_NAME 96
+
+typedef struct {
+    char name[EZ_PACK_NAME];        /* Name of the image, ended by 0 */
+    Ez_uint32 width, height, stride;
+    Ez_uint32 flags;                /* EZ_PACK_ALPHA, EZ_PACK_PREMUL */
+    Ez_uint32 offset;               /* Of the pixels in the file */
+    Ez_uint32 reserved[3];
+} Ez_pack_entry;
+
+typedef struct Ez_pack {
+    Ez_uint8 *data;                 /* The file, mapped in memory */
+    size_t size;
+    Ez_pack_entry *entry;
+    int entry_nb;
+    int refcount;                   /* 1 until closed + number of images */
+#ifdef EZ_BASE_WIN32
+    HANDLE hfile, hmap;
+#endif /* EZ_BASE_ */
+} Ez_pack;
+
+/* Scratch buffers reused by the decoders, see ez_image_load_scratch */
+#define EZ_SCRATCH_SLOTS 16
+
+typedef struct {
+    void   *block[EZ_SCRATCH_SLOTS];
+    size_t  size[EZ_SCRATCH_SLOTS];
+    int     used[EZ_SCRATCH_SLOTS];
+} Ez_scratch;
+
 
 /* Public functions */
 
 Ez_image *ez_image_new (void);
 void ez_image_destroy (Ez_image *img);
 Ez_image *ez_image_create (int w, int h);
+Ez_image *ez_image_create_uninit (int w, int h);
 Ez_image *ez_image_dup (Ez_image *img);
+Ez_image *ez_image_view (Ez_image *img, int x, int y, int w, int h);
+int  ez_image_is_view (Ez_image *img);
 Ez_image *ez_image_load (const char *filename);
+Ez_image *ez_image_load_scratch (const char *filename, Ez_scratch *sc);
+Ez_image *ez_image_load_scaled (const char *filename, int max_w, int max_h);
+Ez_image *ez_image_load_lazy (const char *filename);
+int  ez_image_decode (Ez_image *img);
+int  ez_image_unload (Ez_image *img);
+int  ez_image_is_decoded (Ez_image *img);
+void ez_image_lazy_set_budget (long bytes);
+Ez_scratch *ez_scratch_create (void);
+void ez_scratch_destroy (Ez_scratch *sc);
+int ez_image_load_async (const char *filename, Ez_window win, int tag);
+int ez_image_load_many (const char **filenames, int n, Ez_image **img);
+int ez_image_save_qoi (Ez_image *img, const char *filename);
+
+Ez_image *ez_image_load_cached (const char *filename);
+int  ez_image_unshare (Ez_image *img);
+void ez_image_cache_set_budget (long bytes);
+void ez_image_cache_get_stats (long *hits, long *misses, long *bytes,
+    int *nb);
+void ez_image_cache_clear (void);
+
+void ez_image_pool_set_budget (long bytes);
+void ez_image_pool_get_stats (long *live, long *peak, long *pooled,
+    long *hits, long *misses);
+void ez_image_pool_clear (void);
 
 void ez_image_set_alpha (Ez_image *img, int has_alpha);
 int  ez_image_has_alpha (Ez_image *img);
 void ez_image_set_opacity (Ez_image *img, int opacity);
 int  ez_image_get_opacity (Ez_image *img);
+void ez_image_set_mipmap (Ez_image *img, int has_mipmap);
+int  ez_image_has_mipmap (Ez_image *img);
+void ez_image_premultiply (Ez_image *img);
+void ez_image_unpremultiply (Ez_image *img);
+int  ez_image_is_premultiplied (Ez_image *img);
+void ez_image_touch (Ez_image *img);
+void ez_image_add_dirty (Ez_image *img, int x, int y, int w, int h);
+int  ez_image_get_dirty (Ez_image *img, int *x, int *y, int *w, int *h);
+void ez_image_clear_dirty (Ez_image *img);
 
 void ez_image_paint (Ez_window win, Ez_image *img, int x, int y);
 void ez_image_paint_sub (Ez_window win, Ez_image *img, int x, int y,
@@ -60,29 +163,236 @@ void ez_image_blend (Ez_image *dst, Ez_image *src, int dst_x, int dst_y);
 void ez_image_blend_sub (Ez_image *dst, Ez_image *src, int dst_x, int dst_y,
     int src_x, int src_y, int w, int h);
 
+#define EZ_COMP_SRC      0          /* Porter-Duff operators */
+#define EZ_COMP_OVER     1
+#define EZ_COMP_IN       2
+#define EZ_COMP_OUT      3
+#define EZ_COMP_ATOP     4
+#define EZ_COMP_XOR      5
+#define EZ_COMP_ADD      6          /* Blend modes */
+#define EZ_COMP_MULTIPLY 7
+#define EZ_COMP_SCREEN   8
+#define EZ_COMP_DARKEN   9
+#define EZ_COMP_LIGHTEN  10
+#define EZ_COMP_NB       11
+
+void ez_image_composite (Ez_image *dst, Ez_image *src, int op,
+    int dst_x, int dst_y, int src_x, int src_y, int w, int h);
+void ez_image_set_comp_alpha (int alpha);
+
 Ez_image *ez_image_extract (Ez_image *img, int src_x, int src_y, int w, int h);
 Ez_image *ez_image_sym_ver (Ez_image *img);
 Ez_image *ez_image_sym_hor (Ez_image *img);
 Ez_image *ez_image_scale (Ez_image *img, double factor);
+
+#define EZ_RESIZE_NEAREST  0
+#define EZ_RESIZE_BILINEAR 1
+#define EZ_RESIZE_BICUBIC  2
+#define EZ_RESIZE_LANCZOS3 3
+#define EZ_RESIZE_AREA     4
+
+Ez_image *ez_image_resize (Ez_image *img, int w, int h, int filter);
 Ez_image *ez_image_rotate (Ez_image *img, double theta, int quality);
 void ez_image_rotate_point (Ez_image *img, double theta, int src_x, int src_y,
     int *dst_x, int *dst_y);
 
+#define EZ_TRANSFORM_NEAREST  0
+#define EZ_TRANSFORM_BILINEAR 1
+#define EZ_TRANSFORM_AREA     2
+
+Ez_image *ez_image_transform (Ez_image *img, const double m[6], int quality,
+    int bbox[4]);
+
+Ez_image *ez_transform_cache_image (Ez_image *img, double factor, double theta,
+    int sym_hor, int sym_ver, int quality);
+Ez_pixmap *ez_transform_cache_pixmap (Ez_image *img, double factor,
+    double theta, int sym_hor, int sym_ver, int quality);
+void ez_transform_cache_set_budget (long bytes);
+void ez_transform_cache_get_stats (long *hits, long *misses, long *bytes,
+    int *nb);
+void ez_transform_cache_clear (void);
+
 Ez_pixmap *ez_pixmap_new (void);
 void ez_pixmap_destroy (Ez_pixmap *pix);
 Ez_pixmap *ez_pixmap_create_from_image (Ez_image *img);
+int ez_pixmap_update (Ez_pixmap *pix, Ez_image *img, int x, int y,
+    int w, int h);
+int ez_pixmap_update_dirty (Ez_pixmap *pix, Ez_image *img);
 void ez_pixmap_paint (Ez_window win, Ez_pixmap *pix, int x, int y);
+void ez_pixmap_paint_sub (Ez_window win, Ez_pixmap *pix, int x, int y,
+    int src_x, int src_y, int w, int h);
 void ez_pixmap_tile (Ez_window win, Ez_pixmap *pix, int x, int y, int w, int h);
 
+void ez_sprite_batch_begin (Ez_window win);
+void ez_sprite_batch_add (Ez_pixmap *pix, int x, int y);
+void ez_sprite_batch_add_sub (Ez_pixmap *pix, int x, int y,
+    int src_x, int src_y, int w, int h);
+void ez_sprite_batch_end (void);
+
+Ez_atlas *ez_atlas_create (Ez_image **img, int n);
+void ez_atlas_destroy (Ez_atlas *atlas);
+void ez_atlas_paint (Ez_window win, Ez_atlas *atlas, int num, int x, int y);
+void ez_atlas_batch_add (Ez_atlas *atlas, int num, int x, int y);
+
+int ez_pack_build (const char *filename, const char **names, Ez_image **img,
+    int n);
+Ez_pack *ez_pack_open (const char *filename);
+void ez_pack_close (Ez_pack *pack);
+Ez_image *ez_pack_get_image (Ez_pack *pack, const char *name);
+
 
 /* Private functions */
 #ifdef EZ_PRIVATE_DEFS
 
 int ez_image_debug (void);
 
+#define EZ_PACK_MAGIC   "EZPK"
+#define EZ_PACK_ORDER   0x01020304  /* To check the byte order */
+#define EZ_PACK_VERSION 1
+#define EZ_PACK_ALPHA   1
+#define EZ_PACK_PREMUL  2
+
+typedef struct {
+    char magic[4];
+    Ez_uint32 order, version;
+    Ez_uint32 entry_nb;             /* Followed by the entries */
+} Ez_pack_header;
+
+int ez_pack_map (Ez_pack *pack, const char *filename);
+void ez_pack_unmap (Ez_pack *pack);
+int ez_pack_check (Ez_pack *pack);
+void ez_pack_release (Ez_pack *pack);
+
+/* Chunks of the QOI format, see ez_stbi_qoi_load */
+#define EZ_QOI_OP_INDEX 0x00        /* 00xxxxxx */
+#define EZ_QOI_OP_DIFF  0x40        /* 01xxxxxx */
+#define EZ_QOI_OP_LUMA  0x80        /* 10xxxxxx */
+#define EZ_QOI_OP_RUN   0xc0        /* 11xxxxxx */
+#define EZ_QOI_OP_RGB   0xfe        /* 11111110 */
+#define EZ_QOI_OP_RGBA  0xff        /* 11111111 */
+#define EZ_QOI_MASK     0xc0
+#define EZ_QOI_PIXELS_MAX 400000000
+
+#define EZ_QOI_HASH(p) (((p)[0]*3 + (p)[1]*5 + (p)[2]*7 + (p)[3]*11) % 64)
+
+Ez_uint8 *ez_qoi_encode (Ez_image *img, size_t *len);
+
+Ez_image *ez_image_create_pixels (int w, int h, int zero);
+int ez_image_alloc_pixels (Ez_image *img, int w, int h, int zero);
+
+#define EZ_POOL_BUDGET  (32*1024*1024)
+#define EZ_POOL_CLASSES 256
+#define EZ_POOL_MIN     64          /* Size of the smallest blocks */
+
+typedef struct {
+    long budget;                    /* Max bytes kept in the free lists */
+    long live, peak, pooled;        /* Bytes in use, max in use, kept */
+    long hits, misses;
+    void *free_list[EZ_POOL_CLASSES];  /* Linked by their first word */
+} Ez_pool;
+
+size_t ez_pool_class (size_t size, int *num);
+void *ez_pool_alloc (size_t size, int zero);
+void ez_pool_free (void *p, size_t size);
+void ez_pool_trim (long budget);
+
+#ifdef EZ_BASE_XLIB
+#include <pthread.h>
+#endif /* EZ_BASE_ */
+
+Ez_image *ez_image_load_reduced (const char *filename, Ez_scratch *sc,
+    int scale);
+
+/* Lazy images, see ez_image_load_lazy */
+typedef struct Ez_lazy {
+    char *filename;
+    Ez_image *prev, *next;          /* In ez_lazy_list while decoded */
+    int modified;                   /* Pixels modified since decoded */
+} Ez_lazy;
+
+typedef struct {
+    long budget, bytes;             /* Max bytes decoded, 0 = no limit */
+    Ez_image *first, *last;         /* Most recently used first */
+} Ez_lazy_list;
+
+int ez_image_pixels (Ez_image *img);
+int ez_lazy_decode (Ez_image *img);
+void ez_lazy_link (Ez_image *img);
+void ez_lazy_unlink (Ez_image *img);
+void ez_lazy_free_pixels (Ez_image *img);
+void ez_lazy_trim (void);
+
+void ez_image_link_view (Ez_image *img);
+void ez_image_unlink_view (Ez_image *img);
+void ez_image_mark_dirty (Ez_image *img, int x, int y, int w, int h);
+
+void *ez_scratch_alloc (Ez_scratch *sc, size_t size);
+void *ez_scratch_realloc (Ez_scratch *sc, void *p, size_t size);
+void ez_scratch_free (Ez_scratch *sc, void *p);
+void ez_scratch_trim (Ez_scratch *sc);
+
+void ez_image_lock (void);
+void ez_image_unlock (void);
+int ez_cpu_nb (void);
+
+/* Asynchronous loading, see ez_image_load_async */
+#define EZ_LOADER_THREADS_MAX 8
+
+typedef struct Ez_load_job {
+    char *filename;
+    Ez_window win;
+    int tag;
+    Ez_image *img;                  /* Result, NULL on error */
+    struct Ez_load_job *next;
+} Ez_load_job;
+
+typedef struct {
+    int init;                       /* Lock and signal created */
+    int quit;                       /* Set by ez_loader_stop */
+    int thread_nb;                  /* Running threads */
+    Ez_load_job *todo, *todo_last;  /* Files to load */
+    Ez_load_job *done, *done_last;  /* Images to send to the windows */
+#ifdef EZ_BASE_XLIB
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;            /* Signaled when a job is added in todo,
+                                       or a thread stops */
+#elif defined EZ_BASE_WIN32
+    CRITICAL_SECTION mutex;
+    HANDLE sem;                     /* Counts the jobs in todo */
+#endif /* EZ_BASE_ */
+} Ez_loader;
+
+void ez_loader_lock (void);
+void ez_loader_unlock (void);
+void ez_loader_push (Ez_load_job **first, Ez_load_job **last, Ez_load_job *job);
+Ez_load_job *ez_loader_pop (Ez_load_job **first, Ez_load_job **last);
+int ez_loader_start (void);
+void ez_loader_stop (void);
+#ifdef EZ_BASE_XLIB
+void *ez_loader_thread (void *arg);
+#elif defined EZ_BASE_WIN32
+DWORD WINAPI ez_loader_thread (LPVOID arg);
+#endif /* EZ_BASE_ */
+int ez_loader_next (Ez_event *ev);
+
+/* Files shared by the threads of ez_image_load_many */
+typedef struct {
+    const char **filenames;
+    Ez_image **img;
+    int n, next;                    /* Next file to load */
+} Ez_load_many;
+
+#ifdef EZ_BASE_XLIB
+void *ez_load_many_thread (void *arg);
+#elif defined EZ_BASE_WIN32
+DWORD WINAPI ez_load_many_thread (LPVOID arg);
+#endif /* EZ_BASE_ */
+
 int ez_image_confine_sub_coords (Ez_image *img, int *src_x, int *src_y,
     int *w, int *h);
 int ez_confine_coord (int *t, int *r, int tmax);
+int ez_image_confine_comp_coords (Ez_image *dst, Ez_image *src,
+    int *dst_x, int *dst_y, int *src_x, int *src_y, int *w, int *h);
 
 #ifdef EZ_BASE_XLIB
 
@@ -91,6 +401,16 @@ void ez_image_draw_pict (Ez_window win, Ez_image *img, int x, int y,
 
 typedef void (*ez_xi_func)(XImage *, Ez_image *, int, int, int, int);
 
+/* Layout of the pixels in the XImages for the specialized functions */
+typedef struct {
+    int bpp;                /* 32, 24 or 16 bits per pixel */
+    int swap;               /* Words to swap for the byte order of the server */
+    int bytewise;           /* 8 bits channels, aligned on bytes */
+    int shift[3], loss[3];  /* For r, g, b: shift and bits lost */
+    Ez_uint8 index[4];      /* Byte of RGBA for each byte, 0x80 = none */
+    Ez_uint8 shuffle[16];   /* The same for 4 pixels */
+} Ez_xi_layout;
+
 void ez_image_draw_xi (Ez_window win, Ez_image *img, int x, int y,
     int src_x, int src_y, int w, int h);
 XImage *ez_xi_create (Ez_image *img, int src_x, int src_y, int w, int h,
@@ -98,8 +418,15 @@ XImage *ez_xi_create (Ez_image *img, int src_x, int src_y, int w, int h,
 ez_xi_func ez_xi_get_func (void);
 void ez_xi_fill_default (XImage *xi, Ez_image *img, int src_x, int src_y,
     int w, int h);
+void ez_xi_destroy (XImage *xi);
+int ez_xi_layout_init (XImage *xi);
+void ez_xi_fill_32 (XImage *xi, Ez_image *img, int src_x, int src_y,
+    int w, int h);
 void ez_xi_fill_24 (XImage *xi, Ez_image *img, int src_x, int src_y,
     int w, int h);
+void ez_xi_fill_16 (XImage *xi, Ez_image *img, int src_x, int src_y,
+    int w, int h);
+void ez_xi_shuffle_pixel (Ez_uint8 *dst_p, Ez_uint8 *src_p, int nbytes);
 Ez_image *ez_xi_test_create (void);
 int ez_xi_diff (XImage *xi1, XImage *xi2);
 
@@ -107,6 +434,8 @@ Pixmap ez_xmask_create (Ez_window win, Ez_image *img, int src_x, int src_y,
     int w, int h);
 void ez_xmask_fill (Ez_uint8 *data, Ez_image *img,
     int src_x, int src_y, int w, int h);
+void ez_xmask_row_c (Ez_uint8 *dst_p, Ez_uint8 *src_p, int w, int opacity);
+void ez_image_free_xmask (Ez_image *img);
 
 #elif defined EZ_BASE_WIN32
 
@@ -129,31 +458,257 @@ void ez_image_comp_over (Ez_image *dst, Ez_image *src, int dst_x, int dst_y,
 void ez_image_comp_blend (Ez_image *dst, Ez_image *src, int dst_x, int dst_y,
     int src_x, int src_y, int w, int h);
 
+/* x*a/255 rounded, for x*a in 0..255*255 */
+#define EZ_DIV255(x) (((x) + 0x80 + (((x) + 0x80) >> 8)) >> 8)
+
+void ez_premul_row_c (Ez_uint8 *dst_p, Ez_uint8 *src_p, int n);
+void ez_unpremul_row (Ez_uint8 *dst_p, Ez_uint8 *src_p, int n);
+void ez_blend_row_straight (Ez_uint8 *dst_p, Ez_uint8 *src_p, int n);
+void ez_blend_row_c (Ez_uint8 *dst_p, Ez_uint8 *src_p, int n);
+void ez_image_comp_op (Ez_image *dst, Ez_image *src, int op,
+    int dst_x, int dst_y, int src_x, int src_y, int w, int h);
+void ez_comp_row_c (int op, Ez_uint8 *dst_p, Ez_uint8 *src_p, int n,
+    int alpha);
+
 void ez_image_copy_sub (Ez_image *src, Ez_image *dest , int src_x, int src_y);
 void ez_image_comp_symv (Ez_image *src, Ez_image *dst);
 void ez_image_comp_symh (Ez_image *src, Ez_image *dst);
 void ez_image_expand (Ez_image *src, Ez_image *dst, double factor);
-void ez_image_shrink (Ez_image *src, Ez_image *dst, double factor);
+void ez_image_shrink (Ez_image *src, Ez_image *dst);
 void ez_rotate_get_size (double theta, int src_w, int src_h, int *dst_w, int *dst_h);
 void ez_rotate_get_coords (double theta, int src_w, int src_h, int src_x, int src_y,
     int *dst_x, int *dst_y);
 void ez_image_rotate_nearest (Ez_image *src, Ez_image *dst, double theta);
 void ez_image_rotate_bilinear (Ez_image *src, Ez_image *dst, double theta);
-void ez_bilinear_4points (Ez_uint8 *src_p, Ez_uint8 *dst_p,
-    int src_w, int src_h, double sx, double sy, int t);
-void ez_bilinear_pane (Ez_uint8 *src_p, Ez_uint8 *dst_p,
-    int src_w, int src_h, double sx, double sy, int t, double factor);
+void ez_bilinear_4points (Ez_image *src, Ez_uint8 *dst_p, double sx, double sy);
+void ez_image_transform_nearest  (Ez_image *src, Ez_image *dst, const double inv[6]);
+void ez_image_transform_bilinear (Ez_image *src, Ez_image *dst, const double inv[6]);
+void ez_image_transform_area     (Ez_image *src, Ez_image *dst, const double inv[6]);
+
+#define EZ_WEIGHT_BITS 14          /* Weights of a pixel sum to 1 << 14 */
+
+typedef struct {
+    int size, taps;                 /* Number of pixels, max weights by pixel */
+    int *start, *count, *weight;
+} Ez_weights;
+
+int ez_weights_alloc (Ez_weights *wt, int n, int taps);
+void ez_weights_free (Ez_weights *wt);
+void ez_weights_normalize (Ez_weights *wt, int i, double *w);
+int ez_weights_area (Ez_weights *wt, int src_n, int dst_n);
+double ez_resize_kernel (int filter, double t);
+int ez_weights_filter (Ez_weights *wt, int src_n, int dst_n, int filter);
+void ez_resample_row_c (Ez_uint8 *src_p, int *dst_p, Ez_weights *wx);
+int ez_image_resample (Ez_image *src, Ez_image *dst, Ez_weights *wx,
+    Ez_weights *wy, int y1, int y2);
+
+#define EZ_RESAMPLE_CLAMP(v) ((v) < 0 ? 0 : (v) > 255<<8 ? 255<<8 : (v))
+#define EZ_RESAMPLE_THREADS_MAX 16
+#define EZ_RESAMPLE_BAND_MIN    32  /* Min rows of dst by thread */
+
+typedef struct {
+    Ez_image *src, *dst;
+    Ez_weights *wx, *wy;
+    int y1, y2, result;
+} Ez_resample_band;
+
+int ez_resample_thread_nb (int nrows);
+#ifdef EZ_BASE_XLIB
+void *ez_resample_thread (void *arg);
+#elif defined EZ_BASE_WIN32
+DWORD WINAPI ez_resample_thread (LPVOID arg);
+#endif /* EZ_BASE_ */
+int ez_image_resample_bands (Ez_image *src, Ez_image *dst, Ez_weights *wx,
+    Ez_weights *wy);
+int ez_image_resize_to (Ez_image *src, Ez_image *dst, int filter);
+
+Ez_image *ez_mipmap_next (Ez_image *img);
+void ez_mipmap_halve (Ez_image *src, Ez_image *dst);
+Ez_image *ez_mipmap_select (Ez_image *img, double fx, double fy);
+
+#define EZ_FIX16(x) ((int) floor ((x) * 65536 + 0.5))
+
+void ez_fix_span (int a, int d, int lo, int hi, int *x1, int *x2);
+long long ez_div_floor (long long a, long long b);
+void ez_bilinear_edge (Ez_image *src, Ez_uint8 *dst_p, int u, int v);
+
+typedef struct {
+    void (*nearest)  (Ez_uint32 *src_p, int src_pitch, Ez_uint32 *dst_p,
+                      int u, int v, int du, int dv, int n);
+    void (*bilinear) (Ez_uint8 *src_p, int src_pitch, Ez_uint8 *dst_p,
+                      int u, int v, int du, int dv, int n);
+    void (*resample) (Ez_uint8 *src_p, int *dst_p, Ez_weights *wx);
+    void (*premul)   (Ez_uint8 *dst_p, Ez_uint8 *src_p, int n);
+    void (*blend)    (Ez_uint8 *dst_p, Ez_uint8 *src_p, int n);
+    void (*composite) (int op, Ez_uint8 *dst_p, Ez_uint8 *src_p, int n,
+                       int alpha);
+} Ez_row_kernels;
+
+Ez_row_kernels *ez_row_get_kernels (void);
+void ez_row_init_kernels (void);
+void ez_affine_row_nearest (Ez_image *src, Ez_image *dst, int y,
+    int u, int v, int du, int dv, int opaque, Ez_row_kernels *kernels);
+void ez_affine_row_bilinear (Ez_image *src, Ez_image *dst, int y,
+    int u, int v, int du, int dv, int opaque, Ez_row_kernels *kernels);
+void ez_row_nearest_c (Ez_uint32 *src_p, int src_pitch, Ez_uint32 *dst_p,
+    int u, int v, int du, int dv, int n);
+void ez_row_bilinear_c (Ez_uint8 *src_p, int src_pitch, Ez_uint8 *dst_p,
+    int u, int v, int du, int dv, int n);
+
+/* SIMD kernels, selected at runtime */
+#if defined __GNUC__ && (defined __x86_64__ || defined __i386__)
+#define EZ_SIMD_X86
+void ez_row_bilinear_sse2 (Ez_uint8 *src_p, int src_pitch, Ez_uint8 *dst_p,
+    int u, int v, int du, int dv, int n);
+void ez_row_nearest_avx2 (Ez_uint32 *src_p, int src_pitch, Ez_uint32 *dst_p,
+    int u, int v, int du, int dv, int n);
+void ez_row_bilinear_avx2 (Ez_uint8 *src_p, int src_pitch, Ez_uint8 *dst_p,
+    int u, int v, int du, int dv, int n);
+void ez_resample_row_sse2 (Ez_uint8 *src_p, int *dst_p, Ez_weights *wx);
+void ez_premul_row_sse2 (Ez_uint8 *dst_p, Ez_uint8 *src_p, int n);
+#ifdef EZ_BASE_XLIB
+void ez_xi_fill_32_ssse3 (XImage *xi, Ez_image *img, int src_x, int src_y,
+    int w, int h);
+void ez_xi_fill_32_avx2 (XImage *xi, Ez_image *img, int src_x, int src_y,
+    int w, int h);
+void ez_xi_fill_24_ssse3 (XImage *xi, Ez_image *img, int src_x, int src_y,
+    int w, int h);
+void ez_xi_fill_16_sse2 (XImage *xi, Ez_image *img, int src_x, int src_y,
+    int w, int h);
+void ez_xmask_row_sse2 (Ez_uint8 *dst_p, Ez_uint8 *src_p, int w, int opacity);
+void ez_xmask_row_avx2 (Ez_uint8 *dst_p, Ez_uint8 *src_p, int w, int opacity);
+#endif /* EZ_BASE_ */
+void ez_blend_row_sse2 (Ez_uint8 *dst_p, Ez_uint8 *src_p, int n);
+void ez_premul_row_avx2 (Ez_uint8 *dst_p, Ez_uint8 *src_p, int n);
+void ez_blend_row_avx2 (Ez_uint8 *dst_p, Ez_uint8 *src_p, int n);
+void ez_comp_row_sse2 (int op, Ez_uint8 *dst_p, Ez_uint8 *src_p, int n,
+    int alpha);
+#endif
 
 #ifdef EZ_BASE_XLIB
 int ez_pixmap_build_map (Ez_pixmap *pix, Ez_image *img);
-void ez_pixmap_draw_area (Ez_window win, Ez_pixmap *pix, int x, int y);
+int ez_pixmap_put_area (Ez_pixmap *pix, Ez_image *img, int src_x, int src_y,
+    int x, int y, int w, int h);
+void ez_pixmap_draw_area (Ez_window win, Ez_pixmap *pix, int x, int y,
+    int src_x, int src_y, int w, int h);
 void ez_pixmap_tile_area (Ez_window win, Ez_pixmap *pix, int x, int y, int w, int h);
 #elif defined EZ_BASE_WIN32
 int ez_pixmap_build_hmap (Ez_pixmap *pix, Ez_image *img);
-void ez_pixmap_draw_hmap (HDC hdc_dst, Ez_pixmap *pix, int x, int y);
+int ez_pixmap_put_area (Ez_pixmap *pix, Ez_image *img, int src_x, int src_y,
+    int x, int y, int w, int h);
+void ez_pixmap_draw_hmap (HDC hdc_dst, Ez_pixmap *pix, int x, int y,
+    int src_x, int src_y, int w, int h);
 void ez_pixmap_tile_hmap (HDC hdc_dst, Ez_pixmap *pix, int x, int y, int w, int h);
 #endif /* EZ_BASE_ */
 
+#define EZ_SPRITE_CELL 16
+
+typedef struct {
+    Ez_pixmap *pix;
+    int pix_num;                    /* Number of pix in the batch */
+    int src_x, src_y, w, h;         /* Area in pix */
+    int x, y;                       /* Position in the window */
+    int num, level;                 /* Order of addition, drawing level */
+} Ez_sprite;
+
+typedef struct {
+    int active;
+    Ez_window win;
+    Ez_sprite *sprite;
+    int sprite_nb, sprite_max;
+    Ez_pixmap **pix;
+    int pix_nb, pix_max;
+    int *cell;                      /* Grid of levels */
+    int cell_max;
+#ifdef EZ_BASE_XLIB
+    Pixmap mask;                    /* Composed masks of a group */
+    int mask_w, mask_h;
+    GC mask_gc;
+#endif /* EZ_BASE_ */
+} Ez_sprite_batch;
+
+int ez_sprite_batch_push (Ez_pixmap *pix, int src_x, int src_y, int w, int h,
+    int x, int y);
+int ez_sprite_batch_level (int win_w, int win_h);
+int ez_sprite_compare (const void *a, const void *b);
+#ifdef EZ_BASE_XLIB
+void ez_sprite_draw_group (Drawable d, Ez_sprite *sprite, int n,
+    int win_w, int win_h);
+int ez_sprite_mask_alloc (int w, int h);
+#elif defined EZ_BASE_WIN32
+void ez_sprite_draw_group (HDC hdc_dst, Ez_sprite *sprite, int n);
+#endif /* EZ_BASE_ */
+
+#define EZ_ATLAS_PAGE_W 1024
+#define EZ_ATLAS_PAGE_H 1024
+
+int ez_atlas_compare (const void *a, const void *b);
+Ez_pixmap *ez_atlas_build_page (Ez_atlas *atlas, Ez_image **img, int num);
+
+#define EZ_TCACHE_BUDGET  (16*1024*1024)
+#define EZ_TCACHE_BUCKETS 1021
+#define EZ_TCACHE_SCALE_Q 64        /* Steps of scale factor per unit */
+#define EZ_TCACHE_ANGLE_Q 4         /* Steps of angle per degree */
+
+typedef struct Ez_tcache_entry {
+    Ez_image *src;                  /* Key */
+    int scale_q, theta_q, sym, quality;
+    Ez_image *img;                  /* Transformed image */
+    Ez_pixmap *pix;                 /* Its pixmap, or NULL */
+    long bytes;
+    unsigned long hash;
+    struct Ez_tcache_entry *hnext;  /* Next in the bucket */
+    struct Ez_tcache_entry *prev, *next;  /* LRU list */
+    struct Ez_tcache_entry *sprev, *snext;  /* List of src->tcache */
+} Ez_tcache_entry;
+
+typedef struct {
+    long budget, bytes;
+    long hits, misses;
+    int nb;
+    Ez_tcache_entry *first, *last;  /* Most recently used first */
+    Ez_tcache_entry *bucket[EZ_TCACHE_BUCKETS];
+} Ez_tcache;
+
+Ez_tcache_entry *ez_tcache_lookup (Ez_image *img, double factor, double theta,
+    int sym_hor, int sym_ver, int quality);
+Ez_image *ez_tcache_compute (Ez_image *img, double factor, double theta,
+    int sym, int quality);
+unsigned long ez_tcache_hash (Ez_image *img, int scale_q, int theta_q, int sym,
+    int quality);
+void ez_tcache_link (Ez_tcache_entry *entry);
+void ez_tcache_unlink (Ez_tcache_entry *entry);
+void ez_tcache_remove (Ez_tcache_entry *entry);
+void ez_tcache_evict (void);
+void ez_tcache_purge (Ez_image *img);
+
+#define EZ_ICACHE_BUDGET  (32*1024*1024)
+#define EZ_ICACHE_BUCKETS 251
+
+typedef struct Ez_icache_entry {
+    char *filename;                 /* Key, with the date and size */
+    long mtime, size;
+    Ez_image *img;                  /* Decoded image, shared by the views */
+    long bytes;
+    unsigned long hash;
+    struct Ez_icache_entry *hnext;  /* Next in the bucket */
+    struct Ez_icache_entry *prev, *next;  /* LRU list */
+} Ez_icache_entry;
+
+typedef struct {
+    long budget, bytes;
+    long hits, misses;
+    int nb;
+    Ez_icache_entry *first, *last;  /* Most recently used first */
+    Ez_icache_entry *bucket[EZ_ICACHE_BUCKETS];
+} Ez_icache;
+
+unsigned long ez_icache_hash (const char *filename);
+void ez_icache_link (Ez_icache_entry *entry);
+void ez_icache_unlink (Ez_icache_entry *entry);
+void ez_icache_remove (Ez_icache_entry *entry);
+void ez_icache_evict (void);
+
 #endif /* EZ_PRIVATE_DEFS */
 
 
@@ -192,6 +747,12 @@ Ez_uint8 *ez_stbi_load (char const *filename, int *x, int *y, int *comp, int req
 Ez_uint8 *ez_stbi_load_from_file (FILE *f, int *x, int *y, int *comp, int req_comp);
 /* for ez_stbi_load_from_file, file pointer is left pointing immediately after image */
 
+/* Same as ez_stbi_load; the buffers are taken in sc (can be NULL), and
+   the result must be given back by ez_scratch_free (sc, result) */
+Ez_uint8 *ez_stbi_load_scratch (char const *filename, Ez_scratch *sc, int *x, int *y, int *comp, int req_comp);
+/* Same, a JPEG is decoded at 1/scale of its size, scale in 1, 2, 4, 8 */
+Ez_uint8 *ez_stbi_load_scale (char const *filename, Ez_scratch *sc, int scale, int *x, int *y, int *comp, int req_comp);
+
 typedef struct {
     /* Fill 'data' with 'size' bytes. Return number of bytes actually read */
     int (*read) (void *user, char *data, int size);
@@ -234,6 +795,10 @@ int   ez_stbi_zlib_decode_noheader_buffer (char *obuffer, int olen, const char *
 #define ez_stbi_load_from_memory    stbi_load_from_memory
 #define ez_stbi_load                stbi_load
 #define ez_stbi_load_from_file      stbi_load_from_file
+#define ez_stbi_load_scratch(filename, sc, x, y, comp, req_comp) \
+    stbi_load (filename, x, y, comp, req_comp)
+#define ez_stbi_load_scale(filename, sc, scale, x, y, comp, req_comp) \
+    stbi_load (filename, x, y, comp, req_comp)
 
 #define Ez_stbi_io_callbacks        stbi_io_callbacks
 #define ez_stbi_load_from_callbacks stbi_load_from_callbacks
@@ -0,0 +1,53 @@
+/* ez-pack.c : tool of EZ-Draw to build a pack of images
+ *
+ * EZ-Draw version 1.2
+ *
+ * Compilation on Unix :
+ *     gcc -Wall ez-pack.c ez-draw.c ez-image.c -o ez-pack -lX11 -lXext -lm -lpthread
+ * Compilation on Windows :
+ *     gcc -Wall ez-pack.c ez-draw.c ez-image.c -o ez-pack.exe -lgdi32 -lmsimg32 -lm
+ *
+ * Usage : ez-pack [-p] pack-file image-files ...
+ *     The images are loaded, then stored in the pack with their file
+ *     names; option -p premultiplies their colors by alpha.
+ *     The pack is opened by ez_pack_open, then the images are obtained
+ *     without decoding by ez_pack_get_image (pack, file-name).
+ *
+ * This program is free software under the terms of the
+ * GNU Lesser General Public License (LGPL) version 2.1.
+*/
+
+#include "ez-draw.h"
+#include "ez-image.h"
+
+
+int main (int argc, char *argv[])
+{
+    Ez_image **img;
+    const char **names;
+    int premul = 0, n, i, res;
+
+    if (argc > 1 && strcmp (argv[1], "-p") == 0) { premul = 1; argc--; argv++; }
+    if (argc < 3) {
+        fprintf (stderr, "Usage: ez-pack [-p] pack-file image-files ...\n");
+        exit (1);
+    }
+    n = argc-2;
+    names = (const char **) argv+2;
+
+    img = calloc (n, sizeof (Ez_image *));
+    if (img == NULL) { fprintf (stderr, "Out of memory\n"); exit (1); }
+
+    for (i = 0; i < n; i++) {
+        img[i] = ez_image_load (names[i]);                  /* Load the images */
+        if (img[i] == NULL) exit (1);
+        if (premul) ez_image_premultiply (img[i]);
+    }
+
+    res = ez_pack_build (argv[1], names, img, n);           /* Write the pack */
+    if (res == 0) printf ("%s: %d images\n", argv[1], n);
+
+    for (i = 0; i < n; i++) ez_image_destroy (img[i]);
+    free (img);
+    exit (res < 0 ? 1 : 0);
+}
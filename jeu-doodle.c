@@ -24,6 +24,8 @@
 #define TIMER1 100
 #define TIMER2 10
 
+#define BACKGROUND_LAYER 0
+
 #define FALSE 0
 #define TRUE 1
 
@@ -234,6 +236,7 @@ typedef struct Game
   Doodler doodler;
   Ez_pixmap *background;
   Ez_image *background_image;     /* for blender */
+  int background_offset;          /* score%40 when the layer was drawn */
   Ez_pixmap *gameover;
   Ez_pixmap *doodlejump;
   Platforms platforms;
@@ -293,6 +296,11 @@ int WINDOW_HEIGHT;
 int AREA_WIDTH;
 int AREA_HEIGHT;
 
+/* Pack of the images of images-doodle/, pre-decoded by the tool ez-pack:
+     ./ez-pack images-doodle/images.pack images-doodle/<all the png files> */
+#define PACK_FILE "images-doodle/images.pack"
+Ez_pack *images_pack = NULL;
+
 
 /* ------------------------ P R O T O T Y P E S ---------------------------- */
 
@@ -312,6 +320,7 @@ void *queue_pop_tail(Queue *queue);
 void *queue_peek_tail(Queue *queue);
 void *queue_peek_head(Queue *queue);
 int get_random_with_range(int a, int b);
+Ez_image *image_load(const char *filename);
 Ez_pixmap *ez_pixmap_create_from_file(const char *filename);
 void info_init_default(Info *info);
 void info_timer_init(Info *info);
@@ -693,8 +702,7 @@ int get_random_with_range(int a, int b)
 
 void image_paint_extended(Ez_window win, Ez_image *img, double x, double y, double scale, double rotate, boolean vsym, boolean hsym)
 {
-  Ez_image *rez;
-  Ez_image *del;
+  Ez_pixmap *pix;
 
   x += WINDOW_WIDTH/2 - AREA_WIDTH/2;
   y += WINDOW_HEIGHT/2 - AREA_HEIGHT/2;
@@ -705,36 +713,13 @@ void image_paint_extended(Ez_window win, Ez_image *img, double x, double y, doub
     return;
   }
 
-  rez = ez_image_dup(img);
+  if(scale <= 0) scale = 0.01;
 
-  if(scale != 1.0)
-  {
-    if(scale <= 0) scale = 0.01;
-    del = rez;
-    rez = ez_image_scale(rez, scale);
-    ez_image_destroy(del);
-  }
-  if(rotate != 0.0)
-  {
-    del = rez;
-    rez = ez_image_rotate(rez, rotate, 0);
-    ez_image_destroy(del);
-  }
-  if(hsym)
-  {
-    del = rez;
-    rez = ez_image_sym_hor(rez);
-    ez_image_destroy(del);
-  }
-  if(vsym)
-  {
-    del = rez;
-    rez = ez_image_sym_ver(rez);
-    ez_image_destroy(del);
-  }
+  /* The transformed sprites are kept in the cache of ez-image */
+  pix = ez_transform_cache_pixmap(img, scale, rotate, hsym, vsym, EZ_TRANSFORM_AREA);
+  if(pix == NULL) return;
 
-  ez_image_paint(win, rez, (int)(x - rez->width/2), (int)(y - rez->height/2));
-  ez_image_destroy(rez);
+  ez_pixmap_paint(win, pix, (int)(x - pix->width/2), (int)(y - pix->height/2));
 }
 
 
@@ -748,9 +733,22 @@ void pixmap_paint_extended(Ez_window win, Ez_pixmap *pix, double x, double y)
 
 /* ------------------------------- P I X M A P ----------------------------- */
 
+/* Take the image in the pack if it was opened, else decode the file */
+Ez_image *image_load(const char *filename)
+{
+  Ez_image *image = NULL;
+
+  if (images_pack != NULL)
+    image = ez_pack_get_image(images_pack, filename);
+  if (image == NULL)
+    image = ez_image_load_cached(filename);
+  return image;
+}
+
+
 Ez_pixmap *ez_pixmap_create_from_file(const char *filename)
 {
-  Ez_image *image = ez_image_load(filename);
+  Ez_image *image = image_load(filename);
   Ez_pixmap *pixmap = ez_pixmap_create_from_image(image);
 
   ez_image_destroy(image);
@@ -1001,7 +999,8 @@ void info_game_init_background(Info *info)
   Game *game = &info->game;
 
   game->background = ez_pixmap_create_from_file("images-doodle/carreaux.png");
-  game->background_image = ez_image_load("images-doodle/carreaux.png");
+  game->background_image = image_load("images-doodle/carreaux.png");
+  game->background_offset = -1;
 }
 
 
@@ -1054,8 +1053,20 @@ void info_game_gameover_draw(Info *info, Ez_window win)
 void info_game_background_draw(Info *info, Ez_window win)
 {
   Game *game = &info->game;
+  int offset = info->score%40;
 
-  ez_pixmap_tile(win, game->background, WINDOW_WIDTH/2 - AREA_WIDTH/2, WINDOW_HEIGHT/2 - AREA_HEIGHT/2 - 40 + (info->score%40), info->area_width, info->area_height + 40);
+  /* The tiles are kept in a layer, drawn again only when they scroll */
+  if(offset != game->background_offset)
+  {
+    game->background_offset = offset;
+    ez_layer_set_dirty(win, BACKGROUND_LAYER);
+  }
+  if(ez_layer_begin(win, BACKGROUND_LAYER))
+  {
+    ez_pixmap_tile(win, game->background, WINDOW_WIDTH/2 - AREA_WIDTH/2, WINDOW_HEIGHT/2 - AREA_HEIGHT/2 - 40 + offset, info->area_width, info->area_height + 40);
+    ez_layer_end(win);
+  }
+  ez_layer_compose(win);
 }
 
 
@@ -1111,19 +1122,24 @@ void info_game_doodler_init(Info *info)
 void info_game_doodler_load_images(Info *info)
 {
   Doodler *d = &info->game.doodler;
+  int i;
+
+  d->image[DOODLER_LEFT]       = image_load("images-doodle/bob_left.png");
+  d->image[DOODLER_RIGHT]      = image_load("images-doodle/bob_right.png");
+  d->image[DOODLER_JUMP_LEFT]  = image_load("images-doodle/bob_left_jump.png");
+  d->image[DOODLER_JUMP_RIGHT] = image_load("images-doodle/bob_right_jump.png");
+  d->image[DOODLER_SHOOT]      = image_load("images-doodle/bob_face.png");
+  d->image[DOODLER_JUMP_SHOOT] = image_load("images-doodle/bob_face_jump.png");
 
-  d->image[DOODLER_LEFT]       = ez_image_load("images-doodle/bob_left.png");
-  d->image[DOODLER_RIGHT]      = ez_image_load("images-doodle/bob_right.png");
-  d->image[DOODLER_JUMP_LEFT]  = ez_image_load("images-doodle/bob_left_jump.png");
-  d->image[DOODLER_JUMP_RIGHT] = ez_image_load("images-doodle/bob_right_jump.png");
-  d->image[DOODLER_SHOOT]      = ez_image_load("images-doodle/bob_face.png");
-  d->image[DOODLER_JUMP_SHOOT] = ez_image_load("images-doodle/bob_face_jump.png");
+  /* Shrunk by info_game_doodler_scale */
+  for (i = 0; i < DOODLER_N; i++)
+    ez_image_set_mipmap(d->image[i], 1);
 
-  d->stars[STARS1] = ez_image_load("images-doodle/stars1.png");
-  d->stars[STARS2] = ez_image_load("images-doodle/stars2.png");
-  d->stars[STARS3] = ez_image_load("images-doodle/stars3.png");
+  d->stars[STARS1] = image_load("images-doodle/stars1.png");
+  d->stars[STARS2] = image_load("images-doodle/stars2.png");
+  d->stars[STARS3] = image_load("images-doodle/stars3.png");
 
-  d->image_trompette = ez_image_load("images-doodle/bob_shoot.png");
+  d->image_trompette = image_load("images-doodle/bob_shoot.png");
 
   info_game_doodler_bonus_load_images(info);
   info_game_doodler_tirs_load_images(info);
@@ -1493,25 +1509,25 @@ void info_game_monsters_init(Info *info)
   Monsters *monsters = &info->game.monsters;
   monsters->monsters = NULL;
 
-  monsters->images[MS_SERPENT1] = ez_image_load("images-doodle/monstre_serpent1.png");
-  monsters->images[MS_SERPENT2] = ez_image_load("images-doodle/monstre_serpent2.png");
+  monsters->images[MS_SERPENT1] = image_load("images-doodle/monstre_serpent1.png");
+  monsters->images[MS_SERPENT2] = image_load("images-doodle/monstre_serpent2.png");
 
-  monsters->images[MS_CACTUS1] = ez_image_load("images-doodle/monstre_cactus1.png");
-  monsters->images[MS_CACTUS2] = ez_image_load("images-doodle/monstre_cactus2.png");
+  monsters->images[MS_CACTUS1] = image_load("images-doodle/monstre_cactus1.png");
+  monsters->images[MS_CACTUS2] = image_load("images-doodle/monstre_cactus2.png");
 
-  monsters->images[MS_PIEUVRE] = ez_image_load("images-doodle/monstre_pieuvre.png");
+  monsters->images[MS_PIEUVRE] = image_load("images-doodle/monstre_pieuvre.png");
 
-  monsters->images[MS_PROUT1] = ez_image_load("images-doodle/monstre_prout1.png");
-  monsters->images[MS_PROUT2] = ez_image_load("images-doodle/monstre_prout2.png");
-  monsters->images[MS_PROUT3] = ez_image_load("images-doodle/monstre_prout3.png");
-  monsters->images[MS_PROUT4] = ez_image_load("images-doodle/monstre_prout4.png");
+  monsters->images[MS_PROUT1] = image_load("images-doodle/monstre_prout1.png");
+  monsters->images[MS_PROUT2] = image_load("images-doodle/monstre_prout2.png");
+  monsters->images[MS_PROUT3] = image_load("images-doodle/monstre_prout3.png");
+  monsters->images[MS_PROUT4] = image_load("images-doodle/monstre_prout4.png");
 
-  monsters->images[MS_ROUGE] = ez_image_load("images-doodle/monstre_rouge.png");
+  monsters->images[MS_ROUGE] = image_load("images-doodle/monstre_rouge.png");
 
-  monsters->images[MS_SOUCOUPE1] = ez_image_load("images-doodle/monstre_soucoupe1.png");
-  monsters->images[MS_SOUCOUPE2] = ez_image_load("images-doodle/monstre_soucoupe2.png");
+  monsters->images[MS_SOUCOUPE1] = image_load("images-doodle/monstre_soucoupe1.png");
+  monsters->images[MS_SOUCOUPE2] = image_load("images-doodle/monstre_soucoupe2.png");
 
-  monsters->images[MS_TROU_NOIR] = ez_image_load("images-doodle/trou_noir.png");
+  monsters->images[MS_TROU_NOIR] = image_load("images-doodle/trou_noir.png");
 }
 
 
@@ -2575,31 +2591,31 @@ void info_game_doodler_bonus_load_images(Info *info)
 {
   Doodler *d = &info->game.doodler;
 
-  d->bonus_image[BES_CASQUETTE1] = ez_image_load("images-doodle/bonus_anim_chapeau1.png");
-  d->bonus_image[BES_CASQUETTE2] = ez_image_load("images-doodle/bonus_anim_chapeau2.png");
-  d->bonus_image[BES_CASQUETTE3] = ez_image_load("images-doodle/bonus_anim_chapeau3.png");
-  d->bonus_image[BES_CASQUETTE4] = ez_image_load("images-doodle/bonus_anim_chapeau4.png");
+  d->bonus_image[BES_CASQUETTE1] = image_load("images-doodle/bonus_anim_chapeau1.png");
+  d->bonus_image[BES_CASQUETTE2] = image_load("images-doodle/bonus_anim_chapeau2.png");
+  d->bonus_image[BES_CASQUETTE3] = image_load("images-doodle/bonus_anim_chapeau3.png");
+  d->bonus_image[BES_CASQUETTE4] = image_load("images-doodle/bonus_anim_chapeau4.png");
 
-  d->bonus_image[BES_JETPACK1] = ez_image_load("images-doodle/bonus_anim_jetpack1.png");
-  d->bonus_image[BES_JETPACK2] = ez_image_load("images-doodle/bonus_anim_jetpack2.png");
-  d->bonus_image[BES_JETPACK3] = ez_image_load("images-doodle/bonus_anim_jetpack3.png");
-  d->bonus_image[BES_JETPACK4] = ez_image_load("images-doodle/bonus_anim_jetpack4.png");
-  d->bonus_image[BES_JETPACK5] = ez_image_load("images-doodle/bonus_anim_jetpack5.png");
-  d->bonus_image[BES_JETPACK6] = ez_image_load("images-doodle/bonus_anim_jetpack6.png");
-  d->bonus_image[BES_JETPACK7] = ez_image_load("images-doodle/bonus_anim_jetpack7.png");
-  d->bonus_image[BES_JETPACK8] = ez_image_load("images-doodle/bonus_anim_jetpack8.png");
-  d->bonus_image[BES_JETPACK9] = ez_image_load("images-doodle/bonus_anim_jetpack9.png");
-  d->bonus_image[BES_JETPACK10] = ez_image_load("images-doodle/bonus_anim_jetpack10.png");
+  d->bonus_image[BES_JETPACK1] = image_load("images-doodle/bonus_anim_jetpack1.png");
+  d->bonus_image[BES_JETPACK2] = image_load("images-doodle/bonus_anim_jetpack2.png");
+  d->bonus_image[BES_JETPACK3] = image_load("images-doodle/bonus_anim_jetpack3.png");
+  d->bonus_image[BES_JETPACK4] = image_load("images-doodle/bonus_anim_jetpack4.png");
+  d->bonus_image[BES_JETPACK5] = image_load("images-doodle/bonus_anim_jetpack5.png");
+  d->bonus_image[BES_JETPACK6] = image_load("images-doodle/bonus_anim_jetpack6.png");
+  d->bonus_image[BES_JETPACK7] = image_load("images-doodle/bonus_anim_jetpack7.png");
+  d->bonus_image[BES_JETPACK8] = image_load("images-doodle/bonus_anim_jetpack8.png");
+  d->bonus_image[BES_JETPACK9] = image_load("images-doodle/bonus_anim_jetpack9.png");
+  d->bonus_image[BES_JETPACK10] = image_load("images-doodle/bonus_anim_jetpack10.png");
 
-  d->bonus_image[BES_SHIELD1] = ez_image_load("images-doodle/bonus_anim_shield1.png");
-  d->bonus_image[BES_SHIELD2] = ez_image_load("images-doodle/bonus_anim_shield2.png");
-  d->bonus_image[BES_SHIELD3] = ez_image_load("images-doodle/bonus_anim_shield3.png");
+  d->bonus_image[BES_SHIELD1] = image_load("images-doodle/bonus_anim_shield1.png");
+  d->bonus_image[BES_SHIELD2] = image_load("images-doodle/bonus_anim_shield2.png");
+  d->bonus_image[BES_SHIELD3] = image_load("images-doodle/bonus_anim_shield3.png");
 
-  d->bonus_image[BES_SHOES1] = ez_image_load("images-doodle/bonus_anim_shoes1.png");
-  d->bonus_image[BES_SHOES2] = ez_image_load("images-doodle/bonus_anim_shoes2.png");
-  d->bonus_image[BES_SHOES3] = ez_image_load("images-doodle/bonus_anim_shoes3.png");
-  d->bonus_image[BES_SHOES4] = ez_image_load("images-doodle/bonus_anim_shoes4.png");
-  d->bonus_image[BES_SHOES5] = ez_image_load("images-doodle/bonus_anim_shoes5.png");
+  d->bonus_image[BES_SHOES1] = image_load("images-doodle/bonus_anim_shoes1.png");
+  d->bonus_image[BES_SHOES2] = image_load("images-doodle/bonus_anim_shoes2.png");
+  d->bonus_image[BES_SHOES3] = image_load("images-doodle/bonus_anim_shoes3.png");
+  d->bonus_image[BES_SHOES4] = image_load("images-doodle/bonus_anim_shoes4.png");
+  d->bonus_image[BES_SHOES5] = image_load("images-doodle/bonus_anim_shoes5.png");
 }
 
 
@@ -3786,6 +3802,10 @@ void dessiner_cadre(Ez_window win, Info *info)
 
   ez_window_get_size(win, &w, &h);
 
+  /* The background layer was drawn with the previous size */
+  if(w != WINDOW_WIDTH || h != WINDOW_HEIGHT)
+    ez_layer_set_dirty(win, BACKGROUND_LAYER);
+
   WINDOW_WIDTH = w;
   WINDOW_HEIGHT = h;
   AREA_WIDTH = info->area_width;
@@ -3976,12 +3996,21 @@ void win_on_event(Ez_event *ev)
 int main (void)
 {
   Info info;
+  FILE *pack_file;
   if (ez_init() < 0) exit(1);
 
+  /* Optional; if the pack is missing, the images are decoded */
+  pack_file = fopen(PACK_FILE, "rb");
+  if (pack_file != NULL) {
+    fclose(pack_file);
+    images_pack = ez_pack_open(PACK_FILE);
+  }
+
   info_init_default(&info);
 
   info.win = ez_window_create (WIN_WIDTH, WIN_HEIGHT, WIN_TITLE, win_on_event);
   ez_window_dbuf (info.win, 1);
+  if (ez_layer_create (info.win, BACKGROUND_LAYER, 0) < 0) exit(1);
   ez_set_data (info.win, &info);
 
   ez_start_timer(info.win, TIMER1);